@@ -0,0 +1,127 @@
+// Copyright (c) 2017 The PIVX developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockmap.h"
+
+#include <algorithm>
+#include <new>
+
+/** The table is grown once it is this many quarters full. */
+static const size_t BLOCK_MAP_MAX_LOAD = 3;
+static const size_t BLOCK_MAP_MIN_SLOTS = 64;
+
+const uint32_t CBlockMap::CHUNK_SIZE;
+const uint32_t CBlockMap::NPOS;
+
+uint32_t CBlockMap::NextUsed(uint32_t nPos) const
+{
+    while (nPos < nEntries && !vUsed[nPos])
+        nPos++;
+    return nPos < nEntries ? nPos : NPOS;
+}
+
+size_t CBlockMap::FindSlot(const uint256& hash) const
+{
+    if (vSlots.empty())
+        return NPOS;
+
+    uint64_t nHash = hash.GetLow64();
+    uint32_t nTag = nHash >> 32;
+    size_t nMask = vSlots.size() - 1;
+    for (size_t i = nHash & nMask; vSlots[i].nEntry; i = (i + 1) & nMask) {
+        if (vSlots[i].nTag == nTag && Entry(vSlots[i].nEntry - 1).first == hash)
+            return i;
+    }
+    return NPOS;
+}
+
+uint32_t CBlockMap::Find(const uint256& hash) const
+{
+    size_t nSlot = FindSlot(hash);
+    return nSlot == NPOS ? NPOS : vSlots[nSlot].nEntry - 1;
+}
+
+void CBlockMap::Place(uint32_t nPos)
+{
+    uint64_t nHash = Entry(nPos).first.GetLow64();
+    size_t nMask = vSlots.size() - 1;
+    size_t i = nHash & nMask;
+    while (vSlots[i].nEntry)
+        i = (i + 1) & nMask;
+    vSlots[i].nEntry = nPos + 1;
+    vSlots[i].nTag = nHash >> 32;
+}
+
+void CBlockMap::Rehash(size_t nSlots)
+{
+    CSlot slotEmpty = {0, 0};
+    vSlots.assign(nSlots, slotEmpty);
+    for (uint32_t nPos = NextUsed(0); nPos != NPOS; nPos = NextUsed(nPos + 1))
+        Place(nPos);
+}
+
+std::pair<CBlockMap::iterator, bool> CBlockMap::insert(const std::pair<uint256, CBlockIndex*>& entry)
+{
+    uint32_t nPos = Find(entry.first);
+    if (nPos != NPOS)
+        return std::make_pair(iterator(this, nPos), false);
+
+    if ((nSize + 1) * 4 > vSlots.size() * BLOCK_MAP_MAX_LOAD)
+        Rehash(std::max(BLOCK_MAP_MIN_SLOTS, vSlots.size() * 2));
+
+    if (vFree.empty()) {
+        if (nEntries % CHUNK_SIZE == 0)
+            vChunks.push_back(static_cast<char*>(::operator new(CHUNK_SIZE * sizeof(value_type))));
+        nPos = nEntries++;
+        vUsed.push_back(true);
+    } else {
+        nPos = vFree.back();
+        vFree.pop_back();
+        vUsed[nPos] = true;
+    }
+    new (&Entry(nPos)) value_type(entry.first, entry.second);
+    Place(nPos);
+    nSize++;
+    return std::make_pair(iterator(this, nPos), true);
+}
+
+size_t CBlockMap::erase(const uint256& hash)
+{
+    size_t nSlot = FindSlot(hash);
+    if (nSlot == NPOS)
+        return 0;
+
+    uint32_t nPos = vSlots[nSlot].nEntry - 1;
+    Entry(nPos).~value_type();
+    vUsed[nPos] = false;
+    vFree.push_back(nPos);
+    nSize--;
+
+    // Move later entries of the probe sequence into the gap, unless that would put
+    // them before the slot they hash to
+    size_t nMask = vSlots.size() - 1;
+    for (size_t j = (nSlot + 1) & nMask; vSlots[j].nEntry; j = (j + 1) & nMask) {
+        size_t nHome = Entry(vSlots[j].nEntry - 1).first.GetLow64() & nMask;
+        if (((j - nHome) & nMask) >= ((j - nSlot) & nMask)) {
+            vSlots[nSlot] = vSlots[j];
+            nSlot = j;
+        }
+    }
+    vSlots[nSlot].nEntry = 0;
+    return 1;
+}
+
+void CBlockMap::clear()
+{
+    for (uint32_t nPos = NextUsed(0); nPos != NPOS; nPos = NextUsed(nPos + 1))
+        Entry(nPos).~value_type();
+    for (size_t i = 0; i < vChunks.size(); i++)
+        ::operator delete(vChunks[i]);
+    vChunks.clear();
+    vSlots.clear();
+    vUsed.clear();
+    vFree.clear();
+    nEntries = 0;
+    nSize = 0;
+}
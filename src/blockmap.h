@@ -0,0 +1,154 @@
+// Copyright (c) 2017 The PIVX developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKMAP_H
+#define BITCOIN_BLOCKMAP_H
+
+#include "uint256.h"
+
+#include <cstddef>
+#include <iterator>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+class CBlockIndex;
+
+/**
+ * Map from block hash to block index entry, the type of mapBlockIndex.
+ *
+ * The entries are kept in chunks that are never moved, so the key of an entry (which
+ * CBlockIndex::phashBlock points to) stays where it is until the entry is erased. They
+ * are found through an open addressing table with linear probing, whose slots hold the
+ * position of an entry and 32 more bits of its hash; most probes that miss are settled
+ * in the table without reading the entry. This saves an allocation, two pointers and a
+ * bucket per entry over a node based map.
+ *
+ * Iterators stay valid until their entry is erased.
+ */
+class CBlockMap
+{
+public:
+    typedef uint256 key_type;
+    typedef CBlockIndex* mapped_type;
+    typedef std::pair<const uint256, CBlockIndex*> value_type;
+
+    static const uint32_t CHUNK_SIZE = 4096;
+    //! Position of end()
+    static const uint32_t NPOS = ~(uint32_t)0;
+
+    class const_iterator
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef CBlockMap::value_type value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const value_type* pointer;
+        typedef const value_type& reference;
+
+        const_iterator() : pmap(NULL), nPos(NPOS) {}
+        const value_type& operator*() const { return pmap->Entry(nPos); }
+        const value_type* operator->() const { return &pmap->Entry(nPos); }
+        const_iterator& operator++()
+        {
+            nPos = pmap->NextUsed(nPos + 1);
+            return *this;
+        }
+        const_iterator operator++(int)
+        {
+            const_iterator ret = *this;
+            ++*this;
+            return ret;
+        }
+        bool operator==(const const_iterator& other) const { return nPos == other.nPos; }
+        bool operator!=(const const_iterator& other) const { return nPos != other.nPos; }
+
+    protected:
+        friend class CBlockMap;
+        const CBlockMap* pmap;
+        uint32_t nPos;
+
+        const_iterator(const CBlockMap* pmapIn, uint32_t nPosIn) : pmap(pmapIn), nPos(nPosIn) {}
+    };
+
+    class iterator : public const_iterator
+    {
+    public:
+        typedef value_type* pointer;
+        typedef value_type& reference;
+
+        iterator() {}
+        value_type& operator*() const { return const_cast<CBlockMap*>(pmap)->Entry(nPos); }
+        value_type* operator->() const { return &**this; }
+        iterator& operator++()
+        {
+            const_iterator::operator++();
+            return *this;
+        }
+        iterator operator++(int)
+        {
+            iterator ret = *this;
+            ++*this;
+            return ret;
+        }
+
+    private:
+        friend class CBlockMap;
+        iterator(CBlockMap* pmapIn, uint32_t nPosIn) : const_iterator(pmapIn, nPosIn) {}
+    };
+
+    CBlockMap() : nEntries(0), nSize(0) {}
+    ~CBlockMap() { clear(); }
+
+    iterator begin() { return iterator(this, NextUsed(0)); }
+    const_iterator begin() const { return const_iterator(this, NextUsed(0)); }
+    iterator end() { return iterator(this, NPOS); }
+    const_iterator end() const { return const_iterator(this, NPOS); }
+
+    size_t size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+
+    iterator find(const uint256& hash) { return iterator(this, Find(hash)); }
+    const_iterator find(const uint256& hash) const { return const_iterator(this, Find(hash)); }
+    size_t count(const uint256& hash) const { return Find(hash) != NPOS; }
+
+    std::pair<iterator, bool> insert(const std::pair<uint256, CBlockIndex*>& entry);
+    CBlockIndex*& operator[](const uint256& hash) { return insert(std::make_pair(hash, (CBlockIndex*)NULL)).first->second; }
+    size_t erase(const uint256& hash);
+    void clear();
+
+    //! Number of slots in the lookup table
+    size_t bucket_count() const { return vSlots.size(); }
+
+private:
+    struct CSlot {
+        //! Position of the entry plus one, 0 for an empty slot
+        uint32_t nEntry;
+        //! Bits 32 to 63 of the hash of the entry
+        uint32_t nTag;
+    };
+
+    std::vector<CSlot> vSlots;
+    std::vector<char*> vChunks;
+    std::vector<bool> vUsed;
+    //! Positions of erased entries, reused first
+    std::vector<uint32_t> vFree;
+    //! Positions handed out, used or erased
+    uint32_t nEntries;
+    size_t nSize;
+
+    value_type& Entry(uint32_t nPos) { return reinterpret_cast<value_type*>(vChunks[nPos / CHUNK_SIZE])[nPos % CHUNK_SIZE]; }
+    const value_type& Entry(uint32_t nPos) const { return reinterpret_cast<const value_type*>(vChunks[nPos / CHUNK_SIZE])[nPos % CHUNK_SIZE]; }
+    uint32_t NextUsed(uint32_t nPos) const;
+    //! Slot of the entry with this hash, NPOS if there is none
+    size_t FindSlot(const uint256& hash) const;
+    uint32_t Find(const uint256& hash) const;
+    void Place(uint32_t nPos);
+    void Rehash(size_t nSlots);
+
+    CBlockMap(const CBlockMap&);
+    CBlockMap& operator=(const CBlockMap&);
+};
+
+#endif // BITCOIN_BLOCKMAP_H
@@ -5,8 +5,40 @@
 
 #include "chain.h"
 
+#include <new>
+
 using namespace std;
 
+const size_t CBlockIndexArena::SLAB_SIZE;
+const size_t CBlockIndexArena::CACHE_LINE_SIZE;
+const size_t CBlockIndexArena::STRIDE;
+
+CBlockIndex* CBlockIndexArena::Entry(size_t nSlab, size_t nPos) const
+{
+    uintptr_t nStart = (reinterpret_cast<uintptr_t>(vSlabs[nSlab]) + CACHE_LINE_SIZE - 1) & ~(uintptr_t)(CACHE_LINE_SIZE - 1);
+    return reinterpret_cast<CBlockIndex*>(nStart + nPos * STRIDE);
+}
+
+CBlockIndex* CBlockIndexArena::Allocate()
+{
+    if (nUsed == SLAB_SIZE) {
+        vSlabs.push_back(static_cast<char*>(::operator new(SLAB_SIZE * STRIDE + CACHE_LINE_SIZE - 1)));
+        nUsed = 0;
+    }
+    return new (Entry(vSlabs.size() - 1, nUsed++)) CBlockIndex();
+}
+
+void CBlockIndexArena::Clear()
+{
+    for (size_t i = 0; i < vSlabs.size(); i++) {
+        for (size_t j = 0; j < (i + 1 < vSlabs.size() ? SLAB_SIZE : nUsed); j++)
+            Entry(i, j)->~CBlockIndex();
+        ::operator delete(vSlabs[i]);
+    }
+    vSlabs.clear();
+    nUsed = SLAB_SIZE;
+}
+
 /**
  * CChain implementation
  */
@@ -106,7 +106,11 @@ enum BlockStatus {
 class CBlockIndex
 {
 public:
-    //! pointer to the hash of the block, if any. memory is owned by this CBlockIndex
+    // The fields read by GetAncestor and the skip list walk (pprev, pskip, nHeight) come
+    // first, so a walk touches one cache line per entry; the 64 bytes end at nFlags.
+    // nChainWork, the header fields and the proof-of-stake data follow.
+
+    //! pointer to the hash of the block, if any. memory is owned by mapBlockIndex
     const uint256* phashBlock;
 
     //! pointer to the index of the predecessor of this block
@@ -118,23 +122,11 @@ public:
     //! pointer to the index of some further predecessor of this block
     CBlockIndex* pskip;
 
-    //ppcoin: trust score of block chain
-    uint256 bnChainTrust;
-
     //! height of the entry in the chain. The genesis block has height 0
     int nHeight;
 
-    //! Which # file this block is stored in (blk?????.dat)
-    int nFile;
-
-    //! Byte offset within blk?????.dat where this block's data is stored
-    unsigned int nDataPos;
-
-    //! Byte offset within rev?????.dat where this block's undo data is stored
-    unsigned int nUndoPos;
-
-    //! (memory only) Total amount of work (expected number of hashes) in the chain up to and including this block
-    uint256 nChainWork;
+    //! Verification status of this block. See enum BlockStatus
+    unsigned int nStatus;
 
     //! Number of transactions in this block.
     //! Note: in a potential headers-first mode, this number cannot be relied upon
@@ -145,8 +137,11 @@ public:
     //! Change to 64-bit type when necessary; won't happen before 2030
     unsigned int nChainTx;
 
-    //! Verification status of this block. See enum BlockStatus
-    unsigned int nStatus;
+    //! (memory only) Sequential id assigned to distinguish order in which blocks are received.
+    uint32_t nSequenceId;
+
+    unsigned int nTime;
+    unsigned int nBits;
 
     unsigned int nFlags; // ppcoin: block index flags
     enum {
@@ -155,25 +150,32 @@ public:
         BLOCK_STAKE_MODIFIER = (1 << 2), // regenerated stake modifier
     };
 
-    // proof-of-stake specific fields
-    uint256 GetBlockTrust() const;
-    uint64_t nStakeModifier;             // hash modifier for proof-of-stake
-    unsigned int nStakeModifierChecksum; // checksum of index; in-memeory only
-    COutPoint prevoutStake;
-    unsigned int nStakeTime;
-    uint256 hashProofOfStake;
-    int64_t nMint;
-    int64_t nMoneySupply;
+    //! (memory only) Total amount of work (expected number of hashes) in the chain up to and including this block
+    uint256 nChainWork;
+
+    //! Which # file this block is stored in (blk?????.dat)
+    int nFile;
+
+    //! Byte offset within blk?????.dat where this block's data is stored
+    unsigned int nDataPos;
+
+    //! Byte offset within rev?????.dat where this block's undo data is stored
+    unsigned int nUndoPos;
 
     //! block header
     int nVersion;
     uint256 hashMerkleRoot;
-    unsigned int nTime;
-    unsigned int nBits;
     unsigned int nNonce;
 
-    //! (memory only) Sequential id assigned to distinguish order in which blocks are received.
-    uint32_t nSequenceId;
+    // proof-of-stake specific fields
+    uint256 GetBlockTrust() const;
+    unsigned int nStakeModifierChecksum; // checksum of index; in-memeory only
+    uint64_t nStakeModifier;             // hash modifier for proof-of-stake
+    int64_t nMint;
+    int64_t nMoneySupply;
+    COutPoint prevoutStake;
+    unsigned int nStakeTime;
+    uint256 hashProofOfStake;
 
     void SetNull()
     {
@@ -221,7 +223,6 @@ public:
         nNonce = block.nNonce;
 
         //Proof of Stake
-        bnChainTrust = uint256();
         nMint = 0;
         nMoneySupply = 0;
         nFlags = 0;
@@ -388,6 +389,42 @@ public:
     const CBlockIndex* GetAncestor(int height) const;
 };
 
+/**
+ * Storage for the entries of mapBlockIndex. Entries are default constructed in slabs
+ * of SLAB_SIZE and handed out one at a time, which saves an allocation per block and
+ * keeps entries created together next to each other in memory. Every entry starts on
+ * a cache line, so its leading fields share one. They stay valid until Clear(). Not
+ * thread safe, callers hold cs_main.
+ */
+class CBlockIndexArena
+{
+public:
+    static const size_t SLAB_SIZE = 4096;
+    static const size_t CACHE_LINE_SIZE = 64;
+    //! Distance between two entries
+    static const size_t STRIDE = (sizeof(CBlockIndex) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+
+    CBlockIndexArena() : nUsed(SLAB_SIZE) {}
+    ~CBlockIndexArena() { Clear(); }
+
+    CBlockIndex* Allocate();
+    //! Free all entries
+    void Clear();
+    //! Number of entries handed out
+    size_t size() const { return vSlabs.empty() ? 0 : (vSlabs.size() - 1) * SLAB_SIZE + nUsed; }
+
+private:
+    //! Allocated memory of each slab, the entries start at the first cache line in it
+    std::vector<char*> vSlabs;
+    //! Entries handed out from the last slab
+    size_t nUsed;
+
+    CBlockIndex* Entry(size_t nSlab, size_t nPos) const;
+
+    CBlockIndexArena(const CBlockIndexArena&);
+    CBlockIndexArena& operator=(const CBlockIndexArena&);
+};
+
 /** Used to marshal pointers into hashes for db storage. */
 class CDiskBlockIndex : public CBlockIndex
 {
@@ -448,7 +485,7 @@ public:
         READWRITE(nNonce);
     }
 
-    uint256 GetBlockHash() const
+    CBlockHeader GetBlockHeader() const
     {
         CBlockHeader block;
         block.nVersion = nVersion;
@@ -457,7 +494,12 @@ public:
         block.nTime = nTime;
         block.nBits = nBits;
         block.nNonce = nNonce;
-        return block.GetHash();
+        return block;
+    }
+
+    uint256 GetBlockHash() const
+    {
+        return GetBlockHeader().GetHash();
     }
 
 
@@ -6,6 +6,8 @@
 #define BITCOIN_CHECKQUEUE_H
 
 #include <algorithm>
+#include <atomic>
+#include <deque>
 #include <vector>
 
 #include <boost/foreach.hpp>
@@ -25,12 +27,33 @@ class CCheckQueueControl;
   * onto the queue, where they are processed by N-1 worker threads. When
   * the master is done adding work, it temporarily joins the worker pool
   * as an N'th worker, until all jobs are done.
+  *
+  * Every worker has a deque of its own, which Add fills round robin. A
+  * worker takes batches from the back of its own deque and, once that is
+  * empty, steals half of another one from the front, so the workers only
+  * meet on the shared mutex to sleep and to report the last check done.
   */
 template <typename T>
 class CCheckQueue
 {
+public:
+    //! The maximum number of workers (including the master)
+    static const int MAX_WORKERS = 64;
+
 private:
-    //! Mutex to protect the inner state
+    //! Checks of one worker, protected by their own mutex
+    struct CWorkerDeque {
+        boost::mutex mutex;
+        std::deque<T> checks;
+    };
+
+    //! Deques of the workers; the master always uses the first one
+    CWorkerDeque deques[MAX_WORKERS];
+
+    //! Number of deques in use, one for the master and one per worker thread
+    std::atomic<int> nDeques;
+
+    //! Mutex to protect the sleeping state
     boost::mutex mutex;
 
     //! Worker threads block on this when out of work
@@ -39,9 +62,8 @@ private:
     //! Master thread blocks on this when out of work
     boost::condition_variable condMaster;
 
-    //! The queue of elements to be processed.
-    //! As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
+    //! Number of checks in the deques, changed together with them under their mutex
+    std::atomic<unsigned int> nQueued;
 
     //! The number of workers (including the master) that are idle.
     int nIdle;
@@ -50,14 +72,14 @@ private:
     int nTotal;
 
     //! The temporary evaluation result.
-    bool fAllOk;
+    std::atomic<bool> fAllOk;
 
     /**
      * Number of verifications that haven't completed yet.
-     * This includes elements that are not anymore in queue, but still in
+     * This includes elements that are not anymore in a deque, but still in
      * worker's own batches.
      */
-    unsigned int nTodo;
+    std::atomic<unsigned int> nTodo;
 
     //! Whether we're shutting down.
     bool fQuit;
@@ -65,70 +87,97 @@ private:
     //! The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
+    //! Deque the next Add starts filling at
+    int nNextDeque;
+
+    /**
+     * Move a batch into vChecks, from the back of deque nSelf or else from the front of
+     * another one. Batches are half of what the deque holds, at most nBatchSize, so they
+     * shrink as the work runs out and all workers finish at about the same time.
+     */
+    bool TakeChecks(int nSelf, std::vector<T>& vChecks)
+    {
+        int nCount = nDeques;
+        for (int i = 0; i < nCount; i++) {
+            CWorkerDeque& deque = deques[(nSelf + i) % nCount];
+            boost::unique_lock<boost::mutex> lock(deque.mutex);
+            if (deque.checks.empty())
+                continue;
+            unsigned int nNow = std::max(1U, std::min(nBatchSize, (unsigned int)deque.checks.size() / 2));
+            vChecks.resize(nNow);
+            for (unsigned int j = 0; j < nNow; j++) {
+                // Swap instead of copying to keep the lock short
+                if (i == 0) {
+                    vChecks[j].swap(deque.checks.back());
+                    deque.checks.pop_back();
+                } else {
+                    vChecks[j].swap(deque.checks.front());
+                    deque.checks.pop_front();
+                }
+            }
+            nQueued -= nNow;
+            return true;
+        }
+        return false;
+    }
+
     /** Internal function that does bulk of the verification work. */
     bool Loop(bool fMaster = false)
     {
         boost::condition_variable& cond = fMaster ? condMaster : condWorker;
+        int nSelf = 0;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (!fMaster) {
+                nSelf = nDeques;
+                assert(nSelf < MAX_WORKERS);
+                nDeques++;
+            }
+            nTotal++;
+        }
         std::vector<T> vChecks;
         vChecks.reserve(nBatchSize);
-        unsigned int nNow = 0;
-        bool fOk = true;
         do {
-            {
-                boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
-                if (nNow) {
-                    fAllOk &= fOk;
-                    nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master he can exit and return the result
-                        condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
-                }
-                // logically, the do loop starts here
-                while (queue.empty()) {
-                    if ((fMaster || fQuit) && nTodo == 0) {
-                        nTotal--;
-                        bool fRet = fAllOk;
-                        // reset the status for new work later
-                        if (fMaster)
-                            fAllOk = true;
-                        // return the current status
-                        return fRet;
-                    }
-                    nIdle++;
-                    cond.wait(lock); // wait
-                    nIdle--;
-                }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                    // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                    // queue to the local batch vector instead of copying.
-                    vChecks[i].swap(queue.back());
-                    queue.pop_back();
-                }
+            if (TakeChecks(nSelf, vChecks)) {
                 // Check whether we need to do work at all
-                fOk = fAllOk;
+                bool fOk = fAllOk;
+                BOOST_FOREACH (T& check, vChecks)
+                    if (fOk)
+                        fOk = check();
+                if (!fOk)
+                    fAllOk = false;
+                unsigned int nNow = vChecks.size();
+                vChecks.clear();
+                if ((nTodo -= nNow) == 0 && !fMaster) {
+                    // We processed the last element; inform the master he can exit and return the result
+                    boost::unique_lock<boost::mutex> lock(mutex);
+                    condMaster.notify_one();
+                }
+                continue;
+            }
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            // Checks added since the deques were found empty are announced under this lock
+            if (nQueued > 0)
+                continue;
+            if ((fMaster || fQuit) && nTodo == 0) {
+                nTotal--;
+                bool fRet = fAllOk;
+                // reset the status for new work later
+                if (fMaster)
+                    fAllOk = true;
+                // return the current status
+                return fRet;
             }
-            // execute work
-            BOOST_FOREACH (T& check, vChecks)
-                if (fOk)
-                    fOk = check();
-            vChecks.clear();
+            nIdle++;
+            cond.wait(lock); // wait
+            nIdle--;
         } while (true);
     }
 
 public:
     //! Create a new check queue
-    CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+    CCheckQueue(unsigned int nBatchSizeIn) : nDeques(1), nQueued(0), nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn), nNextDeque(0) {}
 
     //! Worker thread
     void Thread()
@@ -145,15 +194,31 @@ public:
     //! Add a batch of checks to the queue
     void Add(std::vector<T>& vChecks)
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        BOOST_FOREACH (T& check, vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
-        }
+        if (vChecks.empty())
+            return;
+        // Count the checks before any worker can finish one
         nTodo += vChecks.size();
+
+        // Spread them over the deques in contiguous runs
+        int nCount = nDeques;
+        int nRuns = std::min<size_t>(nCount, vChecks.size());
+        for (int i = 0; i < nRuns; i++) {
+            size_t nBegin = vChecks.size() * i / nRuns;
+            size_t nEnd = vChecks.size() * (i + 1) / nRuns;
+            CWorkerDeque& deque = deques[(nNextDeque + i) % nCount];
+            boost::unique_lock<boost::mutex> lock(deque.mutex);
+            for (size_t j = nBegin; j < nEnd; j++) {
+                deque.checks.push_back(T());
+                vChecks[j].swap(deque.checks.back());
+            }
+            nQueued += nEnd - nBegin;
+        }
+        nNextDeque = (nNextDeque + nRuns) % nCount;
+
+        boost::unique_lock<boost::mutex> lock(mutex);
         if (vChecks.size() == 1)
             condWorker.notify_one();
-        else if (vChecks.size() > 1)
+        else
             condWorker.notify_all();
     }
 
@@ -161,10 +226,10 @@ public:
     {
     }
 
+    //! Whether no checks are pending. A worker that did the last one may not be asleep yet, which is harmless.
     bool IsIdle()
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        return (nTotal == nIdle && nTodo == 0 && fAllOk == true);
+        return (nTodo == 0 && nQueued == 0 && fAllOk == true);
     }
 };
 
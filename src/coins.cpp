@@ -8,6 +8,8 @@
 
 #include <assert.h>
 
+#include <algorithm>
+
 /**
  * calculate number of bytes for the bitmask, and its number of non-zero bytes
  * each bit in the bitmask represents the availability of one output, but the
@@ -59,36 +61,67 @@ bool CCoins::Spend(int nPos)
 
 
 bool CCoinsView::GetCoins(const uint256& txid, CCoins& coins) const { return false; }
+void CCoinsView::GetCoinsBatch(const std::vector<uint256>& vTxid, std::vector<std::pair<uint256, CCoins> >& vCoinsRet) const
+{
+    for (std::vector<uint256>::const_iterator it = vTxid.begin(); it != vTxid.end(); it++) {
+        CCoins coins;
+        if (GetCoins(*it, coins)) {
+            vCoinsRet.push_back(std::make_pair(*it, CCoins()));
+            vCoinsRet.back().second.swap(coins);
+        }
+    }
+}
 bool CCoinsView::HaveCoins(const uint256& txid) const { return false; }
 uint256 CCoinsView::GetBestBlock() const { return uint256(0); }
-bool CCoinsView::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock) { return false; }
+bool CCoinsView::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, bool fErase) { return false; }
 bool CCoinsView::GetStats(CCoinsStats& stats) const { return false; }
 
 
 CCoinsViewBacked::CCoinsViewBacked(CCoinsView* viewIn) : base(viewIn) {}
 bool CCoinsViewBacked::GetCoins(const uint256& txid, CCoins& coins) const { return base->GetCoins(txid, coins); }
+void CCoinsViewBacked::GetCoinsBatch(const std::vector<uint256>& vTxid, std::vector<std::pair<uint256, CCoins> >& vCoinsRet) const { base->GetCoinsBatch(vTxid, vCoinsRet); }
 bool CCoinsViewBacked::HaveCoins(const uint256& txid) const { return base->HaveCoins(txid); }
 uint256 CCoinsViewBacked::GetBestBlock() const { return base->GetBestBlock(); }
 void CCoinsViewBacked::SetBackend(CCoinsView& viewIn) { base = &viewIn; }
-bool CCoinsViewBacked::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock) { return base->BatchWrite(mapCoins, hashBlock); }
+bool CCoinsViewBacked::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, bool fErase) { return base->BatchWrite(mapCoins, hashBlock, fErase); }
 bool CCoinsViewBacked::GetStats(CCoinsStats& stats) const { return base->GetStats(stats); }
 
 CCoinsKeyHasher::CCoinsKeyHasher() : salt(GetRandHash()) {}
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView* baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), hashBlock(0) {}
+CCoinsViewCache::CCoinsViewCache(CCoinsView* baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), hashBlock(0), cachedCoinsUsage(0), pendingCoinsUsage(0) {}
 
 CCoinsViewCache::~CCoinsViewCache()
 {
     assert(!hasModifier);
 }
 
+size_t CCoinsViewCache::DynamicMemoryUsage() const
+{
+    return memusage::DynamicUsage(cacheCoins) + cachedCoinsUsage + pendingCoinsUsage;
+}
+
+bool CCoinsViewCache::GetParentCoins(const uint256& txid, CCoins& coins) const
+{
+    if (pendingCoins) {
+        CCoinsMap::const_iterator it = pendingCoins->find(txid);
+        if (it != pendingCoins->end()) {
+            // A pruned entry stands for outputs the base is about to lose
+            if (it->second.coins.IsPruned())
+                return false;
+            coins = it->second.coins;
+            return true;
+        }
+    }
+    return base->GetCoins(txid, coins);
+}
+
 CCoinsMap::const_iterator CCoinsViewCache::FetchCoins(const uint256& txid) const
 {
     CCoinsMap::iterator it = cacheCoins.find(txid);
     if (it != cacheCoins.end())
         return it;
     CCoins tmp;
-    if (!base->GetCoins(txid, tmp))
+    if (!GetParentCoins(txid, tmp))
         return cacheCoins.end();
     CCoinsMap::iterator ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry())).first;
     tmp.swap(ret->second.coins);
@@ -97,6 +130,7 @@ CCoinsMap::const_iterator CCoinsViewCache::FetchCoins(const uint256& txid) const
         // version as fresh.
         ret->second.flags = CCoinsCacheEntry::FRESH;
     }
+    cachedCoinsUsage += ret->second.coins.DynamicMemoryUsage();
     return ret;
 }
 
@@ -110,12 +144,61 @@ bool CCoinsViewCache::GetCoins(const uint256& txid, CCoins& coins) const
     return false;
 }
 
+void CCoinsViewCache::GetCoinsBatch(const std::vector<uint256>& vTxid, std::vector<std::pair<uint256, CCoins> >& vCoinsRet) const
+{
+    Prefetch(vTxid);
+    for (std::vector<uint256>::const_iterator it = vTxid.begin(); it != vTxid.end(); it++) {
+        CCoinsMap::const_iterator itCache = cacheCoins.find(*it);
+        if (itCache != cacheCoins.end())
+            vCoinsRet.push_back(std::make_pair(*it, itCache->second.coins));
+    }
+}
+
+void CCoinsViewCache::Prefetch(const std::vector<uint256>& vTxid) const
+{
+    std::vector<uint256> vMissing;
+    vMissing.reserve(vTxid.size());
+    for (std::vector<uint256>::const_iterator it = vTxid.begin(); it != vTxid.end(); it++) {
+        if (!cacheCoins.count(*it))
+            vMissing.push_back(*it);
+    }
+    if (vMissing.empty())
+        return;
+
+    std::vector<std::pair<uint256, CCoins> > vFetched;
+    if (pendingCoins) {
+        // Entries of the snapshot being written are not read from the base
+        std::vector<uint256> vBase;
+        for (std::vector<uint256>::const_iterator it = vMissing.begin(); it != vMissing.end(); it++) {
+            CCoinsMap::const_iterator itPending = pendingCoins->find(*it);
+            if (itPending == pendingCoins->end())
+                vBase.push_back(*it);
+            else if (!itPending->second.coins.IsPruned())
+                vFetched.push_back(std::make_pair(*it, itPending->second.coins));
+        }
+        vMissing.swap(vBase);
+    }
+    base->GetCoinsBatch(vMissing, vFetched);
+    for (std::vector<std::pair<uint256, CCoins> >::iterator it = vFetched.begin(); it != vFetched.end(); it++) {
+        std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(it->first, CCoinsCacheEntry()));
+        if (!ret.second)
+            continue; // txid was listed twice
+        it->second.swap(ret.first->second.coins);
+        if (ret.first->second.coins.IsPruned()) {
+            // As in FetchCoins, the parent only has an empty entry for this txid.
+            ret.first->second.flags = CCoinsCacheEntry::FRESH;
+        }
+        cachedCoinsUsage += ret.first->second.coins.DynamicMemoryUsage();
+    }
+}
+
 CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256& txid)
 {
     assert(!hasModifier);
     std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry()));
+    size_t cachedCoinUsage = 0;
     if (ret.second) {
-        if (!base->GetCoins(txid, ret.first->second.coins)) {
+        if (!GetParentCoins(txid, ret.first->second.coins)) {
             // The parent view does not have this entry; mark it as fresh.
             ret.first->second.coins.Clear();
             ret.first->second.flags = CCoinsCacheEntry::FRESH;
@@ -123,10 +206,12 @@ CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256& txid)
             // The parent view only has a pruned entry for this; mark it as fresh.
             ret.first->second.flags = CCoinsCacheEntry::FRESH;
         }
+    } else {
+        cachedCoinUsage = ret.first->second.coins.DynamicMemoryUsage();
     }
     // Assume that whenever ModifyCoins is called, the entry will be modified.
     ret.first->second.flags |= CCoinsCacheEntry::DIRTY;
-    return CCoinsModifier(*this, ret.first);
+    return CCoinsModifier(*this, ret.first, cachedCoinUsage);
 }
 
 const CCoins* CCoinsViewCache::AccessCoins(const uint256& txid) const
@@ -161,7 +246,7 @@ void CCoinsViewCache::SetBestBlock(const uint256& hashBlockIn)
     hashBlock = hashBlockIn;
 }
 
-bool CCoinsViewCache::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlockIn)
+bool CCoinsViewCache::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlockIn, bool fErase)
 {
     assert(!hasModifier);
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
@@ -175,7 +260,11 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlockIn
                     // would have pulled it in at first GetCoins).
                     assert(it->second.flags & CCoinsCacheEntry::FRESH);
                     CCoinsCacheEntry& entry = cacheCoins[it->first];
-                    entry.coins.swap(it->second.coins);
+                    if (fErase)
+                        entry.coins.swap(it->second.coins);
+                    else
+                        entry.coins = it->second.coins;
+                    cachedCoinsUsage += entry.coins.DynamicMemoryUsage();
                     entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH;
                 }
             } else {
@@ -183,16 +272,26 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlockIn
                     // The grandparent does not have an entry, and the child is
                     // modified and being pruned. This means we can just delete
                     // it from the parent.
+                    cachedCoinsUsage -= itUs->second.coins.DynamicMemoryUsage();
                     cacheCoins.erase(itUs);
                 } else {
                     // A normal modification.
-                    itUs->second.coins.swap(it->second.coins);
+                    cachedCoinsUsage -= itUs->second.coins.DynamicMemoryUsage();
+                    if (fErase)
+                        itUs->second.coins.swap(it->second.coins);
+                    else
+                        itUs->second.coins = it->second.coins;
+                    cachedCoinsUsage += itUs->second.coins.DynamicMemoryUsage();
                     itUs->second.flags |= CCoinsCacheEntry::DIRTY;
                 }
             }
         }
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
+        if (fErase) {
+            CCoinsMap::iterator itOld = it++;
+            mapCoins.erase(itOld);
+        } else {
+            ++it;
+        }
     }
     hashBlock = hashBlockIn;
     return true;
@@ -200,11 +299,94 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlockIn
 
 bool CCoinsViewCache::Flush()
 {
+    assert(!pendingCoins);
     bool fOk = base->BatchWrite(cacheCoins, hashBlock);
     cacheCoins.clear();
+    cachedCoinsUsage = 0;
     return fOk;
 }
 
+bool CCoinsViewCache::Sync()
+{
+    assert(!hasModifier && !pendingCoins);
+    // The entries are written where they are, without copies
+    if (!base->BatchWrite(cacheCoins, hashBlock, false))
+        return false;
+
+    // The base now holds everything, pruned entries are gone from it
+    for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end();) {
+        if (!(it->second.flags & CCoinsCacheEntry::DIRTY)) {
+            ++it;
+        } else if (it->second.coins.IsPruned()) {
+            cachedCoinsUsage -= it->second.coins.DynamicMemoryUsage();
+            cacheCoins.erase(it++);
+        } else {
+            it->second.flags = 0;
+            ++it;
+        }
+    }
+    return true;
+}
+
+boost::shared_ptr<CCoinsMap> CCoinsViewCache::SnapshotModified()
+{
+    assert(!hasModifier && !pendingCoins);
+    boost::shared_ptr<CCoinsMap> mapDirty(new CCoinsMap());
+    size_t nUsage = 0;
+    for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end();) {
+        if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+            // Moved rather than copied, the snapshot is looked up instead until it is written
+            CCoinsCacheEntry& entry = (*mapDirty)[it->first];
+            entry.coins.swap(it->second.coins);
+            entry.flags = it->second.flags;
+            nUsage += entry.coins.DynamicMemoryUsage();
+            cachedCoinsUsage -= entry.coins.DynamicMemoryUsage();
+            cacheCoins.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+    pendingCoins = mapDirty;
+    pendingCoinsUsage = memusage::DynamicUsage(*mapDirty) + nUsage;
+    return mapDirty;
+}
+
+void CCoinsViewCache::SnapshotWritten()
+{
+    pendingCoins.reset();
+    pendingCoinsUsage = 0;
+}
+
+namespace
+{
+struct CompareCoinsByHeight {
+    bool operator()(const std::pair<int, CCoinsMap::iterator>& a, const std::pair<int, CCoinsMap::iterator>& b) const
+    {
+        return a.first < b.first;
+    }
+};
+}
+
+void CCoinsViewCache::TrimToSize(size_t nMaxUsage)
+{
+    assert(!hasModifier);
+    if (DynamicMemoryUsage() <= nMaxUsage)
+        return;
+
+    // Recently created outputs are the ones most likely to be spent soon
+    std::vector<std::pair<int, CCoinsMap::iterator> > vClean;
+    for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); ++it) {
+        if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+            vClean.push_back(std::make_pair(it->second.coins.nHeight, it));
+    }
+    std::sort(vClean.begin(), vClean.end(), CompareCoinsByHeight());
+
+    for (std::vector<std::pair<int, CCoinsMap::iterator> >::iterator it = vClean.begin(); it != vClean.end() && DynamicMemoryUsage() > nMaxUsage; ++it) {
+        cachedCoinsUsage -= it->second->second.coins.DynamicMemoryUsage();
+        cacheCoins.erase(it->second);
+    }
+}
+
 unsigned int CCoinsViewCache::GetCacheSize() const
 {
     return cacheCoins.size();
@@ -259,7 +441,7 @@ double CCoinsViewCache::GetPriority(const CTransaction& tx, int nHeight) const
     return tx.ComputePriority(dResult);
 }
 
-CCoinsModifier::CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_) : cache(cache_), it(it_)
+CCoinsModifier::CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_, size_t usage) : cache(cache_), it(it_), cachedCoinUsage(usage)
 {
     assert(!cache.hasModifier);
     cache.hasModifier = true;
@@ -270,7 +452,11 @@ CCoinsModifier::~CCoinsModifier()
     assert(cache.hasModifier);
     cache.hasModifier = false;
     it->second.coins.Cleanup();
+    cache.cachedCoinsUsage -= cachedCoinUsage; // Subtract the old usage
     if ((it->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned()) {
         cache.cacheCoins.erase(it);
+    } else {
+        // If the coin still exists after the modification, add the new usage
+        cache.cachedCoinsUsage += it->second.coins.DynamicMemoryUsage();
     }
 }
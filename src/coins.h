@@ -7,6 +7,8 @@
 #define BITCOIN_COINS_H
 
 #include "compressor.h"
+#include "core_memusage.h"
+#include "memusage.h"
 #include "script/standard.h"
 #include "serialize.h"
 #include "uint256.h"
@@ -16,6 +18,7 @@
 #include <stdint.h>
 
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/unordered_map.hpp>
 
 /** 
@@ -283,6 +286,15 @@ public:
                 return false;
         return true;
     }
+
+    size_t DynamicMemoryUsage() const
+    {
+        size_t ret = memusage::DynamicUsage(vout);
+        BOOST_FOREACH (const CTxOut& out, vout) {
+            ret += RecursiveDynamicUsage(out.scriptPubKey);
+        }
+        return ret;
+    }
 };
 
 class CCoinsKeyHasher
@@ -338,6 +350,10 @@ public:
     //! Retrieve the CCoins (unspent transaction outputs) for a given txid
     virtual bool GetCoins(const uint256& txid, CCoins& coins) const;
 
+    //! Retrieve the CCoins of several txids at once, appending those found to vCoinsRet.
+    //! Views backed by a database can read them together instead of one lookup at a time
+    virtual void GetCoinsBatch(const std::vector<uint256>& vTxid, std::vector<std::pair<uint256, CCoins> >& vCoinsRet) const;
+
     //! Just check whether we have data for a given txid.
     //! This may (but cannot always) return true for fully spent transactions
     virtual bool HaveCoins(const uint256& txid) const;
@@ -346,8 +362,8 @@ public:
     virtual uint256 GetBestBlock() const;
 
     //! Do a bulk modification (multiple CCoins changes + BestBlock change).
-    //! The passed mapCoins can be modified.
-    virtual bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
+    //! The passed mapCoins can be modified, unless fErase is false: then it is only read.
+    virtual bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, bool fErase = true);
 
     //! Calculate statistics about the unspent transaction output set
     virtual bool GetStats(CCoinsStats& stats) const;
@@ -366,10 +382,12 @@ protected:
 public:
     CCoinsViewBacked(CCoinsView* viewIn);
     bool GetCoins(const uint256& txid, CCoins& coins) const;
+    void GetCoinsBatch(const std::vector<uint256>& vTxid, std::vector<std::pair<uint256, CCoins> >& vCoinsRet) const;
     bool HaveCoins(const uint256& txid) const;
     uint256 GetBestBlock() const;
     void SetBackend(CCoinsView& viewIn);
-    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
+    CCoinsView* GetBackend() const { return base; }
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, bool fErase = true);
     bool GetStats(CCoinsStats& stats) const;
 };
 
@@ -398,7 +416,8 @@ class CCoinsModifier
 private:
     CCoinsViewCache& cache;
     CCoinsMap::iterator it;
-    CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_);
+    size_t cachedCoinUsage; // Cached memory usage of the CCoins object before modification
+    CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_, size_t usage);
 
 public:
     CCoins* operator->() { return &it->second.coins; }
@@ -421,16 +440,30 @@ protected:
     mutable uint256 hashBlock;
     mutable CCoinsMap cacheCoins;
 
+    /* Cached dynamic memory usage for the inner CCoins objects. */
+    mutable size_t cachedCoinsUsage;
+
+    /**
+     * Modified entries moved out by SnapshotModified. Until SnapshotWritten they
+     * are looked up here before the base, which does not have them yet.
+     */
+    boost::shared_ptr<const CCoinsMap> pendingCoins;
+    size_t pendingCoinsUsage;
+
+    //! Look txid up in the pending snapshot, then in the base
+    bool GetParentCoins(const uint256& txid, CCoins& coins) const;
+
 public:
     CCoinsViewCache(CCoinsView* baseIn);
     ~CCoinsViewCache();
 
     // Standard CCoinsView methods
     bool GetCoins(const uint256& txid, CCoins& coins) const;
+    void GetCoinsBatch(const std::vector<uint256>& vTxid, std::vector<std::pair<uint256, CCoins> >& vCoinsRet) const;
     bool HaveCoins(const uint256& txid) const;
     uint256 GetBestBlock() const;
     void SetBestBlock(const uint256& hashBlock);
-    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, bool fErase = true);
 
     /**
      * Return a pointer to CCoins in the cache, or NULL if not found. This is
@@ -446,6 +479,13 @@ public:
      */
     CCoinsModifier ModifyCoins(const uint256& txid);
 
+    /**
+     * Load the coins of the given txids that are not cached yet with a single
+     * GetCoinsBatch call to the base, so that the lookups that follow are
+     * served from memory.
+     */
+    void Prefetch(const std::vector<uint256>& vTxid) const;
+
     /**
      * Push the modifications applied to this cache to its base.
      * Failure to call this method before destruction will cause the changes to be forgotten.
@@ -453,9 +493,38 @@ public:
      */
     bool Flush();
 
+    /**
+     * Push the modifications applied to this cache to its base, keeping all
+     * entries cached as unmodified. Like Flush, this must not be called while
+     * other caches are backed by this one.
+     */
+    bool Sync();
+
+    /**
+     * Move the modified entries out of the cache into the returned map, leaving
+     * it to the caller to pass them to the base's BatchWrite with fErase false,
+     * possibly from another thread. The cache keeps reading them from that map,
+     * which must not change, until SnapshotWritten is called once the write is
+     * done. Flush, Sync and SnapshotModified must not be called before that.
+     */
+    boost::shared_ptr<CCoinsMap> SnapshotModified();
+
+    //! The snapshot taken last is in the base now, forget it
+    void SnapshotWritten();
+
+    /**
+     * Drop unmodified entries until the memory usage is at most nMaxUsage,
+     * outputs created longest ago first. Modified entries are kept, call Sync
+     * first to make all of them eligible.
+     */
+    void TrimToSize(size_t nMaxUsage);
+
     //! Calculate the size of the cache (in number of transactions)
     unsigned int GetCacheSize() const;
 
+    //! Calculate the size of the cache (in bytes), with a snapshot that is not written yet
+    size_t DynamicMemoryUsage() const;
+
     /** 
      * Amount of pivx coming in to a transaction
      * Note that lightweight clients may not know anything besides the hash of previous transactions,
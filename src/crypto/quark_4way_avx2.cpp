@@ -0,0 +1,7 @@
+// Copyright (c) 2017 The PIVX developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Built with -mavx2 and only called after runtime CPU detection.
+#define QUARK_4WAY_NAMESPACE quark_4way_avx2
+#include "crypto/quark_4way_impl.h"
@@ -0,0 +1,534 @@
+// Copyright (c) 2017 The PIVX developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+/**
+ * Four-lane versions of the 64-bit sph hash functions used by Quark.
+ *
+ * This file is compiled once per instruction set (quark_4way_sse41.cpp and
+ * quark_4way_avx2.cpp), each time with QUARK_4WAY_NAMESPACE set to a
+ * distinct name. Every lane carries one independent message. The code uses
+ * GCC vector extensions so the compiler maps each 4x64-bit operation onto
+ * the widest registers the target flags allow.
+ *
+ * Only the message shapes Quark produces are supported: one input of at
+ * most QUARK_MULTI_MAX_INPUT bytes for the first BLAKE round and exactly
+ * 64 bytes for every later round. Output is bit-for-bit identical to the
+ * corresponding sph_*512 function.
+ */
+
+#ifndef QUARK_4WAY_NAMESPACE
+#error "QUARK_4WAY_NAMESPACE must be defined before including quark_4way_impl.h"
+#endif
+
+#include "crypto/common.h"
+#include "crypto/quark_multi.h"
+
+#include <string.h>
+
+namespace QUARK_4WAY_NAMESPACE
+{
+namespace
+{
+typedef uint64_t v64 __attribute__((vector_size(32)));
+
+inline v64 Splat(uint64_t x) { return (v64){x, x, x, x}; }
+inline v64 Rotl(v64 x, int n) { return (x << n) | (x >> (64 - n)); }
+inline v64 Rotr(v64 x, int n) { return (x >> n) | (x << (64 - n)); }
+
+inline v64 LoadLE(const unsigned char in[4][64], size_t pos)
+{
+    return (v64){ReadLE64(in[0] + pos), ReadLE64(in[1] + pos), ReadLE64(in[2] + pos), ReadLE64(in[3] + pos)};
+}
+
+inline void StoreLE(unsigned char out[4][64], size_t pos, v64 x)
+{
+    for (int i = 0; i < 4; i++)
+        WriteLE64(out[i] + pos, x[i]);
+}
+
+inline void StoreBE(unsigned char out[4][64], size_t pos, v64 x)
+{
+    for (int i = 0; i < 4; i++)
+        WriteBE64(out[i] + pos, x[i]);
+}
+
+/// BLAKE-512
+namespace blake
+{
+const uint64_t IV[8] = {
+    0x6A09E667F3BCC908ULL, 0xBB67AE8584CAA73BULL, 0x3C6EF372FE94F82BULL, 0xA54FF53A5F1D36F1ULL,
+    0x510E527FADE682D1ULL, 0x9B05688C2B3E6C1FULL, 0x1F83D9ABFB41BD6BULL, 0x5BE0CD19137E2179ULL};
+
+const uint64_t CB[16] = {
+    0x243F6A8885A308D3ULL, 0x13198A2E03707344ULL, 0xA4093822299F31D0ULL, 0x082EFA98EC4E6C89ULL,
+    0x452821E638D01377ULL, 0xBE5466CF34E90C6CULL, 0xC0AC29B7C97C50DDULL, 0x3F84D5B5B5470917ULL,
+    0x9216D5D98979FB1BULL, 0xD1310BA698DFB5ACULL, 0x2FFD72DBD01ADFB7ULL, 0xB8E1AFED6A267E96ULL,
+    0xBA7C9045F12C7F99ULL, 0x24A19947B3916CF7ULL, 0x0801F2E2858EFC16ULL, 0x636920D871574E69ULL};
+
+const unsigned char SIGMA[10][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3},
+    {11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4},
+    {7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8},
+    {9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13},
+    {2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9},
+    {12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11},
+    {13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10},
+    {6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5},
+    {10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0}};
+
+inline void G(const v64 m[16], const unsigned char* s, v64& a, v64& b, v64& c, v64& d)
+{
+    a = a + b + (m[s[0]] ^ Splat(CB[s[1]]));
+    d = Rotr(d ^ a, 32);
+    c = c + d;
+    b = Rotr(b ^ c, 25);
+    a = a + b + (m[s[1]] ^ Splat(CB[s[0]]));
+    d = Rotr(d ^ a, 16);
+    c = c + d;
+    b = Rotr(b ^ c, 11);
+}
+
+/** Single-block BLAKE-512 of len bytes per lane (len <= QUARK_MULTI_MAX_INPUT). */
+void Hash(const unsigned char* const in[4], size_t len, unsigned char out[4][64])
+{
+    unsigned char block[4][128];
+    for (int i = 0; i < 4; i++) {
+        memcpy(block[i], in[i], len);
+        memset(block[i] + len, 0, 128 - len);
+        block[i][len] = 0x80;
+        block[i][111] |= 0x01;
+        WriteBE64(block[i] + 120, (uint64_t)len << 3);
+    }
+
+    v64 m[16];
+    for (int i = 0; i < 16; i++)
+        m[i] = (v64){ReadBE64(block[0] + 8 * i), ReadBE64(block[1] + 8 * i), ReadBE64(block[2] + 8 * i), ReadBE64(block[3] + 8 * i)};
+
+    const uint64_t t0 = (uint64_t)len << 3;
+    v64 v[16];
+    for (int i = 0; i < 8; i++)
+        v[i] = Splat(IV[i]);
+    for (int i = 0; i < 4; i++)
+        v[8 + i] = Splat(CB[i]);
+    v[12] = Splat(t0 ^ CB[4]);
+    v[13] = Splat(t0 ^ CB[5]);
+    v[14] = Splat(CB[6]);
+    v[15] = Splat(CB[7]);
+
+    for (int r = 0; r < 16; r++) {
+        const unsigned char* s = SIGMA[r % 10];
+        G(m, s + 0, v[0], v[4], v[8], v[12]);
+        G(m, s + 2, v[1], v[5], v[9], v[13]);
+        G(m, s + 4, v[2], v[6], v[10], v[14]);
+        G(m, s + 6, v[3], v[7], v[11], v[15]);
+        G(m, s + 8, v[0], v[5], v[10], v[15]);
+        G(m, s + 10, v[1], v[6], v[11], v[12]);
+        G(m, s + 12, v[2], v[7], v[8], v[13]);
+        G(m, s + 14, v[3], v[4], v[9], v[14]);
+    }
+
+    for (int i = 0; i < 8; i++)
+        StoreBE(out, 8 * i, Splat(IV[i]) ^ v[i] ^ v[i + 8]);
+}
+} // namespace blake
+
+/// Blue Midnight Wish 512
+namespace bmw
+{
+inline v64 s0(v64 x) { return (x >> 1) ^ (x << 3) ^ Rotl(x, 4) ^ Rotl(x, 37); }
+inline v64 s1(v64 x) { return (x >> 1) ^ (x << 2) ^ Rotl(x, 13) ^ Rotl(x, 43); }
+inline v64 s2(v64 x) { return (x >> 2) ^ (x << 1) ^ Rotl(x, 19) ^ Rotl(x, 53); }
+inline v64 s3(v64 x) { return (x >> 2) ^ (x << 2) ^ Rotl(x, 28) ^ Rotl(x, 59); }
+inline v64 s4(v64 x) { return (x >> 1) ^ x; }
+inline v64 s5(v64 x) { return (x >> 2) ^ x; }
+
+inline v64 AddElt(const v64 m[16], const v64 h[16], int j)
+{
+    const int a = j, b = (j + 3) & 15, c = (j + 10) & 15;
+    return (Rotl(m[a], a + 1) + Rotl(m[b], b + 1) - Rotl(m[c], c + 1) + Splat((uint64_t)(j + 16) * 0x0555555555555555ULL)) ^ h[(j + 7) & 15];
+}
+
+void Compress(const v64 m[16], const v64 h[16], v64 dh[16])
+{
+    v64 x[16], w[16], q[32];
+    for (int i = 0; i < 16; i++)
+        x[i] = m[i] ^ h[i];
+
+    w[0] = x[5] - x[7] + x[10] + x[13] + x[14];
+    w[1] = x[6] - x[8] + x[11] + x[14] - x[15];
+    w[2] = x[0] + x[7] + x[9] - x[12] + x[15];
+    w[3] = x[0] - x[1] + x[8] - x[10] + x[13];
+    w[4] = x[1] + x[2] + x[9] - x[11] - x[14];
+    w[5] = x[3] - x[2] + x[10] - x[12] + x[15];
+    w[6] = x[4] - x[0] - x[3] - x[11] + x[13];
+    w[7] = x[1] - x[4] - x[5] - x[12] - x[14];
+    w[8] = x[2] - x[5] - x[6] + x[13] - x[15];
+    w[9] = x[0] - x[3] + x[6] - x[7] + x[14];
+    w[10] = x[8] - x[1] - x[4] - x[7] + x[15];
+    w[11] = x[8] - x[0] - x[2] - x[5] + x[9];
+    w[12] = x[1] + x[3] - x[6] - x[9] + x[10];
+    w[13] = x[2] + x[4] + x[7] + x[10] + x[11];
+    w[14] = x[3] - x[5] + x[8] - x[11] - x[12];
+    w[15] = x[12] - x[4] - x[6] - x[9] + x[13];
+
+    for (int j = 0; j < 15; j += 5) {
+        q[j + 0] = s0(w[j + 0]) + h[j + 1];
+        q[j + 1] = s1(w[j + 1]) + h[j + 2];
+        q[j + 2] = s2(w[j + 2]) + h[j + 3];
+        q[j + 3] = s3(w[j + 3]) + h[j + 4];
+        q[j + 4] = s4(w[j + 4]) + h[j + 5];
+    }
+    q[15] = s0(w[15]) + h[0];
+
+    for (int i = 16; i < 18; i++) {
+        v64 t = AddElt(m, h, i - 16);
+        for (int k = 0; k < 16; k += 4)
+            t = t + s1(q[i - 16 + k]) + s2(q[i - 15 + k]) + s3(q[i - 14 + k]) + s0(q[i - 13 + k]);
+        q[i] = t;
+    }
+    for (int i = 18; i < 32; i++) {
+        q[i] = q[i - 16] + Rotl(q[i - 15], 5) + q[i - 14] + Rotl(q[i - 13], 11) +
+               q[i - 12] + Rotl(q[i - 11], 27) + q[i - 10] + Rotl(q[i - 9], 32) +
+               q[i - 8] + Rotl(q[i - 7], 37) + q[i - 6] + Rotl(q[i - 5], 43) +
+               q[i - 4] + Rotl(q[i - 3], 53) + s4(q[i - 2]) + s5(q[i - 1]) + AddElt(m, h, i - 16);
+    }
+
+    v64 xl = q[16] ^ q[17] ^ q[18] ^ q[19] ^ q[20] ^ q[21] ^ q[22] ^ q[23];
+    v64 xh = xl ^ q[24] ^ q[25] ^ q[26] ^ q[27] ^ q[28] ^ q[29] ^ q[30] ^ q[31];
+    dh[0] = ((xh << 5) ^ (q[16] >> 5) ^ m[0]) + (xl ^ q[24] ^ q[0]);
+    dh[1] = ((xh >> 7) ^ (q[17] << 8) ^ m[1]) + (xl ^ q[25] ^ q[1]);
+    dh[2] = ((xh >> 5) ^ (q[18] << 5) ^ m[2]) + (xl ^ q[26] ^ q[2]);
+    dh[3] = ((xh >> 1) ^ (q[19] << 5) ^ m[3]) + (xl ^ q[27] ^ q[3]);
+    dh[4] = ((xh >> 3) ^ q[20] ^ m[4]) + (xl ^ q[28] ^ q[4]);
+    dh[5] = ((xh << 6) ^ (q[21] >> 6) ^ m[5]) + (xl ^ q[29] ^ q[5]);
+    dh[6] = ((xh >> 4) ^ (q[22] << 6) ^ m[6]) + (xl ^ q[30] ^ q[6]);
+    dh[7] = ((xh >> 11) ^ (q[23] << 2) ^ m[7]) + (xl ^ q[31] ^ q[7]);
+    dh[8] = Rotl(dh[4], 9) + (xh ^ q[24] ^ m[8]) + ((xl << 8) ^ q[23] ^ q[8]);
+    dh[9] = Rotl(dh[5], 10) + (xh ^ q[25] ^ m[9]) + ((xl >> 6) ^ q[16] ^ q[9]);
+    dh[10] = Rotl(dh[6], 11) + (xh ^ q[26] ^ m[10]) + ((xl << 6) ^ q[17] ^ q[10]);
+    dh[11] = Rotl(dh[7], 12) + (xh ^ q[27] ^ m[11]) + ((xl << 4) ^ q[18] ^ q[11]);
+    dh[12] = Rotl(dh[0], 13) + (xh ^ q[28] ^ m[12]) + ((xl >> 3) ^ q[19] ^ q[12]);
+    dh[13] = Rotl(dh[1], 14) + (xh ^ q[29] ^ m[13]) + ((xl >> 4) ^ q[20] ^ q[13]);
+    dh[14] = Rotl(dh[2], 15) + (xh ^ q[30] ^ m[14]) + ((xl >> 7) ^ q[21] ^ q[14]);
+    dh[15] = Rotl(dh[3], 16) + (xh ^ q[31] ^ m[15]) + ((xl >> 2) ^ q[22] ^ q[15]);
+}
+
+/** BMW-512 of 64 bytes per lane: one padded block, then the final compression. */
+void Hash(const unsigned char in[4][64], unsigned char out[4][64])
+{
+    v64 m[16], h[16], h2[16], h3[16];
+    for (int i = 0; i < 8; i++)
+        m[i] = LoadLE(in, 8 * i);
+    m[8] = Splat(0x80);
+    for (int i = 9; i < 15; i++)
+        m[i] = Splat(0);
+    m[15] = Splat(512);
+    for (int i = 0; i < 16; i++)
+        h[i] = Splat(0x8081828384858687ULL + 0x0808080808080808ULL * i);
+    Compress(m, h, h2);
+
+    for (int i = 0; i < 16; i++)
+        h[i] = Splat(0xaaaaaaaaaaaaaaa0ULL + i);
+    Compress(h2, h, h3);
+
+    for (int i = 0; i < 8; i++)
+        StoreLE(out, 8 * i, h3[8 + i]);
+}
+} // namespace bmw
+
+/// JH-512, bitsliced over (high, low) 64-bit halves like sph with SPH_JH_64.
+namespace jh
+{
+// Constants are stored byte-swapped, matching sph's little-endian internal order.
+const uint64_t IV[16] = {
+    0x17AA003E964BD16FULL, 0x43D5157A052E6A63ULL, 0x0BEF970C8D5E228AULL, 0x61C3B3F2591234E9ULL,
+    0x1E806F53C1A01D89ULL, 0x806D2BEA6B05A92AULL, 0xA6BA7520DBCC8E58ULL, 0xF73BF8BA763A0FA9ULL,
+    0x694AE34105E66901ULL, 0x5AE66F2E8E8AB546ULL, 0x243C84C1D0A74710ULL, 0x99C15A2DB1716E3BULL,
+    0x56F8B19DECF657CFULL, 0x56B116577C8806A7ULL, 0xFB1785E6DFFCC2E3ULL, 0x4BDD8CCC78465A54ULL};
+
+const uint64_t C[168] = {
+    0x67F815DFA2DED572ULL, 0x571523B70A15847BULL, 0xF6875A4D90D6AB81ULL, 0x402BD1C3C54F9F4EULL,
+    0x9CFA455CE03A98EAULL, 0x9A99B26699D2C503ULL, 0x8A53BBF2B4960266ULL, 0x31A2DB881A1456B5ULL,
+    0xDB0E199A5C5AA303ULL, 0x1044C1870AB23F40ULL, 0x1D959E848019051CULL, 0xDCCDE75EADEB336FULL,
+    0x416BBF029213BA10ULL, 0xD027BBF7156578DCULL, 0x5078AA3739812C0AULL, 0xD3910041D2BF1A3FULL,
+    0x907ECCF60D5A2D42ULL, 0xCE97C0929C9F62DDULL, 0xAC442BC70BA75C18ULL, 0x23FCC663D665DFD1ULL,
+    0x1AB8E09E036C6E97ULL, 0xA8EC6C447E450521ULL, 0xFA618E5DBB03F1EEULL, 0x97818394B29796FDULL,
+    0x2F3003DB37858E4AULL, 0x956A9FFB2D8D672AULL, 0x6C69B8F88173FE8AULL, 0x14427FC04672C78AULL,
+    0xC45EC7BD8F15F4C5ULL, 0x80BB118FA76F4475ULL, 0xBC88E4AEB775DE52ULL, 0xF4A3A6981E00B882ULL,
+    0x1563A3A9338FF48EULL, 0x89F9B7D524565FAAULL, 0xFDE05A7C20EDF1B6ULL, 0x362C42065AE9CA36ULL,
+    0x3D98FE4E433529CEULL, 0xA74B9A7374F93A53ULL, 0x86814E6F591FF5D0ULL, 0x9F5AD8AF81AD9D0EULL,
+    0x6A6234EE670605A7ULL, 0x2717B96EBE280B8BULL, 0x3F1080C626077447ULL, 0x7B487EC66F7EA0E0ULL,
+    0xC0A4F84AA50A550DULL, 0x9EF18E979FE7E391ULL, 0xD48D605081727686ULL, 0x62B0E5F3415A9E7EULL,
+    0x7A205440EC1F9FFCULL, 0x84C9F4CE001AE4E3ULL, 0xD895FA9DF594D74FULL, 0xA554C324117E2E55ULL,
+    0x286EFEBD2872DF5BULL, 0xB2C4A50FE27FF578ULL, 0x2ED349EEEF7C8905ULL, 0x7F5928EB85937E44ULL,
+    0x4A3124B337695F70ULL, 0x65E4D61DF128865EULL, 0xE720B95104771BC7ULL, 0x8A87D423E843FE74ULL,
+    0xF2947692A3E8297DULL, 0xC1D9309B097ACBDDULL, 0xE01BDC5BFB301B1DULL, 0xBF829CF24F4924DAULL,
+    0xFFBF70B431BAE7A4ULL, 0x48BCF8DE0544320DULL, 0x39D3BB5332FCAE3BULL, 0xA08B29E0C1C39F45ULL,
+    0x0F09AEF7FD05C9E5ULL, 0x34F1904212347094ULL, 0x95ED44E301B771A2ULL, 0x4A982F4F368E3BE9ULL,
+    0x15F66CA0631D4088ULL, 0xFFAF52874B44C147ULL, 0x30C60AE2F14ABB7EULL, 0xE68C6ECCC5B67046ULL,
+    0x00CA4FBD56A4D5A4ULL, 0xAE183EC84B849DDAULL, 0xADD1643045CE5773ULL, 0x67255C1468CEA6E8ULL,
+    0x16E10ECBF28CDAA3ULL, 0x9A99949A5806E933ULL, 0x7B846FC220B2601FULL, 0x1885D1A07FACCED1ULL,
+    0xD319DD8DA15B5932ULL, 0x46B4A5AAC01C9A50ULL, 0xBA6B04E467633D9FULL, 0x7EEE560BAB19CAF6ULL,
+    0x742128A9EA79B11FULL, 0xEE51363B35F7BDE9ULL, 0x76D350755AAC571DULL, 0x01707DA3FEC2463AULL,
+    0x42D8A498AFC135F7ULL, 0x79676B9E20ECED78ULL, 0xA8DB3AEA15638341ULL, 0x832C83324D3BC3FAULL,
+    0xF347271C1F3B40A7ULL, 0x9A762DB734F04059ULL, 0xFD4F21D26C4E3EE7ULL, 0xEF5957DC398DFDB8ULL,
+    0xDAEB492B490C9B8DULL, 0x0D70F36849D7A25BULL, 0x84558D7AD0AE3B7DULL, 0x658EF8E4F0E9A5F5ULL,
+    0x533B1036F4A2B8A0ULL, 0x5AEC3E759E07A80CULL, 0x4F88E85692946891ULL, 0x4CBCBAF8555CB05BULL,
+    0x7B9487F3993BBBE3ULL, 0x5D1C6B72D6F4DA75ULL, 0x6DB334DC28ACAE64ULL, 0x71DB28B850A5346CULL,
+    0x2A518D10F2E261F8ULL, 0xFC75DD593364DBE3ULL, 0xA23FCE43F1BCAC1CULL, 0xB043E8023CD1BB67ULL,
+    0x75A12988CA5B0A33ULL, 0x5C5316B44D19347FULL, 0x1E4D790EC3943B92ULL, 0x3FAFEEB6D7757479ULL,
+    0x21391ABEF7D4A8EAULL, 0x5127234C097EF45CULL, 0xD23C32BA5324A326ULL, 0xADD5A66D4A17A344ULL,
+    0x08C9F2AFA63E1DB5ULL, 0x563C6B91983D5983ULL, 0x4D608672A17CF84CULL, 0xF6C76E08CC3EE246ULL,
+    0x5E76BCB1B333982FULL, 0x2AE6C4EFA566D62BULL, 0x36D4C1BEE8B6F406ULL, 0x6321EFBC1582EE74ULL,
+    0x69C953F40D4EC1FDULL, 0x26585806C45A7DA7ULL, 0x16FAE0061614C17EULL, 0x3F9D63283DAF907EULL,
+    0x0CD29B00E3F2C9D2ULL, 0x300CD4B730CEAA5FULL, 0x9832E0F216512A74ULL, 0x9AF8CEE3D830EB0DULL,
+    0x9279F1B57B9EC54BULL, 0xD36886046EE651FFULL, 0x316796E6574D239BULL, 0x05750A17F3A6E6CCULL,
+    0xCE6C3213D98176B1ULL, 0x62A205F88452173CULL, 0x47154778B3CB2BF4ULL, 0x486A9323825446FFULL,
+    0x65655E4E0758DF38ULL, 0x8E5086FC897CFCF2ULL, 0x86CA0BD0442E7031ULL, 0x4E477830A20940F0ULL,
+    0x8338F7D139EEA065ULL, 0xBD3A2CE437E95EF7ULL, 0x6FF8130126B29721ULL, 0xE7DE9FEFD1ED44A3ULL,
+    0xD992257615DFA08BULL, 0xBE42DC12F6F7853CULL, 0x7EB027AB7CECA7D8ULL, 0xDEA83EAADA7D8D53ULL,
+    0xD86902BD93CE25AAULL, 0xF908731AFD43F65AULL, 0xA5194A17DAEF5FC0ULL, 0x6A21FD4C33664D97ULL,
+    0x701541DB3198B435ULL, 0x9B54CDEDBB0F1EEAULL, 0x72409751A163D09AULL, 0xE26F4791BF9D75F6ULL};
+
+inline void Sb(v64& x0, v64& x1, v64& x2, v64& x3, uint64_t cc)
+{
+    const v64 c = Splat(cc);
+    x3 = ~x3;
+    x0 ^= c & ~x2;
+    v64 tmp = c ^ (x0 & x1);
+    x0 ^= x2 & x3;
+    x3 ^= ~x1 & x2;
+    x1 ^= x0 & x2;
+    x2 ^= x0 & ~x3;
+    x0 ^= x1 | x3;
+    x3 ^= x1 & x2;
+    x1 ^= tmp & x0;
+    x2 ^= tmp;
+}
+
+inline void Lb(v64& x0, v64& x1, v64& x2, v64& x3, v64& x4, v64& x5, v64& x6, v64& x7)
+{
+    x4 ^= x1;
+    x5 ^= x2;
+    x6 ^= x3 ^ x0;
+    x7 ^= x0;
+    x0 ^= x5;
+    x1 ^= x6;
+    x2 ^= x7 ^ x4;
+    x3 ^= x4;
+}
+
+inline void Swap(v64& x, uint64_t cc, int n)
+{
+    const v64 c = Splat(cc);
+    x = ((x >> n) & c) | ((x & c) << n);
+}
+
+/** The W_r bit permutations applied to the odd words after each round. */
+inline void W(v64& hi, v64& lo, int r)
+{
+    static const uint64_t MASK[6] = {
+        0x5555555555555555ULL, 0x3333333333333333ULL, 0x0F0F0F0F0F0F0F0FULL,
+        0x00FF00FF00FF00FFULL, 0x0000FFFF0000FFFFULL, 0x00000000FFFFFFFFULL};
+    if (r == 6) {
+        v64 t = hi;
+        hi = lo;
+        lo = t;
+    } else {
+        Swap(hi, MASK[r], 1 << r);
+        Swap(lo, MASK[r], 1 << r);
+    }
+}
+
+/** One 64-byte block: absorb, E8, absorb again. h[2*i] is the high half of word i. */
+void Block(v64 h[16], const v64 m[8])
+{
+    for (int i = 0; i < 8; i++)
+        h[i] ^= m[i];
+    for (int r = 0; r < 42; r++) {
+        const uint64_t* c = C + 4 * r;
+        Sb(h[0], h[4], h[8], h[12], c[0]);
+        Sb(h[1], h[5], h[9], h[13], c[1]);
+        Sb(h[2], h[6], h[10], h[14], c[2]);
+        Sb(h[3], h[7], h[11], h[15], c[3]);
+        Lb(h[0], h[4], h[8], h[12], h[2], h[6], h[10], h[14]);
+        Lb(h[1], h[5], h[9], h[13], h[3], h[7], h[11], h[15]);
+        for (int i = 2; i < 16; i += 4)
+            W(h[i], h[i + 1], r % 7);
+    }
+    for (int i = 0; i < 8; i++)
+        h[8 + i] ^= m[i];
+}
+
+/** JH-512 of 64 bytes per lane: the message block followed by the padding block. */
+void Hash(const unsigned char in[4][64], unsigned char out[4][64])
+{
+    v64 h[16], m[8];
+    for (int i = 0; i < 16; i++)
+        h[i] = Splat(IV[i]);
+    for (int i = 0; i < 8; i++)
+        m[i] = LoadLE(in, 8 * i);
+    Block(h, m);
+
+    m[0] = Splat(0x80);
+    for (int i = 1; i < 7; i++)
+        m[i] = Splat(0);
+    m[7] = Splat(0x0002000000000000ULL);
+    Block(h, m);
+
+    for (int i = 0; i < 8; i++)
+        StoreLE(out, 8 * i, h[8 + i]);
+}
+} // namespace jh
+
+/// Keccak-512 (the pre-SHA-3 padding used by sph)
+namespace keccak
+{
+const uint64_t RC[24] = {
+    0x0000000000000001ULL, 0x0000000000008082ULL, 0x800000000000808AULL, 0x8000000080008000ULL,
+    0x000000000000808BULL, 0x0000000080000001ULL, 0x8000000080008081ULL, 0x8000000000008009ULL,
+    0x000000000000008AULL, 0x0000000000000088ULL, 0x0000000080008009ULL, 0x000000008000000AULL,
+    0x000000008000808BULL, 0x800000000000008BULL, 0x8000000000008089ULL, 0x8000000000008003ULL,
+    0x8000000000008002ULL, 0x8000000000000080ULL, 0x000000000000800AULL, 0x800000008000000AULL,
+    0x8000000080008081ULL, 0x8000000000008080ULL, 0x0000000080000001ULL, 0x8000000080008008ULL};
+
+const int RHO[25] = {
+    0, 1, 62, 28, 27,
+    36, 44, 6, 55, 20,
+    3, 10, 43, 25, 39,
+    41, 45, 15, 21, 8,
+    18, 2, 61, 56, 14};
+
+void Permute(v64 a[25])
+{
+    for (int r = 0; r < 24; r++) {
+        v64 c[5], b[25];
+        for (int x = 0; x < 5; x++)
+            c[x] = a[x] ^ a[x + 5] ^ a[x + 10] ^ a[x + 15] ^ a[x + 20];
+        for (int x = 0; x < 5; x++) {
+            const v64 d = c[(x + 4) % 5] ^ Rotl(c[(x + 1) % 5], 1);
+            for (int y = 0; y < 25; y += 5)
+                a[y + x] ^= d;
+        }
+        for (int x = 0; x < 5; x++)
+            for (int y = 0; y < 5; y++) {
+                const int i = x + 5 * y;
+                b[y + 5 * ((2 * x + 3 * y) % 5)] = RHO[i] ? Rotl(a[i], RHO[i]) : a[i];
+            }
+        for (int y = 0; y < 25; y += 5)
+            for (int x = 0; x < 5; x++)
+                a[y + x] = b[y + x] ^ (~b[y + (x + 1) % 5] & b[y + (x + 2) % 5]);
+        a[0] ^= Splat(RC[r]);
+    }
+}
+
+/** Keccak-512 of 64 bytes per lane; the padding fits in the single 72-byte rate block. */
+void Hash(const unsigned char in[4][64], unsigned char out[4][64])
+{
+    v64 a[25];
+    for (int i = 0; i < 8; i++)
+        a[i] = LoadLE(in, 8 * i);
+    a[8] = Splat(0x8000000000000001ULL);
+    for (int i = 9; i < 25; i++)
+        a[i] = Splat(0);
+    Permute(a);
+    for (int i = 0; i < 8; i++)
+        StoreLE(out, 8 * i, a[i]);
+}
+} // namespace keccak
+
+/// Skein-512-512
+namespace skein
+{
+const uint64_t IV[8] = {
+    0x4903ADFF749C51CEULL, 0x0D95DE399746DF03ULL, 0x8FD1934127C79BCEULL, 0x9A255629FF352CB1ULL,
+    0x5DB62599DF6CA7B0ULL, 0xEABE394CA9D5C3F4ULL, 0x991112C71A75B523ULL, 0xAE18A40B660FCC33ULL};
+
+inline void Mix(v64& x0, v64& x1, int rc)
+{
+    x0 = x0 + x1;
+    x1 = Rotl(x1, rc) ^ x0;
+}
+
+inline void Mix8(v64 p[8], int i0, int i1, int i2, int i3, int i4, int i5, int i6, int i7, const int rc[4])
+{
+    Mix(p[i0], p[i1], rc[0]);
+    Mix(p[i2], p[i3], rc[1]);
+    Mix(p[i4], p[i5], rc[2]);
+    Mix(p[i6], p[i7], rc[3]);
+}
+
+inline void AddKey(v64 p[8], const v64 k[9], const uint64_t t[3], int s)
+{
+    for (int i = 0; i < 8; i++)
+        p[i] = p[i] + k[(s + i) % 9];
+    p[5] = p[5] + Splat(t[s % 3]);
+    p[6] = p[6] + Splat(t[(s + 1) % 3]);
+    p[7] = p[7] + Splat((uint64_t)s);
+}
+
+/** One UBI block with the given tweak; the chaining value h is updated in place. */
+void Ubi(v64 h[8], const v64 m[8], uint64_t t0, uint64_t t1)
+{
+    static const int R[8][4] = {
+        {46, 36, 19, 37}, {33, 27, 14, 42}, {17, 49, 36, 39}, {44, 9, 54, 56},
+        {39, 30, 34, 24}, {13, 50, 10, 17}, {25, 29, 39, 43}, {8, 35, 56, 22}};
+
+    v64 k[9], p[8];
+    const uint64_t t[3] = {t0, t1, t0 ^ t1};
+    k[8] = Splat(0x1BD11BDAA9FC1A22ULL);
+    for (int i = 0; i < 8; i++) {
+        k[i] = h[i];
+        k[8] ^= h[i];
+        p[i] = m[i];
+    }
+    for (int s = 0; s < 18; s += 2) {
+        AddKey(p, k, t, s);
+        Mix8(p, 0, 1, 2, 3, 4, 5, 6, 7, R[0]);
+        Mix8(p, 2, 1, 4, 7, 6, 5, 0, 3, R[1]);
+        Mix8(p, 4, 1, 6, 3, 0, 5, 2, 7, R[2]);
+        Mix8(p, 6, 1, 0, 7, 2, 5, 4, 3, R[3]);
+        AddKey(p, k, t, s + 1);
+        Mix8(p, 0, 1, 2, 3, 4, 5, 6, 7, R[4]);
+        Mix8(p, 2, 1, 4, 7, 6, 5, 0, 3, R[5]);
+        Mix8(p, 4, 1, 6, 3, 0, 5, 2, 7, R[6]);
+        Mix8(p, 6, 1, 0, 7, 2, 5, 4, 3, R[7]);
+    }
+    AddKey(p, k, t, 18);
+    for (int i = 0; i < 8; i++)
+        h[i] = m[i] ^ p[i];
+}
+
+/** Skein-512-512 of 64 bytes per lane: one final message block, then the output block. */
+void Hash(const unsigned char in[4][64], unsigned char out[4][64])
+{
+    v64 h[8], m[8];
+    for (int i = 0; i < 8; i++) {
+        h[i] = Splat(IV[i]);
+        m[i] = LoadLE(in, 8 * i);
+    }
+    // Message type, first and final flags (480 << 55); 64 bytes processed.
+    Ubi(h, m, 64, (uint64_t)480 << 55);
+
+    for (int i = 0; i < 8; i++)
+        m[i] = Splat(0);
+    // Output type with first and final flags (510 << 55); 8-byte counter block.
+    Ubi(h, m, 8, (uint64_t)510 << 55);
+
+    for (int i = 0; i < 8; i++)
+        StoreLE(out, 8 * i, h[i]);
+}
+} // namespace skein
+
+} // anonymous namespace
+
+extern const Quark4WayFunctions FUNCTIONS = {
+    blake::Hash,
+    bmw::Hash,
+    jh::Hash,
+    keccak::Hash,
+    skein::Hash,
+};
+} // namespace QUARK_4WAY_NAMESPACE
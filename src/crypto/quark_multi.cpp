@@ -0,0 +1,173 @@
+// Copyright (c) 2017 The PIVX developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "crypto/quark_multi.h"
+
+#include "crypto/sph_groestl.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__amd64__) || defined(__i386__)
+#include <cpuid.h>
+#define HAVE_QUARK_CPUID 1
+#endif
+
+#if defined(ENABLE_AVX2)
+namespace quark_4way_avx2
+{
+extern const Quark4WayFunctions FUNCTIONS;
+}
+#endif
+
+#if defined(ENABLE_SSE41)
+namespace quark_4way_sse41
+{
+extern const Quark4WayFunctions FUNCTIONS;
+}
+#endif
+
+namespace
+{
+#if defined(HAVE_QUARK_CPUID)
+/** Whether the OS saves the YMM registers across context switches. */
+bool AVXStateEnabled()
+{
+    uint32_t a, d;
+    __asm__("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+    return (a & 6) == 6;
+}
+#endif
+
+struct Implementation {
+    const Quark4WayFunctions* pfunctions;
+    const char* name;
+};
+
+Implementation Detect()
+{
+    Implementation impl = {NULL, "none"};
+#if defined(HAVE_QUARK_CPUID)
+    uint32_t eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return impl;
+#if defined(ENABLE_SSE41)
+    if ((ecx >> 19) & 1) {
+        impl.pfunctions = &quark_4way_sse41::FUNCTIONS;
+        impl.name = "sse4.1";
+    }
+#endif
+#if defined(ENABLE_AVX2)
+    const bool fOSXSAVE = (ecx >> 27) & 1;
+    if (fOSXSAVE && AVXStateEnabled() && __get_cpuid_max(0, NULL) >= 7) {
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        if ((ebx >> 5) & 1) {
+            impl.pfunctions = &quark_4way_avx2::FUNCTIONS;
+            impl.name = "avx2";
+        }
+    }
+#endif
+#endif
+    return impl;
+}
+
+const Implementation& Selected()
+{
+    static const Implementation impl = Detect();
+    return impl;
+}
+
+typedef unsigned char Lanes[4][64];
+typedef void (*RoundFunction)(const unsigned char in[4][64], unsigned char out[4][64]);
+
+/** Lanes whose previous round output has bit 3 set; this picks the branch in Quark's conditional rounds. */
+unsigned int BranchMask(const Lanes in)
+{
+    unsigned int mask = 0;
+    for (int i = 0; i < 4; i++)
+        if (in[i][0] & 8)
+            mask |= 1 << i;
+    return mask;
+}
+
+/** Scalar Groestl-512 for the lanes selected by mask. */
+void Groestl512(const Lanes in, Lanes out, unsigned int mask)
+{
+    sph_groestl512_context ctx;
+    for (int i = 0; i < 4; i++) {
+        if (!(mask & (1 << i)))
+            continue;
+        sph_groestl512_init(&ctx);
+        sph_groestl512(&ctx, in[i], 64);
+        sph_groestl512_close(&ctx, out[i]);
+    }
+}
+
+/**
+ * One of Quark's conditional rounds: lanes in mask take fnSet, the rest take fnUnset.
+ * Each vector function runs at most once over all four lanes and the results are merged.
+ */
+void Branch(const Lanes in, Lanes out, unsigned int mask, RoundFunction fnSet, RoundFunction fnUnset)
+{
+    if (mask == 0xf) {
+        fnSet(in, out);
+    } else if (mask == 0) {
+        fnUnset(in, out);
+    } else {
+        Lanes tmp;
+        fnSet(in, out);
+        fnUnset(in, tmp);
+        for (int i = 0; i < 4; i++)
+            if (!(mask & (1 << i)))
+                memcpy(out[i], tmp[i], 64);
+    }
+}
+} // namespace
+
+bool QuarkHash4Way(const unsigned char* const in[4], size_t len, unsigned char out[4][32])
+{
+    const Quark4WayFunctions* f = Selected().pfunctions;
+    if (f == NULL || len > QUARK_MULTI_MAX_INPUT)
+        return false;
+
+    Lanes a, b;
+    unsigned int mask;
+
+    f->Blake512(in, len, a);
+    f->Bmw512(a, b);
+
+    // Groestl has no vector implementation; only compute it for the lanes that need it.
+    mask = BranchMask(b);
+    if (mask != 0xf)
+        f->Skein512(b, a);
+    Groestl512(b, a, mask);
+
+    Groestl512(a, b, 0xf);
+    f->Jh512(b, a);
+
+    mask = BranchMask(a);
+    Lanes blake;
+    if (mask != 0) {
+        const unsigned char* p[4] = {a[0], a[1], a[2], a[3]};
+        f->Blake512(p, 64, blake);
+    }
+    if (mask != 0xf)
+        f->Bmw512(a, b);
+    for (int i = 0; i < 4; i++)
+        if (mask & (1 << i))
+            memcpy(b[i], blake[i], 64);
+
+    f->Keccak512(b, a);
+    f->Skein512(a, b);
+
+    Branch(b, a, BranchMask(b), f->Keccak512, f->Jh512);
+
+    for (int i = 0; i < 4; i++)
+        memcpy(out[i], a[i], 32);
+    return true;
+}
+
+const char* QuarkMultiImplementation()
+{
+    return Selected().name;
+}
@@ -0,0 +1,37 @@
+// Copyright (c) 2017 The PIVX developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CRYPTO_QUARK_MULTI_H
+#define BITCOIN_CRYPTO_QUARK_MULTI_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/** Longest input the multi-lane engine accepts: BLAKE-512 must fit the message in one block. */
+static const size_t QUARK_MULTI_MAX_INPUT = 111;
+
+/** Number of inputs hashed together by QuarkHash4Way. */
+static const size_t QUARK_MULTI_LANES = 4;
+
+/** Four-lane round functions for one instruction set (see quark_4way_impl.h). */
+struct Quark4WayFunctions {
+    void (*Blake512)(const unsigned char* const in[4], size_t len, unsigned char out[4][64]);
+    void (*Bmw512)(const unsigned char in[4][64], unsigned char out[4][64]);
+    void (*Jh512)(const unsigned char in[4][64], unsigned char out[4][64]);
+    void (*Keccak512)(const unsigned char in[4][64], unsigned char out[4][64]);
+    void (*Skein512)(const unsigned char in[4][64], unsigned char out[4][64]);
+};
+
+/**
+ * Compute the Quark hash of four len-byte inputs (len <= QUARK_MULTI_MAX_INPUT)
+ * in one pass, writing 32 bytes per lane to out. Returns false without touching
+ * out when this CPU has no usable SIMD implementation; callers then fall back
+ * to the scalar HashQuark.
+ */
+bool QuarkHash4Way(const unsigned char* const in[4], size_t len, unsigned char out[4][32]);
+
+/** Name of the multi-lane implementation selected for this CPU: "avx2", "sse4.1" or "none". */
+const char* QuarkMultiImplementation();
+
+#endif // BITCOIN_CRYPTO_QUARK_MULTI_H
@@ -10,6 +10,7 @@
 
 #include "crypto/ripemd160.h"
 #include "crypto/sha256.h"
+#include "crypto/quark_multi.h"
 #include "serialize.h"
 #include "uint256.h"
 #include "version.h"
@@ -355,6 +356,33 @@ inline uint256 HashQuark(const T1 pbegin, const T1 pend)
     return hash[8].trim256();
 }
 
+/**
+ * Quark hash of nCount equally sized messages at once. Groups of messages are
+ * hashed in parallel lanes when the CPU supports it; everything else goes
+ * through HashQuark. Results are identical to calling HashQuark on each message.
+ */
+inline void HashQuarkMulti(const unsigned char* const pbegin[], size_t nLen, uint256 pout[], size_t nCount)
+{
+    size_t i = 0;
+    if (nLen <= QUARK_MULTI_MAX_INPUT) {
+        unsigned char out[QUARK_MULTI_LANES][32];
+        while (nCount - i >= 2) {
+            // Pad a partial group by repeating its last message
+            const unsigned char* in[QUARK_MULTI_LANES];
+            size_t nLanes = std::min(nCount - i, (size_t)QUARK_MULTI_LANES);
+            for (size_t j = 0; j < QUARK_MULTI_LANES; j++)
+                in[j] = pbegin[i + std::min(j, nLanes - 1)];
+            if (!QuarkHash4Way(in, nLen, out))
+                break;
+            for (size_t j = 0; j < nLanes; j++)
+                memcpy(pout[i + j].begin(), out[j], 32);
+            i += nLanes;
+        }
+    }
+    for (; i < nCount; i++)
+        pout[i] = HashQuark(pbegin[i], pbegin[i] + nLen);
+}
+
 void scrypt_hash(const char* pass, unsigned int pLen, const char* salt, unsigned int sLen, char* output, unsigned int N, unsigned int r, unsigned int p, unsigned int dkLen);
 
 #endif // BITCOIN_HASH_H
@@ -4,8 +4,14 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <boost/assign/list_of.hpp>
+#include <boost/bind.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
 
+#include <atomic>
+#include <limits>
+
+#include "crypto/common.h"
 #include "db.h"
 #include "kernel.h"
 #include "script/interpreter.h"
@@ -239,11 +245,82 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
     return true;
 }
 
+// Kernel stake modifiers already looked up, keyed by the hash of the block the stake comes from.
+// An entry is valid as long as the blocks up to the one that generated its modifier stay on the active chain.
+struct CStakeModifierEntry {
+    uint64_t nStakeModifier;
+    int nHeight;
+    int64_t nTime;
+};
+static CCriticalSection cs_mapStakeModifierCache;
+static boost::unordered_map<uint256, CStakeModifierEntry, BlockHasher> mapStakeModifierCache;
+
+static void CacheStakeModifier(const uint256& hashBlockFrom, const CStakeModifierEntry& entry)
+{
+    AssertLockHeld(cs_mapStakeModifierCache);
+    // Evict an arbitrary entry once full, like the signature cache does
+    if (mapStakeModifierCache.size() >= MAX_STAKE_MODIFIER_CACHE && !mapStakeModifierCache.count(hashBlockFrom))
+        mapStakeModifierCache.erase(mapStakeModifierCache.begin());
+    mapStakeModifierCache[hashBlockFrom] = entry;
+}
+
+void UpdateStakeModifierCache(const CBlockIndex* pindexNew)
+{
+    // A block that generated a modifier is the kernel modifier of every earlier block whose
+    // selection interval it is the first generating block to reach (see GetKernelStakeModifier).
+    if (!pindexNew->GeneratedStakeModifier())
+        return;
+
+    const int64_t nSelectionInterval = GetStakeModifierSelectionInterval();
+    CStakeModifierEntry entry;
+    entry.nStakeModifier = pindexNew->nStakeModifier;
+    entry.nHeight = pindexNew->nHeight;
+    entry.nTime = pindexNew->GetBlockTime();
+
+    // Latest modifier generated strictly between the candidate block and pindexNew
+    int64_t nLastGeneratedTime = std::numeric_limits<int64_t>::min();
+    const CBlockIndex* pindex = pindexNew->pprev;
+    LOCK(cs_mapStakeModifierCache);
+    for (int i = 0; pindex && i < MAX_STAKE_MODIFIER_CACHE_UPDATE; i++, pindex = pindex->pprev) {
+        int64_t nSelectionEnd = pindex->GetBlockTime() + nSelectionInterval;
+        // An earlier block already completed this selection interval; older
+        // blocks are assumed done too and fall back to the chain walk if not.
+        if (nLastGeneratedTime >= nSelectionEnd)
+            break;
+        if (entry.nTime >= nSelectionEnd)
+            CacheStakeModifier(pindex->GetBlockHash(), entry);
+        if (pindex->GeneratedStakeModifier())
+            nLastGeneratedTime = std::max(nLastGeneratedTime, pindex->GetBlockTime());
+    }
+}
+
+void InvalidateStakeModifierCache(const CBlockIndex* pindexDisconnected)
+{
+    // Entries whose chain walk reached the disconnected block may select a different modifier now
+    LOCK(cs_mapStakeModifierCache);
+    for (boost::unordered_map<uint256, CStakeModifierEntry, BlockHasher>::iterator it = mapStakeModifierCache.begin(); it != mapStakeModifierCache.end();) {
+        if (it->second.nHeight >= pindexDisconnected->nHeight)
+            mapStakeModifierCache.erase(it++);
+        else
+            ++it;
+    }
+}
+
 // The stake modifier used to hash for a stake kernel is chosen as the stake
 // modifier about a selection interval later than the coin generating the kernel
 bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake)
 {
     nStakeModifier = 0;
+    {
+        LOCK(cs_mapStakeModifierCache);
+        boost::unordered_map<uint256, CStakeModifierEntry, BlockHasher>::const_iterator it = mapStakeModifierCache.find(hashBlockFrom);
+        if (it != mapStakeModifierCache.end()) {
+            nStakeModifier = it->second.nStakeModifier;
+            nStakeModifierHeight = it->second.nHeight;
+            nStakeModifierTime = it->second.nTime;
+            return true;
+        }
+    }
     if (!mapBlockIndex.count(hashBlockFrom))
         return error("GetKernelStakeModifier() : block not indexed");
     const CBlockIndex* pindexFrom = mapBlockIndex[hashBlockFrom];
@@ -268,6 +345,13 @@ bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int
         }
     }
     nStakeModifier = pindex->nStakeModifier;
+
+    CStakeModifierEntry entry;
+    entry.nStakeModifier = nStakeModifier;
+    entry.nHeight = nStakeModifierHeight;
+    entry.nTime = nStakeModifierTime;
+    LOCK(cs_mapStakeModifierCache);
+    CacheStakeModifier(hashBlockFrom, entry);
     return true;
 }
 
@@ -360,6 +444,163 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock blockFrom, const CTra
     return fSuccess;
 }
 
+double dStakeHashesPerSec = 0.0;
+
+bool GetStakeKernelInput(const CBlockIndex* pindexFrom, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, CStakeKernelInput& input)
+{
+    input.prevout = prevout;
+    input.nValueIn = txPrev.vout[prevout.n].nValue;
+    input.nTimeBlockFrom = pindexFrom->GetBlockTime();
+
+    // Same time and min age rules as CheckStakeKernelHash, checked before the
+    // modifier lookup which fails for coins younger than a selection interval
+    if (nTimeTx < input.nTimeBlockFrom || input.nTimeBlockFrom + nStakeMinAge > nTimeTx)
+        return false;
+
+    int nStakeModifierHeight = 0;
+    int64_t nStakeModifierTime = 0;
+    return GetKernelStakeModifier(pindexFrom->GetBlockHash(), input.nStakeModifier, nStakeModifierHeight, nStakeModifierTime, false);
+}
+
+namespace
+{
+// Inputs handed to a search thread at a time
+const size_t STAKE_SEARCH_BATCH = 32;
+
+class CStakeKernelSearch
+{
+private:
+    const std::vector<CStakeKernelInput>& vInputs;
+    const uint256 bnTargetPerCoinDay;
+    const unsigned int nTimeTx;
+    const unsigned int nHashDrift;
+
+    std::atomic<size_t> nNext;
+    std::atomic<uint64_t> nHashes;
+
+    boost::mutex mutex;
+    std::atomic<size_t> nFound;
+    unsigned int nTimeFound;
+    uint256 hashFound;
+
+    // Try every timestamp for one input, newest first like CheckStakeKernelHash
+    bool SearchInput(const CStakeKernelInput& input, unsigned int& nTimeRet, uint256& hashRet)
+    {
+        // The kernel is SHA256d(modifier || nTimeBlockFrom || prevout.n || prevout.hash || nTimeTx);
+        // only the last four bytes change, so the hasher is primed with the prefix once.
+        unsigned char prefix[48];
+        WriteLE64(prefix, input.nStakeModifier);
+        WriteLE32(prefix + 8, input.nTimeBlockFrom);
+        WriteLE32(prefix + 12, input.prevout.n);
+        memcpy(prefix + 16, input.prevout.hash.begin(), 32);
+        CHash256 hasherPrefix;
+        hasherPrefix.Write(prefix, sizeof(prefix));
+
+        const uint256 bnTarget = uint256(input.nValueIn) / 100 * bnTargetPerCoinDay;
+        unsigned char time[4];
+        for (unsigned int i = 0; i < nHashDrift; i++) {
+            unsigned int nTryTime = nTimeTx + nHashDrift - i;
+            WriteLE32(time, nTryTime);
+            CHash256(hasherPrefix).Write(time, sizeof(time)).Finalize(hashRet.begin());
+            if (hashRet < bnTarget) {
+                nTimeRet = nTryTime;
+                nHashes += i + 1;
+                return true;
+            }
+        }
+        nHashes += nHashDrift;
+        return false;
+    }
+
+public:
+    CStakeKernelSearch(const std::vector<CStakeKernelInput>& vInputsIn, const uint256& bnTargetPerCoinDayIn, unsigned int nTimeTxIn, unsigned int nHashDriftIn)
+        : vInputs(vInputsIn), bnTargetPerCoinDay(bnTargetPerCoinDayIn), nTimeTx(nTimeTxIn), nHashDrift(nHashDriftIn),
+          nNext(0), nHashes(0), nFound(vInputsIn.size()), nTimeFound(0) {}
+
+    // Worker loop. Batches are taken in input order and an input is only skipped once a
+    // hit at a lower index is known, so the lowest winning index is always found.
+    void Run()
+    {
+        while (true) {
+            size_t nStart = nNext.fetch_add(STAKE_SEARCH_BATCH);
+            if (nStart >= nFound)
+                return;
+            size_t nEnd = std::min(nStart + STAKE_SEARCH_BATCH, vInputs.size());
+            for (size_t i = nStart; i < nEnd && i < nFound; i++) {
+                unsigned int nTime;
+                uint256 hash;
+                if (!SearchInput(vInputs[i], nTime, hash))
+                    continue;
+                boost::mutex::scoped_lock lock(mutex);
+                if (i < nFound) {
+                    nFound = i;
+                    nTimeFound = nTime;
+                    hashFound = hash;
+                }
+                return;
+            }
+        }
+    }
+
+    bool GetResult(size_t& nIndexRet, unsigned int& nTimeRet, uint256& hashRet) const
+    {
+        if (nFound >= vInputs.size())
+            return false;
+        nIndexRet = nFound;
+        nTimeRet = nTimeFound;
+        hashRet = hashFound;
+        return true;
+    }
+
+    uint64_t GetHashCount() const { return nHashes; }
+};
+} // anonymous namespace
+
+bool FindStakeKernel(unsigned int nBits, const std::vector<CStakeKernelInput>& vInputs, unsigned int& nTimeTx, unsigned int nHashDrift, size_t& nIndexRet, uint256& hashProofOfStake)
+{
+    uint256 bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits);
+
+    int nThreads = GetArg("-stakethreads", 0);
+    if (nThreads <= 0)
+        nThreads = boost::thread::hardware_concurrency();
+    nThreads = std::max(1, std::min(nThreads, MAX_STAKE_THREADS));
+    nThreads = std::min<size_t>(nThreads, (vInputs.size() + STAKE_SEARCH_BATCH - 1) / STAKE_SEARCH_BATCH);
+
+    int64_t nStart = GetTimeMicros();
+    CStakeKernelSearch search(vInputs, bnTargetPerCoinDay, nTimeTx, nHashDrift);
+    if (nThreads > 1) {
+        // The workers reference this stack frame, so they must be joined even if this thread is interrupted
+        boost::this_thread::disable_interruption di;
+        boost::thread_group threadGroup;
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&CStakeKernelSearch::Run, &search));
+        threadGroup.join_all();
+    } else {
+        search.Run();
+    }
+    int64_t nElapsed = GetTimeMicros() - nStart;
+    if (nElapsed > 0)
+        dStakeHashesPerSec = 1000000.0 * search.GetHashCount() / nElapsed;
+
+    mapHashedBlocks.clear();
+    mapHashedBlocks[chainActive.Tip()->nHeight] = GetTime(); //store a time stamp of when we last hashed on this block
+
+    unsigned int nTimeFound;
+    if (!search.GetResult(nIndexRet, nTimeFound, hashProofOfStake))
+        return false;
+    nTimeTx = nTimeFound;
+
+    const CStakeKernelInput& input = vInputs[nIndexRet];
+    if (fDebug)
+        LogPrintf("FindStakeKernel() : pass protocol=%s modifier=%s nTimeBlockFrom=%u prevoutHash=%s nPrevout=%u nTimeTx=%u hashProof=%s\n",
+            "0.3",
+            boost::lexical_cast<std::string>(input.nStakeModifier).c_str(),
+            input.nTimeBlockFrom, input.prevout.hash.ToString().c_str(), input.prevout.n, nTimeTx,
+            hashProofOfStake.ToString().c_str());
+    return true;
+}
+
 // Check kernel hash target and coinstake signature
 bool CheckProofOfStake(const CBlock block, uint256& hashProofOfStake)
 {
@@ -17,15 +17,53 @@ extern unsigned int getIntervalVersion(bool fTestNet);
 // ratio of group interval length between the last group and the first group
 static const int MODIFIER_INTERVAL_RATIO = 3;
 
+// Maximum number of kernel stake modifiers kept in memory
+static const size_t MAX_STAKE_MODIFIER_CACHE = 100000;
+// Maximum number of blocks looked back when a connected block fills the modifier cache
+static const int MAX_STAKE_MODIFIER_CACHE_UPDATE = 1000;
+
 // Compute the hash modifier for proof-of-stake
 bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeModifier, bool& fGeneratedStakeModifier);
 
+// Record the kernel stake modifiers selected by a block just connected to the active chain
+void UpdateStakeModifierCache(const CBlockIndex* pindexNew);
+
+// Forget kernel stake modifiers that were selected through a block being disconnected
+void InvalidateStakeModifierCache(const CBlockIndex* pindexDisconnected);
+
+// Get the stake modifier for a kernel whose coin was confirmed in block hashBlockFrom,
+// from the cache or else by walking the active chain
+bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake);
+
 // Check whether stake kernel meets hash target
 // Sets hashProofOfStake on success return
 uint256 stakeHash(unsigned int nTimeTx, CDataStream ss, unsigned int prevoutIndex, uint256 prevoutHash, unsigned int nTimeBlockFrom);
 bool stakeTargetHit(uint256 hashProofOfStake, int64_t nValueIn, uint256 bnTargetPerCoinDay);
 bool CheckStakeKernelHash(unsigned int nBits, const CBlock blockFrom, const CTransaction txPrev, const COutPoint prevout, unsigned int& nTimeTx, unsigned int nHashDrift, bool fCheck, uint256& hashProofOfStake, bool fPrintProofOfStake = false);
 
+// Maximum number of threads searching for a stake kernel
+static const int MAX_STAKE_THREADS = 16;
+
+// Kernel hashes per second reached by the last stake kernel search
+extern double dStakeHashesPerSec;
+
+// A coin considered for staking, with every part of its kernel hash except the timestamp
+struct CStakeKernelInput {
+    COutPoint prevout;
+    int64_t nValueIn;
+    unsigned int nTimeBlockFrom;
+    uint64_t nStakeModifier;
+};
+
+// Fill in the kernel input for prevout of txPrev, which was confirmed in pindexFrom.
+// Returns false if the coin cannot stake at nTimeTx yet
+bool GetStakeKernelInput(const CBlockIndex* pindexFrom, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, CStakeKernelInput& input);
+
+// Search the inputs for a kernel meeting nBits with a timestamp in (nTimeTx, nTimeTx + nHashDrift].
+// The inputs are spread over -stakethreads workers, but the result is the one a serial
+// CheckStakeKernelHash loop over vInputs would find. On success sets nIndexRet, nTimeTx and hashProofOfStake.
+bool FindStakeKernel(unsigned int nBits, const std::vector<CStakeKernelInput>& vInputs, unsigned int& nTimeTx, unsigned int nHashDrift, size_t& nIndexRet, uint256& hashProofOfStake);
+
 // Check kernel hash target and coinstake signature
 // Sets hashProofOfStake on success return
 bool CheckProofOfStake(const CBlock block, uint256& hashProofOfStake);
@@ -14,6 +14,7 @@
 #include "checkqueue.h"
 #include "init.h"
 #include "kernel.h"
+#include "mappedfile.h"
 #include "masternode-budget.h"
 #include "masternode-payments.h"
 #include "masternodeman.h"
@@ -51,6 +52,8 @@ using namespace std;
 CCriticalSection cs_main;
 
 BlockMap mapBlockIndex;
+//! Owns the entries of mapBlockIndex
+static CBlockIndexArena blockIndexArena;
 map<uint256, uint256> mapProofOfStake;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
 map<unsigned int, unsigned int> mapHashedBlocks;
@@ -60,12 +63,13 @@ int64_t nTimeBestReceived = 0;
 CWaitableCriticalSection csBestBlock;
 CConditionVariable cvBlockChange;
 int nScriptCheckThreads = 0;
+int nMessageCheckThreads = 0;
 bool fImporting = false;
 bool fReindex = false;
 bool fTxIndex = true;
 bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
-unsigned int nCoinCacheSize = 5000;
+size_t nCoinCacheUsage = 5000 * 300;
 bool fAlerts = DEFAULT_ALERTS;
 
 unsigned int nStakeMinAge = 60 * 60;
@@ -172,6 +176,14 @@ set<CBlockIndex*> setDirtyBlockIndex;
 
 /** Dirty block file entries. */
 set<int> setDirtyFileInfo;
+
+/** Blocks recently sent to peers as stored on disk, most recent first. Protected by cs_main. */
+list<pair<uint256, vector<char> > > listServedBlocks;
+map<uint256, list<pair<uint256, vector<char> > >::iterator> mapServedBlocks;
+size_t nServedBlocksSize = 0;
+
+/** Block and undo files mapped for reading, see MapStoredRecord. */
+CMappedFileCache mappedDiskFiles(MAX_MAPPED_BLOCK_FILES);
 } // anon namespace
 
 //////////////////////////////////////////////////////////////////////////////
@@ -1082,7 +1094,17 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 }
 
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
+/** Expire old transactions and trim the pool to the -maxmempool limit */
+static void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age)
+{
+    int expired = pool.Expire(GetTime() - age);
+    if (expired != 0)
+        LogPrint("mempool", "Expired %i transactions from the memory pool\n", expired);
+
+    pool.TrimToSize(limit);
+}
+
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees, bool fOverrideMempoolLimit)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1198,7 +1220,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
         CAmount nFees = nValueIn - nValueOut;
         double dPriority = view.GetPriority(tx, chainActive.Height());
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height());
+        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height(), nSigOps);
         unsigned int nSize = entry.GetTxSize();
 
         // Don't accept it if it can't get into a block
@@ -1212,6 +1234,17 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
                                         hash.ToString(), nFees, txMinFee),
                     REJECT_INSUFFICIENTFEE, "insufficient fee");
 
+            // Once the pool had to evict packages, only accept transactions
+            // paying more than what was evicted
+            double dPriorityDelta = 0;
+            CAmount nFeeDelta = 0;
+            pool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
+            CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+            if (!fOverrideMempoolLimit && mempoolRejectFee > 0 && nFees + nFeeDelta < mempoolRejectFee)
+                return state.DoS(0, error("AcceptToMemoryPool : mempool min fee not met %s, %d < %d",
+                                        hash.ToString(), nFees + nFeeDelta, mempoolRejectFee),
+                    REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+
             // Require that free transactions have sufficient priority to be mined in the next block.
             if (GetBoolArg("-relaypriority", true) && nFees < ::minRelayTxFee.GetFee(nSize) && !AllowFree(view.GetPriority(tx, chainActive.Height() + 1))) {
                 return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
@@ -1246,6 +1279,22 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
                 hash.ToString(),
                 nFees, ::minRelayTxFee.GetFee(nSize) * 10000);
 
+        // Calculate in-mempool ancestors, up to a limit. The iterators stay
+        // valid until addUnchecked below as transactions are only removed
+        // from the pool under cs_main.
+        CTxMemPool::setEntries setAncestors;
+        size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+        size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT) * 1000;
+        size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+        size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000;
+        std::string errString;
+        {
+            LOCK(pool.cs);
+            if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString))
+                return state.DoS(0, error("AcceptToMemoryPool : %s %s", hash.ToString(), errString),
+                    REJECT_NONSTANDARD, "too-long-mempool-chain");
+        }
+
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
         if (!CheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true)) {
@@ -1266,7 +1315,14 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
         }
 
         // Store transaction in memory
-        pool.addUnchecked(hash, entry);
+        pool.addUnchecked(hash, entry, setAncestors);
+
+        // trim mempool and check if tx was trimmed
+        if (!fOverrideMempoolLimit) {
+            LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+            if (!pool.exists(hash))
+                return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
+        }
     }
 
     SyncWithWallets(tx, NULL);
@@ -1554,18 +1610,52 @@ bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos)
     return true;
 }
 
+/**
+ * The mapping of the file holding the record (block or undo data) at pos, covering the
+ * record and the nTrailer bytes after it, and the size of the record from the header
+ * in front of it. NULL when the file cannot be mapped and has to be read with stdio.
+ */
+static boost::shared_ptr<const CMappedFile> MapStoredRecord(const CDiskBlockPos& pos, const char* prefix, unsigned int nTrailer, unsigned int& nSizeRet)
+{
+    boost::shared_ptr<const CMappedFile> file;
+    if (pos.IsNull() || pos.nPos < MESSAGE_START_SIZE + sizeof(unsigned int))
+        return file;
+    std::string strPath = GetBlockPosFilename(pos, prefix).string();
+    file = mappedDiskFiles.Get(strPath, pos.nPos);
+    if (!file)
+        return file;
+
+    // Index header, see WriteBlockToDisk
+    const unsigned char* pchHeader = (const unsigned char*)file->Data() + pos.nPos - MESSAGE_START_SIZE - sizeof(unsigned int);
+    if (memcmp(pchHeader, Params().MessageStart(), MESSAGE_START_SIZE))
+        return boost::shared_ptr<const CMappedFile>();
+    memcpy(&nSizeRet, pchHeader + MESSAGE_START_SIZE, sizeof(nSizeRet));
+
+    uint64_t nEnd = (uint64_t)pos.nPos + nSizeRet + nTrailer;
+    if (file->Size() < nEnd)
+        file = mappedDiskFiles.Get(strPath, nEnd);
+    return file;
+}
+
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
 {
     block.SetNull();
 
-    // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("ReadBlockFromDisk : OpenBlockFile failed");
-
     // Read block
     try {
-        filein >> block;
+        unsigned int nSize = 0;
+        boost::shared_ptr<const CMappedFile> file = MapStoredRecord(pos, "blk", 0, nSize);
+        if (file) {
+            CMappedFileReader filein(file, pos.nPos, SER_DISK, CLIENT_VERSION, nSize);
+            filein.SetLimit((uint64_t)pos.nPos + nSize);
+            filein >> block;
+        } else {
+            // Open history file to read
+            CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+            if (filein.IsNull())
+                return error("ReadBlockFromDisk : OpenBlockFile failed");
+            filein >> block;
+        }
     } catch (std::exception& e) {
         return error("%s : Deserialize or I/O error - %s", __func__, e.what());
     }
@@ -1591,6 +1681,84 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
 }
 
 
+bool ReadRawBlockFromDisk(std::vector<char>& vchBlock, const CDiskBlockPos& pos)
+{
+    // The block is preceded by the network magic and its size, see WriteBlockToDisk
+    if (pos.IsNull() || pos.nPos < MESSAGE_START_SIZE + sizeof(unsigned int))
+        return error("%s : no block at file %d pos %u", __func__, pos.nFile, pos.nPos);
+
+    unsigned int nSize = 0;
+    boost::shared_ptr<const CMappedFile> file = MapStoredRecord(pos, "blk", 0, nSize);
+    if (file) {
+        if (nSize < 80 || nSize > MAX_BLOCK_SIZE || file->Size() < (uint64_t)pos.nPos + nSize)
+            return error("%s : no block at file %d pos %u", __func__, pos.nFile, pos.nPos);
+        const char* pchBlock = file->Data() + pos.nPos;
+        vchBlock.assign(pchBlock, pchBlock + nSize);
+        return true;
+    }
+
+    CDiskBlockPos posHeader(pos.nFile, pos.nPos - MESSAGE_START_SIZE - sizeof(unsigned int));
+    CAutoFile filein(OpenBlockFile(posHeader, true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s : OpenBlockFile failed", __func__);
+
+    try {
+        unsigned char pchMessageStart[MESSAGE_START_SIZE];
+        unsigned int nSize;
+        filein >> FLATDATA(pchMessageStart) >> nSize;
+        if (memcmp(pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE) || nSize < 80 || nSize > MAX_BLOCK_SIZE)
+            return error("%s : no block at file %d pos %u", __func__, pos.nFile, pos.nPos);
+        vchBlock.resize(nSize);
+        filein.read(&vchBlock[0], nSize);
+    } catch (std::exception& e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+
+    return true;
+}
+
+void PrefetchBlockFromDisk(const CBlockIndex* pindex)
+{
+    if (!pindex || !(pindex->nStatus & BLOCK_HAVE_DATA))
+        return;
+    CDiskBlockPos pos = pindex->GetBlockPos();
+    unsigned int nSize = 0;
+    boost::shared_ptr<const CMappedFile> file = MapStoredRecord(pos, "blk", 0, nSize);
+    if (file)
+        file->WillNeed(pos.nPos, nSize);
+}
+
+/**
+ * The block of pindex as stored on disk, to be sent as it is. The blocks sent last stay
+ * in memory, as peers catching up with a new tip or syncing from us mostly ask for the
+ * same ones. The result is valid until the next call.
+ */
+static const vector<char>* GetBlockToServe(const CBlockIndex* pindex)
+{
+    uint256 hash = pindex->GetBlockHash();
+    map<uint256, list<pair<uint256, vector<char> > >::iterator>::iterator mi = mapServedBlocks.find(hash);
+    if (mi != mapServedBlocks.end()) {
+        listServedBlocks.splice(listServedBlocks.begin(), listServedBlocks, mi->second);
+        return &mi->second->second;
+    }
+
+    vector<char> vchBlock;
+    if (!ReadRawBlockFromDisk(vchBlock, pindex->GetBlockPos()))
+        return NULL;
+    listServedBlocks.push_front(make_pair(hash, vector<char>()));
+    listServedBlocks.front().second.swap(vchBlock);
+    mapServedBlocks[hash] = listServedBlocks.begin();
+    nServedBlocksSize += listServedBlocks.front().second.size();
+
+    // Never drop the block just read
+    while (nServedBlocksSize > MAX_SERVED_BLOCK_CACHE_SIZE && listServedBlocks.size() > 1) {
+        nServedBlocksSize -= listServedBlocks.back().second.size();
+        mapServedBlocks.erase(listServedBlocks.back().first);
+        listServedBlocks.pop_back();
+    }
+    return &listServedBlocks.front().second;
+}
+
 double ConvertBitsToDouble(unsigned int nBits)
 {
     int nShift = (nBits >> 24) & 0xff;
@@ -2067,13 +2235,13 @@ void UpdateCoins(const CTransaction& tx, CValidationState& state, CCoinsViewCach
 bool CScriptCheck::operator()()
 {
     const CScript& scriptSig = ptxTo->vin[nIn].scriptSig;
-    if (!VerifyScript(scriptSig, scriptPubKey, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, cacheStore), &error)) {
+    if (!VerifyScript(scriptSig, scriptPubKey, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, cacheStore, txdata), &error)) {
         return ::error("CScriptCheck(): %s:%d VerifySignature failed: %s", ptxTo->GetHash().ToString(), nIn, ScriptErrorString(error));
     }
     return true;
 }
 
-bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, std::vector<CScriptCheck>* pvChecks)
+bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, std::vector<CScriptCheck>* pvChecks, const PrecomputedTransactionData* txdata)
 {
     if (!tx.IsCoinBase()) {
         if (pvChecks)
@@ -2133,14 +2301,26 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
         // Skip ECDSA signature verification when connecting blocks
         // before the last block chain checkpoint. This is safe because block merkle hashes are
         // still computed and checked, and any change will be caught at the next checkpoint.
+        // A transaction whose scripts all passed under these flags before, usually when it
+        // entered the memory pool, needs no script checks at all.
+        if (fScriptChecks && IsTransactionVerified(tx.GetHash(), flags))
+            fScriptChecks = false;
+
         if (fScriptChecks) {
+            // Checks run here share the sighash data of the transaction; deferred ones
+            // get it from the caller, which keeps it alive until they are done
+            std::auto_ptr<PrecomputedTransactionData> ptxdataLocal;
+            if (!txdata && !pvChecks && tx.vin.size() > 1) {
+                ptxdataLocal.reset(new PrecomputedTransactionData(tx));
+                txdata = ptxdataLocal.get();
+            }
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint& prevout = tx.vin[i].prevout;
                 const CCoins* coins = inputs.AccessCoins(prevout.hash);
                 assert(coins);
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore);
+                CScriptCheck check(*coins, tx, i, flags, cacheStore, txdata);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -2153,7 +2333,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
                         CScriptCheck check(*coins, tx, i,
-                            flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore);
+                            flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore, txdata);
                         if (check())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
                     }
@@ -2167,6 +2347,10 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
                     return state.DoS(100, false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(check.GetScriptError())));
                 }
             }
+
+            // Deferred checks have not run yet, only record what was verified here
+            if (cacheStore && !pvChecks)
+                SetTransactionVerified(tx.GetHash(), flags);
         }
     }
 
@@ -2266,6 +2450,12 @@ void static FlushBlockFile(bool fFinalize = false)
 
     CDiskBlockPos posOld(nLastBlockFile, 0);
 
+    // Mappings can not reach past the end of a truncated file
+    if (fFinalize) {
+        mappedDiskFiles.Erase(GetBlockPosFilename(posOld, "blk").string());
+        mappedDiskFiles.Erase(GetBlockPosFilename(posOld, "rev").string());
+    }
+
     FILE* fileOld = OpenBlockFile(posOld);
     if (fileOld) {
         if (fFinalize)
@@ -2329,6 +2519,24 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     bool fScriptChecks = pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate();
 
+    // Load the coins spent by the block in one batch, so the database reads them together
+    // instead of one lookup per input in the loop below. Outputs created in the block itself
+    // are not in the database yet.
+    {
+        std::set<uint256> setBlockTxids;
+        std::vector<uint256> vPrevouts;
+        BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+            if (!tx.IsCoinBase()) {
+                BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+                    if (!setBlockTxids.count(txin.prevout.hash))
+                        vPrevouts.push_back(txin.prevout.hash);
+                }
+            }
+            setBlockTxids.insert(tx.GetHash());
+        }
+        view.Prefetch(vPrevouts);
+    }
+
     // Do not allow blocks that contain transactions which 'overwrite' older transactions,
     // unless those are already completely spent.
     // If such overwrites are allowed, coinbases and transactions depending upon those
@@ -2366,6 +2574,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     CBlockUndo blockundo;
 
+    // Sighash data of the transactions, which the script checks use until control is
+    // done with them. Reserved up front so adding one never moves the others.
+    std::vector<PrecomputedTransactionData> vTxData;
+    vTxData.reserve(block.vtx.size());
+
     CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
 
     int64_t nTimeStart = GetTimeMicros();
@@ -2406,8 +2619,13 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                 nFees += view.GetValueIn(tx) - tx.GetValueOut();
             nValueIn += view.GetValueIn(tx);
 
+            const PrecomputedTransactionData* txdata = NULL;
+            if (fScriptChecks && tx.vin.size() > 1) {
+                vTxData.push_back(PrecomputedTransactionData(tx));
+                txdata = &vTxData.back();
+            }
             std::vector<CScriptCheck> vChecks;
-            if (!CheckInputs(tx, state, view, fScriptChecks, flags, false, nScriptCheckThreads ? &vChecks : NULL))
+            if (!CheckInputs(tx, state, view, fScriptChecks, flags, false, nScriptCheckThreads ? &vChecks : NULL, txdata))
                 return false;
             control.Add(vChecks);
         }
@@ -2503,19 +2721,173 @@ enum FlushStateMode {
     FLUSH_STATE_ALWAYS
 };
 
+/** Chain state write taken under cs_main by FlushStateToDisk, to be written by ThreadFlushState */
+struct CStateFlush {
+    std::vector<std::pair<int, CBlockFileInfo> > vFileInfo;
+    int nLastBlockFile; //! -1 if unchanged
+    std::vector<CDiskBlockIndex> vBlockIndex;
+    CCoinsView* pcoinsBase;
+    boost::shared_ptr<CCoinsMap> pmapCoins; //! read by pcoinsTip until SnapshotWritten
+    uint256 hashBestBlock;
+    bool fSetBestChain;
+    CBlockLocator locator;
+
+    CStateFlush() : nLastBlockFile(-1), pcoinsBase(NULL), fSetBestChain(false) {}
+};
+
+static boost::mutex mutexStateFlush;
+static boost::condition_variable condStateFlush;
+//! Snapshot waiting for ThreadFlushState
+static CStateFlush* pStateFlushQueued = NULL;
+//! A snapshot is queued or being written
+static bool fStateFlushBusy = false;
+//! ThreadFlushState is running
+static bool fStateFlushThread = false;
+//! Error of the last queued write, reported by the next FlushStateToDisk
+static std::string strStateFlushError;
+
+/**
+ * Write a snapshot in the order that keeps the files consistent after a crash: block
+ * and undo data, then the block index, then the coins. The best block marker is written
+ * in the same batch as the coins, so it never points past the outputs on disk.
+ */
+static bool WriteStateFlush(CStateFlush& flush, std::string& strError)
+{
+    try {
+        // First make sure all block and undo data is flushed to disk.
+        FlushBlockFile();
+        // Then update all block file information (which may refer to block and undo files).
+        for (std::vector<std::pair<int, CBlockFileInfo> >::const_iterator it = flush.vFileInfo.begin(); it != flush.vFileInfo.end(); ++it) {
+            if (!pblocktree->WriteBlockFileInfo(it->first, it->second)) {
+                strError = "Failed to write to block index";
+                return false;
+            }
+        }
+        if (flush.nLastBlockFile >= 0 && !pblocktree->WriteLastBlockFile(flush.nLastBlockFile)) {
+            strError = "Failed to write to block index";
+            return false;
+        }
+        for (std::vector<CDiskBlockIndex>::const_iterator it = flush.vBlockIndex.begin(); it != flush.vBlockIndex.end(); ++it) {
+            if (!pblocktree->WriteBlockIndex(*it)) {
+                strError = "Failed to write to block index";
+                return false;
+            }
+        }
+        pblocktree->Sync();
+        // Finally flush the chainstate (which may refer to block index entries).
+        if (!flush.pcoinsBase->BatchWrite(*flush.pmapCoins, flush.hashBestBlock, false)) {
+            strError = "Failed to write to coin database";
+            return false;
+        }
+    } catch (const std::runtime_error& e) {
+        strError = std::string("System error while flushing: ") + e.what();
+        return false;
+    }
+    // Update best block in wallet (so we can detect restored wallets).
+    if (flush.fSetBestChain)
+        g_signals.SetBestChain(flush.locator);
+    return true;
+}
+
+/**
+ * Wait until the queued snapshot is written, writing it here if ThreadFlushState has
+ * stopped. Returns false with the error if that write failed.
+ */
+static bool WaitForStateFlush(std::string& strError)
+{
+    // The snapshot must be written before the caches change further, even if this thread is interrupted
+    boost::this_thread::disable_interruption di;
+    boost::unique_lock<boost::mutex> lock(mutexStateFlush);
+    while (fStateFlushBusy) {
+        if (pStateFlushQueued && !fStateFlushThread) {
+            boost::scoped_ptr<CStateFlush> pflush(pStateFlushQueued);
+            pStateFlushQueued = NULL;
+            lock.unlock();
+            std::string strWriteError;
+            if (!WriteStateFlush(*pflush, strWriteError))
+                AbortNode(strWriteError);
+            pflush.reset();
+            lock.lock();
+            strStateFlushError = strWriteError;
+            fStateFlushBusy = false;
+        } else {
+            condStateFlush.wait(lock);
+        }
+    }
+    strError = strStateFlushError;
+    strStateFlushError.clear();
+    return strError.empty();
+}
+
+void ThreadFlushState()
+{
+    RenameThread("pivx-flushstate");
+    boost::unique_lock<boost::mutex> lock(mutexStateFlush);
+    fStateFlushThread = true;
+    try {
+        while (true) {
+            while (!pStateFlushQueued)
+                condStateFlush.wait(lock);
+            boost::scoped_ptr<CStateFlush> pflush(pStateFlushQueued);
+            pStateFlushQueued = NULL;
+            lock.unlock();
+            std::string strError;
+            if (!WriteStateFlush(*pflush, strError))
+                AbortNode(strError);
+            pflush.reset();
+            lock.lock();
+            strStateFlushError = strError;
+            fStateFlushBusy = false;
+            condStateFlush.notify_all();
+        }
+    } catch (const boost::thread_interrupted&) {
+        // Only the wait is interruptible, a queued snapshot is left to WaitForStateFlush
+        fStateFlushThread = false;
+        condStateFlush.notify_all();
+        throw;
+    }
+}
+
 /**
  * Update the on-disk chain state.
  * The caches and indexes are flushed if either they're too large, forceWrite is set, or
  * fast is not set and it's been a while since the last write.
+ * The coins cache is measured in bytes against nCoinCacheUsage, together with the
+ * snapshot being written. Writing it keeps its unmodified entries; only when it is
+ * over the budget are some of them dropped.
+ *
+ * The modified coins are moved out of the cache and the index entries copied under
+ * cs_main, and except for FLUSH_STATE_ALWAYS written by ThreadFlushState while
+ * validation goes on. Only a flush due before the previous one is written waits for it.
  */
 bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
 {
     LOCK(cs_main);
     static int64_t nLastWrite = 0;
+    {
+        // The cache reads the coins of the last snapshot from it until they are on disk
+        boost::unique_lock<boost::mutex> lock(mutexStateFlush);
+        if (!fStateFlushBusy && strStateFlushError.empty())
+            pcoinsTip->SnapshotWritten();
+    }
     try {
-        if ((mode == FLUSH_STATE_ALWAYS) ||
-            ((mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && pcoinsTip->GetCacheSize() > nCoinCacheSize) ||
-            (mode == FLUSH_STATE_PERIODIC && GetTimeMicros() > nLastWrite + DATABASE_WRITE_INTERVAL * 1000000)) {
+        size_t cacheSize = pcoinsTip->DynamicMemoryUsage();
+        // The cache is large and close to the limit, but we have time now (not in the middle of a block processing).
+        bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && cacheSize * (10.0 / 9) > nCoinCacheUsage;
+        // The cache is over the limit, we have to write now.
+        bool fCacheCritical = mode == FLUSH_STATE_IF_NEEDED && cacheSize > nCoinCacheUsage;
+        // It's been a while since we wrote the block index and chain state to disk.
+        bool fPeriodicWrite = mode == FLUSH_STATE_PERIODIC && GetTimeMicros() > nLastWrite + DATABASE_WRITE_INTERVAL * 1000000;
+        if (mode == FLUSH_STATE_ALWAYS || fCacheLarge || fCacheCritical || fPeriodicWrite) {
+            // The previous snapshot must be on disk before the next one is taken.
+            std::string strError;
+            if (!WaitForStateFlush(strError))
+                return state.Error(strError);
+            pcoinsTip->SnapshotWritten();
+            // Make room by dropping the oldest unmodified coins, leaving some
+            // headroom so the next write is not due right away.
+            if (fCacheLarge || fCacheCritical)
+                pcoinsTip->TrimToSize(nCoinCacheUsage / 4 * 3);
             // Typical CCoins structures on disk are around 100 bytes in size.
             // Pushing a new one to the database can cause it to be written
             // twice (once in the log, and once in the tables). This is already
@@ -2523,33 +2895,38 @@ bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
             // overwrite one. Still, use a conservative safety factor of 2.
             if (!CheckDiskSpace(100 * 2 * 2 * pcoinsTip->GetCacheSize()))
                 return state.Error("out of disk space");
-            // First make sure all block and undo data is flushed to disk.
-            FlushBlockFile();
-            // Then update all block file information (which may refer to block and undo files).
-            bool fileschanged = false;
+
+            auto_ptr<CStateFlush> pflush(new CStateFlush());
             for (set<int>::iterator it = setDirtyFileInfo.begin(); it != setDirtyFileInfo.end();) {
-                if (!pblocktree->WriteBlockFileInfo(*it, vinfoBlockFile[*it])) {
-                    return state.Abort("Failed to write to block index");
-                }
-                fileschanged = true;
+                pflush->vFileInfo.push_back(std::make_pair(*it, vinfoBlockFile[*it]));
+                pflush->nLastBlockFile = nLastBlockFile;
                 setDirtyFileInfo.erase(it++);
             }
-            if (fileschanged && !pblocktree->WriteLastBlockFile(nLastBlockFile)) {
-                return state.Abort("Failed to write to block index");
-            }
+            pflush->vBlockIndex.reserve(setDirtyBlockIndex.size());
             for (set<CBlockIndex*>::iterator it = setDirtyBlockIndex.begin(); it != setDirtyBlockIndex.end();) {
-                if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(*it))) {
-                    return state.Abort("Failed to write to block index");
-                }
+                pflush->vBlockIndex.push_back(CDiskBlockIndex(*it));
                 setDirtyBlockIndex.erase(it++);
             }
-            pblocktree->Sync();
-            // Finally flush the chainstate (which may refer to block index entries).
-            if (!pcoinsTip->Flush())
-                return state.Abort("Failed to write to coin database");
-            // Update best block in wallet (so we can detect restored wallets).
+            pflush->pcoinsBase = pcoinsTip->GetBackend();
+            pflush->pmapCoins = pcoinsTip->SnapshotModified();
+            pflush->hashBestBlock = pcoinsTip->GetBestBlock();
             if (mode != FLUSH_STATE_IF_NEEDED) {
-                g_signals.SetBestChain(chainActive.GetLocator());
+                pflush->fSetBestChain = true;
+                pflush->locator = chainActive.GetLocator();
+            }
+
+            if (mode != FLUSH_STATE_ALWAYS) {
+                boost::unique_lock<boost::mutex> lock(mutexStateFlush);
+                if (fStateFlushThread) {
+                    pStateFlushQueued = pflush.release();
+                    fStateFlushBusy = true;
+                    condStateFlush.notify_all();
+                }
+            }
+            if (pflush.get()) {
+                if (!WriteStateFlush(*pflush, strError))
+                    return state.Abort(strError);
+                pcoinsTip->SnapshotWritten();
             }
             nLastWrite = GetTimeMicros();
         }
@@ -2574,10 +2951,10 @@ void static UpdateTip(CBlockIndex* pindexNew)
     nTimeBestReceived = GetTime();
     mempool.AddTransactionsUpdated(1);
 
-    LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%u\n",
+    LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%.1fMiB(%utx)\n",
         chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(), log(chainActive.Tip()->nChainWork.getdouble()) / log(2.0), (unsigned long)chainActive.Tip()->nChainTx,
         DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
-        Checkpoints::GuessVerificationProgress(chainActive.Tip()), (unsigned int)pcoinsTip->GetCacheSize());
+        Checkpoints::GuessVerificationProgress(chainActive.Tip()), pcoinsTip->DynamicMemoryUsage() * (1.0 / (1 << 20)), (unsigned int)pcoinsTip->GetCacheSize());
 
     cvBlockChange.notify_all();
 
@@ -2629,12 +3006,15 @@ bool static DisconnectTip(CValidationState& state)
         // ignore validation errors in resurrected transactions
         list<CTransaction> removed;
         CValidationState stateDummy;
-        if (tx.IsCoinBase() || tx.IsCoinStake() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
+        if (tx.IsCoinBase() || tx.IsCoinStake() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL, false, false, true))
             mempool.remove(tx, removed, true);
     }
+    // resurrected transactions bypass the limits, trim once the whole block is back
+    LimitMempoolSize(mempool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
     mempool.removeCoinbaseSpends(pcoinsTip, pindexDelete->nHeight);
     mempool.check(pcoinsTip);
     // Update chainActive and related variables.
+    InvalidateStakeModifierCache(pindexDelete);
     UpdateTip(pindexDelete->pprev);
     // Let wallets know transactions went from 1-confirmed to
     // 0-confirmed or conflicted:
@@ -2649,6 +3029,9 @@ static int64_t nTimeConnectTotal = 0;
 static int64_t nTimeFlush = 0;
 static int64_t nTimeChainState = 0;
 static int64_t nTimePostConnect = 0;
+static uint64_t nQuarkHashesLast = 0;
+static uint64_t nQuarkHashesConnect = 0;
+static uint64_t nBlocksConnected = 0;
 
 /**
  * Connect a new block to chainActive. pblock is either NULL or a pointer to a CBlock
@@ -2708,6 +3091,7 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock*
     mempool.check(pcoinsTip);
     // Update chainActive & related variables.
     UpdateTip(pindexNew);
+    UpdateStakeModifierCache(pindexNew);
     // Tell wallet about transactions that went from mempool
     // to conflicted:
     BOOST_FOREACH (const CTransaction& tx, txConflicted) {
@@ -2723,6 +3107,15 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock*
     nTimeTotal += nTime6 - nTime1;
     LogPrint("bench", "  - Connect postprocess: %.2fms [%.2fs]\n", (nTime6 - nTime5) * 0.001, nTimePostConnect * 0.000001);
     LogPrint("bench", "- Connect block: %.2fms [%.2fs]\n", (nTime6 - nTime1) * 0.001, nTimeTotal * 0.000001);
+
+    // Quark evaluations since the previous block was connected. The first
+    // block is left out of the average as it also pays for loading the index.
+    uint64_t nQuarkHashes = GetBlockHashCount();
+    uint64_t nQuarkHashesBlock = nQuarkHashes - nQuarkHashesLast;
+    nQuarkHashesLast = nQuarkHashes;
+    if (nBlocksConnected++ > 0)
+        nQuarkHashesConnect += nQuarkHashesBlock;
+    LogPrint("bench", "- Quark hashes: %u [%.2f/blk]\n", nQuarkHashesBlock, nBlocksConnected > 1 ? (double)nQuarkHashesConnect / (nBlocksConnected - 1) : 0.0);
     return true;
 }
 
@@ -3089,8 +3482,8 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
         return it->second;
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(block);
-    assert(pindexNew);
+    CBlockIndex* pindexNew = blockIndexArena.Allocate();
+    *pindexNew = CBlockIndex(block);
     // We assign the sequence id to blocks only when the full data is available,
     // to avoid miners withholding blocks but broadcasting headers, to get a
     // competitive advantage.
@@ -3111,9 +3504,6 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
         //update previous block pointer
         pindexNew->pprev->pnext = pindexNew;
 
-        // ppcoin: compute chain trust score
-        pindexNew->bnChainTrust = (pindexNew->pprev ? pindexNew->pprev->bnChainTrust : 0) + pindexNew->GetBlockTrust();
-
         // ppcoin: compute stake entropy bit for stake modifier
         if (!pindexNew->SetStakeEntropyBit(pindexNew->GetStakeEntropyBit()))
             LogPrintf("AddToBlockIndex() : SetStakeEntropyBit() failed \n");
@@ -3304,7 +3694,7 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
     // Check the merkle root.
     if (fCheckMerkleRoot) {
         bool mutated;
-        uint256 hashMerkleRoot2 = block.BuildMerkleTree(&mutated);
+        uint256 hashMerkleRoot2 = block.GetMerkleRoot(&mutated);
         if (block.hashMerkleRoot != hashMerkleRoot2)
             return state.DoS(100, error("CheckBlock() : hashMerkleRoot mismatch"),
                 REJECT_INVALID, "bad-txnmrklroot", true);
@@ -3665,9 +4055,13 @@ CBlockIndex* CBlockIndex::GetAncestor(int height)
     if (height > nHeight || height < 0)
         return NULL;
 
+    // Callers hold cs_main, so chainActive can serve as a flat height index: once the walk
+    // reaches an entry of the active chain, the ancestor is looked up there.
     CBlockIndex* pindexWalk = this;
     int heightWalk = nHeight;
     while (heightWalk > height) {
+        if (chainActive[heightWalk] == pindexWalk)
+            return chainActive[height];
         int heightSkip = GetSkipHeight(heightWalk);
         int heightSkipPrev = GetSkipHeight(heightWalk - 1);
         if (heightSkip == height ||
@@ -3864,9 +4258,7 @@ CBlockIndex* InsertBlockIndex(uint256 hash)
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = blockIndexArena.Allocate();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
 
     //mark as PoS seen
@@ -4097,6 +4489,8 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
         uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100)))));
         if (pindex->nHeight < chainActive.Height() - nCheckDepth)
             break;
+        // the blocks are read backwards, let the next one load meanwhile
+        PrefetchBlockFromDisk(pindex->pprev);
         CBlock block;
         // check level 0: read from disk
         if (!ReadBlockFromDisk(block, pindex))
@@ -4114,7 +4508,7 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
             }
         }
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= nCoinCacheSize) {
+        if (nCheckLevel >= 3 && pindex == pindexState && (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage()) <= nCoinCacheUsage) {
             bool fClean = true;
             if (!DisconnectBlock(block, state, pindex, coins, &fClean))
                 return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
@@ -4138,6 +4532,7 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
             boost::this_thread::interruption_point();
             uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, 100 - (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * 50))));
             pindex = chainActive.Next(pindex);
+            PrefetchBlockFromDisk(chainActive.Next(pindex));
             CBlock block;
             if (!ReadBlockFromDisk(block, pindex))
                 return error("VerifyDB() : *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
@@ -4153,10 +4548,20 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
 
 void UnloadBlockIndex()
 {
+    // A queued chain state write still refers to the databases
+    std::string strError;
+    WaitForStateFlush(strError);
     mapBlockIndex.clear();
     setBlockIndexCandidates.clear();
     chainActive.SetTip(NULL);
     pindexBestInvalid = NULL;
+    pindexBestHeader = NULL;
+    pindexBestForkTip = NULL;
+    pindexBestForkBase = NULL;
+    mapBlocksUnlinked.clear();
+    setDirtyBlockIndex.clear();
+    // nothing refers to the entries anymore, give their memory back before the index is loaded again
+    blockIndexArena.Clear();
 }
 
 bool LoadBlockIndex()
@@ -4208,98 +4613,381 @@ bool InitBlockIndex()
 }
 
 
-bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
+/**
+ * Process a block read by LoadExternalBlockFile, then the blocks read before it that were
+ * waiting for it as their parent. False when a system error ends the import.
+ */
+static bool ProcessExternalBlock(CBlock& block, uint64_t nBlockPos, CDiskBlockPos* dbp, std::multimap<uint256, CDiskBlockPos>& mapBlocksUnknownParent, int& nLoaded)
 {
-    // Map of disk positions for blocks with unknown parent (only used for reindex)
-    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
-    int64_t nStart = GetTimeMillis();
+    if (dbp)
+        dbp->nPos = nBlockPos;
 
-    int nLoaded = 0;
-    try {
-        // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
-        CBufferedFile blkdat(fileIn, 2 * MAX_BLOCK_SIZE, MAX_BLOCK_SIZE + 8, SER_DISK, CLIENT_VERSION);
+    // detect out of order blocks, and store them for later
+    uint256 hash = block.GetHash();
+    if (hash != Params().HashGenesisBlock() && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
+        LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
+            block.hashPrevBlock.ToString());
+        if (dbp)
+            mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
+        return true;
+    }
+
+    // process in case the block isn't known yet
+    if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
+        CValidationState state;
+        if (ProcessNewBlock(state, NULL, &block, dbp))
+            nLoaded++;
+        if (state.IsError())
+            return false;
+    } else if (hash != Params().HashGenesisBlock() && mapBlockIndex[hash]->nHeight % 1000 == 0) {
+        LogPrintf("Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
+    }
+
+    // Recursively process earlier encountered successors of this block
+    deque<uint256> queue;
+    queue.push_back(hash);
+    while (!queue.empty()) {
+        uint256 head = queue.front();
+        queue.pop_front();
+        std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
+        while (range.first != range.second) {
+            std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
+            if (ReadBlockFromDisk(block, it->second)) {
+                LogPrintf("%s: Processing out of order child %s of %s\n", __func__, block.GetHash().ToString(),
+                    head.ToString());
+                CValidationState dummy;
+                if (ProcessNewBlock(dummy, NULL, &block, &it->second)) {
+                    nLoaded++;
+                    queue.push_back(block.GetHash());
+                }
+            }
+            range.first++;
+            mapBlocksUnknownParent.erase(it);
+        }
+    }
+    return true;
+}
+
+/** Scan blkdat for blocks and parse and process them one after the other */
+template <typename Stream>
+static void ScanExternalBlocksInline(Stream& blkdat, const boost::function<bool(CBlock&, uint64_t)>& fnProcess)
+{
+    uint64_t nRewind = blkdat.GetPos();
+    while (!blkdat.eof()) {
+        boost::this_thread::interruption_point();
+
+        blkdat.SetPos(nRewind);
+        nRewind++;         // start one byte further next time, in case of failure
+        blkdat.SetLimit(); // remove former limit
+        unsigned int nSize = 0;
+        try {
+            // locate a header
+            unsigned char buf[MESSAGE_START_SIZE];
+            blkdat.FindByte(Params().MessageStart()[0]);
+            nRewind = blkdat.GetPos() + 1;
+            blkdat >> FLATDATA(buf);
+            if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
+                continue;
+            // read size
+            blkdat >> nSize;
+            if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+                continue;
+        } catch (const std::exception&) {
+            // no valid block header found; don't complain
+            break;
+        }
+        try {
+            // read block
+            uint64_t nBlockPos = blkdat.GetPos();
+            blkdat.SetLimit(nBlockPos + nSize);
+            blkdat.SetPos(nBlockPos);
+            CBlock block;
+            blkdat >> block;
+            nRewind = blkdat.GetPos();
+
+            if (!fnProcess(block, nBlockPos))
+                break;
+        } catch (std::exception& e) {
+            LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+}
+
+/** Block found by the reader of a CExternalBlockPipeline */
+struct CExternalBlock {
+    uint64_t nHeaderPos; // position of the network magic in front of the block
+    uint64_t nBlockPos;
+    unsigned int nSize; // size given in the header
+    uint64_t nEndPos;   // end of the parsed block
+    CDataStream ssBlock;
+    CBlock block;
+    bool fParsed;
+    std::string strError;
+
+    CExternalBlock() : nHeaderPos(0), nBlockPos(0), nSize(0), nEndPos(0), ssBlock(SER_DISK, CLIENT_VERSION), fParsed(false) {}
+};
+
+/**
+ * Pipelined scan of a block stream. A reader thread finds the blocks and copies them out of
+ * the stream, worker threads parse them, which hashes the header and the transactions, and
+ * build their merkle trees. The importing thread takes them in file order, so it is left
+ * with the contextual checks and connecting the blocks. The reader stays at most
+ * LOAD_BLOCK_QUEUE_SIZE bytes ahead of the importing thread.
+ */
+template <typename Stream>
+class CExternalBlockPipeline
+{
+private:
+    Stream& blkdat;
+    int nWorkers;
+
+    boost::mutex mutex;
+    boost::condition_variable condReader; // room in the queue, or stop
+    boost::condition_variable condWorker; // a block to parse, or stop
+    boost::condition_variable condImport; // a block parsed, or the reader done
+    std::deque<boost::shared_ptr<CExternalBlock> > queueBlocks; // in file order
+    std::deque<boost::shared_ptr<CExternalBlock> > queueParse;
+    uint64_t nQueuedSize;
+    bool fReaderDone;
+    bool fStop;
+    boost::scoped_ptr<boost::thread_group> threads;
+
+    void Push(const boost::shared_ptr<CExternalBlock>& pblock)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        queueBlocks.push_back(pblock);
+        queueParse.push_back(pblock);
+        nQueuedSize += pblock->nSize;
+        condWorker.notify_one();
+    }
+
+    void ThreadRead()
+    {
         uint64_t nRewind = blkdat.GetPos();
         while (!blkdat.eof()) {
-            boost::this_thread::interruption_point();
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fStop && nQueuedSize >= LOAD_BLOCK_QUEUE_SIZE)
+                    condReader.wait(lock);
+                if (fStop)
+                    return;
+            }
 
+            // Same scan as ScanExternalBlocksInline, the blocks are parsed by the workers
             blkdat.SetPos(nRewind);
-            nRewind++;         // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
+            nRewind++;
+            blkdat.SetLimit();
+            boost::shared_ptr<CExternalBlock> pblock(new CExternalBlock());
             try {
-                // locate a header
                 unsigned char buf[MESSAGE_START_SIZE];
                 blkdat.FindByte(Params().MessageStart()[0]);
-                nRewind = blkdat.GetPos() + 1;
+                pblock->nHeaderPos = blkdat.GetPos();
+                nRewind = pblock->nHeaderPos + 1;
                 blkdat >> FLATDATA(buf);
                 if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
                     continue;
-                // read size
-                blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+                blkdat >> pblock->nSize;
+                if (pblock->nSize < 80 || pblock->nSize > MAX_BLOCK_SIZE)
                     continue;
             } catch (const std::exception&) {
-                // no valid block header found; don't complain
                 break;
             }
             try {
-                // read block
-                uint64_t nBlockPos = blkdat.GetPos();
-                if (dbp)
-                    dbp->nPos = nBlockPos;
-                blkdat.SetLimit(nBlockPos + nSize);
-                blkdat.SetPos(nBlockPos);
-                CBlock block;
-                blkdat >> block;
+                pblock->nBlockPos = blkdat.GetPos();
+                blkdat.SetLimit(pblock->nBlockPos + pblock->nSize);
+                pblock->ssBlock.resize(pblock->nSize);
+                blkdat.read(&pblock->ssBlock[0], pblock->nSize);
                 nRewind = blkdat.GetPos();
+            } catch (std::exception& e) {
+                LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
+                continue;
+            }
+            Push(pblock);
+        }
 
-                // detect out of order blocks, and store them for later
-                uint256 hash = block.GetHash();
-                if (hash != Params().HashGenesisBlock() && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
-                    LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
-                        block.hashPrevBlock.ToString());
-                    if (dbp)
-                        mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
-                    continue;
-                }
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fReaderDone = true;
+        condImport.notify_all();
+    }
 
-                // process in case the block isn't known yet
-                if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
-                    CValidationState state;
-                    if (ProcessNewBlock(state, NULL, &block, dbp))
-                        nLoaded++;
-                    if (state.IsError())
-                        break;
-                } else if (hash != Params().HashGenesisBlock() && mapBlockIndex[hash]->nHeight % 1000 == 0) {
-                    LogPrintf("Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
-                }
+    void ThreadParse()
+    {
+        while (true) {
+            boost::shared_ptr<CExternalBlock> pblock;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fStop && queueParse.empty())
+                    condWorker.wait(lock);
+                if (fStop)
+                    return;
+                pblock = queueParse.front();
+                queueParse.pop_front();
+            }
 
-                // Recursively process earlier encountered successors of this block
-                deque<uint256> queue;
-                queue.push_back(hash);
-                while (!queue.empty()) {
-                    uint256 head = queue.front();
-                    queue.pop_front();
-                    std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
-                    while (range.first != range.second) {
-                        std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
-                        if (ReadBlockFromDisk(block, it->second)) {
-                            LogPrintf("%s: Processing out of order child %s of %s\n", __func__, block.GetHash().ToString(),
-                                head.ToString());
-                            CValidationState dummy;
-                            if (ProcessNewBlock(dummy, NULL, &block, &it->second)) {
-                                nLoaded++;
-                                queue.push_back(block.GetHash());
-                            }
-                        }
-                        range.first++;
-                        mapBlocksUnknownParent.erase(it);
-                    }
-                }
+            try {
+                pblock->ssBlock >> pblock->block;
+                pblock->nEndPos = pblock->nBlockPos + pblock->nSize - pblock->ssBlock.size();
+                pblock->block.GetHash();
+                pblock->block.BuildMerkleTree();
+            } catch (std::exception& e) {
+                pblock->strError = e.what();
+            }
+            pblock->ssBlock.clear();
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            pblock->fParsed = true;
+            condImport.notify_all();
+        }
+    }
+
+public:
+    CExternalBlockPipeline(Stream& blkdatIn, int nWorkersIn) : blkdat(blkdatIn), nWorkers(nWorkersIn), nQueuedSize(0), fReaderDone(false), fStop(false) {}
+
+    ~CExternalBlockPipeline()
+    {
+        Stop();
+    }
+
+    //! Start scanning the stream at nPos
+    void Start(uint64_t nPos)
+    {
+        assert(!threads);
+        if (!blkdat.SetPos(nPos))
+            blkdat.Seek(nPos);
+        fReaderDone = false;
+        fStop = false;
+        threads.reset(new boost::thread_group());
+        threads->create_thread(boost::bind(&CExternalBlockPipeline::ThreadRead, this));
+        for (int i = 0; i < nWorkers; i++)
+            threads->create_thread(boost::bind(&CExternalBlockPipeline::ThreadParse, this));
+    }
+
+    //! Stop the threads and drop the blocks read ahead, the stream can be used again afterwards
+    void Stop()
+    {
+        if (!threads)
+            return;
+        // Also called while an interruption unwinds the importing thread
+        boost::this_thread::disable_interruption di;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStop = true;
+            condReader.notify_all();
+            condWorker.notify_all();
+        }
+        threads->join_all();
+        threads.reset();
+        queueBlocks.clear();
+        queueParse.clear();
+        nQueuedSize = 0;
+    }
+
+    //! The next block in file order once it is parsed, NULL after the last one
+    boost::shared_ptr<CExternalBlock> Next()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (true) {
+            if (!queueBlocks.empty() && queueBlocks.front()->fParsed) {
+                boost::shared_ptr<CExternalBlock> pblock = queueBlocks.front();
+                queueBlocks.pop_front();
+                nQueuedSize -= pblock->nSize;
+                condReader.notify_all();
+                return pblock;
+            }
+            if (queueBlocks.empty() && fReaderDone)
+                return boost::shared_ptr<CExternalBlock>();
+            condImport.wait(lock);
+        }
+    }
+};
+
+/** Same as ScanExternalBlocksInline, with the blocks read and parsed ahead by a CExternalBlockPipeline */
+template <typename Stream>
+static void ScanExternalBlocksPipelined(Stream& blkdat, int nWorkers, const boost::function<bool(CBlock&, uint64_t)>& fnProcess)
+{
+    CExternalBlockPipeline<Stream> pipeline(blkdat, nWorkers);
+    pipeline.Start(blkdat.GetPos());
+    while (true) {
+        boost::this_thread::interruption_point();
+        boost::shared_ptr<CExternalBlock> pblock = pipeline.Next();
+        if (!pblock)
+            break;
+
+        // The inline scan goes on where parsing stopped, the reader went on after nSize bytes
+        bool fRestart = false;
+        uint64_t nRestart = 0;
+        if (!pblock->strError.empty()) {
+            LogPrintf("%s : Deserialize or I/O error - %s", __func__, pblock->strError);
+            fRestart = true;
+            nRestart = pblock->nHeaderPos + 1;
+        } else {
+            if (pblock->nEndPos != pblock->nBlockPos + pblock->nSize) {
+                fRestart = true;
+                nRestart = pblock->nEndPos;
+            }
+            try {
+                if (!fnProcess(pblock->block, pblock->nBlockPos))
+                    break;
             } catch (std::exception& e) {
                 LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
             }
         }
+        if (fRestart) {
+            pipeline.Stop();
+            pipeline.Start(nRestart);
+        }
+    }
+}
+
+void ScanExternalBlocks(CBufferedFile& blkdat, int nThreads, const boost::function<bool(CBlock&, uint64_t)>& fnProcess)
+{
+    if (nThreads <= 1)
+        ScanExternalBlocksInline(blkdat, fnProcess);
+    else
+        ScanExternalBlocksPipelined(blkdat, nThreads, fnProcess);
+}
+
+void ScanExternalBlocks(CMappedFileReader& blkdat, int nThreads, const boost::function<bool(CBlock&, uint64_t)>& fnProcess)
+{
+    if (nThreads <= 1)
+        ScanExternalBlocksInline(blkdat, fnProcess);
+    else
+        ScanExternalBlocksPipelined(blkdat, nThreads, fnProcess);
+}
+
+/** Scan blkdat for blocks and process them, see LoadExternalBlockFile */
+template <typename Stream>
+static void LoadExternalBlocks(Stream& blkdat, CDiskBlockPos* dbp, std::multimap<uint256, CDiskBlockPos>& mapBlocksUnknownParent, int& nLoaded)
+{
+    int nThreads = GetArg("-loadblockthreads", 0);
+    if (nThreads <= 0)
+        nThreads = boost::thread::hardware_concurrency();
+    nThreads = std::min(nThreads, MAX_LOAD_BLOCK_THREADS);
+    ScanExternalBlocks(blkdat, nThreads, boost::bind(&ProcessExternalBlock, _1, _2, dbp, boost::ref(mapBlocksUnknownParent), boost::ref(nLoaded)));
+}
+
+bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
+{
+    // Map of disk positions for blocks with unknown parent (only used for reindex)
+    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
+    int64_t nStart = GetTimeMillis();
+
+    int nLoaded = 0;
+    try {
+        // Block files are read from their mapping when they can be mapped
+        boost::shared_ptr<const CMappedFile> file;
+        if (dbp)
+            file = mappedDiskFiles.Get(GetBlockPosFilename(*dbp, "blk").string(), 0);
+        if (file) {
+            fclose(fileIn);
+            file->Sequential();
+            CMappedFileReader blkdat(file, 0, SER_DISK, CLIENT_VERSION);
+            LoadExternalBlocks(blkdat, dbp, mapBlocksUnknownParent, nLoaded);
+        } else {
+            // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
+            CBufferedFile blkdat(fileIn, 2 * MAX_BLOCK_SIZE, MAX_BLOCK_SIZE + 8, SER_DISK, CLIENT_VERSION);
+            LoadExternalBlocks(blkdat, dbp, mapBlocksUnknownParent, nLoaded);
+        }
     } catch (std::runtime_error& e) {
         AbortNode(std::string("System error: ") + e.what());
     }
@@ -4609,14 +5297,18 @@ void static ProcessGetData(CNode* pfrom)
                     }
                 }
                 if (send) {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
-                    else // MSG_FILTERED_BLOCK)
+                    if (inv.type == MSG_BLOCK) {
+                        // Send block from disk, the stored bytes are what goes over the wire
+                        const vector<char>* pvchBlock = GetBlockToServe((*mi).second);
+                        if (!pvchBlock)
+                            assert(!"cannot load block from disk");
+                        char* pchBlock = const_cast<char*>(&(*pvchBlock)[0]);
+                        pfrom->PushMessage("block", CFlatData(pchBlock, pchBlock + pvchBlock->size()));
+                    } else // MSG_FILTERED_BLOCK)
                     {
+                        CBlock block;
+                        if (!ReadBlockFromDisk(block, (*mi).second))
+                            assert(!"cannot load block from disk");
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter) {
                             CMerkleBlock merkleBlock(block, *pfrom->pfilter);
@@ -5638,6 +6330,82 @@ int ActiveProtocol()
     return MIN_PEER_PROTO_VERSION_BEFORE_ENFORCEMENT;
 }
 
+static CCheckQueue<CSignedMessageCheck> messagecheckqueue(128);
+
+void ThreadMessageCheck()
+{
+    RenameThread("pivx-msgcheck");
+    messagecheckqueue.Thread();
+}
+
+/** Add the signature checks of a masternode ping, broadcast or winner vote not seen before */
+static void GetMasternodeMessageChecks(const std::string& strCommand, CDataStream& vRecv, std::vector<CSignedMessageCheck>& vChecks)
+{
+    if (strCommand == "mnb") {
+        CMasternodeBroadcast mnb;
+        vRecv >> mnb;
+        if (mnodeman.mapSeenMasternodeBroadcast.count(mnb.GetHash())) return;
+        vChecks.push_back(CSignedMessageCheck(mnb.GetStrMessage(), mnb.sig));
+        if (mnb.lastPing != CMasternodePing())
+            vChecks.push_back(CSignedMessageCheck(mnb.lastPing.GetStrMessage(), mnb.lastPing.vchSig));
+    } else if (strCommand == "mnp") {
+        CMasternodePing mnp;
+        vRecv >> mnp;
+        if (mnodeman.mapSeenMasternodePing.count(mnp.GetHash())) return;
+        vChecks.push_back(CSignedMessageCheck(mnp.GetStrMessage(), mnp.vchSig));
+    } else if (strCommand == "mnw") {
+        CMasternodePaymentWinner winner;
+        vRecv >> winner;
+        if (masternodePayments.mapMasternodePayeeVotes.count(winner.GetHash())) return;
+        vChecks.push_back(CSignedMessageCheck(winner.GetStrMessage(), winner.vchSig));
+    }
+}
+
+/**
+ * A masternode list sync delivers thousands of pings, broadcasts and winner votes back to back.
+ * When the next one to handle has an unchecked signature, recover the keys of it and the masternode
+ * messages queued behind it on the -msgcheckthreads threads. The handlers then run one at a time as
+ * before and find the keys in the cache.
+ */
+static void CheckMasternodeMessageSignatures(CNode* pfrom, std::deque<CNetMessage>::iterator itMsg)
+{
+    if (!nMessageCheckThreads || fLiteMode || !masternodeSync.IsBlockchainSynced()) return;
+
+    std::vector<CSignedMessageCheck> vChecks;
+    int nMessages = 0;
+    for (std::deque<CNetMessage>::iterator it = itMsg; it != pfrom->vRecvMsg.end() && nMessages < MAX_MESSAGE_CHECK_BATCH; ++it, ++nMessages) {
+        if (!it->complete()) break;
+
+        std::vector<CSignedMessageCheck> vMessageChecks;
+        try {
+            CDataStream vRecv(it->vRecv);
+            GetMasternodeMessageChecks(it->hdr.GetCommand(), vRecv, vMessageChecks);
+        } catch (std::exception&) {
+            // malformed, left for ProcessMessage to reject
+            if (it == itMsg) return;
+            continue;
+        }
+
+        // nothing to do if the next message was seen or checked with an earlier batch already
+        if (it == itMsg && (vMessageChecks.empty() || vMessageChecks[0].IsCached())) return;
+
+        BOOST_FOREACH (CSignedMessageCheck& check, vMessageChecks) {
+            if (check.IsCached()) continue;
+            vChecks.push_back(CSignedMessageCheck());
+            check.swap(vChecks.back());
+        }
+    }
+
+    unsigned int nChecks = vChecks.size();
+    if (nChecks < 2) return;
+
+    int64_t nTimeStart = GetTimeMicros();
+    CCheckQueueControl<CSignedMessageCheck> control(&messagecheckqueue);
+    control.Add(vChecks);
+    control.Wait();
+    LogPrint("bench", "- Verify %u masternode message signatures from %d messages: %.2fms\n", nChecks, nMessages, (GetTimeMicros() - nTimeStart) * 0.001);
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool ProcessMessages(CNode* pfrom)
 {
@@ -5713,6 +6481,8 @@ bool ProcessMessages(CNode* pfrom)
         // Process message
         bool fRet = false;
         try {
+            if (strCommand == "mnb" || strCommand == "mnp" || strCommand == "mnw")
+                CheckMasternodeMessageSignatures(pfrom, it - 1);
             fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
             boost::this_thread::interruption_point();
         } catch (std::ios_base::failure& e) {
@@ -6004,16 +6774,23 @@ bool CBlockUndo::WriteToDisk(CDiskBlockPos& pos, const uint256& hashBlock)
 
 bool CBlockUndo::ReadFromDisk(const CDiskBlockPos& pos, const uint256& hashBlock)
 {
-    // Open history file to read
-    CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("CBlockUndo::ReadFromDisk : OpenBlockFile failed");
-
     // Read block
     uint256 hashChecksum;
     try {
-        filein >> *this;
-        filein >> hashChecksum;
+        unsigned int nSize = 0;
+        boost::shared_ptr<const CMappedFile> file = MapStoredRecord(pos, "rev", sizeof(hashChecksum), nSize);
+        if (file) {
+            CMappedFileReader filein(file, pos.nPos, SER_DISK, CLIENT_VERSION, nSize + sizeof(hashChecksum));
+            filein >> *this;
+            filein >> hashChecksum;
+        } else {
+            // Open history file to read
+            CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
+            if (filein.IsNull())
+                return error("CBlockUndo::ReadFromDisk : OpenBlockFile failed");
+            filein >> *this;
+            filein >> hashChecksum;
+        }
     } catch (std::exception& e) {
         return error("%s : Deserialize or I/O error - %s", __func__, e.what());
     }
@@ -6041,10 +6818,8 @@ public:
     ~CMainCleanup()
     {
         // block headers
-        BlockMap::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
         mapBlockIndex.clear();
+        blockIndexArena.Clear();
 
         // orphan transactions
         mapOrphanTransactions.clear();
@@ -0,0 +1,115 @@
+// Copyright (c) 2017 The PIVX developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "mappedfile.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+CMappedFile::CMappedFile(const std::string& strPath) : pchData(NULL), nSize(0)
+{
+#ifndef WIN32
+    // A 32 bit address space cannot hold a useful number of mapped block files
+    if (sizeof(void*) < 8)
+        return;
+
+    int fd = open(strPath.c_str(), O_RDONLY);
+    if (fd == -1)
+        return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) {
+            pchData = (const char*)p;
+            nSize = st.st_size;
+        }
+    }
+    // The mapping stays valid without the descriptor
+    close(fd);
+#endif
+}
+
+CMappedFile::~CMappedFile()
+{
+#ifndef WIN32
+    if (pchData)
+        munmap((void*)pchData, nSize);
+#endif
+}
+
+void CMappedFile::WillNeed(uint64_t nPos, uint64_t nLength) const
+{
+#ifndef WIN32
+    if (!pchData || nPos >= nSize)
+        return;
+    // The range given to posix_madvise has to start on a page boundary
+    static const uint64_t nPageSize = sysconf(_SC_PAGESIZE);
+    uint64_t nStart = nPos - nPos % nPageSize;
+    uint64_t nEnd = std::min(nSize, nPos + nLength);
+    posix_madvise((void*)(pchData + nStart), nEnd - nStart, POSIX_MADV_WILLNEED);
+#endif
+}
+
+void CMappedFile::Sequential() const
+{
+#ifndef WIN32
+    if (pchData)
+        posix_madvise((void*)pchData, nSize, POSIX_MADV_SEQUENTIAL);
+#endif
+}
+
+boost::shared_ptr<const CMappedFile> CMappedFileCache::Get(const std::string& strPath, uint64_t nMinSize)
+{
+    LOCK(cs);
+    std::map<std::string, list_type::iterator>::iterator mi = mapFiles.find(strPath);
+    if (mi != mapFiles.end()) {
+        listFiles.splice(listFiles.begin(), listFiles, mi->second);
+        if (mi->second->second->Size() >= nMinSize)
+            return mi->second->second;
+        // The file grew since it was mapped, readers of the old mapping keep it alive
+        listFiles.erase(mi->second);
+        mapFiles.erase(mi);
+    }
+
+    boost::shared_ptr<const CMappedFile> file(new CMappedFile(strPath));
+    if (file->IsNull() || file->Size() < nMinSize)
+        return boost::shared_ptr<const CMappedFile>();
+    if (nMaxFiles == 0)
+        return file;
+
+    listFiles.push_front(std::make_pair(strPath, file));
+    mapFiles[strPath] = listFiles.begin();
+    while (listFiles.size() > nMaxFiles) {
+        mapFiles.erase(listFiles.back().first);
+        listFiles.pop_back();
+    }
+    return file;
+}
+
+void CMappedFileCache::Erase(const std::string& strPath)
+{
+    LOCK(cs);
+    std::map<std::string, list_type::iterator>::iterator mi = mapFiles.find(strPath);
+    if (mi != mapFiles.end()) {
+        listFiles.erase(mi->second);
+        mapFiles.erase(mi);
+    }
+}
+
+void CMappedFileCache::Clear()
+{
+    LOCK(cs);
+    listFiles.clear();
+    mapFiles.clear();
+}
+
+size_t CMappedFileCache::size() const
+{
+    LOCK(cs);
+    return listFiles.size();
+}
@@ -0,0 +1,198 @@
+// Copyright (c) 2017 The PIVX developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_MAPPEDFILE_H
+#define BITCOIN_MAPPEDFILE_H
+
+#include "serialize.h"
+#include "sync.h"
+
+#include <list>
+#include <map>
+#include <string>
+
+#include <boost/shared_ptr.hpp>
+
+/** Size of the window a sequential reader of a mapped file asks the kernel to read ahead */
+static const unsigned int MAPPED_FILE_READAHEAD_SIZE = 4 * 1024 * 1024;
+
+/**
+ * A file mapped read-only into memory. Once its pages are cached, reading from it costs no
+ * system call, where fopen/fseek/fread cost several for every record read.
+ *
+ * Mapping is not used on Windows, where a mapped file cannot be truncated, nor in a 32 bit
+ * address space. IsNull() is true then, or when the file is empty or cannot be opened, and
+ * callers read the file with stdio instead.
+ */
+class CMappedFile
+{
+private:
+    // Disallow copies
+    CMappedFile(const CMappedFile&);
+    CMappedFile& operator=(const CMappedFile&);
+
+    const char* pchData;
+    uint64_t nSize;
+
+public:
+    explicit CMappedFile(const std::string& strPath);
+    ~CMappedFile();
+
+    bool IsNull() const { return pchData == NULL; }
+    const char* Data() const { return pchData; }
+    //! Size of the file when it was mapped, later appends are not visible
+    uint64_t Size() const { return nSize; }
+
+    //! Hint that [nPos, nPos + nLength) is about to be read, so the kernel starts reading it
+    void WillNeed(uint64_t nPos, uint64_t nLength) const;
+    //! Hint that the file is read front to back, pages behind the reader can be dropped early
+    void Sequential() const;
+};
+
+/**
+ * Mapped files shared by all readers, the least recently used one is unmapped when there are
+ * more than nMaxFiles. A mapping lives on while a reader still holds it, and is replaced when
+ * a read needs more than it covers, as files are appended to after they are mapped.
+ */
+class CMappedFileCache
+{
+private:
+    typedef std::list<std::pair<std::string, boost::shared_ptr<const CMappedFile> > > list_type;
+
+    mutable CCriticalSection cs;
+    size_t nMaxFiles;
+    list_type listFiles;
+    std::map<std::string, list_type::iterator> mapFiles;
+
+public:
+    explicit CMappedFileCache(size_t nMaxFilesIn) : nMaxFiles(nMaxFilesIn) {}
+
+    //! The mapping of strPath, covering its first nMinSize bytes at least; NULL if there is none
+    boost::shared_ptr<const CMappedFile> Get(const std::string& strPath, uint64_t nMinSize);
+    //! Forget the mapping of strPath, before the file is truncated
+    void Erase(const std::string& strPath);
+    void Clear();
+    size_t size() const;
+};
+
+/**
+ * Reading stream over a mapped file, with the interface of CBufferedFile. Objects are
+ * deserialized straight from the mapping, and the kernel is asked for the next nReadAhead
+ * bytes whenever the reader gets past half of the window requested before.
+ */
+class CMappedFileReader
+{
+private:
+    boost::shared_ptr<const CMappedFile> file;
+    int nType;
+    int nVersion;
+
+    uint64_t nReadPos;   // position of the next byte to read
+    uint64_t nReadLimit; // up to which position we're allowed to read
+    uint64_t nReadAhead; // size of the read-ahead window
+    uint64_t nHintPos;   // end of the window requested so far
+
+    void ReadAhead()
+    {
+        if (nReadAhead == 0 || nReadPos + nReadAhead / 2 < nHintPos || nHintPos >= file->Size())
+            return;
+        nHintPos = std::max(nHintPos, nReadPos);
+        file->WillNeed(nHintPos, nReadAhead);
+        nHintPos += nReadAhead;
+    }
+
+public:
+    CMappedFileReader(const boost::shared_ptr<const CMappedFile>& fileIn, uint64_t nPos, int nTypeIn, int nVersionIn, uint64_t nReadAheadIn = MAPPED_FILE_READAHEAD_SIZE) : file(fileIn), nType(nTypeIn), nVersion(nVersionIn), nReadPos(nPos), nReadLimit((uint64_t)(-1)), nReadAhead(nReadAheadIn), nHintPos(nPos)
+    {
+        assert(file && !file->IsNull());
+        ReadAhead();
+    }
+
+    int GetType() const { return nType; }
+    int GetVersion() const { return nVersion; }
+
+    // check whether we're at the end of the mapped file
+    bool eof() const
+    {
+        return nReadPos >= file->Size();
+    }
+
+    // read a number of bytes
+    CMappedFileReader& read(char* pch, size_t nSize)
+    {
+        if (nSize + nReadPos > nReadLimit)
+            throw std::ios_base::failure("Read attempted past buffer limit");
+        if (nReadPos > file->Size() || nSize > file->Size() - nReadPos)
+            throw std::ios_base::failure("CMappedFileReader::read : end of file");
+        memcpy(pch, file->Data() + nReadPos, nSize);
+        nReadPos += nSize;
+        ReadAhead();
+        return (*this);
+    }
+
+    // return the current reading position
+    uint64_t GetPos() const
+    {
+        return nReadPos;
+    }
+
+    // move to a given reading position, any position inside the file can be reached
+    bool SetPos(uint64_t nPos)
+    {
+        if (nPos > file->Size()) {
+            nReadPos = file->Size();
+            return false;
+        }
+        nReadPos = nPos;
+        return true;
+    }
+
+    bool Seek(uint64_t nPos)
+    {
+        if (!SetPos(nPos))
+            return false;
+        nHintPos = nPos;
+        ReadAhead();
+        return true;
+    }
+
+    // prevent reading beyond a certain position
+    // no argument removes the limit
+    bool SetLimit(uint64_t nPos = (uint64_t)(-1))
+    {
+        if (nPos < nReadPos)
+            return false;
+        nReadLimit = nPos;
+        return true;
+    }
+
+    template <typename T>
+    CMappedFileReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+
+    // search for a given byte in the stream, and remain positioned on it
+    void FindByte(char ch)
+    {
+        while (true) {
+            if (nReadPos >= file->Size())
+                throw std::ios_base::failure("CMappedFileReader::FindByte : end of file");
+            // search half a window at a time, so the hints stay ahead of the reader
+            uint64_t nEnd = std::min(file->Size(), nReadPos + (nReadAhead ? nReadAhead / 2 + 1 : file->Size()));
+            const char* pchFound = (const char*)memchr(file->Data() + nReadPos, ch, nEnd - nReadPos);
+            if (pchFound) {
+                nReadPos = pchFound - file->Data();
+                ReadAhead();
+                return;
+            }
+            nReadPos = nEnd;
+            ReadAhead();
+        }
+    }
+};
+
+#endif // BITCOIN_MAPPEDFILE_H
@@ -8,6 +8,7 @@
 
 #include "addrman.h"
 #include "masternode-budget.h"
+#include "masternode-payments.h"
 #include "masternode-sync.h"
 #include "masternode.h"
 #include "masternodeman.h"
@@ -233,39 +234,17 @@ void CBudgetManager::SubmitFinalBudget()
 // CBudgetDB
 //
 
-CBudgetDB::CBudgetDB()
+CBudgetDB::CBudgetDB() : CSnapshotDB("budget.dat", "MasternodeBudget")
 {
-    pathDB = GetDataDir() / "budget.dat";
-    strMagicMessage = "MasternodeBudget";
 }
 
-bool CBudgetDB::Write(const CBudgetManager& objToSave)
+bool CBudgetDB::Write(CBudgetManager& objToSave)
 {
-    LOCK(objToSave.cs);
-
     int64_t nStart = GetTimeMillis();
 
-    // serialize, checksum data up to that point, then append checksum
-    CDataStream ssObj(SER_DISK, CLIENT_VERSION);
-    ssObj << strMagicMessage;                   // masternode cache file specific magic message
-    ssObj << FLATDATA(Params().MessageStart()); // network specific magic number
-    ssObj << objToSave;
-    uint256 hash = Hash(ssObj.begin(), ssObj.end());
-    ssObj << hash;
-
-    // open output file, and associate with CAutoFile
-    FILE* file = fopen(pathDB.string().c_str(), "wb");
-    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathDB.string());
-
-    // Write and commit header, data
-    try {
-        fileout << ssObj;
-    } catch (std::exception& e) {
-        return error("%s : Serialize or I/O error - %s", __func__, e.what());
-    }
-    fileout.fclose();
+    objToSave.WriteSnapshot(*this);
+    if (!WriteSections())
+        return false;
 
     LogPrintf("Written info to budget.dat  %dms\n", GetTimeMillis() - nStart);
 
@@ -274,85 +253,23 @@ bool CBudgetDB::Write(const CBudgetManager& objToSave)
 
 CBudgetDB::ReadResult CBudgetDB::Read(CBudgetManager& objToLoad, bool fDryRun)
 {
-    LOCK(objToLoad.cs);
-
     int64_t nStart = GetTimeMillis();
-    // open input file, and associate with CAutoFile
-    FILE* file = fopen(pathDB.string().c_str(), "rb");
-    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull()) {
-        error("%s : Failed to open file %s", __func__, pathDB.string());
-        return FileError;
-    }
-
-    // use file size to size memory buffer
-    int fileSize = boost::filesystem::file_size(pathDB);
-    int dataSize = fileSize - sizeof(uint256);
-    // Don't try to resize to a negative number if file is small
-    if (dataSize < 0)
-        dataSize = 0;
-    vector<unsigned char> vchData;
-    vchData.resize(dataSize);
-    uint256 hashIn;
-
-    // read data and checksum from file
-    try {
-        filein.read((char*)&vchData[0], dataSize);
-        filein >> hashIn;
-    } catch (std::exception& e) {
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return HashReadError;
-    }
-    filein.fclose();
-
-    CDataStream ssObj(vchData, SER_DISK, CLIENT_VERSION);
-
-    // verify stored checksum matches input data
-    uint256 hashTmp = Hash(ssObj.begin(), ssObj.end());
-    if (hashIn != hashTmp) {
-        error("%s : Checksum mismatch, data corrupted", __func__);
-        return IncorrectHash;
-    }
 
+    // a dry run only needs the header, every section is verified when it is read
+    ReadResult result = ReadHeader();
+    if (result != Ok || fDryRun)
+        return result;
 
-    unsigned char pchMsgTmp[4];
-    std::string strMagicMessageTmp;
-    try {
-        // de-serialize file header (masternode cache file specific magic message) and ..
-        ssObj >> strMagicMessageTmp;
-
-        // ... verify the message matches predefined one
-        if (strMagicMessage != strMagicMessageTmp) {
-            error("%s : Invalid masternode cache magic message", __func__);
-            return IncorrectMagicMessage;
-        }
-
-
-        // de-serialize file header (network specific magic number) and ..
-        ssObj >> FLATDATA(pchMsgTmp);
-
-        // ... verify the network matches ours
-        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp))) {
-            error("%s : Invalid network magic number", __func__);
-            return IncorrectMagicNumber;
-        }
-
-        // de-serialize data into CBudgetManager object
-        ssObj >> objToLoad;
-    } catch (std::exception& e) {
-        objToLoad.Clear();
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return IncorrectFormat;
-    }
+    result = objToLoad.ReadSnapshot(*this);
+    if (result != Ok)
+        return result;
 
     LogPrintf("Loaded info from budget.dat  %dms\n", GetTimeMillis() - nStart);
     LogPrintf("  %s\n", objToLoad.ToString());
-    if (!fDryRun) {
-        LogPrintf("Budget manager - cleaning....\n");
-        objToLoad.CheckAndRemove();
-        LogPrintf("Budget manager - result:\n");
-        LogPrintf("  %s\n", objToLoad.ToString());
-    }
+    LogPrintf("Budget manager - cleaning....\n");
+    objToLoad.CheckAndRemove();
+    LogPrintf("Budget manager - result:\n");
+    LogPrintf("  %s\n", objToLoad.ToString());
 
     return Ok;
 }
@@ -394,6 +311,7 @@ bool CBudgetManager::AddFinalizedBudget(CFinalizedBudget& finalizedBudget)
     }
 
     mapFinalizedBudgets.insert(make_pair(finalizedBudget.GetHash(), finalizedBudget));
+    AddBlockPayeesUpdated();
     return true;
 }
 
@@ -450,7 +368,7 @@ void CBudgetManager::CheckAndRemove()
     LogPrintf("CBudgetManager::CheckAndRemove - PASSED\n");
 }
 
-void CBudgetManager::FillBlockPayee(CMutableTransaction& txNew, CAmount nFees, bool fProofOfStake)
+void CBudgetManager::FillBlockPayee(CMutableTransaction& txNew, CAmount nFees, bool fProofOfStake, bool fLog)
 {
     LOCK(cs);
 
@@ -500,11 +418,13 @@ void CBudgetManager::FillBlockPayee(CMutableTransaction& txNew, CAmount nFees, b
             txNew.vout[1].scriptPubKey = payee;
             txNew.vout[1].nValue = nAmount;
 
-            CTxDestination address1;
-            ExtractDestination(payee, address1);
-            CBitcoinAddress address2(address1);
+            if (fLog) {
+                CTxDestination address1;
+                ExtractDestination(payee, address1);
+                CBitcoinAddress address2(address1);
 
-            LogPrintf("CBudgetManager::FillBlockPayee - Budget payment to %s for %lld\n", address2.ToString(), nAmount);
+                LogPrintf("CBudgetManager::FillBlockPayee - Budget payment to %s for %lld\n", address2.ToString(), nAmount);
+            }
         }
     }
 }
@@ -949,6 +869,7 @@ void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
     if (!masternodeSync.IsBlockchainSynced()) return;
 
     LOCK(cs_budget);
+    LoadDeferredSections();
 
     if (strCommand == "mnvs") { //Masternode vote sync
         uint256 nProp;
@@ -1317,7 +1238,10 @@ bool CBudgetManager::UpdateFinalizedBudget(CFinalizedBudgetVote& vote, CNode* pf
         return false;
     }
 
-    return mapFinalizedBudgets[vote.nBudgetHash].AddOrUpdateVote(vote, strError);
+    if (!mapFinalizedBudgets[vote.nBudgetHash].AddOrUpdateVote(vote, strError))
+        return false;
+    AddBlockPayeesUpdated();
+    return true;
 }
 
 CBudgetProposal::CBudgetProposal()
@@ -2087,6 +2011,63 @@ bool CFinalizedBudgetVote::SignatureValid(bool fSignatureCheck)
     return true;
 }
 
+void CBudgetManager::WriteSnapshot(CSnapshotDB& snapshot)
+{
+    LOCK(cs);
+
+    // seen and orphan messages not read yet are kept as they are on disk, unless entries were added since
+    if (snapshotDeferred && !(mapSeenMasternodeBudgetProposals.empty() && mapSeenMasternodeBudgetVotes.empty() && mapSeenFinalizedBudgets.empty() &&
+                                mapSeenFinalizedBudgetVotes.empty() && mapOrphanMasternodeBudgetVotes.empty() && mapOrphanFinalizedBudgetVotes.empty()))
+        LoadDeferredSections();
+
+    snapshot.AddSection(SNAPSHOT_PROPOSALS, mapProposals);
+    snapshot.AddSection(SNAPSHOT_FINALIZED_BUDGETS, mapFinalizedBudgets);
+    snapshot.AddMapSection(SNAPSHOT_SEEN_PROPOSALS, mapSeenMasternodeBudgetProposals, snapshotDeferred.get());
+    snapshot.AddMapSection(SNAPSHOT_SEEN_PROPOSAL_VOTES, mapSeenMasternodeBudgetVotes, snapshotDeferred.get());
+    snapshot.AddMapSection(SNAPSHOT_SEEN_FINALIZED_BUDGETS, mapSeenFinalizedBudgets, snapshotDeferred.get());
+    snapshot.AddMapSection(SNAPSHOT_SEEN_FINALIZED_BUDGET_VOTES, mapSeenFinalizedBudgetVotes, snapshotDeferred.get());
+    snapshot.AddMapSection(SNAPSHOT_ORPHAN_PROPOSAL_VOTES, mapOrphanMasternodeBudgetVotes, snapshotDeferred.get());
+    snapshot.AddMapSection(SNAPSHOT_ORPHAN_FINALIZED_BUDGET_VOTES, mapOrphanFinalizedBudgetVotes, snapshotDeferred.get());
+}
+
+CSnapshotDB::ReadResult CBudgetManager::ReadSnapshot(CSnapshotDB& snapshot)
+{
+    LOCK(cs);
+
+    CSnapshotDB::ReadResult result = snapshot.ReadSection(SNAPSHOT_PROPOSALS, mapProposals);
+    if (result == CSnapshotDB::Ok)
+        result = snapshot.ReadSection(SNAPSHOT_FINALIZED_BUDGETS, mapFinalizedBudgets);
+    if (result != CSnapshotDB::Ok) {
+        Clear();
+        return result;
+    }
+
+    // the seen and orphan maps are only needed once the chain is synced, see LoadDeferredSections
+    snapshotDeferred.reset(new CSnapshotDB(snapshot));
+
+    return CSnapshotDB::Ok;
+}
+
+void CBudgetManager::LoadDeferredSections()
+{
+    LOCK(cs);
+    if (!snapshotDeferred)
+        return;
+    boost::scoped_ptr<CSnapshotDB> snapshot;
+    snapshot.swap(snapshotDeferred);
+
+    // entries added since startup are newer than the ones read, a damaged section only loses its own data
+    int64_t nStart = GetTimeMillis();
+    snapshot->MergeSection(SNAPSHOT_SEEN_PROPOSALS, mapSeenMasternodeBudgetProposals);
+    snapshot->MergeSection(SNAPSHOT_SEEN_PROPOSAL_VOTES, mapSeenMasternodeBudgetVotes);
+    snapshot->MergeSection(SNAPSHOT_SEEN_FINALIZED_BUDGETS, mapSeenFinalizedBudgets);
+    snapshot->MergeSection(SNAPSHOT_SEEN_FINALIZED_BUDGET_VOTES, mapSeenFinalizedBudgetVotes);
+    snapshot->MergeSection(SNAPSHOT_ORPHAN_PROPOSAL_VOTES, mapOrphanMasternodeBudgetVotes);
+    snapshot->MergeSection(SNAPSHOT_ORPHAN_FINALIZED_BUDGET_VOTES, mapOrphanFinalizedBudgetVotes);
+
+    LogPrint("mnbudget", "Loaded seen and orphan messages from %s  %dms\n", snapshot->GetFilename(), GetTimeMillis() - nStart);
+}
+
 std::string CBudgetManager::ToString() const
 {
     std::ostringstream info;
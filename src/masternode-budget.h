@@ -12,9 +12,11 @@
 #include "main.h"
 #include "masternode.h"
 #include "net.h"
+#include "snapshotdb.h"
 #include "sync.h"
 #include "util.h"
 #include <boost/lexical_cast.hpp>
+#include <boost/scoped_ptr.hpp>
 
 using namespace std;
 
@@ -145,25 +147,11 @@ public:
 
 /** Save Budget Manager (budget.dat)
  */
-class CBudgetDB
+class CBudgetDB : public CSnapshotDB
 {
-private:
-    boost::filesystem::path pathDB;
-    std::string strMagicMessage;
-
 public:
-    enum ReadResult {
-        Ok,
-        FileError,
-        HashReadError,
-        IncorrectHash,
-        IncorrectMagicMessage,
-        IncorrectMagicNumber,
-        IncorrectFormat
-    };
-
     CBudgetDB();
-    bool Write(const CBudgetManager& objToSave);
+    bool Write(CBudgetManager& objToSave);
     ReadResult Read(CBudgetManager& objToLoad, bool fDryRun = false);
 };
 
@@ -178,6 +166,9 @@ private:
     // XX42    map<uint256, CTransaction> mapCollateral;
     map<uint256, uint256> mapCollateralTxids;
 
+    // budget.dat as read at startup, while the seen and orphan sections in it are not read yet
+    boost::scoped_ptr<CSnapshotDB> snapshotDeferred;
+
 public:
     // critical section to protect the inner data structures
     mutable CCriticalSection cs;
@@ -205,6 +196,13 @@ public:
         mapSeenMasternodeBudgetVotes.clear();
         mapSeenFinalizedBudgets.clear();
         mapSeenFinalizedBudgetVotes.clear();
+        // the ones not read yet are forgotten as well
+        if (snapshotDeferred) {
+            snapshotDeferred->DropSection(SNAPSHOT_SEEN_PROPOSALS);
+            snapshotDeferred->DropSection(SNAPSHOT_SEEN_PROPOSAL_VOTES);
+            snapshotDeferred->DropSection(SNAPSHOT_SEEN_FINALIZED_BUDGETS);
+            snapshotDeferred->DropSection(SNAPSHOT_SEEN_FINALIZED_BUDGET_VOTES);
+        }
     }
 
     int sizeFinalized() { return (int)mapFinalizedBudgets.size(); }
@@ -237,7 +235,7 @@ public:
     bool PropExists(uint256 nHash);
     bool IsTransactionValid(const CTransaction& txNew, int nBlockHeight);
     std::string GetRequiredPaymentsString(int nBlockHeight);
-    void FillBlockPayee(CMutableTransaction& txNew, CAmount nFees, bool fProofOfStake);
+    void FillBlockPayee(CMutableTransaction& txNew, CAmount nFees, bool fProofOfStake, bool fLog = true);
 
     void CheckOrphanVotes();
     void Clear()
@@ -253,26 +251,28 @@ public:
         mapSeenFinalizedBudgetVotes.clear();
         mapOrphanMasternodeBudgetVotes.clear();
         mapOrphanFinalizedBudgetVotes.clear();
+        snapshotDeferred.reset();
     }
     void CheckAndRemove();
     std::string ToString() const;
 
 
-    ADD_SERIALIZE_METHODS;
+    // sections of budget.dat
+    enum {
+        SNAPSHOT_PROPOSALS = 1,
+        SNAPSHOT_FINALIZED_BUDGETS,
+        SNAPSHOT_SEEN_PROPOSALS,
+        SNAPSHOT_SEEN_PROPOSAL_VOTES,
+        SNAPSHOT_SEEN_FINALIZED_BUDGETS,
+        SNAPSHOT_SEEN_FINALIZED_BUDGET_VOTES,
+        SNAPSHOT_ORPHAN_PROPOSAL_VOTES,
+        SNAPSHOT_ORPHAN_FINALIZED_BUDGET_VOTES
+    };
 
-    template <typename Stream, typename Operation>
-    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
-    {
-        READWRITE(mapSeenMasternodeBudgetProposals);
-        READWRITE(mapSeenMasternodeBudgetVotes);
-        READWRITE(mapSeenFinalizedBudgets);
-        READWRITE(mapSeenFinalizedBudgetVotes);
-        READWRITE(mapOrphanMasternodeBudgetVotes);
-        READWRITE(mapOrphanFinalizedBudgetVotes);
-
-        READWRITE(mapProposals);
-        READWRITE(mapFinalizedBudgets);
-    }
+    void WriteSnapshot(CSnapshotDB& snapshot);
+    CSnapshotDB::ReadResult ReadSnapshot(CSnapshotDB& snapshot);
+    /// Read the seen and orphan sections left out by ReadSnapshot, done on the first message once synced
+    void LoadDeferredSections();
 };
 
 
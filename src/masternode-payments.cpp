@@ -13,6 +13,8 @@
 #include "sync.h"
 #include "util.h"
 #include "utilmoneystr.h"
+#include <atomic>
+
 #include <boost/filesystem.hpp>
 #include <boost/lexical_cast.hpp>
 
@@ -27,37 +29,17 @@ CCriticalSection cs_mapMasternodePayeeVotes;
 // CMasternodePaymentDB
 //
 
-CMasternodePaymentDB::CMasternodePaymentDB()
+CMasternodePaymentDB::CMasternodePaymentDB() : CSnapshotDB("mnpayments.dat", "MasternodePayments")
 {
-    pathDB = GetDataDir() / "mnpayments.dat";
-    strMagicMessage = "MasternodePayments";
 }
 
-bool CMasternodePaymentDB::Write(const CMasternodePayments& objToSave)
+bool CMasternodePaymentDB::Write(CMasternodePayments& objToSave)
 {
     int64_t nStart = GetTimeMillis();
 
-    // serialize, checksum data up to that point, then append checksum
-    CDataStream ssObj(SER_DISK, CLIENT_VERSION);
-    ssObj << strMagicMessage;                   // masternode cache file specific magic message
-    ssObj << FLATDATA(Params().MessageStart()); // network specific magic number
-    ssObj << objToSave;
-    uint256 hash = Hash(ssObj.begin(), ssObj.end());
-    ssObj << hash;
-
-    // open output file, and associate with CAutoFile
-    FILE* file = fopen(pathDB.string().c_str(), "wb");
-    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathDB.string());
-
-    // Write and commit header, data
-    try {
-        fileout << ssObj;
-    } catch (std::exception& e) {
-        return error("%s : Serialize or I/O error - %s", __func__, e.what());
-    }
-    fileout.fclose();
+    objToSave.WriteSnapshot(*this);
+    if (!WriteSections())
+        return false;
 
     LogPrintf("Written info to mnpayments.dat  %dms\n", GetTimeMillis() - nStart);
 
@@ -67,81 +49,22 @@ bool CMasternodePaymentDB::Write(const CMasternodePayments& objToSave)
 CMasternodePaymentDB::ReadResult CMasternodePaymentDB::Read(CMasternodePayments& objToLoad, bool fDryRun)
 {
     int64_t nStart = GetTimeMillis();
-    // open input file, and associate with CAutoFile
-    FILE* file = fopen(pathDB.string().c_str(), "rb");
-    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull()) {
-        error("%s : Failed to open file %s", __func__, pathDB.string());
-        return FileError;
-    }
-
-    // use file size to size memory buffer
-    int fileSize = boost::filesystem::file_size(pathDB);
-    int dataSize = fileSize - sizeof(uint256);
-    // Don't try to resize to a negative number if file is small
-    if (dataSize < 0)
-        dataSize = 0;
-    vector<unsigned char> vchData;
-    vchData.resize(dataSize);
-    uint256 hashIn;
-
-    // read data and checksum from file
-    try {
-        filein.read((char*)&vchData[0], dataSize);
-        filein >> hashIn;
-    } catch (std::exception& e) {
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return HashReadError;
-    }
-    filein.fclose();
-
-    CDataStream ssObj(vchData, SER_DISK, CLIENT_VERSION);
-
-    // verify stored checksum matches input data
-    uint256 hashTmp = Hash(ssObj.begin(), ssObj.end());
-    if (hashIn != hashTmp) {
-        error("%s : Checksum mismatch, data corrupted", __func__);
-        return IncorrectHash;
-    }
-
-    unsigned char pchMsgTmp[4];
-    std::string strMagicMessageTmp;
-    try {
-        // de-serialize file header (masternode cache file specific magic message) and ..
-        ssObj >> strMagicMessageTmp;
-
-        // ... verify the message matches predefined one
-        if (strMagicMessage != strMagicMessageTmp) {
-            error("%s : Invalid masternode payement cache magic message", __func__);
-            return IncorrectMagicMessage;
-        }
-
 
-        // de-serialize file header (network specific magic number) and ..
-        ssObj >> FLATDATA(pchMsgTmp);
+    // a dry run only needs the header, every section is verified when it is read
+    ReadResult result = ReadHeader();
+    if (result != Ok || fDryRun)
+        return result;
 
-        // ... verify the network matches ours
-        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp))) {
-            error("%s : Invalid network magic number", __func__);
-            return IncorrectMagicNumber;
-        }
-
-        // de-serialize data into CMasternodePayments object
-        ssObj >> objToLoad;
-    } catch (std::exception& e) {
-        objToLoad.Clear();
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return IncorrectFormat;
-    }
+    result = objToLoad.ReadSnapshot(*this);
+    if (result != Ok)
+        return result;
 
     LogPrintf("Loaded info from mnpayments.dat  %dms\n", GetTimeMillis() - nStart);
     LogPrintf("  %s\n", objToLoad.ToString());
-    if (!fDryRun) {
-        LogPrintf("Masternode payments manager - cleaning....\n");
-        objToLoad.CleanPaymentList();
-        LogPrintf("Masternode payments manager - result:\n");
-        LogPrintf("  %s\n", objToLoad.ToString());
-    }
+    LogPrintf("Masternode payments manager - cleaning....\n");
+    objToLoad.CleanPaymentList();
+    LogPrintf("Masternode payments manager - result:\n");
+    LogPrintf("  %s\n", objToLoad.ToString());
 
     return Ok;
 }
@@ -257,18 +180,30 @@ bool IsBlockPayeeValid(const CBlock& block, int nBlockHeight)
 }
 
 
-void FillBlockPayee(CMutableTransaction& txNew, CAmount nFees, bool fProofOfStake)
+void FillBlockPayee(CMutableTransaction& txNew, CAmount nFees, bool fProofOfStake, bool fLog)
 {
     CBlockIndex* pindexPrev = chainActive.Tip();
     if (!pindexPrev) return;
 
     if (IsSporkActive(SPORK_13_ENABLE_SUPERBLOCKS) && budget.IsBudgetPaymentBlock(pindexPrev->nHeight + 1)) {
-        budget.FillBlockPayee(txNew, nFees, fProofOfStake);
+        budget.FillBlockPayee(txNew, nFees, fProofOfStake, fLog);
     } else {
-        masternodePayments.FillBlockPayee(txNew, nFees, fProofOfStake);
+        masternodePayments.FillBlockPayee(txNew, nFees, fProofOfStake, fLog);
     }
 }
 
+static std::atomic<unsigned int> nBlockPayeesUpdated(0);
+
+unsigned int GetBlockPayeesUpdated()
+{
+    return nBlockPayeesUpdated;
+}
+
+void AddBlockPayeesUpdated()
+{
+    nBlockPayeesUpdated++;
+}
+
 std::string GetRequiredPaymentsString(int nBlockHeight)
 {
     if (IsSporkActive(SPORK_13_ENABLE_SUPERBLOCKS) && budget.IsBudgetPaymentBlock(nBlockHeight)) {
@@ -278,7 +213,7 @@ std::string GetRequiredPaymentsString(int nBlockHeight)
     }
 }
 
-void CMasternodePayments::FillBlockPayee(CMutableTransaction& txNew, int64_t nFees, bool fProofOfStake)
+void CMasternodePayments::FillBlockPayee(CMutableTransaction& txNew, int64_t nFees, bool fProofOfStake, bool fLog)
 {
     CBlockIndex* pindexPrev = chainActive.Tip();
     if (!pindexPrev) return;
@@ -293,7 +228,8 @@ void CMasternodePayments::FillBlockPayee(CMutableTransaction& txNew, int64_t nFe
         if (winningNode) {
             payee = GetScriptForDestination(winningNode->pubKeyCollateralAddress.GetID());
         } else {
-            LogPrintf("CreateNewBlock: Failed to detect masternode to pay\n");
+            if (fLog)
+                LogPrintf("CreateNewBlock: Failed to detect masternode to pay\n");
             hasPayment = false;
         }
     }
@@ -322,11 +258,13 @@ void CMasternodePayments::FillBlockPayee(CMutableTransaction& txNew, int64_t nFe
             txNew.vout[0].nValue = blockValue - masternodePayment;
         }
 
-        CTxDestination address1;
-        ExtractDestination(payee, address1);
-        CBitcoinAddress address2(address1);
+        if (fLog) {
+            CTxDestination address1;
+            ExtractDestination(payee, address1);
+            CBitcoinAddress address2(address1);
 
-        LogPrintf("Masternode payment of %s to %s\n", FormatMoney(masternodePayment).c_str(), address2.ToString().c_str());
+            LogPrintf("Masternode payment of %s to %s\n", FormatMoney(masternodePayment).c_str(), address2.ToString().c_str());
+        }
     }
 }
 
@@ -344,6 +282,7 @@ void CMasternodePayments::ProcessMessageMasternodePayments(CNode* pfrom, std::st
 
     if (fLiteMode) return; //disable all Obfuscation/Masternode related functionality
 
+    LoadDeferredSections();
 
     if (strCommand == "mnget") { //Masternode Payments Request Sync
         if (fLiteMode) return;   //disable all Obfuscation/Masternode related functionality
@@ -425,9 +364,7 @@ bool CMasternodePaymentWinner::Sign(CKey& keyMasternode, CPubKey& pubKeyMasterno
     std::string errorMessage;
     std::string strMasterNodeSignMessage;
 
-    std::string strMessage = vinMasternode.prevout.ToStringShort() +
-                             boost::lexical_cast<std::string>(nBlockHeight) +
-                             payee.ToString();
+    std::string strMessage = GetStrMessage();
 
     if (!obfuScationSigner.SignMessage(strMessage, errorMessage, vchSig, keyMasternode)) {
         LogPrintf("CMasternodePing::Sign() - Error: %s\n", errorMessage.c_str());
@@ -442,6 +379,13 @@ bool CMasternodePaymentWinner::Sign(CKey& keyMasternode, CPubKey& pubKeyMasterno
     return true;
 }
 
+std::string CMasternodePaymentWinner::GetStrMessage() const
+{
+    return vinMasternode.prevout.ToStringShort() +
+           boost::lexical_cast<std::string>(nBlockHeight) +
+           payee.ToString();
+}
+
 bool CMasternodePayments::GetBlockPayee(int nBlockHeight, CScript& payee)
 {
     if (mapMasternodeBlocks.count(nBlockHeight)) {
@@ -502,10 +446,69 @@ bool CMasternodePayments::AddWinningMasternode(CMasternodePaymentWinner& winnerI
             CMasternodeBlockPayees blockPayees(winnerIn.nBlockHeight);
             mapMasternodeBlocks[winnerIn.nBlockHeight] = blockPayees;
         }
+
+        mapMasternodeBlocks[winnerIn.nBlockHeight].AddPayee(winnerIn.payee, 1);
+        AddPaidHeight(winnerIn.nBlockHeight, winnerIn.payee);
+    }
+    AddBlockPayeesUpdated();
+
+    return true;
+}
+
+void CMasternodePayments::AddPaidHeight(int nBlockHeight, const CScript& payee)
+{
+    AssertLockHeld(cs_mapMasternodeBlocks);
+    if (mapMasternodeBlocks[nBlockHeight].HasPayeeWithVotes(payee, MNPAYMENTS_LASTPAID_VOTES))
+        mapPaidHeights[payee].insert(nBlockHeight);
+}
+
+void CMasternodePayments::RemovePaidHeights(int nBlockHeight)
+{
+    AssertLockHeld(cs_mapMasternodeBlocks);
+    std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.find(nBlockHeight);
+    if (it == mapMasternodeBlocks.end())
+        return;
+
+    LOCK(cs_vecPayments);
+    BOOST_FOREACH (CMasternodePayee& payee, it->second.vecPayments) {
+        std::map<CScript, std::set<int> >::iterator itPaid = mapPaidHeights.find(payee.scriptPubKey);
+        if (itPaid == mapPaidHeights.end())
+            continue;
+        itPaid->second.erase(nBlockHeight);
+        if (itPaid->second.empty())
+            mapPaidHeights.erase(itPaid);
+    }
+}
+
+void CMasternodePayments::RebuildPaidHeights()
+{
+    LOCK2(cs_mapMasternodeBlocks, cs_vecPayments);
+    mapPaidHeights.clear();
+    for (std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.begin(); it != mapMasternodeBlocks.end(); ++it) {
+        BOOST_FOREACH (CMasternodePayee& payee, it->second.vecPayments) {
+            if (payee.nVotes >= MNPAYMENTS_LASTPAID_VOTES)
+                mapPaidHeights[payee.scriptPubKey].insert(it->first);
+        }
     }
+}
 
-    mapMasternodeBlocks[winnerIn.nBlockHeight].AddPayee(winnerIn.payee, 1);
+// Most recent height in [nMinHeight, nMaxHeight] at which payee has enough votes to count as paid
+bool CMasternodePayments::GetLastPaidHeight(const CScript& payee, int nMinHeight, int nMaxHeight, int& nHeightRet)
+{
+    LOCK(cs_mapMasternodeBlocks);
+
+    std::map<CScript, std::set<int> >::const_iterator it = mapPaidHeights.find(payee);
+    if (it == mapPaidHeights.end() || nMinHeight > nMaxHeight)
+        return false;
 
+    std::set<int>::const_iterator itHeight = it->second.upper_bound(nMaxHeight);
+    if (itHeight == it->second.begin())
+        return false;
+    --itHeight;
+    if (*itHeight < nMinHeight)
+        return false;
+
+    nHeightRet = *itHeight;
     return true;
 }
 
@@ -636,6 +639,7 @@ void CMasternodePayments::CleanPaymentList()
             LogPrint("mnpayments", "CMasternodePayments::CleanPaymentList - Removing old Masternode payment - block %d\n", winner.nBlockHeight);
             masternodeSync.mapSeenSyncMNW.erase((*it).first);
             mapMasternodePayeeVotes.erase(it++);
+            RemovePaidHeights(winner.nBlockHeight);
             mapMasternodeBlocks.erase(winner.nBlockHeight);
         } else {
             ++it;
@@ -759,9 +763,7 @@ bool CMasternodePaymentWinner::SignatureValid()
     CMasternode* pmn = mnodeman.Find(vinMasternode);
 
     if (pmn != NULL) {
-        std::string strMessage = vinMasternode.prevout.ToStringShort() +
-                                 boost::lexical_cast<std::string>(nBlockHeight) +
-                                 payee.ToString();
+        std::string strMessage = GetStrMessage();
 
         std::string errorMessage = "";
         if (!obfuScationSigner.VerifyMessage(pmn->pubKeyMasternode, vchSig, strMessage, errorMessage)) {
@@ -801,6 +803,50 @@ void CMasternodePayments::Sync(CNode* node, int nCountNeeded)
     node->PushMessage("ssc", MASTERNODE_SYNC_MNW, nInvCount);
 }
 
+void CMasternodePayments::WriteSnapshot(CSnapshotDB& snapshot)
+{
+    LOCK2(cs_mapMasternodePayeeVotes, cs_mapMasternodeBlocks);
+
+    // votes not read yet are kept as they are on disk, unless votes were added since
+    if (snapshotDeferred && !mapMasternodePayeeVotes.empty())
+        LoadDeferredSections();
+
+    snapshot.AddMapSection(SNAPSHOT_PAYEE_VOTES, mapMasternodePayeeVotes, snapshotDeferred.get());
+    snapshot.AddSection(SNAPSHOT_BLOCKS, mapMasternodeBlocks);
+}
+
+CSnapshotDB::ReadResult CMasternodePayments::ReadSnapshot(CSnapshotDB& snapshot)
+{
+    LOCK2(cs_mapMasternodePayeeVotes, cs_mapMasternodeBlocks);
+
+    CSnapshotDB::ReadResult result = snapshot.ReadSection(SNAPSHOT_BLOCKS, mapMasternodeBlocks);
+    if (result != CSnapshotDB::Ok) {
+        Clear();
+        return result;
+    }
+
+    // the votes are only relayed on, they are needed once the chain is synced, see LoadDeferredSections
+    snapshotDeferred.reset(new CSnapshotDB(snapshot));
+
+    RebuildPaidHeights();
+    return CSnapshotDB::Ok;
+}
+
+void CMasternodePayments::LoadDeferredSections()
+{
+    LOCK(cs_mapMasternodePayeeVotes);
+    if (!snapshotDeferred)
+        return;
+    boost::scoped_ptr<CSnapshotDB> snapshot;
+    snapshot.swap(snapshotDeferred);
+
+    // votes added since startup are newer than the ones read, a damaged section loses them but not the block payees
+    int64_t nStart = GetTimeMillis();
+    snapshot->MergeSection(SNAPSHOT_PAYEE_VOTES, mapMasternodePayeeVotes);
+
+    LogPrint("mnpayments", "Loaded votes from %s  %dms\n", snapshot->GetFilename(), GetTimeMillis() - nStart);
+}
+
 std::string CMasternodePayments::ToString() const
 {
     std::ostringstream info;
@@ -9,7 +9,9 @@
 #include "key.h"
 #include "main.h"
 #include "masternode.h"
+#include "snapshotdb.h"
 #include <boost/lexical_cast.hpp>
+#include <boost/scoped_ptr.hpp>
 
 using namespace std;
 
@@ -25,36 +27,27 @@ extern CMasternodePayments masternodePayments;
 
 #define MNPAYMENTS_SIGNATURES_REQUIRED 6
 #define MNPAYMENTS_SIGNATURES_TOTAL 10
+// Votes a payee needs for a block before a masternode counts as paid in that block
+#define MNPAYMENTS_LASTPAID_VOTES 2
 
 void ProcessMessageMasternodePayments(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 bool IsBlockPayeeValid(const CBlock& block, int nBlockHeight);
 std::string GetRequiredPaymentsString(int nBlockHeight);
 bool IsBlockValueValid(const CBlock& block, CAmount nExpectedValue, CAmount nMinted);
-void FillBlockPayee(CMutableTransaction& txNew, CAmount nFees, bool fProofOfStake);
+void FillBlockPayee(CMutableTransaction& txNew, CAmount nFees, bool fProofOfStake, bool fLog = true);
+/** Counter of changes to what FillBlockPayee pays: winner votes, finalized budgets and sporks */
+unsigned int GetBlockPayeesUpdated();
+void AddBlockPayeesUpdated();
 
 void DumpMasternodePayments();
 
 /** Save Masternode Payment Data (mnpayments.dat)
  */
-class CMasternodePaymentDB
+class CMasternodePaymentDB : public CSnapshotDB
 {
-private:
-    boost::filesystem::path pathDB;
-    std::string strMagicMessage;
-
 public:
-    enum ReadResult {
-        Ok,
-        FileError,
-        HashReadError,
-        IncorrectHash,
-        IncorrectMagicMessage,
-        IncorrectMagicNumber,
-        IncorrectFormat
-    };
-
     CMasternodePaymentDB();
-    bool Write(const CMasternodePayments& objToSave);
+    bool Write(CMasternodePayments& objToSave);
     ReadResult Read(CMasternodePayments& objToLoad, bool fDryRun = false);
 };
 
@@ -193,6 +186,7 @@ public:
     }
 
     bool Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode);
+    std::string GetStrMessage() const;
     bool IsValid(CNode* pnode, std::string& strError);
     bool SignatureValid();
     void Relay();
@@ -236,6 +230,17 @@ private:
     int nSyncedFromPeer;
     int nLastBlockHeight;
 
+    // Heights at which each payee has MNPAYMENTS_LASTPAID_VOTES votes, so the last
+    // payment of a masternode is found without walking back through the blocks
+    std::map<CScript, std::set<int> > mapPaidHeights;
+
+    void AddPaidHeight(int nBlockHeight, const CScript& payee);
+    void RemovePaidHeights(int nBlockHeight);
+    void RebuildPaidHeights();
+
+    // mnpayments.dat as read at startup, while the votes in it are not read yet
+    boost::scoped_ptr<CSnapshotDB> snapshotDeferred;
+
 public:
     std::map<uint256, CMasternodePaymentWinner> mapMasternodePayeeVotes;
     std::map<int, CMasternodeBlockPayees> mapMasternodeBlocks;
@@ -252,6 +257,9 @@ public:
         LOCK2(cs_mapMasternodeBlocks, cs_mapMasternodePayeeVotes);
         mapMasternodeBlocks.clear();
         mapMasternodePayeeVotes.clear();
+        mapPaidHeights.clear();
+        snapshotDeferred.reset();
+        AddBlockPayeesUpdated();
     }
 
     bool AddWinningMasternode(CMasternodePaymentWinner& winner);
@@ -260,6 +268,7 @@ public:
     void Sync(CNode* node, int nCountNeeded);
     void CleanPaymentList();
     int LastPayment(CMasternode& mn);
+    bool GetLastPaidHeight(const CScript& payee, int nMinHeight, int nMaxHeight, int& nHeightRet);
 
     bool GetBlockPayee(int nBlockHeight, CScript& payee);
     bool IsTransactionValid(const CTransaction& txNew, int nBlockHeight);
@@ -283,19 +292,21 @@ public:
     int GetMinMasternodePaymentsProto();
     void ProcessMessageMasternodePayments(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
     std::string GetRequiredPaymentsString(int nBlockHeight);
-    void FillBlockPayee(CMutableTransaction& txNew, int64_t nFees, bool fProofOfStake);
+    void FillBlockPayee(CMutableTransaction& txNew, int64_t nFees, bool fProofOfStake, bool fLog = true);
     std::string ToString() const;
     int GetOldestBlock();
     int GetNewestBlock();
 
-    ADD_SERIALIZE_METHODS;
+    // sections of mnpayments.dat
+    enum {
+        SNAPSHOT_PAYEE_VOTES = 1,
+        SNAPSHOT_BLOCKS
+    };
 
-    template <typename Stream, typename Operation>
-    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
-    {
-        READWRITE(mapMasternodePayeeVotes);
-        READWRITE(mapMasternodeBlocks);
-    }
+    void WriteSnapshot(CSnapshotDB& snapshot);
+    CSnapshotDB::ReadResult ReadSnapshot(CSnapshotDB& snapshot);
+    /// Read the votes left out by ReadSnapshot, done on the first message once synced
+    void LoadDeferredSections();
 };
 
 
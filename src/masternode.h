@@ -13,6 +13,7 @@
 #include "sync.h"
 #include "timedata.h"
 #include "util.h"
+#include "validationinterface.h"
 
 #define MASTERNODE_MIN_CONFIRMATIONS 15
 #define MASTERNODE_MIN_MNP_SECONDS (10 * 60)
@@ -26,8 +27,10 @@ using namespace std;
 
 class CMasternode;
 class CMasternodeBroadcast;
+class CMasternodeCollateralWatcher;
 class CMasternodePing;
 extern map<int64_t, uint256> mapCacheBlockHashes;
+extern CMasternodeCollateralWatcher masternodeCollateralWatcher;
 
 bool GetBlockHash(uint256& hash, int nBlockHeight);
 
@@ -61,6 +64,7 @@ public:
 
     bool CheckAndUpdate(int& nDos, bool fRequireEnabled = true);
     bool Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode);
+    std::string GetStrMessage() const;
     void Relay();
 
     uint256 GetHash()
@@ -191,6 +195,7 @@ public:
     }
 
     uint256 CalculateScore(int mod = 1, int64_t nBlockHeight = 0);
+    uint256 CalculateScore(const uint256& hashBlock, const uint256& hash2) const;
 
     ADD_SERIALIZE_METHODS;
 
@@ -217,7 +222,7 @@ public:
         READWRITE(nLastScanningErrorBlockHeight);
     }
 
-    int64_t SecondsSincePayment();
+    int64_t SecondsSincePayment(int nMnCount);
 
     bool UpdateFromNewBroadcast(CMasternodeBroadcast& mnb);
 
@@ -280,7 +285,7 @@ public:
         return strStatus;
     }
 
-    int64_t GetLastPaid();
+    int64_t GetLastPaid(int nMnCount);
     bool IsValidNetAddr();
 };
 
@@ -289,6 +294,30 @@ public:
 // The Masternode Broadcast Class : Contains a different serialize method for sending masternodes through the network
 //
 
+//
+// Remembers which masternode collateral outputs are known to be unspent. Any transaction that spends one,
+// whether it enters the mempool, gets connected, or gets dropped again, makes it be looked up again, so
+// CMasternode::Check doesn't have to run the mempool acceptance checks every time
+//
+
+class CMasternodeCollateralWatcher : public CValidationInterface
+{
+private:
+    mutable CCriticalSection cs;
+    std::set<COutPoint> setUnspent;
+
+protected:
+    void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
+
+public:
+    /// Whether the collateral is unspent in the chain and the mempool; false if that can't be told without waiting for cs_main
+    bool IsUnspent(const COutPoint& outpoint, bool& fUnspent);
+
+    /// Forget a collateral once its masternode is gone
+    void Remove(const COutPoint& outpoint);
+    void Clear();
+};
+
 class CMasternodeBroadcast : public CMasternode
 {
 public:
@@ -299,6 +328,7 @@ public:
     bool CheckAndUpdate(int& nDoS);
     bool CheckInputsAndAdd(int& nDos);
     bool Sign(CKey& keyCollateralAddress);
+    std::string GetStrMessage() const;
     void Relay();
 
     ADD_SERIALIZE_METHODS;
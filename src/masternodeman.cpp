@@ -16,27 +16,19 @@
 /** Masternode manager */
 CMasternodeMan mnodeman;
 
-struct CompareLastPaid {
+struct CompareLastPaidHigh {
     bool operator()(const pair<int64_t, CTxIn>& t1,
         const pair<int64_t, CTxIn>& t2) const
     {
-        return t1.first < t2.first;
+        return t1.first > t2.first;
     }
 };
 
-struct CompareScoreTxIn {
-    bool operator()(const pair<int64_t, CTxIn>& t1,
-        const pair<int64_t, CTxIn>& t2) const
+struct CompareScoreIndex {
+    bool operator()(const pair<int64_t, size_t>& t1,
+        const pair<int64_t, size_t>& t2) const
     {
-        return t1.first < t2.first;
-    }
-};
-
-struct CompareScoreMN {
-    bool operator()(const pair<int64_t, CMasternode>& t1,
-        const pair<int64_t, CMasternode>& t2) const
-    {
-        return t1.first < t2.first;
+        return t1.first > t2.first || (t1.first == t2.first && t1.second < t2.second);
     }
 };
 
@@ -44,38 +36,17 @@ struct CompareScoreMN {
 // CMasternodeDB
 //
 
-CMasternodeDB::CMasternodeDB()
+CMasternodeDB::CMasternodeDB() : CSnapshotDB("mncache.dat", "MasternodeCache")
 {
-    pathMN = GetDataDir() / "mncache.dat";
-    strMagicMessage = "MasternodeCache";
 }
 
-bool CMasternodeDB::Write(const CMasternodeMan& mnodemanToSave)
+bool CMasternodeDB::Write(CMasternodeMan& mnodemanToSave)
 {
     int64_t nStart = GetTimeMillis();
 
-    // serialize, checksum data up to that point, then append checksum
-    CDataStream ssMasternodes(SER_DISK, CLIENT_VERSION);
-    ssMasternodes << strMagicMessage;                   // masternode cache file specific magic message
-    ssMasternodes << FLATDATA(Params().MessageStart()); // network specific magic number
-    ssMasternodes << mnodemanToSave;
-    uint256 hash = Hash(ssMasternodes.begin(), ssMasternodes.end());
-    ssMasternodes << hash;
-
-    // open output file, and associate with CAutoFile
-    FILE* file = fopen(pathMN.string().c_str(), "wb");
-    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathMN.string());
-
-    // Write and commit header, data
-    try {
-        fileout << ssMasternodes;
-    } catch (std::exception& e) {
-        return error("%s : Serialize or I/O error - %s", __func__, e.what());
-    }
-    //    FileCommit(fileout);
-    fileout.fclose();
+    mnodemanToSave.WriteSnapshot(*this);
+    if (!WriteSections())
+        return false;
 
     LogPrintf("Written info to mncache.dat  %dms\n", GetTimeMillis() - nStart);
     LogPrintf("  %s\n", mnodemanToSave.ToString());
@@ -86,80 +57,22 @@ bool CMasternodeDB::Write(const CMasternodeMan& mnodemanToSave)
 CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad, bool fDryRun)
 {
     int64_t nStart = GetTimeMillis();
-    // open input file, and associate with CAutoFile
-    FILE* file = fopen(pathMN.string().c_str(), "rb");
-    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull()) {
-        error("%s : Failed to open file %s", __func__, pathMN.string());
-        return FileError;
-    }
 
-    // use file size to size memory buffer
-    int fileSize = boost::filesystem::file_size(pathMN);
-    int dataSize = fileSize - sizeof(uint256);
-    // Don't try to resize to a negative number if file is small
-    if (dataSize < 0)
-        dataSize = 0;
-    vector<unsigned char> vchData;
-    vchData.resize(dataSize);
-    uint256 hashIn;
-
-    // read data and checksum from file
-    try {
-        filein.read((char*)&vchData[0], dataSize);
-        filein >> hashIn;
-    } catch (std::exception& e) {
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return HashReadError;
-    }
-    filein.fclose();
-
-    CDataStream ssMasternodes(vchData, SER_DISK, CLIENT_VERSION);
-
-    // verify stored checksum matches input data
-    uint256 hashTmp = Hash(ssMasternodes.begin(), ssMasternodes.end());
-    if (hashIn != hashTmp) {
-        error("%s : Checksum mismatch, data corrupted", __func__);
-        return IncorrectHash;
-    }
-
-    unsigned char pchMsgTmp[4];
-    std::string strMagicMessageTmp;
-    try {
-        // de-serialize file header (masternode cache file specific magic message) and ..
-
-        ssMasternodes >> strMagicMessageTmp;
-
-        // ... verify the message matches predefined one
-        if (strMagicMessage != strMagicMessageTmp) {
-            error("%s : Invalid masternode cache magic message", __func__);
-            return IncorrectMagicMessage;
-        }
+    // a dry run only needs the header, every section is verified when it is read
+    ReadResult result = ReadHeader();
+    if (result != Ok || fDryRun)
+        return result;
 
-        // de-serialize file header (network specific magic number) and ..
-        ssMasternodes >> FLATDATA(pchMsgTmp);
-
-        // ... verify the network matches ours
-        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp))) {
-            error("%s : Invalid network magic number", __func__);
-            return IncorrectMagicNumber;
-        }
-        // de-serialize data into CMasternodeMan object
-        ssMasternodes >> mnodemanToLoad;
-    } catch (std::exception& e) {
-        mnodemanToLoad.Clear();
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return IncorrectFormat;
-    }
+    result = mnodemanToLoad.ReadSnapshot(*this);
+    if (result != Ok)
+        return result;
 
     LogPrintf("Loaded info from mncache.dat  %dms\n", GetTimeMillis() - nStart);
     LogPrintf("  %s\n", mnodemanToLoad.ToString());
-    if (!fDryRun) {
-        LogPrintf("Masternode manager - cleaning....\n");
-        mnodemanToLoad.CheckAndRemove(true);
-        LogPrintf("Masternode manager - result:\n");
-        LogPrintf("  %s\n", mnodemanToLoad.ToString());
-    }
+    LogPrintf("Masternode manager - cleaning....\n");
+    mnodemanToLoad.CheckAndRemove(true);
+    LogPrintf("Masternode manager - result:\n");
+    LogPrintf("  %s\n", mnodemanToLoad.ToString());
 
     return Ok;
 }
@@ -194,6 +107,7 @@ void DumpMasternodes()
 CMasternodeMan::CMasternodeMan()
 {
     nDsqCount = 0;
+    nScoresUsed = 0;
 }
 
 bool CMasternodeMan::Add(CMasternode& mn)
@@ -207,6 +121,8 @@ bool CMasternodeMan::Add(CMasternode& mn)
     if (pmn == NULL) {
         LogPrint("masternode", "CMasternodeMan: Adding new Masternode %s - %i now\n", mn.vin.prevout.hash.ToString(), size() + 1);
         vMasternodes.push_back(mn);
+        IndexMasternode(vMasternodes.size() - 1);
+        mapScores.clear();
         return true;
     }
 
@@ -245,6 +161,7 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
     LOCK(cs);
 
     //remove inactive and outdated
+    bool fRemoved = false;
     vector<CMasternode>::iterator it = vMasternodes.begin();
     while (it != vMasternodes.end()) {
         if ((*it).activeState == CMasternode::MASTERNODE_REMOVE ||
@@ -276,12 +193,19 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
                 }
             }
 
+            masternodeCollateralWatcher.Remove((*it).vin.prevout);
             it = vMasternodes.erase(it);
+            fRemoved = true;
         } else {
             ++it;
         }
     }
 
+    if (fRemoved) {
+        RebuildIndexes();
+        mapScores.clear();
+    }
+
     // check who's asked for the Masternode list
     map<CNetAddr, int64_t>::iterator it1 = mAskedUsForMasternodeList.begin();
     while (it1 != mAskedUsForMasternodeList.end()) {
@@ -338,12 +262,18 @@ void CMasternodeMan::Clear()
 {
     LOCK(cs);
     vMasternodes.clear();
+    mapIndexByVin.clear();
+    mapIndexByPubKey.clear();
+    mapIndexByPayee.clear();
+    masternodeCollateralWatcher.Clear();
     mAskedUsForMasternodeList.clear();
     mWeAskedForMasternodeList.clear();
     mWeAskedForMasternodeListEntry.clear();
     mapSeenMasternodeBroadcast.clear();
     mapSeenMasternodePing.clear();
+    mapScores.clear();
     nDsqCount = 0;
+    snapshotDeferred.reset();
 }
 
 int CMasternodeMan::stable_size ()
@@ -433,38 +363,95 @@ void CMasternodeMan::DsegUpdate(CNode* pnode)
     mWeAskedForMasternodeList[pnode->addr] = askAgain;
 }
 
-CMasternode* CMasternodeMan::Find(const CScript& payee)
+void CMasternodeMan::IndexMasternode(size_t nIndex)
+{
+    AssertLockHeld(cs);
+    const CMasternode& mn = vMasternodes[nIndex];
+
+    mapIndexByVin[mn.vin.prevout] = nIndex;
+
+    // keys can be shared, Find returns the first entry that has them
+    std::map<CPubKey, size_t>::iterator itPubKey = mapIndexByPubKey.find(mn.pubKeyMasternode);
+    if (itPubKey == mapIndexByPubKey.end() || itPubKey->second > nIndex || vMasternodes[itPubKey->second].pubKeyMasternode != mn.pubKeyMasternode)
+        mapIndexByPubKey[mn.pubKeyMasternode] = nIndex;
+
+    CScript payee = GetScriptForDestination(mn.pubKeyCollateralAddress.GetID());
+    std::map<CScript, size_t>::iterator itPayee = mapIndexByPayee.find(payee);
+    if (itPayee == mapIndexByPayee.end() || itPayee->second > nIndex || vMasternodes[itPayee->second].pubKeyCollateralAddress != mn.pubKeyCollateralAddress)
+        mapIndexByPayee[payee] = nIndex;
+}
+
+void CMasternodeMan::RebuildIndexes()
 {
     LOCK(cs);
-    CScript payee2;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        payee2 = GetScriptForDestination(mn.pubKeyCollateralAddress.GetID());
-        if (payee2 == payee)
-            return &mn;
+    mapIndexByVin.clear();
+    mapIndexByPubKey.clear();
+    mapIndexByPayee.clear();
+    for (size_t i = 0; i < vMasternodes.size(); i++) {
+        IndexMasternode(i);
     }
-    return NULL;
 }
 
-CMasternode* CMasternodeMan::Find(const CTxIn& vin)
+void CMasternodeMan::UpdateIndexes(const CTxIn& vin)
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.vin.prevout == vin.prevout)
-            return &mn;
+    std::map<COutPoint, size_t>::iterator it = mapIndexByVin.find(vin.prevout);
+    if (it != mapIndexByVin.end())
+        IndexMasternode(it->second);
+}
+
+CMasternode* CMasternodeMan::Find(const CScript& payee)
+{
+    LOCK(cs);
+
+    std::map<CScript, size_t>::iterator it = mapIndexByPayee.find(payee);
+    if (it == mapIndexByPayee.end())
+        return NULL;
+    if (GetScriptForDestination(vMasternodes[it->second].pubKeyCollateralAddress.GetID()) == payee)
+        return &vMasternodes[it->second];
+
+    // the indexed entry changed its key since, look for another one with this payee
+    mapIndexByPayee.erase(it);
+    CScript payee2;
+    for (size_t i = 0; i < vMasternodes.size(); i++) {
+        payee2 = GetScriptForDestination(vMasternodes[i].pubKeyCollateralAddress.GetID());
+        if (payee2 == payee) {
+            mapIndexByPayee[payee] = i;
+            return &vMasternodes[i];
+        }
     }
     return NULL;
 }
 
+CMasternode* CMasternodeMan::Find(const CTxIn& vin)
+{
+    LOCK(cs);
+
+    std::map<COutPoint, size_t>::iterator it = mapIndexByVin.find(vin.prevout);
+    if (it == mapIndexByVin.end())
+        return NULL;
+    return &vMasternodes[it->second];
+}
 
 CMasternode* CMasternodeMan::Find(const CPubKey& pubKeyMasternode)
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.pubKeyMasternode == pubKeyMasternode)
-            return &mn;
+    std::map<CPubKey, size_t>::iterator it = mapIndexByPubKey.find(pubKeyMasternode);
+    if (it == mapIndexByPubKey.end())
+        return NULL;
+    if (vMasternodes[it->second].pubKeyMasternode == pubKeyMasternode)
+        return &vMasternodes[it->second];
+
+    // the indexed entry changed its key since, look for another one with this key
+    mapIndexByPubKey.erase(it);
+    for (size_t i = 0; i < vMasternodes.size(); i++) {
+        if (vMasternodes[i].pubKeyMasternode == pubKeyMasternode) {
+            mapIndexByPubKey[pubKeyMasternode] = i;
+            return &vMasternodes[i];
+        }
     }
     return NULL;
 }
@@ -500,7 +487,7 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
         //make sure it has as many confirmations as there are masternodes
         if (mn.GetMasternodeInputAge() < nMnCount) continue;
 
-        vecMasternodeLastPaid.push_back(make_pair(mn.SecondsSincePayment(), mn.vin));
+        vecMasternodeLastPaid.push_back(make_pair(mn.SecondsSincePayment(nMnCount), mn.vin));
     }
 
     nCount = (int)vecMasternodeLastPaid.size();
@@ -508,14 +495,16 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
     //when the network is in the process of upgrading, don't penalize nodes that recently restarted
     if (fFilterSigTime && nCount < nMnCount / 3) return GetNextMasternodeInQueueForPayment(nBlockHeight, false, nCount);
 
-    // Sort them high to low
-    sort(vecMasternodeLastPaid.rbegin(), vecMasternodeLastPaid.rend(), CompareLastPaid());
-
     // Look at 1/10 of the oldest nodes (by last payment), calculate their scores and pay the best one
     //  -- This doesn't look at who is being paid in the +8-10 blocks, allowing for double payments very rarely
     //  -- 1/100 payments should be a double payment on mainnet - (1/(3000/10))*2
     //  -- (chance per block * chances before IsScheduled will fire)
-    int nTenthNetwork = CountEnabled() / 10;
+    int nTenthNetwork = nMnCount / 10;
+
+    // Only the oldest tenth is scored, so only that part needs sorting high to low
+    size_t nSorted = std::min(vecMasternodeLastPaid.size(), (size_t)std::max(nTenthNetwork, 1));
+    partial_sort(vecMasternodeLastPaid.begin(), vecMasternodeLastPaid.begin() + nSorted, vecMasternodeLastPaid.end(), CompareLastPaidHigh());
+
     int nCountTenth = 0;
     uint256 nHigh = 0;
     BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeLastPaid) {
@@ -565,42 +554,80 @@ CMasternode* CMasternodeMan::FindRandomNotInVec(std::vector<CTxIn>& vecToExclude
     return NULL;
 }
 
+const std::vector<pair<int64_t, size_t> >* CMasternodeMan::GetScores(int64_t nBlockHeight)
+{
+    AssertLockHeld(cs);
+
+    //make sure we know about this block
+    uint256 hash = 0;
+    if (!GetBlockHash(hash, nBlockHeight)) return NULL;
+
+    std::map<uint256, CMasternodeScores>::iterator it = mapScores.find(hash);
+    if (it == mapScores.end()) {
+        if (mapScores.size() >= MASTERNODES_SCORE_CACHE_SIZE) {
+            std::map<uint256, CMasternodeScores>::iterator itOldest = mapScores.begin();
+            for (std::map<uint256, CMasternodeScores>::iterator it2 = mapScores.begin(); it2 != mapScores.end(); ++it2) {
+                if (it2->second.nLastUsed < itOldest->second.nLastUsed) itOldest = it2;
+            }
+            mapScores.erase(itOldest);
+        }
+
+        it = mapScores.insert(make_pair(hash, CMasternodeScores())).first;
+
+        // hash2 only depends on the block, so it is shared by every masternode
+        CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+        ss << hash;
+        uint256 hash2 = ss.GetHash();
+
+        std::vector<pair<int64_t, size_t> >& vScores = it->second.vScores;
+        vScores.reserve(vMasternodes.size());
+        for (size_t i = 0; i < vMasternodes.size(); i++) {
+            uint256 n = vMasternodes[i].CalculateScore(hash, hash2);
+            vScores.push_back(make_pair((int64_t)n.GetCompact(false), i));
+        }
+
+        // high to low, ties go to the masternode that comes first in the list
+        sort(vScores.begin(), vScores.end(), CompareScoreIndex());
+    }
+
+    it->second.nLastUsed = ++nScoresUsed;
+    return &it->second.vScores;
+}
+
 CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight, int minProtocol)
 {
-    int64_t score = 0;
-    CMasternode* winner = NULL;
+    LOCK(cs);
 
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    const std::vector<pair<int64_t, size_t> >* pvScores = GetScores(nBlockHeight);
+    if (pvScores == NULL) return NULL;
+
+    // the first eligible Masternode in score order is the winner
+    BOOST_FOREACH (const PAIRTYPE(int64_t, size_t) & s, *pvScores) {
+        if (s.first <= 0) break;
+
+        CMasternode& mn = vMasternodes[s.second];
         mn.Check();
         if (mn.protocolVersion < minProtocol || !mn.IsEnabled()) continue;
 
-        // calculate the score for each Masternode
-        uint256 n = mn.CalculateScore(mod, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        // determine the winner
-        if (n2 > score) {
-            score = n2;
-            winner = &mn;
-        }
+        return &mn;
     }
 
-    return winner;
+    return NULL;
 }
 
 int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
+    LOCK(cs);
+
     int64_t nMasternode_Min_Age = GetSporkValue(SPORK_16_MN_WINNER_MINIMUM_AGE);
     int64_t nMasternode_Age = 0;
 
-    //make sure we know about this block
-    uint256 hash = 0;
-    if (!GetBlockHash(hash, nBlockHeight)) return -1;
+    const std::vector<pair<int64_t, size_t> >* pvScores = GetScores(nBlockHeight);
+    if (pvScores == NULL) return -1;
 
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    int rank = 0;
+    BOOST_FOREACH (const PAIRTYPE(int64_t, size_t) & s, *pvScores) {
+        CMasternode& mn = vMasternodes[s.second];
         if (mn.protocolVersion < minProtocol) {
             LogPrintf("Skipping Masternode with obsolete version %d\n", mn.protocolVersion);
             continue;                                                       // Skip obsolete versions
@@ -619,18 +646,9 @@ int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, in
             mn.Check();
             if (!mn.IsEnabled()) continue;
         }
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
-    }
-
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
 
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeScores) {
         rank++;
-        if (s.second.prevout == vin.prevout) {
+        if (mn.vin.prevout == vin.prevout) {
             return rank;
         }
     }
@@ -640,36 +658,36 @@ int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, in
 
 std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t nBlockHeight, int minProtocol)
 {
-    std::vector<pair<int64_t, CMasternode> > vecMasternodeScores;
+    LOCK(cs);
+
+    std::vector<pair<int64_t, size_t> > vecMasternodeScores;
     std::vector<pair<int, CMasternode> > vecMasternodeRanks;
 
-    //make sure we know about this block
-    uint256 hash = 0;
-    if (!GetBlockHash(hash, nBlockHeight)) return vecMasternodeRanks;
+    const std::vector<pair<int64_t, size_t> >* pvScores = GetScores(nBlockHeight);
+    if (pvScores == NULL) return vecMasternodeRanks;
 
     // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (const PAIRTYPE(int64_t, size_t) & s, *pvScores) {
+        CMasternode& mn = vMasternodes[s.second];
         mn.Check();
 
         if (mn.protocolVersion < minProtocol) continue;
 
         if (!mn.IsEnabled()) {
-            vecMasternodeScores.push_back(make_pair(9999, mn));
+            vecMasternodeScores.push_back(make_pair(9999, s.second));
             continue;
         }
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        vecMasternodeScores.push_back(make_pair(n2, mn));
+        vecMasternodeScores.push_back(make_pair(s.first, s.second));
     }
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreMN());
+    // only the disabled entries are out of place
+    sort(vecMasternodeScores.begin(), vecMasternodeScores.end(), CompareScoreIndex());
 
     int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CMasternode) & s, vecMasternodeScores) {
+    BOOST_FOREACH (PAIRTYPE(int64_t, size_t) & s, vecMasternodeScores) {
         rank++;
-        vecMasternodeRanks.push_back(make_pair(rank, s.second));
+        vecMasternodeRanks.push_back(make_pair(rank, vMasternodes[s.second]));
     }
 
     return vecMasternodeRanks;
@@ -677,29 +695,23 @@ std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t
 
 CMasternode* CMasternodeMan::GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
+    LOCK(cs);
 
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    const std::vector<pair<int64_t, size_t> >* pvScores = GetScores(nBlockHeight);
+    if (pvScores == NULL) return NULL;
+
+    int rank = 0;
+    BOOST_FOREACH (const PAIRTYPE(int64_t, size_t) & s, *pvScores) {
+        CMasternode& mn = vMasternodes[s.second];
         if (mn.protocolVersion < minProtocol) continue;
         if (fOnlyActive) {
             mn.Check();
             if (!mn.IsEnabled()) continue;
         }
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
-    }
-
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
-
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeScores) {
         rank++;
         if (rank == nRank) {
-            return Find(s.second);
+            return &mn;
         }
     }
 
@@ -728,6 +740,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
     if (!masternodeSync.IsBlockchainSynced()) return;
 
     LOCK(cs_process_message);
+    LoadDeferredSections();
 
     if (strCommand == "mnb") { //Masternode Broadcast
         CMasternodeBroadcast mnb;
@@ -942,6 +955,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
                     LogPrint("masternode", "dsee - Got updated entry for %s\n", vin.prevout.hash.ToString());
                     if (pmn->protocolVersion < GETHEADERS_VERSION) {
                         pmn->pubKeyMasternode = pubkey2;
+                        UpdateIndexes(vin);
                         pmn->sigTime = sigTime;
                         pmn->sig = vchSig;
                         pmn->protocolVersion = protocolVersion;
@@ -1139,7 +1153,10 @@ void CMasternodeMan::Remove(CTxIn vin)
     while (it != vMasternodes.end()) {
         if ((*it).vin == vin) {
             LogPrint("masternode", "CMasternodeMan: Removing Masternode %s - %i now\n", (*it).vin.prevout.hash.ToString(), size() - 1);
+            masternodeCollateralWatcher.Remove((*it).vin.prevout);
             vMasternodes.erase(it);
+            RebuildIndexes();
+            mapScores.clear();
             break;
         }
         ++it;
@@ -1165,6 +1182,71 @@ void CMasternodeMan::UpdateMasternodeList(CMasternodeBroadcast mnb)
     }
 }
 
+void CMasternodeMan::WriteSnapshot(CSnapshotDB& snapshot)
+{
+    LOCK(cs);
+
+    // relay state not read yet is kept as it is on disk, unless entries were added since
+    if (snapshotDeferred && !(mAskedUsForMasternodeList.empty() && mWeAskedForMasternodeList.empty() && mWeAskedForMasternodeListEntry.empty() &&
+                                mapSeenMasternodeBroadcast.empty() && mapSeenMasternodePing.empty()))
+        LoadDeferredSections();
+
+    snapshot.AddSection(SNAPSHOT_MASTERNODES, vMasternodes);
+    snapshot.AddSection(SNAPSHOT_DSQ_COUNT, nDsqCount);
+    snapshot.AddMapSection(SNAPSHOT_ASKED_US, mAskedUsForMasternodeList, snapshotDeferred.get());
+    snapshot.AddMapSection(SNAPSHOT_WE_ASKED, mWeAskedForMasternodeList, snapshotDeferred.get());
+    snapshot.AddMapSection(SNAPSHOT_WE_ASKED_ENTRY, mWeAskedForMasternodeListEntry, snapshotDeferred.get());
+    snapshot.AddMapSection(SNAPSHOT_SEEN_BROADCASTS, mapSeenMasternodeBroadcast, snapshotDeferred.get());
+    snapshot.AddMapSection(SNAPSHOT_SEEN_PINGS, mapSeenMasternodePing, snapshotDeferred.get());
+}
+
+CSnapshotDB::ReadResult CMasternodeMan::ReadSnapshot(CSnapshotDB& snapshot)
+{
+    LOCK(cs);
+
+    CSnapshotDB::ReadResult result = snapshot.ReadSection(SNAPSHOT_MASTERNODES, vMasternodes);
+    if (result != CSnapshotDB::Ok) {
+        Clear();
+        return result;
+    }
+
+    // the rest can be rebuilt from the network, a damaged section only loses its own data
+    if (snapshot.ReadSection(SNAPSHOT_DSQ_COUNT, nDsqCount) != CSnapshotDB::Ok) nDsqCount = 0;
+
+    // the relay state is only needed once the chain is synced, see LoadDeferredSections
+    snapshotDeferred.reset(new CSnapshotDB(snapshot));
+
+    mapScores.clear();
+    RebuildIndexes();
+    return CSnapshotDB::Ok;
+}
+
+void CMasternodeMan::LoadDeferredSections()
+{
+    LOCK(cs);
+    if (!snapshotDeferred)
+        return;
+    boost::scoped_ptr<CSnapshotDB> snapshot;
+    snapshot.swap(snapshotDeferred);
+
+    // entries added since startup are newer than the ones read, a damaged section only loses its own data
+    int64_t nStart = GetTimeMillis();
+    snapshot->MergeSection(SNAPSHOT_ASKED_US, mAskedUsForMasternodeList);
+    snapshot->MergeSection(SNAPSHOT_WE_ASKED, mWeAskedForMasternodeList);
+    snapshot->MergeSection(SNAPSHOT_WE_ASKED_ENTRY, mWeAskedForMasternodeListEntry);
+    snapshot->MergeSection(SNAPSHOT_SEEN_PINGS, mapSeenMasternodePing);
+
+    // broadcasts of the masternodes removed at startup are forgotten, as CheckAndRemove does
+    map<uint256, CMasternodeBroadcast> mapSeen;
+    if (snapshot->MergeSection(SNAPSHOT_SEEN_BROADCASTS, mapSeen) == CSnapshotDB::Ok) {
+        for (map<uint256, CMasternodeBroadcast>::iterator it = mapSeen.begin(); it != mapSeen.end(); ++it)
+            if (Find(it->second.vin))
+                mapSeenMasternodeBroadcast.insert(*it);
+    }
+
+    LogPrint("masternode", "Loaded relay state from %s  %dms\n", snapshot->GetFilename(), GetTimeMillis() - nStart);
+}
+
 std::string CMasternodeMan::ToString() const
 {
     std::ostringstream info;
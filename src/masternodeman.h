@@ -11,11 +11,15 @@
 #include "main.h"
 #include "masternode.h"
 #include "net.h"
+#include "snapshotdb.h"
 #include "sync.h"
 #include "util.h"
 
+#include <boost/scoped_ptr.hpp>
+
 #define MASTERNODES_DUMP_SECONDS (15 * 60)
 #define MASTERNODES_DSEG_SECONDS (3 * 60 * 60)
+#define MASTERNODES_SCORE_CACHE_SIZE 32
 
 using namespace std;
 
@@ -26,28 +30,25 @@ void DumpMasternodes();
 
 /** Access to the MN database (mncache.dat)
  */
-class CMasternodeDB
+class CMasternodeDB : public CSnapshotDB
 {
-private:
-    boost::filesystem::path pathMN;
-    std::string strMagicMessage;
-
 public:
-    enum ReadResult {
-        Ok,
-        FileError,
-        HashReadError,
-        IncorrectHash,
-        IncorrectMagicMessage,
-        IncorrectMagicNumber,
-        IncorrectFormat
-    };
-
     CMasternodeDB();
-    bool Write(const CMasternodeMan& mnodemanToSave);
+    bool Write(CMasternodeMan& mnodemanToSave);
     ReadResult Read(CMasternodeMan& mnodemanToLoad, bool fDryRun = false);
 };
 
+/** Scores of every masternode for one block, highest first, as (compact score, index into the list)
+ */
+class CMasternodeScores
+{
+public:
+    std::vector<std::pair<int64_t, size_t> > vScores;
+    uint64_t nLastUsed;
+
+    CMasternodeScores() : nLastUsed(0) {}
+};
+
 class CMasternodeMan
 {
 private:
@@ -66,6 +67,24 @@ private:
     // which Masternodes we've asked for
     std::map<COutPoint, int64_t> mWeAskedForMasternodeListEntry;
 
+    // positions in vMasternodes by collateral, masternode key and payee script, rebuilt whenever entries are erased
+    std::map<COutPoint, size_t> mapIndexByVin;
+    std::map<CPubKey, size_t> mapIndexByPubKey;
+    std::map<CScript, size_t> mapIndexByPayee;
+
+    void IndexMasternode(size_t nIndex);
+    void RebuildIndexes();
+
+    // score tables by block hash, the least recently used one is dropped past MASTERNODES_SCORE_CACHE_SIZE
+    std::map<uint256, CMasternodeScores> mapScores;
+    uint64_t nScoresUsed;
+
+    /// Get the score table for a block, building it if needed; NULL if the block is unknown
+    const std::vector<std::pair<int64_t, size_t> >* GetScores(int64_t nBlockHeight);
+
+    // mncache.dat as read at startup, while the relay state sections in it are not read yet
+    boost::scoped_ptr<CSnapshotDB> snapshotDeferred;
+
 public:
     // Keep track of all broadcasts I've seen
     map<uint256, CMasternodeBroadcast> mapSeenMasternodeBroadcast;
@@ -75,21 +94,21 @@ public:
     // keep track of dsq count to prevent masternodes from gaming obfuscation queue
     int64_t nDsqCount;
 
-    ADD_SERIALIZE_METHODS;
+    // sections of mncache.dat
+    enum {
+        SNAPSHOT_MASTERNODES = 1,
+        SNAPSHOT_DSQ_COUNT,
+        SNAPSHOT_ASKED_US,
+        SNAPSHOT_WE_ASKED,
+        SNAPSHOT_WE_ASKED_ENTRY,
+        SNAPSHOT_SEEN_BROADCASTS,
+        SNAPSHOT_SEEN_PINGS
+    };
 
-    template <typename Stream, typename Operation>
-    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
-    {
-        LOCK(cs);
-        READWRITE(vMasternodes);
-        READWRITE(mAskedUsForMasternodeList);
-        READWRITE(mWeAskedForMasternodeList);
-        READWRITE(mWeAskedForMasternodeListEntry);
-        READWRITE(nDsqCount);
-
-        READWRITE(mapSeenMasternodeBroadcast);
-        READWRITE(mapSeenMasternodePing);
-    }
+    void WriteSnapshot(CSnapshotDB& snapshot);
+    CSnapshotDB::ReadResult ReadSnapshot(CSnapshotDB& snapshot);
+    /// Read the relay state sections left out by ReadSnapshot, done on the first message once synced
+    void LoadDeferredSections();
 
     CMasternodeMan();
     CMasternodeMan(CMasternodeMan& other);
@@ -120,6 +139,9 @@ public:
     CMasternode* Find(const CTxIn& vin);
     CMasternode* Find(const CPubKey& pubKeyMasternode);
 
+    /// Index the keys of an entry again after they were changed in place
+    void UpdateIndexes(const CTxIn& vin);
+
     /// Find an entry in the masternode list that is next to be paid
     CMasternode* GetNextMasternodeInQueueForPayment(int nBlockHeight, bool fFilterSigTime, int& nCount);
 
@@ -24,7 +24,6 @@
 #include "masternode-payments.h"
 
 #include <boost/thread.hpp>
-#include <boost/tuple/tuple.hpp>
 
 using namespace std;
 
@@ -34,52 +33,443 @@ using namespace std;
 //
 
 //
-// Unconfirmed transactions in the memory pool often depend on other
-// transactions in the memory pool. When we select transactions from the
-// pool, we select by highest priority or fee rate, so we might consider
-// transactions that depend on transactions that aren't yet in the block.
-// The COrphan class keeps track of these 'temporary orphans' while
-// CreateBlock is figuring out which transactions to include.
+// Block assembly works on packages: a mempool transaction together with its
+// in-mempool ancestors that are not in the block yet. The mempool caches the
+// size, fees and sigops of every transaction with all its ancestors and keeps
+// them sorted by the resulting fee rate, so the best package is found without
+// walking the dependency graph. Once a package is in the block, the cached
+// state of its descendants overstates what they still need; those are tracked
+// with adjusted values in a CTxMemPoolModifiedEntry while the block is filled.
 //
-class COrphan
+struct CTxMemPoolModifiedEntry {
+    CTxMemPoolModifiedEntry(CTxMemPool::txiter entry)
+    {
+        iter = entry;
+        nSizeWithAncestors = entry->GetSizeWithAncestors();
+        nModFeesWithAncestors = entry->GetModFeesWithAncestors();
+        nSigOpCountWithAncestors = entry->GetSigOpCountWithAncestors();
+    }
+
+    CTxMemPool::txiter iter;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
+    unsigned int nSigOpCountWithAncestors;
+};
+
+// Same order as the ancestor_score index of the mempool
+class CompareModifiedEntry
 {
 public:
-    const CTransaction* ptx;
-    set<uint256> setDependsOn;
-    CFeeRate feeRate;
-    double dPriority;
+    bool operator()(const CTxMemPoolModifiedEntry& a, const CTxMemPoolModifiedEntry& b) const
+    {
+        double f1 = (double)a.nModFeesWithAncestors * b.nSizeWithAncestors;
+        double f2 = (double)b.nModFeesWithAncestors * a.nSizeWithAncestors;
+        if (f1 == f2)
+            return CTxMemPool::CompareIteratorByHash()(a.iter, b.iter);
+        return f1 > f2;
+    }
+};
+
+// Parents before children, every transaction has more ancestors than its parents
+class CompareTxIterByAncestorCount
+{
+public:
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
+    {
+        if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        return CTxMemPool::CompareIteratorByHash()(a, b);
+    }
+};
 
-    COrphan(const CTransaction* ptxIn) : ptx(ptxIn), feeRate(0), dPriority(0)
+struct modifiedentry_iter {
+    typedef CTxMemPool::txiter result_type;
+    result_type operator()(const CTxMemPoolModifiedEntry& entry) const
     {
+        return entry.iter;
     }
 };
 
+typedef boost::multi_index_container<
+    CTxMemPoolModifiedEntry,
+    boost::multi_index::indexed_by<
+        boost::multi_index::ordered_unique<
+            modifiedentry_iter,
+            CTxMemPool::CompareIteratorByHash>,
+        // sorted by fee rate with the remaining ancestors, highest first
+        boost::multi_index::ordered_non_unique<
+            boost::multi_index::tag<ancestor_score>,
+            boost::multi_index::identity<CTxMemPoolModifiedEntry>,
+            CompareModifiedEntry> > >
+    indexed_modified_transaction_set;
+
+typedef indexed_modified_transaction_set::nth_index<0>::type::iterator modtxiter;
+typedef indexed_modified_transaction_set::index<ancestor_score>::type::iterator modtxscoreiter;
+
+struct update_for_parent_inclusion {
+    update_for_parent_inclusion(CTxMemPool::txiter it) : iter(it) {}
+
+    void operator()(CTxMemPoolModifiedEntry& e)
+    {
+        e.nModFeesWithAncestors -= iter->GetModifiedFee();
+        e.nSizeWithAncestors -= iter->GetTxSize();
+        e.nSigOpCountWithAncestors -= iter->GetSigOpCount();
+    }
+
+    CTxMemPool::txiter iter;
+};
+
 uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockSize = 0;
 int64_t nLastCoinStakeSearchInterval = 0;
 
-// We want to sort transactions by priority and fee rate, so:
-typedef boost::tuple<double, CFeeRate, const CTransaction*> TxPriority;
-class TxPriorityCompare
+// We want to sort transactions by priority, so:
+typedef std::pair<double, CTxMemPool::txiter> TxCoinAgePriority;
+class TxCoinAgePriorityCompare
 {
-    bool byFee;
-
 public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) {}
+    bool operator()(const TxCoinAgePriority& a, const TxCoinAgePriority& b)
+    {
+        if (a.first == b.first)
+            return CompareTxMemPoolEntryByAncestorFee()(*b.second, *a.second); // lower fee rate last
+        return a.first < b.first;
+    }
+};
 
-    bool operator()(const TxPriority& a, const TxPriority& b)
+/** Fills the transactions of a block template from the mempool, cs_main and mempool.cs must be held */
+class CBlockAssembler
+{
+private:
+    CBlockTemplate* pblocktemplate;
+    CBlock* pblock;
+    CCoinsViewCache& view;
+    int nHeight;
+    unsigned int nBlockMaxSize;
+    unsigned int nBlockMinSize;
+    bool fPrintPriority;
+
+    // Information on the current status of the block
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    unsigned int nBlockSigOps;
+    CAmount nFees;
+    CTxMemPool::setEntries inBlock;
+
+public:
+    CBlockAssembler(CBlockTemplate* pblocktemplateIn, CCoinsViewCache& viewIn, int nHeightIn, unsigned int nBlockMaxSizeIn, unsigned int nBlockMinSizeIn)
+        : pblocktemplate(pblocktemplateIn), pblock(&pblocktemplateIn->block), view(viewIn), nHeight(nHeightIn),
+          nBlockMaxSize(nBlockMaxSizeIn), nBlockMinSize(nBlockMinSizeIn), nBlockSize(1000), nBlockTx(0), nBlockSigOps(100), nFees(0)
     {
-        if (byFee) {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
+        fPrintPriority = GetBoolArg("-printpriority", false);
+    }
+
+    /** Add a transaction checked for this block before, only applying it to the view.
+     *  Returns false if its inputs are gone. */
+    bool AddCheckedTx(CTxMemPool::txiter it, CAmount nTxFees, unsigned int nTxSigOps);
+    /** Add transactions by coin age priority until nBlockPrioritySize is reached */
+    void AddPriorityTxs(unsigned int nBlockPrioritySize);
+    /** Add packages by fee rate with ancestors until the block is full */
+    void AddPackageTxs();
+
+    uint64_t GetBlockSize() const { return nBlockSize; }
+    uint64_t GetBlockTx() const { return nBlockTx; }
+    CAmount GetFees() const { return nFees; }
+
+private:
+    /** Append a transaction whose inputs are applied to the view already */
+    void AddToBlock(CTxMemPool::txiter it, CAmount nTxFees, unsigned int nTxSigOps);
+    /** Check a package, sorted parents first, and add it to the block. Nothing
+     *  is added if any transaction of the package fails. */
+    bool AddPackage(const std::vector<CTxMemPool::txiter>& vPackage);
+    /** Whether an in-mempool parent of the entry is not in the block yet */
+    bool IsStillDependent(CTxMemPool::txiter iter) const;
+    /** Reduce the ancestor state of the descendants of newly added transactions */
+    void UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set& mapModifiedTx) const;
+    /** Whether an entry of the ancestor_score index is to be skipped, see AddPackageTxs */
+    bool SkipMapTxEntry(CTxMemPool::txiter it, const indexed_modified_transaction_set& mapModifiedTx, const CTxMemPool::setEntries& failedTx) const;
+};
+
+void CBlockAssembler::AddToBlock(CTxMemPool::txiter it, CAmount nTxFees, unsigned int nTxSigOps)
+{
+    pblock->vtx.push_back(it->GetTx());
+    pblocktemplate->vTxFees.push_back(nTxFees);
+    pblocktemplate->vTxSigOps.push_back(nTxSigOps);
+    nBlockSize += it->GetTxSize();
+    ++nBlockTx;
+    nBlockSigOps += nTxSigOps;
+    nFees += nTxFees;
+    inBlock.insert(it);
+}
+
+bool CBlockAssembler::AddCheckedTx(CTxMemPool::txiter it, CAmount nTxFees, unsigned int nTxSigOps)
+{
+    const CTransaction& tx = it->GetTx();
+    if (!view.HaveInputs(tx))
+        return false;
+
+    CValidationState state;
+    CTxUndo txundo;
+    UpdateCoins(tx, state, view, txundo, nHeight);
+    AddToBlock(it, nTxFees, nTxSigOps);
+    return true;
+}
+
+bool CBlockAssembler::AddPackage(const std::vector<CTxMemPool::txiter>& vPackage)
+{
+    // Work on a view of our own so a failure part way leaves the block untouched
+    CCoinsViewCache viewPackage(&view);
+    uint64_t nPackageSize = 0;
+    unsigned int nPackageSigOps = 0;
+    std::vector<CAmount> vTxFees;
+    std::vector<unsigned int> vTxSigOps;
+    BOOST_FOREACH (CTxMemPool::txiter it, vPackage) {
+        const CTransaction& tx = it->GetTx();
+        if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
+            return false;
+
+        // Size limits
+        nPackageSize += it->GetTxSize();
+        if (nBlockSize + nPackageSize >= nBlockMaxSize)
+            return false;
+
+        if (!viewPackage.HaveInputs(tx))
+            return false;
+
+        // Limits on sigOps, counted from the transaction itself
+        unsigned int nTxSigOps = GetLegacySigOpCount(tx) + GetP2SHSigOpCount(tx, viewPackage);
+        nPackageSigOps += nTxSigOps;
+        if (nBlockSigOps + nPackageSigOps >= MAX_BLOCK_SIGOPS)
+            return false;
+
+        // Note that flags: we don't want to set mempool/IsStandard()
+        // policy here, but we still have to ensure that the block we
+        // create only contains transactions that are valid in new blocks.
+        CValidationState state;
+        if (!CheckInputs(tx, state, viewPackage, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
+            return false;
+
+        vTxFees.push_back(viewPackage.GetValueIn(tx) - tx.GetValueOut());
+        vTxSigOps.push_back(nTxSigOps);
+
+        CTxUndo txundo;
+        UpdateCoins(tx, state, viewPackage, txundo, nHeight);
+    }
+    viewPackage.Flush();
+
+    // Added
+    for (unsigned int i = 0; i < vPackage.size(); i++) {
+        CTxMemPool::txiter it = vPackage[i];
+        AddToBlock(it, vTxFees[i], vTxSigOps[i]);
+
+        if (fPrintPriority) {
+            LogPrintf("fee %s txid %s\n",
+                CFeeRate(it->GetModifiedFee(), it->GetTxSize()).ToString(), it->GetTx().GetHash().ToString());
+        }
+    }
+    return true;
+}
+
+bool CBlockAssembler::IsStillDependent(CTxMemPool::txiter iter) const
+{
+    BOOST_FOREACH (CTxMemPool::txiter parent, mempool.GetMemPoolParents(iter)) {
+        if (!inBlock.count(parent))
+            return true;
+    }
+    return false;
+}
+
+void CBlockAssembler::AddPriorityTxs(unsigned int nBlockPrioritySize)
+{
+    if (nBlockPrioritySize == 0)
+        return;
+
+    // Transactions wait here until all their in-mempool parents are in the block
+    std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash> mapWaitPriority;
+
+    // This vector will be sorted into a priority queue:
+    std::vector<TxCoinAgePriority> vecPriority;
+    TxCoinAgePriorityCompare comparer;
+    vecPriority.reserve(mempool.mapTx.size());
+    for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin();
+         mi != mempool.mapTx.end(); ++mi) {
+        double dPriority = mi->GetPriority(nHeight);
+        CAmount dummy;
+        mempool.ApplyDeltas(mi->GetTx().GetHash(), dPriority, dummy);
+        vecPriority.push_back(TxCoinAgePriority(dPriority, mi));
+    }
+    std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+
+    while (!vecPriority.empty()) {
+        // Take highest priority transaction off the priority queue:
+        double dPriority = vecPriority.front().first;
+        CTxMemPool::txiter iter = vecPriority.front().second;
+        std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
+        vecPriority.pop_back();
+
+        // Has to wait for dependencies
+        if (IsStillDependent(iter)) {
+            mapWaitPriority.insert(std::make_pair(iter, dPriority));
+            continue;
+        }
+
+        if (!AddPackage(std::vector<CTxMemPool::txiter>(1, iter)))
+            continue;
+
+        if (fPrintPriority)
+            LogPrintf("priority %.1f txid %s\n", dPriority, iter->GetTx().GetHash().ToString());
+
+        // Continue by fee rate once past the priority size or we run out of
+        // high-priority transactions
+        if (nBlockSize >= nBlockPrioritySize || !AllowFree(dPriority))
+            return;
+
+        // Add transactions that depend on this one to the priority queue
+        BOOST_FOREACH (CTxMemPool::txiter child, mempool.GetMemPoolChildren(iter)) {
+            std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash>::iterator wpiter = mapWaitPriority.find(child);
+            if (wpiter != mapWaitPriority.end()) {
+                vecPriority.push_back(TxCoinAgePriority(wpiter->second, child));
+                std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                mapWaitPriority.erase(wpiter);
+            }
+        }
+    }
+}
+
+void CBlockAssembler::UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set& mapModifiedTx) const
+{
+    BOOST_FOREACH (const CTxMemPool::txiter it, alreadyAdded) {
+        CTxMemPool::setEntries descendants;
+        mempool.CalculateDescendants(it, descendants);
+        // Insert all descendants (not yet in block) into the modified set
+        BOOST_FOREACH (CTxMemPool::txiter desc, descendants) {
+            if (alreadyAdded.count(desc))
+                continue;
+            modtxiter mit = mapModifiedTx.find(desc);
+            if (mit == mapModifiedTx.end()) {
+                CTxMemPoolModifiedEntry modEntry(desc);
+                modEntry.nSizeWithAncestors -= it->GetTxSize();
+                modEntry.nModFeesWithAncestors -= it->GetModifiedFee();
+                modEntry.nSigOpCountWithAncestors -= it->GetSigOpCount();
+                mapModifiedTx.insert(modEntry);
+            } else {
+                mapModifiedTx.modify(mit, update_for_parent_inclusion(it));
+            }
+        }
+    }
+}
+
+bool CBlockAssembler::SkipMapTxEntry(CTxMemPool::txiter it, const indexed_modified_transaction_set& mapModifiedTx, const CTxMemPool::setEntries& failedTx) const
+{
+    // Entries in mapModifiedTx are considered with their adjusted state
+    return mapModifiedTx.count(it) || inBlock.count(it) || failedTx.count(it);
+}
+
+void CBlockAssembler::AddPackageTxs()
+{
+    // Descendants of transactions in the block, with the state of the
+    // ancestors in the block taken out
+    indexed_modified_transaction_set mapModifiedTx;
+    // Entries of mapModifiedTx that failed, so they are not retried from mapTx
+    CTxMemPool::setEntries failedTx;
+
+    // Start by adding all descendants of previously added txs to mapModifiedTx
+    UpdatePackagesForAdded(inBlock, mapModifiedTx);
+
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi = mempool.mapTx.get<ancestor_score>().begin();
+    CTxMemPool::txiter iter;
+    while (mi != mempool.mapTx.get<ancestor_score>().end() || !mapModifiedTx.empty()) {
+        if (mi != mempool.mapTx.get<ancestor_score>().end() &&
+            SkipMapTxEntry(mempool.mapTx.project<0>(mi), mapModifiedTx, failedTx)) {
+            ++mi;
+            continue;
+        }
+
+        // Take the better of the next mapTx entry and the best entry of mapModifiedTx
+        bool fUsingModified = false;
+        modtxscoreiter modit = mapModifiedTx.get<ancestor_score>().begin();
+        if (mi == mempool.mapTx.get<ancestor_score>().end()) {
+            iter = modit->iter;
+            fUsingModified = true;
         } else {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
+            iter = mempool.mapTx.project<0>(mi);
+            if (modit != mapModifiedTx.get<ancestor_score>().end() &&
+                CompareModifiedEntry()(*modit, CTxMemPoolModifiedEntry(iter))) {
+                iter = modit->iter;
+                fUsingModified = true;
+            } else {
+                ++mi;
+            }
         }
+
+        // Skipped or removed from mapModifiedTx when added
+        assert(!inBlock.count(iter));
+
+        uint64_t nPackageSize = iter->GetSizeWithAncestors();
+        CAmount nPackageFees = iter->GetModFeesWithAncestors();
+        unsigned int nPackageSigOps = iter->GetSigOpCountWithAncestors();
+        if (fUsingModified) {
+            nPackageSize = modit->nSizeWithAncestors;
+            nPackageFees = modit->nModFeesWithAncestors;
+            nPackageSigOps = modit->nSigOpCountWithAncestors;
+        }
+
+        // Everything that follows pays a lower fee rate
+        if (nPackageFees < ::minRelayTxFee.GetFee(nPackageSize) && nBlockSize >= nBlockMinSize)
+            return;
+
+        if (nBlockSize + nPackageSize >= nBlockMaxSize || nBlockSigOps + nPackageSigOps >= MAX_BLOCK_SIGOPS) {
+            if (fUsingModified) {
+                mapModifiedTx.get<ancestor_score>().erase(modit);
+                failedTx.insert(iter);
+            }
+            continue;
+        }
+
+        CTxMemPool::setEntries ancestors;
+        mempool.CalculateAncestors(iter, ancestors);
+        std::vector<CTxMemPool::txiter> vPackage;
+        BOOST_FOREACH (CTxMemPool::txiter it, ancestors) {
+            if (!inBlock.count(it))
+                vPackage.push_back(it);
+        }
+        vPackage.push_back(iter);
+        std::sort(vPackage.begin(), vPackage.end(), CompareTxIterByAncestorCount());
+
+        if (!AddPackage(vPackage)) {
+            if (fUsingModified) {
+                mapModifiedTx.get<ancestor_score>().erase(modit);
+                failedTx.insert(iter);
+            }
+            continue;
+        }
+
+        CTxMemPool::setEntries setAdded(vPackage.begin(), vPackage.end());
+        BOOST_FOREACH (CTxMemPool::txiter it, setAdded)
+            mapModifiedTx.erase(it);
+
+        // Update transactions that depend on each of these
+        UpdatePackagesForAdded(setAdded, mapModifiedTx);
     }
-};
+}
+
+/** Size limits of a new block from -blockmaxsize, -blockprioritysize and -blockminsize */
+static void GetBlockSizeLimits(unsigned int& nBlockMaxSize, unsigned int& nBlockPrioritySize, unsigned int& nBlockMinSize)
+{
+    // Largest block you're willing to create:
+    nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
+    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
+    nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE - 1000), nBlockMaxSize));
+
+    // How much of the block should be dedicated to high-priority transactions,
+    // included regardless of the fees they pay
+    nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
+    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
+
+    // Minimum block size you want to create; block will be filled with free transactions
+    // until there are no more or the block reaches this size:
+    nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
+    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
+}
 
 void UpdateTime(CBlockHeader* pblock, const CBlockIndex* pindexPrev)
 {
@@ -88,6 +478,8 @@ void UpdateTime(CBlockHeader* pblock, const CBlockIndex* pindexPrev)
     // Updating time can change work required on testnet:
     if (Params().AllowMinDifficultyBlocks())
         pblock->nBits = GetNextWorkRequired(pindexPrev, pblock);
+
+    pblock->InvalidateHash();
 }
 
 CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet, bool fProofOfStake)
@@ -142,20 +534,8 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
             return NULL;
     }
 
-    // Largest block you're willing to create:
-    unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
-    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
-    nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE - 1000), nBlockMaxSize));
-
-    // How much of the block should be dedicated to high-priority transactions,
-    // included regardless of the fees they pay
-    unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
-    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
-
-    // Minimum block size you want to create; block will be filled with free transactions
-    // until there are no more or the block reaches this size:
-    unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
-    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
+    unsigned int nBlockMaxSize, nBlockPrioritySize, nBlockMinSize;
+    GetBlockSizeLimits(nBlockMaxSize, nBlockPrioritySize, nBlockMinSize);
 
     // Collect memory pool transactions into the block
     CAmount nFees = 0;
@@ -167,169 +547,14 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
         const int nHeight = pindexPrev->nHeight + 1;
         CCoinsViewCache view(pcoinsTip);
 
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        bool fPrintPriority = GetBoolArg("-printpriority", false);
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi) {
-            const CTransaction& tx = mi->second.GetTx();
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
-                continue;
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            CAmount nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH (const CTxIn& txin, tx.vin) {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash)) {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash)) {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan) {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
-
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = nHeight - coins->nHeight;
-
-                dPriority += (double)nValueIn * nConf;
-            }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
-
-            uint256 hash = tx.GetHash();
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
+        // High-priority transactions first, then packages by fee rate
+        CBlockAssembler assembler(pblocktemplate.get(), view, nHeight, nBlockMaxSize, nBlockMinSize);
+        assembler.AddPriorityTxs(nBlockPrioritySize);
+        assembler.AddPackageTxs();
 
-            CFeeRate feeRate(nTotalIn - tx.GetValueOut(), nTxSize);
-
-            if (porphan) {
-                porphan->dPriority = dPriority;
-                porphan->feeRate = feeRate;
-            } else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &mi->second.GetTx()));
-        }
-
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty()) {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            CAmount nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Prioritise by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority))) {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
-
-            if (!view.HaveInputs(tx))
-                continue;
-
-            CAmount nTxFees = view.GetValueIn(tx) - tx.GetValueOut();
-
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            CValidationState state;
-            if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
-                continue;
-
-            CTxUndo txundo;
-            UpdateCoins(tx, state, view, txundo, nHeight);
-
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            if (fPrintPriority) {
-                LogPrintf("priority %.1f fee %s txid %s\n",
-                    dPriority, feeRate.ToString(), tx.GetHash().ToString());
-            }
-
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash)) {
-                BOOST_FOREACH (COrphan* porphan, mapDependers[hash]) {
-                    if (!porphan->setDependsOn.empty()) {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty()) {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
-        }
+        uint64_t nBlockSize = assembler.GetBlockSize();
+        uint64_t nBlockTx = assembler.GetBlockTx();
+        nFees = assembler.GetFees();
 
         if (!fProofOfStake) {
             //Masternode and general budget payments
@@ -359,6 +584,7 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
             UpdateTime(pblock, pindexPrev);
         pblock->nBits = GetNextWorkRequired(pindexPrev, pblock);
         pblock->nNonce = 0;
+        pblock->InvalidateHash();
         pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(pblock->vtx[0]);
 
         CValidationState state;
@@ -371,6 +597,122 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
     return pblocktemplate.release();
 }
 
+CBlockTemplateCache blockTemplateCache;
+
+bool CBlockTemplateCache::PayeesChanged()
+{
+    CMutableTransaction txPayees;
+    txPayees.vout.resize(1);
+    txPayees.vout[0].scriptPubKey = ptemplate->block.vtx[0].vout[0].scriptPubKey;
+    FillBlockPayee(txPayees, 0, false, false);
+    return txPayees.vout != ptemplate->block.vtx[0].vout;
+}
+
+CBlockTemplate* CBlockTemplateCache::UpdateTransactions(const CBlockIndex* pindexPrev)
+{
+    LOCK(mempool.cs);
+
+    unsigned int nBlockMaxSize, nBlockPrioritySize, nBlockMinSize;
+    GetBlockSizeLimits(nBlockMaxSize, nBlockPrioritySize, nBlockMinSize);
+
+    // Same header and coinbase, the fees are filled in at the end
+    const CBlock& blockPrev = ptemplate->block;
+    auto_ptr<CBlockTemplate> pblocktemplate(new CBlockTemplate());
+    CBlock* pblock = &pblocktemplate->block;
+    *pblock = CBlock(blockPrev.GetBlockHeader());
+    pblock->payee = blockPrev.payee;
+    pblock->vtx.push_back(blockPrev.vtx[0]);
+    pblocktemplate->vTxFees.push_back(-1);
+    pblocktemplate->vTxSigOps.push_back(ptemplate->vTxSigOps[0]);
+
+    const int nHeight = pindexPrev->nHeight + 1;
+    CCoinsViewCache view(pcoinsTip);
+    CBlockAssembler assembler(pblocktemplate.get(), view, nHeight, nBlockMaxSize, nBlockMinSize);
+
+    // Keep the transactions still in the mempool, unless they spend one that is dropped.
+    // The block lists parents first, so a single pass finds all descendants.
+    std::set<uint256> setDropped;
+    for (unsigned int i = 1; i < blockPrev.vtx.size(); i++) {
+        const CTransaction& tx = blockPrev.vtx[i];
+        CTxMemPool::txiter it = mempool.mapTx.find(tx.GetHash());
+        bool fKeep = it != mempool.mapTx.end();
+        for (unsigned int j = 0; fKeep && j < tx.vin.size(); j++)
+            fKeep = !setDropped.count(tx.vin[j].prevout.hash);
+        if (!fKeep || !assembler.AddCheckedTx(it, ptemplate->vTxFees[i], ptemplate->vTxSigOps[i]))
+            setDropped.insert(tx.GetHash());
+    }
+
+    // New packages and the descendants of the kept transactions by fee rate
+    assembler.AddPackageTxs();
+    pblocktemplate->vTxFees[0] = -assembler.GetFees();
+    nLastBlockTx = assembler.GetBlockTx();
+    nLastBlockSize = assembler.GetBlockSize();
+
+    UpdateTime(pblock, pindexPrev);
+    pblock->nBits = GetNextWorkRequired(pindexPrev, pblock);
+    pblock->nNonce = 0;
+    pblock->InvalidateHash();
+
+    LogPrint("bench", "%s : %u transactions dropped, %u in block\n", __func__, setDropped.size(), pblock->vtx.size() - 1);
+    return pblocktemplate.release();
+}
+
+boost::shared_ptr<const CBlockTemplate> CBlockTemplateCache::Get(const CScript& scriptPubKeyIn, CWallet* pwallet, int64_t nRefreshInterval, unsigned int& nTransactionsUpdatedRet)
+{
+    LOCK2(cs_main, cs);
+
+    CBlockIndex* pindexPrev = chainActive.Tip();
+    int64_t nNow = GetTime();
+    bool fSameTip = ptemplate && hashPrevBlock == pindexPrev->GetBlockHash();
+    if (fSameTip && (GetBlockPayeesUpdated() != nPayeesUpdated || nNow - nTimePayees > nRefreshInterval)) {
+        // Winner votes, budgets, sporks and the masternode list change the payees without a new tip
+        nPayeesUpdated = GetBlockPayeesUpdated();
+        nTimePayees = nNow;
+        if (PayeesChanged()) {
+            LogPrint("bench", "%s : block payees changed\n", __func__);
+            fSameTip = false;
+        }
+    }
+
+    bool fUpdate = fSameTip && mempool.GetTransactionsUpdated() != nTransactionsUpdated && nNow - nTimeUpdated > nRefreshInterval;
+    if (!fSameTip || fUpdate) {
+        // Read the counters before selecting transactions, a change while building is caught next time
+        unsigned int nTransactionsUpdatedNew = mempool.GetTransactionsUpdated();
+        unsigned int nPayeesUpdatedNew = GetBlockPayeesUpdated();
+        int64_t nStart = GetTimeMicros();
+        CBlockTemplate* pblocktemplate = fUpdate ? UpdateTransactions(pindexPrev) : NULL;
+        if (pblocktemplate) {
+            LogPrint("bench", "%s : updated template in %.2fms\n", __func__, (GetTimeMicros() - nStart) * 0.001);
+        } else {
+            pblocktemplate = CreateNewBlock(scriptPubKeyIn, pwallet, false);
+            if (!pblocktemplate) {
+                ptemplate.reset();
+                return ptemplate;
+            }
+            LogPrint("bench", "%s : created template in %.2fms\n", __func__, (GetTimeMicros() - nStart) * 0.001);
+            hashPrevBlock = pindexPrev->GetBlockHash();
+            nPayeesUpdated = nPayeesUpdatedNew;
+            nTimePayees = nNow;
+        }
+        ptemplate.reset(pblocktemplate);
+        nTransactionsUpdated = nTransactionsUpdatedNew;
+        nTimeUpdated = nNow;
+    }
+
+    if (ptemplate->block.vtx[0].vout[0].scriptPubKey != scriptPubKeyIn) {
+        // Same transactions and payees, only the miner output changes
+        CBlockTemplate* pblocktemplate = new CBlockTemplate(*ptemplate);
+        CMutableTransaction txCoinbase(pblocktemplate->block.vtx[0]);
+        txCoinbase.vout[0].scriptPubKey = scriptPubKeyIn;
+        pblocktemplate->block.vtx[0] = txCoinbase;
+        pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(pblocktemplate->block.vtx[0]);
+        ptemplate.reset(pblocktemplate);
+    }
+
+    nTransactionsUpdatedRet = nTransactionsUpdated;
+    return ptemplate;
+}
+
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
 {
     // Update nExtraNonce
@@ -387,6 +729,7 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
 
     pblock->vtx[0] = txCoinbase;
     pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+    pblock->InvalidateHash();
 }
 
 #ifdef ENABLE_WALLET
@@ -492,7 +835,19 @@ void BitcoinMiner(CWallet* pwallet, bool fProofOfStake)
         if (!pindexPrev)
             continue;
 
-        auto_ptr<CBlockTemplate> pblocktemplate(CreateNewBlockWithKey(reservekey, pwallet, fProofOfStake));
+        auto_ptr<CBlockTemplate> pblocktemplate;
+        if (fProofOfStake) {
+            // The coinstake is found for every block, nothing to reuse
+            pblocktemplate.reset(CreateNewBlockWithKey(reservekey, pwallet, fProofOfStake));
+        } else {
+            CPubKey pubkey;
+            if (!reservekey.GetReservedKey(pubkey))
+                continue;
+            CScript scriptPubKey = CScript() << ToByteVector(pubkey) << OP_CHECKSIG;
+            boost::shared_ptr<const CBlockTemplate> ptemplate = blockTemplateCache.Get(scriptPubKey, pwallet, 60, nTransactionsUpdatedLast);
+            if (ptemplate)
+                pblocktemplate.reset(new CBlockTemplate(*ptemplate));
+        }
         if (!pblocktemplate.get())
             continue;
 
@@ -546,6 +901,7 @@ void BitcoinMiner(CWallet* pwallet, bool fProofOfStake)
                     break;
                 }
                 pblock->nNonce += 1;
+                pblock->InvalidateHash();
                 nHashesDone += 1;
                 if ((pblock->nNonce & 0xFF) == 0)
                     break;
@@ -6,13 +6,18 @@
 #ifndef BITCOIN_MINER_H
 #define BITCOIN_MINER_H
 
+#include "script/script.h"
+#include "sync.h"
+#include "uint256.h"
+
 #include <stdint.h>
 
+#include <boost/shared_ptr.hpp>
+
 class CBlock;
 class CBlockHeader;
 class CBlockIndex;
 class CReserveKey;
-class CScript;
 class CWallet;
 
 struct CBlockTemplate;
@@ -29,6 +34,52 @@ void UpdateTime(CBlockHeader* block, const CBlockIndex* pindexPrev);
 
 void BitcoinMiner(CWallet* pwallet, bool fProofOfStake);
 
+/**
+ * Last proof-of-work block template built on the current tip, handed out to
+ * everybody until it is outdated. Callers asking for another coinbase script
+ * get a copy paying the miner output to theirs.
+ *
+ * The transactions are selected from scratch for a new tip or new block
+ * payees only. A change of the mempool updates the selection, no more often
+ * than the refresh interval asked for: transactions that left the mempool
+ * are dropped together with their descendants in the block, the others are
+ * kept without being checked again, and new packages are added by fee rate
+ * into the space left.
+ *
+ * The payees are worked out again, without logging, when a winner vote, a
+ * finalized budget or a spork changed, and once per refresh interval for
+ * changes of the masternode list.
+ *
+ * Templates are never modified once handed out, callers copy the block
+ * before changing it.
+ */
+class CBlockTemplateCache
+{
+private:
+    CCriticalSection cs;
+    boost::shared_ptr<const CBlockTemplate> ptemplate;
+    uint256 hashPrevBlock;
+    unsigned int nTransactionsUpdated;
+    unsigned int nPayeesUpdated;
+    int64_t nTimeUpdated;
+    int64_t nTimePayees;
+
+    /** Whether the payees of the next block differ from those of the template */
+    bool PayeesChanged();
+    /** The template with its transactions updated to the mempool, NULL if they have to be selected again */
+    CBlockTemplate* UpdateTransactions(const CBlockIndex* pindexPrev);
+
+public:
+    CBlockTemplateCache() : nTransactionsUpdated(0), nPayeesUpdated(0), nTimeUpdated(0), nTimePayees(0) {}
+
+    /** Get the template for the current tip, empty if it could not be built.
+     *  nTransactionsUpdatedRet is set to the mempool counter the template reflects. */
+    boost::shared_ptr<const CBlockTemplate> Get(const CScript& scriptPubKeyIn, CWallet* pwallet, int64_t nRefreshInterval, unsigned int& nTransactionsUpdatedRet);
+};
+
+/** Template cache shared by getblocktemplate and the miner threads */
+extern CBlockTemplateCache blockTemplateCache;
+
 extern double dHashesPerSec;
 extern int64_t nHPSTimerStart;
 
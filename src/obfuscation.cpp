@@ -2161,21 +2161,114 @@ bool CObfuScationSigner::SignMessage(std::string strMessage, std::string& errorM
 }
 
 bool CObfuScationSigner::VerifyMessage(CPubKey pubkey, vector<unsigned char>& vchSig, std::string strMessage, std::string& errorMessage)
+{
+    CKeyID keyID;
+    if (!RecoverMessageKey(GetMessageHash(strMessage), vchSig, keyID)) {
+        errorMessage = _("Error recovering public key.");
+        return false;
+    }
+
+    if (fDebug && keyID != pubkey.GetID())
+        LogPrintf("CObfuScationSigner::VerifyMessage -- keys don't match: %s %s\n", keyID.ToString(), pubkey.GetID().ToString());
+
+    return (keyID == pubkey.GetID());
+}
+
+uint256 CObfuScationSigner::GetMessageHash(const std::string& strMessage)
 {
     CHashWriter ss(SER_GETHASH, 0);
     ss << strMessageMagic;
     ss << strMessage;
+    return ss.GetHash();
+}
+
+namespace
+{
+/**
+ * Keys recovered from message signatures. Pings, broadcasts and votes are relayed by every peer and
+ * checked again on the way, and CSignedMessageCheck fills this in ahead of the message handlers.
+ */
+class CMessageKeyCache
+{
+private:
+    CCriticalSection cs;
+    //! Hash of (message hash, signature) to the key it recovers to
+    std::map<uint256, CKeyID> mapKeys;
+
+    static uint256 GetEntryHash(const uint256& hash, const std::vector<unsigned char>& vchSig)
+    {
+        CHashWriter ss(SER_GETHASH, 0);
+        ss << hash;
+        ss << vchSig;
+        return ss.GetHash();
+    }
+
+public:
+    bool Get(const uint256& hash, const std::vector<unsigned char>& vchSig, CKeyID& keyIDRet)
+    {
+        uint256 hashEntry = GetEntryHash(hash, vchSig);
+        LOCK(cs);
+        std::map<uint256, CKeyID>::const_iterator it = mapKeys.find(hashEntry);
+        if (it == mapKeys.end())
+            return false;
+        keyIDRet = it->second;
+        return true;
+    }
+
+    void Set(const uint256& hash, const std::vector<unsigned char>& vchSig, const CKeyID& keyID)
+    {
+        uint256 hashEntry = GetEntryHash(hash, vchSig);
+        LOCK(cs);
+        // Evict a random entry, see CSignatureCache
+        while (mapKeys.size() >= MESSAGE_KEY_CACHE_SIZE) {
+            std::map<uint256, CKeyID>::iterator it = mapKeys.lower_bound(GetRandHash());
+            if (it == mapKeys.end())
+                it = mapKeys.begin();
+            mapKeys.erase(it);
+        }
+        mapKeys[hashEntry] = keyID;
+    }
+};
+
+CMessageKeyCache messageKeyCache;
+} // namespace
+
+bool CObfuScationSigner::RecoverMessageKey(const uint256& hash, const std::vector<unsigned char>& vchSig, CKeyID& keyIDRet)
+{
+    if (messageKeyCache.Get(hash, vchSig, keyIDRet))
+        return true;
 
     CPubKey pubkey2;
-    if (!pubkey2.RecoverCompact(ss.GetHash(), vchSig)) {
-        errorMessage = _("Error recovering public key.");
+    if (!pubkey2.RecoverCompact(hash, vchSig))
         return false;
-    }
 
-    if (fDebug && pubkey2.GetID() != pubkey.GetID())
-        LogPrintf("CObfuScationSigner::VerifyMessage -- keys don't match: %s %s\n", pubkey2.GetID().ToString(), pubkey.GetID().ToString());
+    keyIDRet = pubkey2.GetID();
+    messageKeyCache.Set(hash, vchSig, keyIDRet);
+    return true;
+}
 
-    return (pubkey2.GetID() == pubkey.GetID());
+bool CObfuScationSigner::GetCachedMessageKey(const uint256& hash, const std::vector<unsigned char>& vchSig, CKeyID& keyIDRet)
+{
+    return messageKeyCache.Get(hash, vchSig, keyIDRet);
+}
+
+CSignedMessageCheck::CSignedMessageCheck(const std::string& strMessage, const std::vector<unsigned char>& vchSigIn) : vchSig(vchSigIn)
+{
+    hash = obfuScationSigner.GetMessageHash(strMessage);
+}
+
+bool CSignedMessageCheck::IsCached() const
+{
+    CKeyID keyID;
+    return obfuScationSigner.GetCachedMessageKey(hash, vchSig, keyID);
+}
+
+bool CSignedMessageCheck::operator()()
+{
+    // a signature that doesn't recover is rejected by the message handler itself, don't stop the batch
+    CKeyID keyID;
+    obfuScationSigner.RecoverMessageKey(hash, vchSig, keyID);
+    return true;
 }
 
 bool CObfuscationQueue::Sign()
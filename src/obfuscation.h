@@ -41,6 +41,9 @@ class CActiveMasternode;
 #define OBFUSCATION_QUEUE_TIMEOUT 30
 #define OBFUSCATION_SIGNING_TIMEOUT 15
 
+// recovered message signature keys to remember
+#define MESSAGE_KEY_CACHE_SIZE 50000
+
 // used for anonymous relaying of inputs/outputs/sigs
 #define OBFUSCATION_RELAY_IN 1
 #define OBFUSCATION_RELAY_OUT 2
@@ -242,6 +245,31 @@ public:
     int64_t sigTime;
 };
 
+/** Recovers the key behind a signed message ahead of time, so that the CObfuScationSigner::VerifyMessage
+ *  call made while processing the message is answered from the cache
+ */
+class CSignedMessageCheck
+{
+private:
+    uint256 hash;
+    std::vector<unsigned char> vchSig;
+
+public:
+    CSignedMessageCheck() {}
+    CSignedMessageCheck(const std::string& strMessage, const std::vector<unsigned char>& vchSigIn);
+
+    /// Whether the key is already known, so there is nothing left to check
+    bool IsCached() const;
+
+    bool operator()();
+
+    void swap(CSignedMessageCheck& check)
+    {
+        std::swap(hash, check.hash);
+        vchSig.swap(check.vchSig);
+    }
+};
+
 /** Helper object for signing and checking signatures
  */
 class CObfuScationSigner
@@ -257,6 +285,12 @@ public:
     bool SignMessage(std::string strMessage, std::string& errorMessage, std::vector<unsigned char>& vchSig, CKey key);
     /// Verify the message, returns true if succcessful
     bool VerifyMessage(CPubKey pubkey, std::vector<unsigned char>& vchSig, std::string strMessage, std::string& errorMessage);
+    /// Hash that is signed for a message
+    uint256 GetMessageHash(const std::string& strMessage);
+    /// Recover the key that signed a message hash, returns true if successful; results are cached
+    bool RecoverMessageKey(const uint256& hash, const std::vector<unsigned char>& vchSig, CKeyID& keyIDRet);
+    /// Look up a key recovered before
+    bool GetCachedMessageKey(const uint256& hash, const std::vector<unsigned char>& vchSig, CKeyID& keyIDRet);
 };
 
 /** Used to keep track of current status of Obfuscation pool
@@ -12,9 +12,34 @@
 #include "utilstrencodings.h"
 #include "util.h"
 
+#include <atomic>
+
+static std::atomic<uint64_t> nBlockHashCount(0);
+
 uint256 CBlockHeader::GetHash() const
 {
-    return HashQuark(BEGIN(nVersion), END(nNonce));
+    if (!fHashCached) {
+        hashCached = HashQuark(BEGIN(nVersion), END(nNonce));
+        fHashCached = true;
+        nBlockHashCount++;
+    }
+    return hashCached;
+}
+
+void CBlockHeader::GetHashes(const std::vector<CBlockHeader>& vHeaders, std::vector<uint256>& vHashesRet)
+{
+    std::vector<const unsigned char*> vData(vHeaders.size());
+    for (size_t i = 0; i < vHeaders.size(); i++)
+        vData[i] = (const unsigned char*)BEGIN(vHeaders[i].nVersion);
+    vHashesRet.resize(vHeaders.size());
+    if (!vHeaders.empty())
+        HashQuarkMulti(&vData[0], END(vHeaders[0].nNonce) - BEGIN(vHeaders[0].nVersion), &vHashesRet[0], vHeaders.size());
+    nBlockHashCount += vHeaders.size();
+}
+
+uint64_t GetBlockHashCount()
+{
+    return nBlockHashCount;
 }
 
 uint256 CBlock::BuildMerkleTree(bool* fMutated) const
@@ -80,6 +105,31 @@ uint256 CBlock::BuildMerkleTree(bool* fMutated) const
     return (vMerkleTree.empty() ? uint256() : vMerkleTree.back());
 }
 
+uint256 CBlock::GetMerkleRoot(bool* fMutated) const
+{
+    size_t nNodes = vtx.size();
+    for (size_t nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
+        nNodes += (nSize + 1) / 2;
+    bool fBuilt = vMerkleTree.size() == nNodes;
+    for (size_t i = 0; fBuilt && i < vtx.size(); i++)
+        fBuilt = vMerkleTree[i] == vtx[i].GetHash();
+    if (!fBuilt)
+        return BuildMerkleTree(fMutated);
+
+    if (fMutated) {
+        // Same detection as in BuildMerkleTree: two identical hashes at the end of a level
+        bool mutated = false;
+        int j = 0;
+        for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2) {
+            if (nSize % 2 == 0 && vMerkleTree[j + nSize - 2] == vMerkleTree[j + nSize - 1])
+                mutated = true;
+            j += nSize;
+        }
+        *fMutated = mutated;
+    }
+    return (vMerkleTree.empty() ? uint256() : vMerkleTree.back());
+}
+
 std::vector<uint256> CBlock::GetMerkleBranch(int nIndex) const
 {
     if (vMerkleTree.empty())
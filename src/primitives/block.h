@@ -23,6 +23,11 @@ static const unsigned int MAX_BLOCK_SIZE = 1000000;
  */
 class CBlockHeader
 {
+private:
+    /** Memory only. */
+    mutable uint256 hashCached;
+    mutable bool fHashCached;
+
 public:
     // header
     static const int32_t CURRENT_VERSION=3;
@@ -49,6 +54,8 @@ public:
         READWRITE(nTime);
         READWRITE(nBits);
         READWRITE(nNonce);
+        if (ser_action.ForRead())
+            InvalidateHash();
     }
 
     void SetNull()
@@ -59,6 +66,7 @@ public:
         nTime = 0;
         nBits = 0;
         nNonce = 0;
+        InvalidateHash();
     }
 
     bool IsNull() const
@@ -66,8 +74,21 @@ public:
         return (nBits == 0);
     }
 
+    /** The Quark hash of the header. Computed on first use and cached until InvalidateHash() is called. */
     uint256 GetHash() const;
 
+    /**
+     * Forget the cached hash. Must be called after changing any header field in
+     * place; deserialization and SetNull() do this themselves.
+     */
+    void InvalidateHash()
+    {
+        fHashCached = false;
+    }
+
+    /** Compute GetHash() of every header in vHeaders at once, hashing several headers in parallel where the CPU allows. */
+    static void GetHashes(const std::vector<CBlockHeader>& vHeaders, std::vector<uint256>& vHashesRet);
+
     int64_t GetBlockTime() const
     {
         return (int64_t)nTime;
@@ -120,14 +141,8 @@ public:
 
     CBlockHeader GetBlockHeader() const
     {
-        CBlockHeader block;
-        block.nVersion       = nVersion;
-        block.hashPrevBlock  = hashPrevBlock;
-        block.hashMerkleRoot = hashMerkleRoot;
-        block.nTime          = nTime;
-        block.nBits          = nBits;
-        block.nNonce         = nNonce;
-        return block;
+        // Copying the base keeps the cached hash
+        return *this;
     }
 
     // ppcoin: two types of block: proof-of-work or proof-of-stake
@@ -155,6 +170,11 @@ public:
     // merkle root).
     uint256 BuildMerkleTree(bool* mutated = NULL) const;
 
+    // Like BuildMerkleTree(), but the in-memory merkle tree is used as it is when it
+    // was built from the current transactions, so a block whose tree was built on
+    // another thread is not hashed again.
+    uint256 GetMerkleRoot(bool* mutated = NULL) const;
+
     std::vector<uint256> GetMerkleBranch(int nIndex) const;
     static uint256 CheckMerkleBranch(uint256 hash, const std::vector<uint256>& vMerkleBranch, int nIndex);
     std::string ToString() const;
@@ -197,4 +217,7 @@ struct CBlockLocator
     }
 };
 
+/** Number of block header Quark hashes computed by this process so far. */
+uint64_t GetBlockHashCount();
+
 #endif // BITCOIN_PRIMITIVES_BLOCK_H
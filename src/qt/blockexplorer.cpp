@@ -406,7 +406,7 @@ std::string AddressToString(const CBitcoinAddress& Address)
             CBlock block;
             uint256 bhash = block.GetHash();
             GetTransaction(pos.nTxOffset, tx, bhash);
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
+            BlockMap::iterator mi = mapBlockIndex.find(block.GetHash());
             if (mi == mapBlockIndex.end())
                 continue;
             CBlockIndex* pindex = (*mi).second;
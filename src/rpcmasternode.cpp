@@ -275,6 +275,7 @@ Value listmasternodes(const Array& params, bool fHelp)
         nHeight = pindex->nHeight;
     }
     std::vector<pair<int, CMasternode> > vMasternodeRanks = mnodeman.GetMasternodeRanks(nHeight);
+    int nMnCount = mnodeman.CountEnabled();
     BOOST_FOREACH (PAIRTYPE(int, CMasternode) & s, vMasternodeRanks) {
         Object obj;
         std::string strVin = s.second.vin.prevout.ToStringShort();
@@ -304,7 +305,7 @@ Value listmasternodes(const Array& params, bool fHelp)
             obj.push_back(Pair("version", mn->protocolVersion));
             obj.push_back(Pair("lastseen", (int64_t)mn->lastPing.sigTime));
             obj.push_back(Pair("activetime", (int64_t)(mn->lastPing.sigTime - mn->sigTime)));
-            obj.push_back(Pair("lastpaid", (int64_t)mn->GetLastPaid()));
+            obj.push_back(Pair("lastpaid", (int64_t)mn->GetLastPaid(nMnCount)));
 
             ret.push_back(obj);
         }
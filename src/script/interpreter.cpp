@@ -12,6 +12,7 @@
 #include "eccryptoverify.h"
 #include "pubkey.h"
 #include "script/script.h"
+#include "streams.h"
 #include "uint256.h"
 
 using namespace std;
@@ -1031,9 +1032,57 @@ public:
     }
 };
 
+/** Stream that feeds what is serialized into it to a SHA256 hasher */
+class CSHA256Writer
+{
+private:
+    CSHA256& sha;
+
+public:
+    int nType;
+    int nVersion;
+
+    CSHA256Writer(CSHA256& shaIn) : sha(shaIn), nType(SER_GETHASH), nVersion(0) {}
+
+    CSHA256Writer& write(const char* pch, size_t size)
+    {
+        sha.Write((const unsigned char*)pch, size);
+        return (*this);
+    }
+
+    template <typename T>
+    CSHA256Writer& operator<<(const T& obj)
+    {
+        ::Serialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 } // anon namespace
 
-uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+PrecomputedTransactionData::PrecomputedTransactionData(const CTransaction& txTo)
+{
+    CSHA256 sha;
+    CSHA256Writer ss(sha);
+    ss << txTo.nVersion;
+    WriteCompactSize(ss, txTo.vin.size());
+
+    // The same bytes CTransactionSignatureSerializer writes for the other inputs and the outputs
+    CDataStream ssTail(SER_GETHASH, 0);
+    vPrefix.reserve(txTo.vin.size());
+    vTailStart.reserve(txTo.vin.size());
+    for (unsigned int i = 0; i < txTo.vin.size(); i++) {
+        vPrefix.push_back(sha);
+        size_t nStart = ssTail.size();
+        ssTail << txTo.vin[i].prevout << CScript() << txTo.vin[i].nSequence;
+        ss.write(&ssTail[nStart], ssTail.size() - nStart);
+        vTailStart.push_back(ssTail.size());
+    }
+    ssTail << txTo.vout << txTo.nLockTime;
+    vchTail.assign(ssTail.begin(), ssTail.end());
+}
+
+uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const PrecomputedTransactionData* txdata)
 {
     if (nIn >= txTo.vin.size()) {
         //  nIn out of range
@@ -1051,6 +1100,25 @@ uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsig
     // Wrapper to serialize only the necessary parts of the transaction being signed
     CTransactionSignatureSerializer txTmp(txTo, scriptCode, nIn, nHashType);
 
+    // For SIGHASH_ALL only this input's part has to be serialized, the hash of what comes
+    // before it is resumed from its midstate and what follows is hashed as it was stored
+    if (txdata && !(nHashType & SIGHASH_ANYONECANPAY) && (nHashType & 0x1f) != SIGHASH_SINGLE && (nHashType & 0x1f) != SIGHASH_NONE) {
+        assert(nIn < txdata->vPrefix.size());
+        CSHA256 sha(txdata->vPrefix[nIn]);
+        CSHA256Writer ss(sha);
+        txTmp.SerializeInput(ss, nIn, SER_GETHASH, 0);
+        size_t nStart = txdata->vTailStart[nIn];
+        sha.Write(&txdata->vchTail[nStart], txdata->vchTail.size() - nStart);
+        ss << nHashType;
+
+        // Double SHA256, as CHashWriter
+        uint256 hash;
+        unsigned char buf[CSHA256::OUTPUT_SIZE];
+        sha.Finalize(buf);
+        CSHA256().Write(buf, sizeof(buf)).Finalize((unsigned char*)&hash);
+        return hash;
+    }
+
     // Serialize and hash
     CHashWriter ss(SER_GETHASH, 0);
     ss << txTmp << nHashType;
@@ -1075,7 +1143,7 @@ bool TransactionSignatureChecker::CheckSig(const vector<unsigned char>& vchSigIn
     int nHashType = vchSig.back();
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, *txTo, nIn, nHashType);
+    uint256 sighash = SignatureHash(scriptCode, *txTo, nIn, nHashType, txdata);
 
     if (!VerifySignature(vchSig, pubkey, sighash))
         return false;
@@ -5,78 +5,166 @@
 
 #include "sigcache.h"
 
+#include "crypto/common.h"
+#include "crypto/sha256.h"
 #include "pubkey.h"
 #include "random.h"
 #include "uint256.h"
 #include "util.h"
 
-#include <boost/thread.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
-
-namespace {
-
-/**
- * Valid signature cache, to avoid doing expensive ECDSA signature checking
- * twice for every transaction (once when accepted into memory pool, and
- * again when accepted into the block chain)
- */
-class CSignatureCache
-{
-private:
-     //! sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
-
-public:
-    bool
-    Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
-    {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
+#include <boost/thread/locks.hpp>
+
+CSignatureCache::CSignatureCache(size_t nBytes)
+{
+    // The salt keeps others from predicting which entries share a bucket
+    salt = GetRandHash();
+    nBucketsPerShard = nBytes / NUM_SHARDS / BUCKET_SIZE / (sizeof(uint256) + sizeof(uint32_t));
+    nGenerationSize = std::max<size_t>(1, nBucketsPerShard * BUCKET_SIZE / 4);
+    for (unsigned int i = 0; i < NUM_SHARDS; i++) {
+        shards[i].vEntry.resize(nBucketsPerShard * BUCKET_SIZE);
+        shards[i].vGeneration.resize(nBucketsPerShard * BUCKET_SIZE, 0);
+    }
+}
+
+uint256 CSignatureCache::ComputeEntry(const uint256& sighash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const
+{
+    unsigned char pchSigSize[4];
+    WriteLE32(pchSigSize, vchSig.size());
+    uint256 entry;
+    CSHA256 hasher;
+    hasher.Write(salt.begin(), salt.size()).Write(sighash.begin(), sighash.size()).Write(pchSigSize, sizeof(pchSigSize));
+    if (!vchSig.empty())
+        hasher.Write(&vchSig[0], vchSig.size());
+    hasher.Write(pubKey.begin(), pubKey.size()).Finalize(entry.begin());
+    return entry;
+}
+
+CSignatureCache::CShard& CSignatureCache::Locate(const uint256& entry, size_t& nSlotRet)
+{
+    uint64_t nHash = entry.GetLow64();
+    nSlotRet = (nHash / NUM_SHARDS) % nBucketsPerShard * BUCKET_SIZE;
+    return shards[nHash % NUM_SHARDS];
+}
+
+const CSignatureCache::CShard& CSignatureCache::Locate(const uint256& entry, size_t& nSlotRet) const
+{
+    return const_cast<CSignatureCache*>(this)->Locate(entry, nSlotRet);
+}
+
+uint256 CSignatureCache::ComputeEntry(const uint256& txid, unsigned int flags) const
+{
+    unsigned char pchFlags[4];
+    WriteLE32(pchFlags, flags);
+    uint256 entry;
+    CSHA256().Write(salt.begin(), salt.size()).Write(txid.begin(), txid.size()).Write(pchFlags, sizeof(pchFlags)).Finalize(entry.begin());
+    return entry;
+}
+
+bool CSignatureCache::Contains(const uint256& entry) const
+{
+    if (nBucketsPerShard == 0)
         return false;
+
+    size_t nSlot;
+    const CShard& shard = Locate(entry, nSlot);
+    boost::shared_lock<boost::shared_mutex> lock(shard.cs);
+    for (size_t i = nSlot; i < nSlot + BUCKET_SIZE; i++) {
+        if (shard.vGeneration[i] && shard.vEntry[i] == entry)
+            return true;
     }
+    return false;
+}
 
-    void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
-    {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
-
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
-        {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
-        }
-
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+void CSignatureCache::Insert(const uint256& entry)
+{
+    if (nBucketsPerShard == 0)
+        return;
+
+    size_t nSlot;
+    CShard& shard = Locate(entry, nSlot);
+    boost::unique_lock<boost::shared_mutex> lock(shard.cs);
+
+    // Take an empty slot or the one written longest ago
+    size_t nVictim = nSlot;
+    for (size_t i = nSlot; i < nSlot + BUCKET_SIZE; i++) {
+        if (shard.vGeneration[i] && shard.vEntry[i] == entry)
+            return;
+        if (shard.vGeneration[i] < shard.vGeneration[nVictim])
+            nVictim = i;
+    }
+    shard.vEntry[nVictim] = entry;
+    shard.vGeneration[nVictim] = shard.nGeneration;
+    if (++shard.nWritten >= nGenerationSize) {
+        shard.nGeneration++;
+        shard.nWritten = 0;
     }
-};
+}
 
+bool CSignatureCache::Get(const uint256& sighash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const
+{
+    return nBucketsPerShard && Contains(ComputeEntry(sighash, vchSig, pubKey));
+}
+
+void CSignatureCache::Set(const uint256& sighash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+{
+    if (nBucketsPerShard)
+        Insert(ComputeEntry(sighash, vchSig, pubKey));
+}
+
+bool CSignatureCache::Get(const uint256& txid, unsigned int flags) const
+{
+    return nBucketsPerShard && Contains(ComputeEntry(txid, flags));
+}
+
+void CSignatureCache::Set(const uint256& txid, unsigned int flags)
+{
+    if (nBucketsPerShard)
+        Insert(ComputeEntry(txid, flags));
+}
+
+namespace
+{
+int64_t GetCacheBytes()
+{
+    const int64_t nMaxBytes = MAX_SIG_CACHE_MB << 20;
+    if (!mapArgs.count("-sigcachemb") && mapArgs.count("-maxsigcachesize")) {
+        // The deprecated -maxsigcachesize counts signature entries, keep that many
+        const int64_t nEntrySize = sizeof(uint256) + sizeof(uint32_t);
+        int64_t nEntries = std::max<int64_t>(0, std::min(GetArg("-maxsigcachesize", 0), nMaxBytes / nEntrySize));
+        return std::min(nMaxBytes, nEntries * nEntrySize * 4 / 3);
+    }
+    return std::max<int64_t>(0, std::min(GetArg("-sigcachemb", DEFAULT_SIG_CACHE_MB), MAX_SIG_CACHE_MB)) << 20;
+}
+
+// DoS prevention: both caches take a fixed amount of memory. Signatures get three
+// quarters of -sigcachemb, by default room for about 700,000 entries, well
+// over the signature operations of a block.
+CSignatureCache& GetSignatureCache()
+{
+    static CSignatureCache signatureCache(GetCacheBytes() - GetCacheBytes() / 4);
+    return signatureCache;
+}
+
+CSignatureCache& GetTransactionCache()
+{
+    static CSignatureCache transactionCache(GetCacheBytes() / 4);
+    return transactionCache;
+}
+}
+
+bool IsTransactionVerified(const uint256& txid, unsigned int flags)
+{
+    return GetTransactionCache().Get(txid, flags);
+}
+
+void SetTransactionVerified(const uint256& txid, unsigned int flags)
+{
+    GetTransactionCache().Set(txid, flags);
 }
 
 bool CachingTransactionSignatureChecker::VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& pubkey, const uint256& sighash) const
 {
-    static CSignatureCache signatureCache;
+    CSignatureCache& signatureCache = GetSignatureCache();
 
     if (signatureCache.Get(sighash, vchSig, pubkey))
         return true;
@@ -7,18 +7,96 @@
 #define BITCOIN_SCRIPT_SIGCACHE_H
 
 #include "script/interpreter.h"
+#include "uint256.h"
 
 #include <vector>
 
+#include <boost/thread/shared_mutex.hpp>
+
 class CPubKey;
 
+//! -sigcachemb default (MiB)
+static const int64_t DEFAULT_SIG_CACHE_MB = 32;
+//! max. -sigcachemb (MiB)
+static const int64_t MAX_SIG_CACHE_MB = sizeof(void*) > 4 ? 16384 : 1024;
+
+/**
+ * Valid signature cache, to avoid doing expensive ECDSA signature checking
+ * twice for every transaction (once when accepted into memory pool, and
+ * again when accepted into the block chain)
+ *
+ * An entry is a salted hash of (signature hash, signature, public key), or of
+ * (txid, script flags) for a transaction whose scripts all passed, so it takes
+ * a fixed 36 bytes. The table is allocated once and split into shards
+ * with a lock each, which keeps the script check threads from waiting on each
+ * other. Each slot records the generation it was written in; a full bucket
+ * gives up its oldest entry.
+ */
+class CSignatureCache
+{
+public:
+    //! Number of entries per bucket
+    static const unsigned int BUCKET_SIZE = 4;
+    static const unsigned int NUM_SHARDS = 16;
+
+    //! A cache of nBytes, none disables it
+    CSignatureCache(size_t nBytes);
+
+    bool Get(const uint256& sighash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const;
+    void Set(const uint256& sighash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey);
+
+    bool Get(const uint256& txid, unsigned int flags) const;
+    void Set(const uint256& txid, unsigned int flags);
+
+    //! Number of entries the cache holds at most
+    size_t GetCapacity() const { return nBucketsPerShard * BUCKET_SIZE * NUM_SHARDS; }
+
+private:
+    class CShard
+    {
+    public:
+        mutable boost::shared_mutex cs;
+        std::vector<uint256> vEntry;
+        //! Generation each entry was written in, 0 for an empty slot
+        std::vector<uint32_t> vGeneration;
+        uint32_t nGeneration;
+        //! Entries written in the current generation
+        size_t nWritten;
+
+        CShard() : nGeneration(1), nWritten(0) {}
+    };
+
+    uint256 salt;
+    size_t nBucketsPerShard;
+    //! Entries written per generation, a quarter of a shard
+    size_t nGenerationSize;
+    CShard shards[NUM_SHARDS];
+
+    uint256 ComputeEntry(const uint256& sighash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const;
+    uint256 ComputeEntry(const uint256& txid, unsigned int flags) const;
+    bool Contains(const uint256& entry) const;
+    void Insert(const uint256& entry);
+    //! Shard and first slot of the bucket an entry belongs to
+    CShard& Locate(const uint256& entry, size_t& nSlotRet);
+    const CShard& Locate(const uint256& entry, size_t& nSlotRet) const;
+};
+
+/**
+ * Whether every script of the transaction already passed under exactly these flags.
+ * The txid commits to the scriptSigs and to the spent outputs, so nothing else can
+ * change the outcome.
+ */
+bool IsTransactionVerified(const uint256& txid, unsigned int flags);
+//! Record that every script of the transaction passed under these flags
+void SetTransactionVerified(const uint256& txid, unsigned int flags);
+
 class CachingTransactionSignatureChecker : public TransactionSignatureChecker
 {
 private:
     bool store;
 
 public:
-    CachingTransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, bool storeIn=true) : TransactionSignatureChecker(txToIn, nInIn), store(storeIn) {}
+    CachingTransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, bool storeIn=true, const PrecomputedTransactionData* txdataIn = NULL) : TransactionSignatureChecker(txToIn, nInIn, txdataIn), store(storeIn) {}
 
     bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 };
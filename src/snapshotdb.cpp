@@ -0,0 +1,312 @@
+// Copyright (c) 2017 The PIVX developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "snapshotdb.h"
+
+#include "chainparams.h"
+#include "clientversion.h"
+#include "hash.h"
+#include "util.h"
+
+#include <boost/filesystem.hpp>
+
+/** Size of the trailer at the end of a snapshot: position of the section table and checksum */
+static const uint64_t SNAPSHOT_TRAILER_SIZE = sizeof(uint64_t) + sizeof(uint256);
+
+CSnapshotDB::CSnapshotDB(const std::string& strFilename, const std::string& strMagicMessageIn) : strMagicMessage(strMagicMessageIn), nFileSize(0)
+{
+    pathDB = GetDataDir() / strFilename;
+}
+
+CDataStream CSnapshotDB::GetPrefix() const
+{
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << strMagicMessage;                   // file specific magic message
+    ssPrefix << FLATDATA(Params().MessageStart()); // network specific magic number
+    ssPrefix << SNAPSHOT_VERSION;
+    return ssPrefix;
+}
+
+uint256 CSnapshotDB::GetTableHash(const CDataStream& ssTable) const
+{
+    CDataStream ssHeader = GetPrefix();
+    ssHeader += ssTable;
+    return Hash(ssHeader.begin(), ssHeader.end());
+}
+
+const CSnapshotSection* CSnapshotDB::FindSection(uint32_t nId) const
+{
+    for (std::vector<CSnapshotSection>::const_iterator it = vSections.begin(); it != vSections.end(); ++it)
+        if (it->nId == nId)
+            return &*it;
+    return NULL;
+}
+
+void CSnapshotDB::DropSection(uint32_t nId)
+{
+    for (std::vector<CSnapshotSection>::iterator it = vSections.begin(); it != vSections.end(); ++it) {
+        if (it->nId == nId) {
+            vSections.erase(it);
+            return;
+        }
+    }
+}
+
+CDataStream& CSnapshotDB::AddSectionData(uint32_t nId)
+{
+    listWrite.push_back(std::make_pair(nId, CDataStream(SER_DISK, CLIENT_VERSION)));
+    return listWrite.back().second;
+}
+
+void CSnapshotDB::KeepSection(uint32_t nId)
+{
+    vKeep.push_back(nId);
+}
+
+bool CSnapshotDB::WriteSections()
+{
+    std::list<std::pair<uint32_t, CDataStream> > listSections;
+    listSections.swap(listWrite);
+    std::vector<uint32_t> vKeepIds;
+    vKeepIds.swap(vKeep);
+
+    // sections of the file on disk that are kept or unchanged are not written again
+    bool fExisting = boost::filesystem::exists(pathDB) && ReadHeader() == Ok;
+
+    std::vector<CSnapshotSection> vSectionsNew;
+    std::vector<const CDataStream*> vAppend;
+    uint64_t nAppendSize = 0;
+    uint64_t nLiveSize = 0;
+    for (unsigned int i = 0; i < vKeepIds.size(); i++) {
+        const CSnapshotSection* pSection = fExisting ? FindSection(vKeepIds[i]) : NULL;
+        if (!pSection) {
+            LogPrintf("%s : Section %u of %s to keep is missing\n", __func__, vKeepIds[i], GetFilename());
+            continue;
+        }
+        vSectionsNew.push_back(*pSection);
+        nLiveSize += pSection->nSize;
+    }
+    for (std::list<std::pair<uint32_t, CDataStream> >::const_iterator it = listSections.begin(); it != listSections.end(); ++it) {
+        CSnapshotSection section;
+        section.nId = it->first;
+        section.nSize = it->second.size();
+        section.hash = Hash(it->second.begin(), it->second.end());
+        const CSnapshotSection* pSection = fExisting ? FindSection(section.nId) : NULL;
+        if (pSection && pSection->nSize == section.nSize && pSection->hash == section.hash) {
+            section.nOffset = pSection->nOffset;
+        } else {
+            section.nOffset = nFileSize + nAppendSize;
+            vAppend.push_back(&it->second);
+            nAppendSize += section.nSize;
+        }
+        vSectionsNew.push_back(section);
+        nLiveSize += section.nSize;
+    }
+
+    // nothing changed since the file was written
+    if (fExisting && vAppend.empty() && vSectionsNew.size() == vSections.size()) {
+        LogPrint("masternode", "%s : %s is up to date\n", __func__, GetFilename());
+        return true;
+    }
+
+    // the file is written anew once most of it is stale, but not while sections are kept,
+    // whose readers rely on them staying where they are
+    if (fExisting && (!vKeepIds.empty() || 2 * nLiveSize >= nFileSize + nAppendSize))
+        return AppendFile(vSectionsNew, vAppend, nAppendSize);
+    return WriteFile(listSections);
+}
+
+bool CSnapshotDB::WriteFile(const std::list<std::pair<uint32_t, CDataStream> >& listSections)
+{
+    CDataStream ssPrefix = GetPrefix();
+    std::vector<CSnapshotSection> vSectionsNew;
+    uint64_t nOffset = ssPrefix.size();
+    for (std::list<std::pair<uint32_t, CDataStream> >::const_iterator it = listSections.begin(); it != listSections.end(); ++it) {
+        CSnapshotSection section;
+        section.nId = it->first;
+        section.nOffset = nOffset;
+        section.nSize = it->second.size();
+        section.hash = Hash(it->second.begin(), it->second.end());
+        vSectionsNew.push_back(section);
+        nOffset += section.nSize;
+    }
+    CDataStream ssTable(SER_DISK, CLIENT_VERSION);
+    ssTable << vSectionsNew;
+
+    // write next to the old file and swap it in when complete
+    boost::filesystem::path pathTmp = pathDB.string() + ".new";
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull())
+        return error("%s : Failed to open file %s", __func__, pathTmp.string());
+
+    try {
+        fileout << ssPrefix;
+        for (std::list<std::pair<uint32_t, CDataStream> >::const_iterator it = listSections.begin(); it != listSections.end(); ++it)
+            fileout << it->second;
+        fileout << ssTable << nOffset << GetTableHash(ssTable);
+    } catch (std::exception& e) {
+        return error("%s : Serialize or I/O error - %s", __func__, e.what());
+    }
+    FileCommit(fileout.Get());
+    fileout.fclose();
+
+    if (!RenameOver(pathTmp, pathDB))
+        return error("%s : Failed to rename %s to %s", __func__, pathTmp.string(), pathDB.string());
+
+    vSections.swap(vSectionsNew);
+    nFileSize = nOffset + ssTable.size() + SNAPSHOT_TRAILER_SIZE;
+    return true;
+}
+
+bool CSnapshotDB::AppendFile(const std::vector<CSnapshotSection>& vSectionsNew, const std::vector<const CDataStream*>& vAppend, uint64_t nAppendSize)
+{
+    CDataStream ssTable(SER_DISK, CLIENT_VERSION);
+    ssTable << vSectionsNew;
+    uint64_t nTablePos = nFileSize + nAppendSize;
+
+    FILE* file = fopen(pathDB.string().c_str(), "r+b");
+    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull())
+        return error("%s : Failed to open file %s", __func__, pathDB.string());
+
+    // an append cut short leaves the file without a valid trailer, it is recreated on next start
+    try {
+        if (fseek(fileout.Get(), nFileSize, SEEK_SET))
+            throw std::ios_base::failure("seek failed");
+        for (unsigned int i = 0; i < vAppend.size(); i++)
+            fileout << *vAppend[i];
+        fileout << ssTable << nTablePos << GetTableHash(ssTable);
+    } catch (std::exception& e) {
+        TruncateFile(fileout.Get(), nFileSize);
+        return error("%s : Serialize or I/O error - %s", __func__, e.what());
+    }
+    FileCommit(fileout.Get());
+    fileout.fclose();
+
+    vSections = vSectionsNew;
+    nFileSize = nTablePos + ssTable.size() + SNAPSHOT_TRAILER_SIZE;
+    return true;
+}
+
+CSnapshotDB::ReadResult CSnapshotDB::ReadHeader()
+{
+    vSections.clear();
+    nFileSize = 0;
+
+    FILE* file = fopen(pathDB.string().c_str(), "rb");
+    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull()) {
+        error("%s : Failed to open file %s", __func__, pathDB.string());
+        return FileError;
+    }
+
+    uint64_t nSize = boost::filesystem::file_size(pathDB);
+    uint64_t nPrefixSize = GetPrefix().size();
+    std::string strMagicMessageTmp;
+    unsigned char pchMsgTmp[4];
+    uint32_t nVersion;
+    uint64_t nTablePos;
+    uint256 hashIn;
+    std::vector<char> vchTable;
+    try {
+        // de-serialize file header (file specific magic message) and ..
+        filein >> strMagicMessageTmp;
+
+        // ... verify the message matches predefined one
+        if (strMagicMessage != strMagicMessageTmp) {
+            error("%s : Invalid %s magic message", __func__, GetFilename());
+            return IncorrectMagicMessage;
+        }
+
+        // de-serialize file header (network specific magic number) and ..
+        filein >> FLATDATA(pchMsgTmp);
+
+        // ... verify the network matches ours
+        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp))) {
+            error("%s : Invalid network magic number", __func__);
+            return IncorrectMagicNumber;
+        }
+
+        filein >> nVersion;
+        if (nVersion != SNAPSHOT_VERSION) {
+            error("%s : Unknown %s version %u", __func__, GetFilename(), nVersion);
+            return IncorrectFormat;
+        }
+
+        // the trailer at the end of the file locates the last section table written
+        if (nSize < nPrefixSize + SNAPSHOT_TRAILER_SIZE || fseek(filein.Get(), nSize - SNAPSHOT_TRAILER_SIZE, SEEK_SET))
+            throw std::ios_base::failure("no trailer");
+        filein >> nTablePos >> hashIn;
+        if (nTablePos < nPrefixSize || nTablePos > nSize - SNAPSHOT_TRAILER_SIZE || fseek(filein.Get(), nTablePos, SEEK_SET))
+            throw std::ios_base::failure("invalid table position");
+        vchTable.resize(nSize - SNAPSHOT_TRAILER_SIZE - nTablePos);
+        if (!vchTable.empty())
+            filein.read(&vchTable[0], vchTable.size());
+    } catch (std::exception& e) {
+        error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        return IncorrectFormat;
+    }
+
+    // verify stored checksum matches the table
+    CDataStream ssTable(vchTable, SER_DISK, CLIENT_VERSION);
+    if (hashIn != GetTableHash(ssTable)) {
+        error("%s : Checksum mismatch, header corrupted", __func__);
+        return IncorrectHash;
+    }
+
+    std::vector<CSnapshotSection> vSectionsTmp;
+    try {
+        ssTable >> vSectionsTmp;
+    } catch (std::exception& e) {
+        error("%s : Deserialize error - %s", __func__, e.what());
+        return IncorrectFormat;
+    }
+    for (unsigned int i = 0; i < vSectionsTmp.size(); i++) {
+        if (vSectionsTmp[i].nOffset < nPrefixSize || vSectionsTmp[i].nOffset > nTablePos || vSectionsTmp[i].nSize > nTablePos - vSectionsTmp[i].nOffset) {
+            error("%s : Section %u outside of %s", __func__, vSectionsTmp[i].nId, GetFilename());
+            return IncorrectFormat;
+        }
+    }
+
+    vSections.swap(vSectionsTmp);
+    nFileSize = nSize;
+    return Ok;
+}
+
+CSnapshotDB::ReadResult CSnapshotDB::ReadSectionData(uint32_t nId, CDataStream& ssRet)
+{
+    const CSnapshotSection* pSection = FindSection(nId);
+    if (!pSection) {
+        error("%s : Missing section %u in %s", __func__, nId, GetFilename());
+        return IncorrectFormat;
+    }
+
+    FILE* file = fopen(pathDB.string().c_str(), "rb");
+    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull()) {
+        error("%s : Failed to open file %s", __func__, pathDB.string());
+        return FileError;
+    }
+
+    std::vector<char> vchData(pSection->nSize);
+    try {
+        if (fseek(filein.Get(), pSection->nOffset, SEEK_SET))
+            throw std::ios_base::failure("seek failed");
+        if (!vchData.empty())
+            filein.read(&vchData[0], vchData.size());
+    } catch (std::exception& e) {
+        error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        return HashReadError;
+    }
+
+    // verify stored checksum matches the section
+    if (pSection->hash != Hash(vchData.begin(), vchData.end())) {
+        error("%s : Checksum mismatch, section %u of %s corrupted", __func__, nId, GetFilename());
+        return IncorrectHash;
+    }
+
+    ssRet = CDataStream(vchData, SER_DISK, CLIENT_VERSION);
+    return Ok;
+}
@@ -0,0 +1,165 @@
+// Copyright (c) 2017 The PIVX developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SNAPSHOTDB_H
+#define BITCOIN_SNAPSHOTDB_H
+
+#include "clientversion.h"
+#include "serialize.h"
+#include "streams.h"
+#include "uint256.h"
+#include "util.h"
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+
+/** Version of the snapshot file layout */
+static const uint32_t SNAPSHOT_VERSION = 2;
+
+/** Entry of the section table of a snapshot */
+class CSnapshotSection
+{
+public:
+    uint32_t nId;
+    //! Position of the payload in the file
+    uint64_t nOffset;
+    uint64_t nSize;
+    uint256 hash;
+
+    CSnapshotSection() : nId(0), nOffset(0), nSize(0), hash(0) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(nId);
+        READWRITE(nOffset);
+        READWRITE(nSize);
+        READWRITE(hash);
+    }
+};
+
+/**
+ * Snapshot file of a masternode manager (mncache.dat, mnpayments.dat, budget.dat).
+ *
+ * The file starts with the file specific magic message, the network magic number and
+ * SNAPSHOT_VERSION. Every write appends the payloads of the sections that changed, then a table
+ * with the id, position, size and checksum of every section, then a trailer of fixed size with
+ * the position of that table and a checksum of the table and the start of the file. Sections
+ * that did not change stay where an earlier write put them. Once less than half of the file is
+ * referenced by the last table, the file is written anew next to the old one and swapped in.
+ *
+ * The table is found from the end of the file and verified without reading any payload, and
+ * every section is read and verified on its own, so a damaged section only loses the data in
+ * it. A manager reads the sections it needs at startup and the others on first use, from the
+ * table it read at startup: a section not read yet is kept by the writes in between, and the
+ * file is not written anew while a section is kept, so the section does not move.
+ */
+class CSnapshotDB
+{
+protected:
+    boost::filesystem::path pathDB;
+    std::string strMagicMessage;
+
+    //! Sections to write, in order
+    std::list<std::pair<uint32_t, CDataStream> > listWrite;
+    //! Sections to take over from the file on disk as they are
+    std::vector<uint32_t> vKeep;
+
+    //! Section table of the file on disk, see ReadHeader
+    std::vector<CSnapshotSection> vSections;
+    uint64_t nFileSize;
+
+    CDataStream GetPrefix() const;
+    uint256 GetTableHash(const CDataStream& ssTable) const;
+    const CSnapshotSection* FindSection(uint32_t nId) const;
+    bool WriteFile(const std::list<std::pair<uint32_t, CDataStream> >& listSections);
+    bool AppendFile(const std::vector<CSnapshotSection>& vSectionsNew, const std::vector<const CDataStream*>& vAppend, uint64_t nAppendSize);
+
+public:
+    enum ReadResult {
+        Ok,
+        FileError,
+        HashReadError,
+        IncorrectHash,
+        IncorrectMagicMessage,
+        IncorrectMagicNumber,
+        IncorrectFormat
+    };
+
+    CSnapshotDB(const std::string& strFilename, const std::string& strMagicMessageIn);
+
+    /// Start a new section to be written, serialize its content into the returned stream
+    CDataStream& AddSectionData(uint32_t nId);
+    /// Take a section over from the file on disk without reading it, the file is only appended to then
+    void KeepSection(uint32_t nId);
+    /// Write all added and kept sections, appending the ones that changed
+    bool WriteSections();
+
+    /// Read and verify the section table of the file on disk
+    ReadResult ReadHeader();
+    /// Read and verify one section, ReadHeader must have succeeded
+    ReadResult ReadSectionData(uint32_t nId, CDataStream& ssRet);
+
+    bool HasSection(uint32_t nId) const { return FindSection(nId) != NULL; }
+    /// Forget a section of the file on disk, so it is neither read nor kept
+    void DropSection(uint32_t nId);
+
+    /// Add a section holding one object
+    template <typename T>
+    void AddSection(uint32_t nId, const T& obj)
+    {
+        AddSectionData(nId) << obj;
+    }
+
+    /// Read a section holding one object
+    template <typename T>
+    ReadResult ReadSection(uint32_t nId, T& obj)
+    {
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        ReadResult result = ReadSectionData(nId, ss);
+        if (result != Ok)
+            return result;
+
+        try {
+            ss >> obj;
+        } catch (std::exception& e) {
+            error("%s : Deserialize error in section %u of %s - %s", __func__, nId, GetFilename(), e.what());
+            return IncorrectFormat;
+        }
+        return Ok;
+    }
+
+    /// Read a section holding a map into m, the entries m already has are kept; nothing to read if it was dropped
+    template <typename K, typename T>
+    ReadResult MergeSection(uint32_t nId, std::map<K, T>& m)
+    {
+        if (!HasSection(nId))
+            return Ok;
+        std::map<K, T> mapRead;
+        ReadResult result = ReadSection(nId, mapRead);
+        if (result == Ok)
+            m.insert(mapRead.begin(), mapRead.end());
+        return result;
+    }
+
+    /// Add a section holding a map, or keep the one on disk when pDeferred still has it unread and m is empty
+    template <typename K, typename T>
+    void AddMapSection(uint32_t nId, const std::map<K, T>& m, const CSnapshotDB* pDeferred)
+    {
+        if (pDeferred && pDeferred->HasSection(nId) && m.empty())
+            KeepSection(nId);
+        else
+            AddSection(nId, m);
+    }
+
+    std::string GetFilename() const { return pathDB.filename().string(); }
+};
+
+#endif // BITCOIN_SNAPSHOTDB_H
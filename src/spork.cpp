@@ -8,6 +8,7 @@
 #include "key.h"
 #include "main.h"
 #include "masternode-budget.h"
+#include "masternode-payments.h"
 #include "net.h"
 #include "protocol.h"
 #include "sync.h"
@@ -58,6 +59,7 @@ void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
 
         mapSporks[hash] = spork;
         mapSporksActive[spork.nSporkID] = spork;
+        AddBlockPayeesUpdated();
         sporkManager.Relay(spork);
 
         //does a task if needed
@@ -227,6 +229,7 @@ bool CSporkManager::UpdateSpork(int nSporkID, int64_t nValue)
         Relay(msg);
         mapSporks[msg.GetHash()] = msg;
         mapSporksActive[nSporkID] = msg;
+        AddBlockPayeesUpdated();
         return true;
     }
 
@@ -0,0 +1,150 @@
+// Copyright (c) 2017 The PIVX developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chain.h"
+#include "main.h"
+#include "random.h"
+#include "txdb.h"
+#include "util.h"
+
+#include <map>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(blockindex_tests)
+
+BOOST_AUTO_TEST_CASE(blockindex_arena)
+{
+    CBlockIndexArena arena;
+    BOOST_CHECK_EQUAL(arena.size(), 0);
+    vector<CBlockIndex*> vIndex;
+    for (size_t i = 0; i < CBlockIndexArena::SLAB_SIZE + 10; i++) {
+        vIndex.push_back(arena.Allocate());
+        vIndex.back()->nHeight = i;
+    }
+    BOOST_CHECK_EQUAL(arena.size(), CBlockIndexArena::SLAB_SIZE + 10);
+    // Entries handed out earlier are not moved by later slabs, each starts a cache line
+    for (size_t i = 0; i < vIndex.size(); i++) {
+        BOOST_CHECK_EQUAL(vIndex[i]->nHeight, (int)i);
+        BOOST_CHECK_EQUAL(reinterpret_cast<uintptr_t>(vIndex[i]) % CBlockIndexArena::CACHE_LINE_SIZE, 0);
+    }
+    BOOST_CHECK_EQUAL((char*)vIndex[1] - (char*)vIndex[0], CBlockIndexArena::STRIDE);
+    arena.Clear();
+    BOOST_CHECK_EQUAL(arena.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(blockmap_entries)
+{
+    CBlockMap blockmap;
+    CBlockIndexArena arena;
+    map<uint256, CBlockIndex*> mapExpected;
+    vector<const uint256*> vKeys;
+
+    // Keys stay where they are while the table grows
+    for (unsigned int i = 0; i < 20000; i++) {
+        uint256 hash = GetRandHash();
+        CBlockIndex* pindex = arena.Allocate();
+        pair<CBlockMap::iterator, bool> ret = blockmap.insert(make_pair(hash, pindex));
+        BOOST_CHECK(ret.second);
+        pindex->phashBlock = &ret.first->first;
+        vKeys.push_back(pindex->phashBlock);
+        mapExpected[hash] = pindex;
+    }
+    BOOST_CHECK(!blockmap.insert(make_pair(*vKeys[0], (CBlockIndex*)NULL)).second);
+    BOOST_CHECK(blockmap.bucket_count() * 3 >= blockmap.size() * 4);
+    for (unsigned int i = 0; i < vKeys.size(); i++) {
+        CBlockMap::iterator it = blockmap.find(*vKeys[i]);
+        BOOST_REQUIRE(it != blockmap.end());
+        BOOST_CHECK(&it->first == vKeys[i]);
+        BOOST_CHECK(it->second == mapExpected[*vKeys[i]]);
+    }
+
+    // Erasing keeps every other entry reachable
+    for (unsigned int i = 0; i < vKeys.size(); i += 3) {
+        uint256 hash = *vKeys[i];
+        BOOST_CHECK_EQUAL(blockmap.erase(hash), 1);
+        BOOST_CHECK_EQUAL(blockmap.erase(hash), 0);
+        mapExpected.erase(hash);
+    }
+    BOOST_CHECK_EQUAL(blockmap.size(), mapExpected.size());
+    size_t nFound = 0;
+    for (CBlockMap::const_iterator it = blockmap.begin(); it != blockmap.end(); it++) {
+        BOOST_CHECK(mapExpected[it->first] == it->second);
+        nFound++;
+    }
+    BOOST_CHECK_EQUAL(nFound, mapExpected.size());
+    for (map<uint256, CBlockIndex*>::const_iterator it = mapExpected.begin(); it != mapExpected.end(); it++)
+        BOOST_CHECK(blockmap.count(it->first));
+
+    // Unknown keys are added by operator[]
+    uint256 hashNew = GetRandHash();
+    BOOST_CHECK(blockmap[hashNew] == NULL);
+    BOOST_CHECK_EQUAL(blockmap.size(), mapExpected.size() + 1);
+
+    blockmap.clear();
+    BOOST_CHECK(blockmap.empty());
+    BOOST_CHECK(blockmap.begin() == blockmap.end());
+    BOOST_CHECK(blockmap.find(hashNew) == blockmap.end());
+}
+
+BOOST_AUTO_TEST_CASE(blockindex_load)
+{
+    LOCK(cs_main);
+    CBlockTreeDB blocktree(1 << 20, true);
+
+    // A chain of entries above the proof of work blocks
+    vector<CDiskBlockIndex> vDiskIndex(300);
+    vector<uint256> vHashes;
+    for (unsigned int i = 0; i < vDiskIndex.size(); i++) {
+        CDiskBlockIndex& diskindex = vDiskIndex[i];
+        diskindex.nHeight = 1000000 + i;
+        diskindex.nVersion = 1;
+        diskindex.hashPrev = i ? vHashes.back() : uint256();
+        diskindex.hashMerkleRoot = GetRandHash();
+        diskindex.nTime = 1500000000 + i;
+        diskindex.nNonce = insecure_rand();
+        diskindex.nMint = i;
+        vHashes.push_back(diskindex.GetBlockHash());
+        BOOST_CHECK(blocktree.WriteBlockIndex(diskindex));
+    }
+
+    const char* threads[] = {"1", "4"};
+    for (int t = 0; t < 2; t++) {
+        mapArgs["-dbreadthreads"] = threads[t];
+        mapArgs["-blockindexsample"] = "1";
+        BOOST_CHECK(blocktree.LoadBlockIndexGuts());
+        for (unsigned int i = 0; i < vHashes.size(); i++) {
+            BlockMap::iterator mi = mapBlockIndex.find(vHashes[i]);
+            BOOST_REQUIRE(mi != mapBlockIndex.end());
+            CBlockIndex* pindex = mi->second;
+            BOOST_CHECK(*pindex->phashBlock == vHashes[i]);
+            BOOST_CHECK_EQUAL(pindex->nHeight, vDiskIndex[i].nHeight);
+            BOOST_CHECK_EQUAL(pindex->nMint, i);
+            BOOST_CHECK(pindex->hashMerkleRoot == vDiskIndex[i].hashMerkleRoot);
+            BOOST_CHECK(pindex->pprev == (i ? mapBlockIndex[vHashes[i - 1]] : NULL));
+        }
+    }
+
+    // An entry stored under a key that is not its header hash is only found by a
+    // sampled check
+    CDiskBlockIndex diskindexBad(vDiskIndex[0]);
+    diskindexBad.nNonce++;
+    uint256 hashBad = GetRandHash();
+    BOOST_CHECK(blocktree.Write(make_pair('b', hashBad), diskindexBad));
+    BOOST_CHECK(!blocktree.LoadBlockIndexGuts());
+    mapArgs["-blockindexsample"] = "0";
+    BOOST_CHECK(blocktree.LoadBlockIndexGuts());
+    BOOST_CHECK(mapBlockIndex.count(hashBad));
+
+    mapArgs.erase("-dbreadthreads");
+    mapArgs.erase("-blockindexsample");
+    for (unsigned int i = 0; i < vHashes.size(); i++)
+        mapBlockIndex.erase(vHashes[i]);
+    mapBlockIndex.erase(hashBad);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -60,10 +60,47 @@ BOOST_AUTO_TEST_CASE(May15)
 
         // After May 15'th, big blocks are OK:
         forkingBlock.nTime = tMay15; // Invalidates PoW
+        forkingBlock.InvalidateHash();
         BOOST_CHECK(CheckBlock(forkingBlock, state, false, false));
     }
 
     SetMockTime(0);
 }
 
+BOOST_AUTO_TEST_CASE(header_hash_cache)
+{
+    CBlockHeader header;
+    header.nVersion = 1;
+    header.hashPrevBlock = uint256(1);
+    header.hashMerkleRoot = uint256(2);
+    header.nTime = 1454124731;
+    header.nBits = 0x1e0ffff0;
+    header.nNonce = 1;
+
+    uint256 hash = header.GetHash();
+    BOOST_CHECK(hash == HashQuark(BEGIN(header.nVersion), END(header.nNonce)));
+    uint64_t nCount = GetBlockHashCount();
+    BOOST_CHECK(header.GetHash() == hash);
+    BOOST_CHECK(CBlock(header).GetBlockHeader().GetHash() == hash);
+    BOOST_CHECK_EQUAL(GetBlockHashCount(), nCount);
+
+    // In-place changes need an explicit invalidation
+    header.nNonce = 2;
+    header.InvalidateHash();
+    BOOST_CHECK(header.GetHash() != hash);
+    BOOST_CHECK(header.GetHash() == HashQuark(BEGIN(header.nVersion), END(header.nNonce)));
+
+    // Deserializing over an existing header drops the old hash
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    header.nNonce = 1;
+    header.InvalidateHash();
+    ss << header;
+    CBlockHeader header2 = header;
+    header2.nNonce = 3;
+    header2.InvalidateHash();
+    header2.GetHash();
+    ss >> header2;
+    BOOST_CHECK(header2.GetHash() == hash);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
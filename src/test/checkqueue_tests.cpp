@@ -0,0 +1,78 @@
+// Copyright (c) 2017 The PIVX developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "checkqueue.h"
+#include "random.h"
+
+#include <atomic>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(checkqueue_tests)
+
+namespace
+{
+std::atomic<unsigned int> nChecksRun(0);
+
+struct CCountingCheck {
+    bool fOk;
+
+    CCountingCheck(bool fOkIn = true) : fOk(fOkIn) {}
+
+    bool operator()()
+    {
+        nChecksRun++;
+        return fOk;
+    }
+
+    void swap(CCountingCheck& check) { std::swap(fOk, check.fOk); }
+};
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_work_stealing)
+{
+    static CCheckQueue<CCountingCheck> queue(16);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < 3; i++)
+        threadGroup.create_thread(boost::bind(&CCheckQueue<CCountingCheck>::Thread, &queue));
+
+    for (int round = 0; round < 100; round++) {
+        nChecksRun = 0;
+        unsigned int nTotal = 0;
+        {
+            CCheckQueueControl<CCountingCheck> control(&queue);
+            // Batches of every size, including some smaller than the number of deques
+            for (int i = 0; i < 20; i++) {
+                std::vector<CCountingCheck> vChecks(insecure_rand() % 200);
+                nTotal += vChecks.size();
+                control.Add(vChecks);
+            }
+            BOOST_CHECK(control.Wait());
+        }
+        BOOST_CHECK_EQUAL(nChecksRun, nTotal);
+    }
+
+    // A failing check fails the whole run, and the next one starts over
+    {
+        CCheckQueueControl<CCountingCheck> control(&queue);
+        std::vector<CCountingCheck> vChecks(1000);
+        vChecks[insecure_rand() % vChecks.size()].fOk = false;
+        control.Add(vChecks);
+        BOOST_CHECK(!control.Wait());
+    }
+    {
+        CCheckQueueControl<CCountingCheck> control(&queue);
+        std::vector<CCountingCheck> vChecks(1000);
+        control.Add(vChecks);
+        BOOST_CHECK(control.Wait());
+    }
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -4,7 +4,9 @@
 
 #include "coins.h"
 #include "random.h"
+#include "txdb.h"
 #include "uint256.h"
+#include "util.h"
 
 #include <vector>
 #include <map>
@@ -41,7 +43,7 @@ public:
 
     uint256 GetBestBlock() const { return hashBestBlock_; }
 
-    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, bool fErase = true)
     {
         for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ) {
             map_[it->first] = it->second.coins;
@@ -49,21 +51,69 @@ public:
                 // Randomly delete empty entries on write.
                 map_.erase(it->first);
             }
-            mapCoins.erase(it++);
+            if (fErase)
+                mapCoins.erase(it++);
+            else
+                ++it;
         }
-        mapCoins.clear();
+        if (fErase)
+            mapCoins.clear();
         hashBestBlock_ = hashBlock;
         return true;
     }
 
     bool GetStats(CCoinsStats& stats) const { return false; }
 };
+
+class CCoinsViewCacheTest : public CCoinsViewCache
+{
+public:
+    CCoinsViewCacheTest(CCoinsView* base) : CCoinsViewCache(base) {}
+
+    void SelfTest() const
+    {
+        // Manually recompute the dynamic usage of the whole data, and compare it.
+        size_t ret = memusage::DynamicUsage(cacheCoins);
+        for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
+            ret += it->second.coins.DynamicMemoryUsage();
+        }
+        if (pendingCoins) {
+            ret += memusage::DynamicUsage(*pendingCoins);
+            for (CCoinsMap::const_iterator it = pendingCoins->begin(); it != pendingCoins->end(); it++) {
+                ret += it->second.coins.DynamicMemoryUsage();
+            }
+        }
+        BOOST_CHECK_EQUAL(DynamicMemoryUsage(), ret);
+    }
+};
+
+class CCoinsViewDBTest : public CCoinsViewDB
+{
+public:
+    CCoinsViewDBTest() : CCoinsViewDB(1 << 20, true, true) {}
+
+    void WriteLegacyCoins(const uint256& txid, const CCoins& coins)
+    {
+        db.Write(std::make_pair('c', txid), coins);
+    }
+};
 }
 
 BOOST_AUTO_TEST_SUITE(coins_tests)
 
 static const unsigned int NUM_SIMULATION_ITERATIONS = 40000;
 
+// Write a snapshot into the base of the cache it was taken of, as ThreadFlushState does
+static void WriteSnapshot(CCoinsViewCache*& pcache, boost::shared_ptr<CCoinsMap>& pmapCoins, const uint256& hashBlock)
+{
+    if (!pcache)
+        return;
+    BOOST_CHECK(pcache->GetBackend()->BatchWrite(*pmapCoins, hashBlock, false));
+    pcache->SnapshotWritten();
+    pcache = NULL;
+    pmapCoins.reset();
+}
+
 // This is a large randomized insert/remove simulation test on a variable-size
 // stack of caches on top of CCoinsViewTest.
 //
@@ -83,14 +133,23 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     bool updated_an_entry = false;
     bool found_an_entry = false;
     bool missed_an_entry = false;
+    bool synced_a_cache = false;
+    bool trimmed_an_entry = false;
+    bool snapshot_a_cache = false;
+    bool read_a_snapshot = false;
 
     // A simple map to track what we expect the cache stack to represent.
     std::map<uint256, CCoins> result;
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
-    std::vector<CCoinsViewCache*> stack; // A stack of CCoinsViewCaches on top.
-    stack.push_back(new CCoinsViewCache(&base)); // Start with one cache.
+    std::vector<CCoinsViewCacheTest*> stack; // A stack of CCoinsViewCaches on top.
+    stack.push_back(new CCoinsViewCacheTest(&base)); // Start with one cache.
+
+    // A snapshot taken and not written yet, the cache keeps reading from it meanwhile.
+    CCoinsViewCache* snapshotCache = NULL;
+    boost::shared_ptr<CCoinsMap> snapshot;
+    uint256 snapshotBlock;
 
     // Use a limited set of random transaction ids, so we do test overwriting entries.
     std::vector<uint256> txids;
@@ -115,6 +174,7 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                 coins.nVersion = insecure_rand();
                 coins.vout.resize(1);
                 coins.vout[0].nValue = insecure_rand();
+                coins.vout[0].scriptPubKey = CScript() << std::vector<unsigned char>(insecure_rand() % 64, 1);
                 *entry = coins;
             } else {
                 coins.Clear();
@@ -125,6 +185,8 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
 
         // Once every 1000 iterations and at the end, verify the full cache.
         if (insecure_rand() % 1000 == 1 || i == NUM_SIMULATION_ITERATIONS - 1) {
+            if (snapshotCache)
+                read_a_snapshot = true;
             for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
                 const CCoins* coins = stack.back()->AccessCoins(it->first);
                 if (coins) {
@@ -135,11 +197,36 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                     missed_an_entry = true;
                 }
             }
+            BOOST_FOREACH (const CCoinsViewCacheTest* test, stack) {
+                test->SelfTest();
+            }
+        }
+
+        if (insecure_rand() % 200 == 0 && stack.size() > 0) {
+            // Write the tip without dropping its entries, then shrink it.
+            WriteSnapshot(snapshotCache, snapshot, snapshotBlock);
+            size_t nUsage = stack.back()->DynamicMemoryUsage();
+            unsigned int nSize = stack.back()->GetCacheSize();
+            if (insecure_rand() % 2) {
+                stack.back()->Sync();
+            } else {
+                // As FlushStateToDisk does, take a snapshot of the modified entries to write later
+                snapshotCache = stack.back();
+                snapshot = stack.back()->SnapshotModified();
+                snapshotBlock = stack.back()->GetBestBlock();
+                snapshot_a_cache = true;
+            }
+            stack.back()->TrimToSize(nUsage / 2);
+            stack.back()->SelfTest();
+            synced_a_cache = true;
+            if (stack.back()->GetCacheSize() < nSize)
+                trimmed_an_entry = true;
         }
 
         if (insecure_rand() % 100 == 0) {
             // Every 100 iterations, change the cache stack.
             if (stack.size() > 0 && insecure_rand() % 2 == 0) {
+                WriteSnapshot(snapshotCache, snapshot, snapshotBlock);
                 stack.back()->Flush();
                 delete stack.back();
                 stack.pop_back();
@@ -151,7 +238,7 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                 } else {
                     removed_all_caches = true;
                 }
-                stack.push_back(new CCoinsViewCache(tip));
+                stack.push_back(new CCoinsViewCacheTest(tip));
                 if (stack.size() == 4) {
                     reached_4_caches = true;
                 }
@@ -160,6 +247,7 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     }
 
     // Clean up the stack.
+    WriteSnapshot(snapshotCache, snapshot, snapshotBlock);
     while (stack.size() > 0) {
         delete stack.back();
         stack.pop_back();
@@ -173,6 +261,128 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(updated_an_entry);
     BOOST_CHECK(found_an_entry);
     BOOST_CHECK(missed_an_entry);
+    BOOST_CHECK(synced_a_cache);
+    BOOST_CHECK(trimmed_an_entry);
+    BOOST_CHECK(snapshot_a_cache);
+    BOOST_CHECK(read_a_snapshot);
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_output_records)
+{
+    CCoinsViewDBTest db;
+
+    CCoins coins;
+    coins.nVersion = 1;
+    coins.nHeight = 100;
+    coins.fCoinStake = true;
+    coins.vout.resize(3);
+    for (unsigned int i = 0; i < coins.vout.size(); i++) {
+        coins.vout[i].nValue = 1000 * (i + 1);
+        coins.vout[i].scriptPubKey = CScript() << OP_TRUE;
+    }
+
+    uint256 txid = GetRandHash();
+    {
+        CCoinsViewCache cache(&db);
+        *cache.ModifyCoins(txid) = coins;
+        cache.SetBestBlock(GetRandHash());
+        BOOST_CHECK(cache.Flush());
+    }
+    CCoins coinsRead;
+    BOOST_CHECK(db.GetCoins(txid, coinsRead));
+    BOOST_CHECK(coinsRead == coins);
+
+    // Spending one output leaves the others alone
+    {
+        CCoinsViewCache cache(&db);
+        BOOST_CHECK(cache.ModifyCoins(txid)->Spend(1));
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK(coins.Spend(1));
+    BOOST_CHECK(db.GetCoins(txid, coinsRead));
+    BOOST_CHECK(coinsRead == coins);
+    BOOST_CHECK(coinsRead.IsAvailable(0) && !coinsRead.IsAvailable(1) && coinsRead.IsAvailable(2));
+    BOOST_CHECK(coinsRead.fCoinStake && !coinsRead.fCoinBase && coinsRead.nHeight == 100);
+
+    // Spending the rest removes the transaction
+    {
+        CCoinsViewCache cache(&db);
+        {
+            CCoinsModifier entry = cache.ModifyCoins(txid);
+            BOOST_CHECK(entry->Spend(0));
+            BOOST_CHECK(entry->Spend(2));
+        }
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK(!db.HaveCoins(txid));
+    BOOST_CHECK(!db.GetCoins(txid, coinsRead));
+
+    // Records of the old layout are converted once
+    uint256 txidLegacy = GetRandHash();
+    CCoins coinsLegacy = coins;
+    db.WriteLegacyCoins(txidLegacy, coinsLegacy);
+    BOOST_CHECK(!db.HaveCoins(txidLegacy));
+    BOOST_CHECK(db.Upgrade());
+    BOOST_CHECK(db.GetCoins(txidLegacy, coinsRead));
+    BOOST_CHECK(coinsRead == coinsLegacy);
+    BOOST_CHECK(db.Upgrade());
+    BOOST_CHECK(db.GetCoins(txidLegacy, coinsRead));
+    BOOST_CHECK(coinsRead == coinsLegacy);
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_batch_read)
+{
+    CCoinsViewDBTest db;
+
+    // Half of the txids are written, the batch asks for all of them and some twice
+    std::map<uint256, CCoins> mapWritten;
+    std::vector<uint256> vTxid;
+    {
+        CCoinsViewCache cache(&db);
+        for (unsigned int i = 0; i < 1000; i++) {
+            uint256 txid = GetRandHash();
+            vTxid.push_back(txid);
+            if (i % 2)
+                continue;
+            CCoins& coins = mapWritten[txid];
+            coins.nVersion = 1;
+            coins.nHeight = i;
+            coins.vout.resize(1 + insecure_rand() % 4);
+            for (unsigned int j = 0; j < coins.vout.size(); j++) {
+                coins.vout[j].nValue = insecure_rand();
+                coins.vout[j].scriptPubKey = CScript() << OP_TRUE;
+            }
+            *cache.ModifyCoins(txid) = coins;
+        }
+        cache.SetBestBlock(GetRandHash());
+        BOOST_CHECK(cache.Flush());
+    }
+    vTxid.insert(vTxid.end(), vTxid.begin(), vTxid.begin() + 10);
+
+    const char* threads[] = {"1", "4"};
+    for (int t = 0; t < 2; t++) {
+        mapArgs["-dbreadthreads"] = threads[t];
+        std::vector<std::pair<uint256, CCoins> > vCoins;
+        db.GetCoinsBatch(vTxid, vCoins);
+        BOOST_CHECK_EQUAL(vCoins.size(), mapWritten.size());
+        for (unsigned int i = 0; i < vCoins.size(); i++) {
+            BOOST_CHECK(mapWritten.count(vCoins[i].first));
+            BOOST_CHECK(vCoins[i].second == mapWritten[vCoins[i].first]);
+        }
+
+        // A cache serves the prefetched coins like fetched ones
+        CCoinsViewCacheTest cache(&db);
+        cache.Prefetch(vTxid);
+        BOOST_CHECK_EQUAL(cache.GetCacheSize(), mapWritten.size());
+        cache.SelfTest();
+        for (unsigned int i = 0; i < vTxid.size(); i++) {
+            const CCoins* coins = cache.AccessCoins(vTxid[i]);
+            BOOST_CHECK_EQUAL(coins != NULL, mapWritten.count(vTxid[i]) > 0);
+            if (coins)
+                BOOST_CHECK(*coins == mapWritten[vTxid[i]]);
+        }
+    }
+    mapArgs.erase("-dbreadthreads");
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -3,6 +3,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "hash.h"
+#include "random.h"
 #include "utilstrencodings.h"
 
 #include <vector>
@@ -46,4 +47,28 @@ BOOST_AUTO_TEST_CASE(murmurhash3)
 #undef T
 }
 
+BOOST_AUTO_TEST_CASE(quark_multi)
+{
+    // Every batch size and input length must agree with the scalar HashQuark,
+    // including partial lane groups and inputs too long for the vector engine.
+    const size_t lengths[] = {0, 1, 64, 80, QUARK_MULTI_MAX_INPUT, QUARK_MULTI_MAX_INPUT + 1};
+    for (unsigned int l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+        const size_t nLen = lengths[l];
+        for (size_t nCount = 0; nCount <= 9; nCount++) {
+            vector<vector<unsigned char> > vData(nCount, vector<unsigned char>(nLen + 1));
+            vector<const unsigned char*> vBegin(nCount + 1);
+            for (size_t i = 0; i < nCount; i++) {
+                for (size_t j = 0; j < nLen; j++)
+                    vData[i][j] = insecure_rand();
+                vBegin[i] = &vData[i][0];
+            }
+            vector<uint256> vHashes(nCount + 1);
+            HashQuarkMulti(&vBegin[0], nLen, &vHashes[0], nCount);
+            for (size_t i = 0; i < nCount; i++)
+                BOOST_CHECK(vHashes[i] == HashQuark(vData[i].begin(), vData[i].begin() + nLen));
+        }
+    }
+    BOOST_TEST_MESSAGE("multi-lane Quark implementation: " << QuarkMultiImplementation());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
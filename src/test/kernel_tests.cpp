@@ -0,0 +1,177 @@
+// Copyright (c) 2017 The PIVX developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "kernel.h"
+#include "random.h"
+#include "util.h"
+
+#include <map>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(kernel_tests)
+
+// Reference search: the CheckStakeKernelHash loop over every input in order
+static bool SerialStakeSearch(unsigned int nBits, const vector<CStakeKernelInput>& vInputs, unsigned int nTimeTx, unsigned int nHashDrift, size_t& nIndexRet, unsigned int& nTimeRet, uint256& hashRet)
+{
+    uint256 bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits);
+    for (size_t i = 0; i < vInputs.size(); i++) {
+        CDataStream ss(SER_GETHASH, 0);
+        ss << vInputs[i].nStakeModifier;
+        for (unsigned int j = 0; j < nHashDrift; j++) {
+            unsigned int nTryTime = nTimeTx + nHashDrift - j;
+            uint256 hash = stakeHash(nTryTime, ss, vInputs[i].prevout.n, vInputs[i].prevout.hash, vInputs[i].nTimeBlockFrom);
+            if (stakeTargetHit(hash, vInputs[i].nValueIn, bnTargetPerCoinDay)) {
+                nIndexRet = i;
+                nTimeRet = nTryTime;
+                hashRet = hash;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+BOOST_AUTO_TEST_CASE(find_stake_kernel)
+{
+    const unsigned int nTimeTx = 1500000000;
+    const unsigned int nHashDrift = 45;
+
+    vector<CStakeKernelInput> vInputs(500);
+    for (size_t i = 0; i < vInputs.size(); i++) {
+        vInputs[i].prevout = COutPoint(GetRandHash(), insecure_rand() % 4);
+        vInputs[i].nValueIn = 1000 * COIN;
+        vInputs[i].nTimeBlockFrom = nTimeTx - 100000 - insecure_rand() % 1000;
+        vInputs[i].nStakeModifier = GetRand(std::numeric_limits<uint64_t>::max());
+    }
+
+    // Roughly one hit per 5000 hashes, so the winner is usually well inside the list
+    uint256 bnEasy = ~uint256(0) / (uint256(1000 * COIN / 100) * 5000);
+    unsigned int nBitsEasy = bnEasy.GetCompact();
+    unsigned int nBitsHard = uint256(1).GetCompact();
+
+    const char* threads[] = {"1", "4"};
+    for (int t = 0; t < 2; t++) {
+        mapArgs["-stakethreads"] = threads[t];
+        for (int round = 0; round < 4; round++) {
+            size_t nExpected = 0, nIndex = 0;
+            unsigned int nTimeExpected = 0, nTime = nTimeTx;
+            uint256 hashExpected, hash;
+            bool fExpected = SerialStakeSearch(nBitsEasy, vInputs, nTimeTx, nHashDrift, nExpected, nTimeExpected, hashExpected);
+            BOOST_CHECK_EQUAL(FindStakeKernel(nBitsEasy, vInputs, nTime, nHashDrift, nIndex, hash), fExpected);
+            if (fExpected) {
+                BOOST_CHECK_EQUAL(nIndex, nExpected);
+                BOOST_CHECK_EQUAL(nTime, nTimeExpected);
+                BOOST_CHECK(hash == hashExpected);
+            }
+            // Drop the winner so the next round finds a different one
+            vInputs.erase(vInputs.begin(), vInputs.begin() + (fExpected ? nExpected + 1 : 0));
+        }
+
+        unsigned int nTime = nTimeTx;
+        size_t nIndex = 0;
+        uint256 hash;
+        BOOST_CHECK(!FindStakeKernel(nBitsHard, vInputs, nTime, nHashDrift, nIndex, hash));
+        BOOST_CHECK_EQUAL(nTime, nTimeTx);
+    }
+    mapArgs.erase("-stakethreads");
+}
+
+// Connect a block on top of pindexPrev, generating a new modifier now and then
+static CBlockIndex* ConnectStakeBlock(vector<CBlockIndex*>& vBlocks, CBlockIndex* pindexPrev, unsigned int nTime)
+{
+    CBlockIndex* pindex = new CBlockIndex();
+    vBlocks.push_back(pindex);
+    pindex->phashBlock = &mapBlockIndex.insert(make_pair(GetRandHash(), pindex)).first->first;
+    pindex->pprev = pindexPrev;
+    pindex->nHeight = pindexPrev ? pindexPrev->nHeight + 1 : 0;
+    pindex->nTime = nTime;
+    if (!pindexPrev || insecure_rand() % 3 == 0)
+        pindex->SetStakeModifier(GetRand(std::numeric_limits<uint64_t>::max()), true);
+    else
+        pindex->SetStakeModifier(pindexPrev->nStakeModifier, false);
+    chainActive.SetTip(pindex);
+    UpdateStakeModifierCache(pindex);
+    return pindex;
+}
+
+struct CKernelModifier {
+    bool fFound;
+    uint64_t nStakeModifier;
+    int nHeight;
+    int64_t nTime;
+
+    bool operator==(const CKernelModifier& other) const
+    {
+        return fFound == other.fFound && (!fFound || (nStakeModifier == other.nStakeModifier && nHeight == other.nHeight && nTime == other.nTime));
+    }
+};
+
+static vector<CKernelModifier> GetKernelModifiers()
+{
+    vector<CKernelModifier> vModifiers(chainActive.Height() + 1);
+    for (int i = 0; i <= chainActive.Height(); i++) {
+        CKernelModifier& modifier = vModifiers[i];
+        modifier.fFound = GetKernelStakeModifier(chainActive[i]->GetBlockHash(), modifier.nStakeModifier, modifier.nHeight, modifier.nTime, false);
+    }
+    return vModifiers;
+}
+
+// Compare the modifiers found with the cache to those found walking the chain
+static void CheckKernelModifiers()
+{
+    vector<CKernelModifier> vCached = GetKernelModifiers();
+    // Every entry is at least as high as the first block, so this empties the cache
+    InvalidateStakeModifierCache(chainActive.Genesis());
+    vector<CKernelModifier> vWalked = GetKernelModifiers();
+    int nFound = 0;
+    for (unsigned int i = 0; i < vWalked.size(); i++) {
+        BOOST_CHECK_MESSAGE(vCached[i] == vWalked[i], strprintf("kernel modifier of block %d", i));
+        nFound += vWalked[i].fFound;
+    }
+    // The blocks of the last selection interval have no modifier yet
+    BOOST_CHECK(nFound > 0);
+    BOOST_CHECK(nFound < (int)vWalked.size());
+}
+
+BOOST_AUTO_TEST_CASE(stake_modifier_cache)
+{
+    CBlockIndex* pindexTipOld = chainActive.Tip();
+    vector<CBlockIndex*> vBlocks;
+
+    // A selection interval is about 35 blocks a minute apart
+    const unsigned int nTimeStart = 1500000000;
+    CBlockIndex* pindex = NULL;
+    for (int i = 0; i < 300; i++)
+        pindex = ConnectStakeBlock(vBlocks, pindex, nTimeStart + i * 60 + insecure_rand() % 30);
+    CheckKernelModifiers();
+
+    // The cache is full again after the walk. A reorg disconnects the last 100 blocks,
+    // whose modifiers were selected for blocks from before the fork...
+    CBlockIndex* pindexFork = chainActive[200];
+    while (chainActive.Tip() != pindexFork) {
+        InvalidateStakeModifierCache(chainActive.Tip());
+        chainActive.SetTip(chainActive.Tip()->pprev);
+    }
+    CheckKernelModifiers();
+
+    // ...and connects others in their place
+    pindex = pindexFork;
+    for (int i = 201; i < 320; i++)
+        pindex = ConnectStakeBlock(vBlocks, pindex, nTimeStart + i * 60 + 30 + insecure_rand() % 30);
+    CheckKernelModifiers();
+
+    chainActive.SetTip(pindexTipOld);
+    InvalidateStakeModifierCache(vBlocks[0]);
+    for (unsigned int i = 0; i < vBlocks.size(); i++) {
+        mapBlockIndex.erase(vBlocks[i]->GetBlockHash());
+        delete vBlocks[i];
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -5,8 +5,17 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "primitives/transaction.h"
+#include "clientversion.h"
 #include "main.h"
+#include "mappedfile.h"
+#include "random.h"
+#include "streams.h"
+#include "util.h"
 
+#include <stdio.h>
+
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
 #include <boost/test/unit_test.hpp>
 
 BOOST_AUTO_TEST_SUITE(main_tests)
@@ -48,4 +57,124 @@ BOOST_AUTO_TEST_CASE(subsidy_limit_test)
     BOOST_CHECK(nSum == 4109975100000000ULL);
 }
 
+BOOST_AUTO_TEST_CASE(read_raw_block)
+{
+    LOCK(cs_main);
+    CBlockIndex* pindex = chainActive.Genesis();
+    BOOST_REQUIRE(pindex);
+
+    // The stored bytes are the block as sent over the network
+    CBlock block;
+    BOOST_REQUIRE(ReadBlockFromDisk(block, pindex));
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << block;
+
+    std::vector<char> vchBlock;
+    BOOST_CHECK(ReadRawBlockFromDisk(vchBlock, pindex->GetBlockPos()));
+    BOOST_CHECK(vchBlock == std::vector<char>(ss.begin(), ss.end()));
+
+    // A position that is not the start of a block is refused
+    CDiskBlockPos pos = pindex->GetBlockPos();
+    pos.nPos += 1;
+    BOOST_CHECK(!ReadRawBlockFromDisk(vchBlock, pos));
+    BOOST_CHECK(!ReadRawBlockFromDisk(vchBlock, CDiskBlockPos()));
+}
+
+typedef std::vector<std::pair<uint64_t, uint256> > ExternalBlocks;
+
+static bool RecordExternalBlock(CBlock& block, uint64_t nBlockPos, ExternalBlocks& vBlocks, size_t nMax)
+{
+    vBlocks.push_back(std::make_pair(nBlockPos, block.GetHash()));
+    return vBlocks.size() < nMax;
+}
+
+BOOST_AUTO_TEST_CASE(scan_external_blocks)
+{
+    const unsigned char* pchMessageStart = Params().MessageStart();
+    boost::filesystem::path path = GetDataDir() / "scan_external_blocks.dat";
+
+    // Blocks of unknown parents, with garbage, headers of impossible sizes and truncated
+    // blocks in between, and blocks followed by bytes their size covers
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ExternalBlocks vExpected;
+    for (int i = 0; i < 200; i++) {
+        for (int j = insecure_rand() % 50; j > 0; j--) {
+            unsigned char ch = insecure_rand() % 3 == 0 ? pchMessageStart[0] : insecure_rand();
+            ss << (unsigned char)(ch == pchMessageStart[1] ? ch + 1 : ch);
+        }
+        if (insecure_rand() % 10 == 0) {
+            ss.write((const char*)pchMessageStart, MESSAGE_START_SIZE);
+            ss << (unsigned int)5;
+        }
+
+        CBlock block;
+        block.nVersion = 1;
+        block.hashPrevBlock = GetRandHash();
+        block.nTime = i;
+        block.nNonce = insecure_rand();
+        for (int j = 1 + insecure_rand() % 10; j > 0; j--) {
+            CMutableTransaction tx;
+            tx.vin.resize(1);
+            tx.vin[0].prevout = COutPoint(GetRandHash(), j);
+            tx.vout.resize(1);
+            tx.vout[0].nValue = insecure_rand();
+            tx.vout[0].scriptPubKey = CScript(std::vector<unsigned char>(insecure_rand() % 20 == 0 ? 30000 : 10, OP_TRUE));
+            block.vtx.push_back(CTransaction(tx));
+        }
+        block.hashMerkleRoot = block.BuildMerkleTree();
+        CDataStream ssBlock(SER_DISK, CLIENT_VERSION);
+        ssBlock << block;
+        unsigned int nSize = ssBlock.size();
+
+        ss.write((const char*)pchMessageStart, MESSAGE_START_SIZE);
+        switch (insecure_rand() % 10) {
+        case 0:
+            // truncated after the header, the bytes up to the size given fail to parse
+            ss << nSize;
+            ss.write(&ssBlock[0], 80);
+            ss.write(std::string(nSize, '\xff').data(), nSize);
+            break;
+        case 1:
+            // the size given covers bytes after the block
+            ss << nSize + 7;
+            vExpected.push_back(std::make_pair(ss.size(), block.GetHash()));
+            ss << block;
+            ss.write(std::string(7, '\x11').data(), 7);
+            break;
+        default:
+            ss << nSize;
+            vExpected.push_back(std::make_pair(ss.size(), block.GetHash()));
+            ss << block;
+        }
+    }
+    FILE* file = fopen(path.string().c_str(), "wb");
+    BOOST_REQUIRE(file);
+    BOOST_REQUIRE_EQUAL(fwrite(&ss[0], 1, ss.size(), file), ss.size());
+    fclose(file);
+
+    // The inline scan and the pipeline find the same blocks at the same positions, and stop alike
+    boost::shared_ptr<const CMappedFile> mapped(new CMappedFile(path.string()));
+    for (int nThreads = 1; nThreads <= 4; nThreads++) {
+        for (int nStop = 0; nStop < 2; nStop++) {
+            size_t nMax = nStop ? vExpected.size() / 2 : vExpected.size();
+            ExternalBlocks vBlocks;
+            {
+                CBufferedFile blkdat(fopen(path.string().c_str(), "rb"), 2 * MAX_BLOCK_SIZE, MAX_BLOCK_SIZE + 8, SER_DISK, CLIENT_VERSION);
+                ScanExternalBlocks(blkdat, nThreads, boost::bind(&RecordExternalBlock, _1, _2, boost::ref(vBlocks), nMax));
+            }
+            BOOST_CHECK(vBlocks == ExternalBlocks(vExpected.begin(), vExpected.begin() + nMax));
+
+            if (mapped->IsNull())
+                continue;
+            vBlocks.clear();
+            CMappedFileReader blkdat(mapped, 0, SER_DISK, CLIENT_VERSION);
+            ScanExternalBlocks(blkdat, nThreads, boost::bind(&RecordExternalBlock, _1, _2, boost::ref(vBlocks), nMax));
+            BOOST_CHECK(vBlocks == ExternalBlocks(vExpected.begin(), vExpected.begin() + nMax));
+        }
+    }
+
+    mapped.reset();
+    boost::filesystem::remove(path);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,138 @@
+// Copyright (c) 2017 The PIVX developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "clientversion.h"
+#include "mappedfile.h"
+#include "random.h"
+#include "streams.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(mappedfile_tests)
+
+static void AppendToFile(const boost::filesystem::path& path, const vector<char>& vch)
+{
+    FILE* file = fopen(path.string().c_str(), "ab");
+    BOOST_REQUIRE(file);
+    BOOST_REQUIRE_EQUAL(fwrite(&vch[0], 1, vch.size(), file), vch.size());
+    fclose(file);
+}
+
+BOOST_AUTO_TEST_CASE(mappedfile_reader)
+{
+    boost::filesystem::path path = GetDataDir() / "mappedfile_reader.dat";
+
+    // Records marked with 0xf9 in between random bytes without that value
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    vector<uint64_t> vRecords;
+    for (int i = 0; i < 2000; i++) {
+        for (int j = insecure_rand() % 3000; j > 0; j--)
+            ss << (unsigned char)(insecure_rand() % 0xf9);
+        vRecords.push_back(((uint64_t)insecure_rand() << 32) | insecure_rand());
+        ss << (unsigned char)0xf9 << vRecords.back();
+    }
+    AppendToFile(path, vector<char>(ss.begin(), ss.end()));
+
+    boost::shared_ptr<const CMappedFile> file(new CMappedFile(path.string()));
+    if (file->IsNull()) {
+        BOOST_TEST_MESSAGE("file mapping not available");
+        return;
+    }
+    BOOST_CHECK_EQUAL(file->Size(), ss.size());
+
+    // The mapped reader finds what the buffered reader finds, with a small window to cross it often
+    CMappedFileReader reader(file, 0, SER_DISK, CLIENT_VERSION, 4096);
+    CBufferedFile buffered(fopen(path.string().c_str(), "rb"), 16384, 16, SER_DISK, CLIENT_VERSION);
+    for (size_t i = 0; i < vRecords.size(); i++) {
+        reader.FindByte((char)0xf9);
+        buffered.FindByte((char)0xf9);
+        BOOST_CHECK_EQUAL(reader.GetPos(), buffered.GetPos());
+        unsigned char ch;
+        uint64_t n, nBuffered;
+        reader >> ch >> n;
+        buffered >> ch >> nBuffered;
+        BOOST_CHECK_EQUAL(n, vRecords[i]);
+        BOOST_CHECK_EQUAL(n, nBuffered);
+    }
+    BOOST_CHECK(reader.eof());
+    BOOST_CHECK_THROW(reader.FindByte((char)0xf9), std::ios_base::failure);
+
+    // Limits and positions
+    uint64_t n;
+    BOOST_CHECK(reader.SetPos(0));
+    BOOST_CHECK(!reader.eof());
+    BOOST_CHECK(reader.SetLimit(4));
+    BOOST_CHECK_THROW(reader >> n, std::ios_base::failure);
+    BOOST_CHECK(reader.SetLimit());
+    BOOST_CHECK(!reader.SetPos(file->Size() + 1));
+    BOOST_CHECK_EQUAL(reader.GetPos(), file->Size());
+    BOOST_CHECK(reader.SetPos(file->Size() - 4));
+    BOOST_CHECK_THROW(reader >> n, std::ios_base::failure);
+    BOOST_CHECK(reader.Seek(file->Size() - 8));
+    reader >> n;
+    BOOST_CHECK_EQUAL(n, vRecords.back());
+
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE(mappedfile_cache)
+{
+    vector<boost::filesystem::path> vPaths;
+    for (int i = 0; i < 3; i++) {
+        vPaths.push_back(GetDataDir() / strprintf("mappedfile_cache%d.dat", i));
+        AppendToFile(vPaths.back(), vector<char>(1000, (char)i));
+    }
+
+    CMappedFileCache cache(2);
+    boost::shared_ptr<const CMappedFile> file = cache.Get(vPaths[0].string(), 1000);
+    if (!file) {
+        BOOST_TEST_MESSAGE("file mapping not available");
+        return;
+    }
+    BOOST_CHECK(cache.Get(vPaths[0].string(), 1000) == file);
+    BOOST_CHECK(!cache.Get(vPaths[0].string(), 1001));
+    BOOST_CHECK(!cache.Get((GetDataDir() / "mappedfile_missing.dat").string(), 0));
+
+    // The least recently used file goes first, its mapping stays valid for its holder
+    file = cache.Get(vPaths[0].string(), 0);
+    boost::shared_ptr<const CMappedFile> file1 = cache.Get(vPaths[1].string(), 0);
+    BOOST_CHECK(cache.Get(vPaths[0].string(), 0) == file);
+    cache.Get(vPaths[2].string(), 0);
+    BOOST_CHECK_EQUAL(cache.size(), 2U);
+    BOOST_CHECK(cache.Get(vPaths[0].string(), 0) == file);
+    BOOST_CHECK(cache.Get(vPaths[1].string(), 0) != file1);
+    BOOST_CHECK_EQUAL(file->Data()[999], 0);
+    BOOST_CHECK_EQUAL(file1->Data()[999], 1);
+    file1 = cache.Get(vPaths[1].string(), 0);
+
+    // A file that grew is mapped again when more of it is needed
+    AppendToFile(vPaths[1], vector<char>(1000, 'x'));
+    BOOST_CHECK(cache.Get(vPaths[1].string(), 1000) == file1);
+    boost::shared_ptr<const CMappedFile> file1Grown = cache.Get(vPaths[1].string(), 2000);
+    BOOST_REQUIRE(file1Grown);
+    BOOST_CHECK(file1Grown != file1);
+    BOOST_CHECK_EQUAL(file1Grown->Size(), 2000U);
+    BOOST_CHECK_EQUAL(file1Grown->Data()[1999], 'x');
+    BOOST_CHECK_EQUAL(file1->Size(), 1000U);
+
+    cache.Erase(vPaths[1].string());
+    BOOST_CHECK_EQUAL(cache.size(), 1U);
+    cache.Clear();
+    BOOST_CHECK_EQUAL(cache.size(), 0U);
+
+    file.reset();
+    file1.reset();
+    file1Grown.reset();
+    for (size_t i = 0; i < vPaths.size(); i++)
+        boost::filesystem::remove(vPaths[i]);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
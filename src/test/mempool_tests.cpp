@@ -3,11 +3,13 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "main.h"
+#include "random.h"
 #include "txmempool.h"
 #include "util.h"
 
 #include <boost/test/unit_test.hpp>
 #include <list>
+#include <map>
 
 BOOST_AUTO_TEST_SUITE(mempool_tests)
 
@@ -99,4 +101,305 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+BOOST_AUTO_TEST_CASE(MempoolDescendantStateTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    std::list<CTransaction> removed;
+
+    // Chain of parent -> child -> grandchild, with a second child of the parent
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(2);
+    for (int i = 0; i < 2; i++) {
+        txParent.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txParent.vout[i].nValue = 33000LL;
+    }
+    CMutableTransaction txChild[2];
+    for (int i = 0; i < 2; i++) {
+        txChild[i].vin.resize(1);
+        txChild[i].vin[0].scriptSig = CScript() << OP_11;
+        txChild[i].vin[0].prevout.hash = txParent.GetHash();
+        txChild[i].vin[0].prevout.n = i;
+        txChild[i].vout.resize(1);
+        txChild[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txChild[i].vout[0].nValue = 11000LL;
+    }
+    CMutableTransaction txGrandChild;
+    txGrandChild.vin.resize(1);
+    txGrandChild.vin[0].scriptSig = CScript() << OP_11;
+    txGrandChild.vin[0].prevout.hash = txChild[0].GetHash();
+    txGrandChild.vin[0].prevout.n = 0;
+    txGrandChild.vout.resize(1);
+    txGrandChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txGrandChild.vout[0].nValue = 11000LL;
+
+    pool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 1000LL, 0, 0.0, 1));
+    pool.addUnchecked(txChild[0].GetHash(), CTxMemPoolEntry(txChild[0], 2000LL, 0, 0.0, 1));
+    pool.addUnchecked(txChild[1].GetHash(), CTxMemPoolEntry(txChild[1], 3000LL, 0, 0.0, 1));
+    pool.addUnchecked(txGrandChild.GetHash(), CTxMemPoolEntry(txGrandChild, 4000LL, 0, 0.0, 1));
+
+    CTxMemPool::txiter itParent = pool.mapTx.find(txParent.GetHash());
+    CTxMemPool::txiter itChild = pool.mapTx.find(txChild[0].GetHash());
+    uint64_t nParentSize = itParent->GetTxSize();
+    uint64_t nChildSize = itChild->GetTxSize();
+    BOOST_CHECK_EQUAL(itParent->GetCountWithDescendants(), 4);
+    BOOST_CHECK_EQUAL(itParent->GetModFeesWithDescendants(), 10000LL);
+    BOOST_CHECK_EQUAL(itChild->GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(itChild->GetModFeesWithDescendants(), 6000LL);
+
+    // Prioritisation counts towards the ancestors
+    pool.PrioritiseTransaction(txGrandChild.GetHash(), txGrandChild.GetHash().ToString(), 0.0, 500LL);
+    BOOST_CHECK_EQUAL(itParent->GetModFeesWithDescendants(), 10500LL);
+    BOOST_CHECK_EQUAL(itChild->GetModFeesWithDescendants(), 6500LL);
+
+    // Non-recursive removal of a leaf only updates its ancestors
+    pool.remove(txChild[1], removed, false);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    removed.clear();
+    BOOST_CHECK_EQUAL(itParent->GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(itParent->GetModFeesWithDescendants(), 7500LL);
+
+    // Removing the parent as if it was mined leaves the child as a root
+    pool.remove(txParent, removed, false);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    removed.clear();
+    itChild = pool.mapTx.find(txChild[0].GetHash());
+    BOOST_CHECK(pool.GetMemPoolParents(itChild).empty());
+    BOOST_CHECK_EQUAL(itChild->GetCountWithDescendants(), 2);
+
+    // Resurrecting the parent picks up the child already in the pool
+    pool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 1000LL, 0, 0.0, 1));
+    itParent = pool.mapTx.find(txParent.GetHash());
+    BOOST_CHECK_EQUAL(itParent->GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(itParent->GetSizeWithDescendants(), nParentSize + nChildSize + pool.mapTx.find(txGrandChild.GetHash())->GetTxSize());
+    BOOST_CHECK_EQUAL(itParent->GetModFeesWithDescendants(), 7500LL);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolAncestorStateTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    std::list<CTransaction> removed;
+
+    // Chain of parent -> child -> grandchild
+    CMutableTransaction tx[3];
+    for (int i = 0; i < 3; i++) {
+        tx[i].vin.resize(1);
+        tx[i].vin[0].scriptSig = CScript() << OP_11;
+        if (i > 0) {
+            tx[i].vin[0].prevout.hash = tx[i - 1].GetHash();
+            tx[i].vin[0].prevout.n = 0;
+        }
+        tx[i].vout.resize(1);
+        tx[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx[i].vout[0].nValue = 33000LL - i * 1000LL;
+    }
+    pool.addUnchecked(tx[0].GetHash(), CTxMemPoolEntry(tx[0], 1000LL, 0, 0.0, 1, 1));
+    pool.addUnchecked(tx[1].GetHash(), CTxMemPoolEntry(tx[1], 5000LL, 0, 0.0, 1, 2));
+    pool.addUnchecked(tx[2].GetHash(), CTxMemPoolEntry(tx[2], 0LL, 0, 0.0, 1, 4));
+
+    CTxMemPool::txiter it[3];
+    for (int i = 0; i < 3; i++)
+        it[i] = pool.mapTx.find(tx[i].GetHash());
+    BOOST_CHECK_EQUAL(it[0]->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(it[2]->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(it[2]->GetSizeWithAncestors(), it[0]->GetTxSize() + it[1]->GetTxSize() + it[2]->GetTxSize());
+    BOOST_CHECK_EQUAL(it[2]->GetModFeesWithAncestors(), 6000LL);
+    BOOST_CHECK_EQUAL(it[2]->GetSigOpCountWithAncestors(), 7);
+
+    // The child pays for its parent, so their package sorts first
+    BOOST_CHECK(pool.mapTx.project<0>(pool.mapTx.get<ancestor_score>().begin()) == it[1]);
+
+    // Prioritisation counts towards the descendants
+    pool.PrioritiseTransaction(tx[0].GetHash(), tx[0].GetHash().ToString(), 0.0, 3000LL);
+    BOOST_CHECK_EQUAL(it[1]->GetModFeesWithAncestors(), 9000LL);
+    BOOST_CHECK_EQUAL(it[2]->GetModFeesWithAncestors(), 9000LL);
+
+    // A spend of the grandchild would have three ancestors
+    CMutableTransaction txSpend = tx[2];
+    txSpend.vin[0].prevout.hash = tx[2].GetHash();
+    CTxMemPool::setEntries setAncestors;
+    std::string errString;
+    CTxMemPoolEntry entrySpend(txSpend, 0LL, 0, 0.0, 1);
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(entrySpend, setAncestors, 3, 1000000, 25, 1000000, errString));
+    setAncestors.clear();
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(entrySpend, setAncestors, 4, 1000000, 25, 1000000, errString));
+    BOOST_CHECK_EQUAL(setAncestors.size(), 3);
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(entrySpend, setAncestors, 4, 1000000, 3, 1000000, errString));
+
+    // Removing the parent as if it was mined leaves the rest with one ancestor less
+    pool.remove(tx[0], removed, false);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    BOOST_CHECK_EQUAL(it[1]->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(it[1]->GetModFeesWithAncestors(), 5000LL);
+    BOOST_CHECK_EQUAL(it[2]->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(it[2]->GetSigOpCountWithAncestors(), 6);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    CTxMemPool pool(CFeeRate(1000));
+
+    CMutableTransaction tx1 = CMutableTransaction();
+    tx1.vin.resize(1);
+    tx1.vin[0].scriptSig = CScript() << OP_1;
+    tx1.vout.resize(1);
+    tx1.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+    tx1.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 10000LL, 0, 10.0, 1));
+
+    CMutableTransaction tx2 = CMutableTransaction();
+    tx2.vin.resize(1);
+    tx2.vin[0].scriptSig = CScript() << OP_2;
+    tx2.vout.resize(1);
+    tx2.vout[0].scriptPubKey = CScript() << OP_2 << OP_EQUAL;
+    tx2.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 5000LL, 0, 10.0, 1));
+
+    pool.TrimToSize(pool.DynamicMemoryUsage()); // should do nothing
+    BOOST_CHECK(pool.exists(tx1.GetHash()));
+    BOOST_CHECK(pool.exists(tx2.GetHash()));
+
+    pool.TrimToSize(pool.DynamicMemoryUsage() * 3 / 4); // should remove the lower-feerate transaction
+    BOOST_CHECK(pool.exists(tx1.GetHash()));
+    BOOST_CHECK(!pool.exists(tx2.GetHash()));
+
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 5000LL, 0, 10.0, 1));
+    CMutableTransaction tx3 = CMutableTransaction();
+    tx3.vin.resize(1);
+    tx3.vin[0].prevout = COutPoint(tx2.GetHash(), 0);
+    tx3.vin[0].scriptSig = CScript() << OP_2;
+    tx3.vout.resize(1);
+    tx3.vout[0].scriptPubKey = CScript() << OP_3 << OP_EQUAL;
+    tx3.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx3.GetHash(), CTxMemPoolEntry(tx3, 20000LL, 0, 10.0, 1));
+
+    pool.TrimToSize(pool.DynamicMemoryUsage() * 3 / 4); // tx3 should pay for tx2 (CPFP)
+    BOOST_CHECK(!pool.exists(tx1.GetHash()));
+    BOOST_CHECK(pool.exists(tx2.GetHash()));
+    BOOST_CHECK(pool.exists(tx3.GetHash()));
+
+    pool.TrimToSize(::GetSerializeSize(CTransaction(tx1), SER_NETWORK, PROTOCOL_VERSION)); // nothing fits anymore
+    BOOST_CHECK(!pool.exists(tx2.GetHash()));
+    BOOST_CHECK(!pool.exists(tx3.GetHash()));
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), 0);
+
+    // The rolling minimum fee is the feerate of the best package evicted plus the relay fee
+    CFeeRate maxFeeRateRemoved(25000, ::GetSerializeSize(CTransaction(tx3), SER_NETWORK, PROTOCOL_VERSION) + ::GetSerializeSize(CTransaction(tx2), SER_NETWORK, PROTOCOL_VERSION));
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), maxFeeRateRemoved.GetFeePerK() + 1000);
+
+    // ... and only starts to decay once a block arrived
+    SetMockTime(42);
+    SetMockTime(42 + CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), maxFeeRateRemoved.GetFeePerK() + 1000);
+
+    std::vector<CTransaction> vtx;
+    std::list<CTransaction> conflicts;
+    pool.removeForBlock(vtx, 1, conflicts);
+
+    SetMockTime(42 + 2 * CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), (maxFeeRateRemoved.GetFeePerK() + 1000) / 2);
+
+    // Long enough and it drops below half the relay fee and resets
+    SetMockTime(42 + 20 * CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), 0);
+
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolExpireTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    CMutableTransaction tx1 = CMutableTransaction();
+    tx1.vin.resize(1);
+    tx1.vin[0].scriptSig = CScript() << OP_1;
+    tx1.vout.resize(1);
+    tx1.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+    tx1.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 10000LL, 30, 10.0, 1));
+
+    CMutableTransaction tx2 = CMutableTransaction();
+    tx2.vin.resize(1);
+    tx2.vin[0].scriptSig = CScript() << OP_2;
+    tx2.vout.resize(1);
+    tx2.vout[0].scriptPubKey = CScript() << OP_2 << OP_EQUAL;
+    tx2.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 10000LL, 10, 10.0, 1));
+
+    // A young child of an expired transaction goes with it
+    CMutableTransaction tx3 = CMutableTransaction();
+    tx3.vin.resize(1);
+    tx3.vin[0].prevout = COutPoint(tx2.GetHash(), 0);
+    tx3.vin[0].scriptSig = CScript() << OP_2;
+    tx3.vout.resize(1);
+    tx3.vout[0].scriptPubKey = CScript() << OP_3 << OP_EQUAL;
+    tx3.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx3.GetHash(), CTxMemPoolEntry(tx3, 10000LL, 40, 10.0, 1));
+
+    BOOST_CHECK_EQUAL(pool.Expire(10), 0);
+    BOOST_CHECK_EQUAL(pool.Expire(20), 2);
+    BOOST_CHECK(pool.exists(tx1.GetHash()));
+    BOOST_CHECK(!pool.exists(tx2.GetHash()));
+    BOOST_CHECK(!pool.exists(tx3.GetHash()));
+}
+
+/** Coins view holding a few coins, some of them pruned */
+class CCoinsViewMapTest : public CCoinsView
+{
+public:
+    std::map<uint256, CCoins> mapCoins;
+
+    bool GetCoins(const uint256& txid, CCoins& coins) const
+    {
+        std::map<uint256, CCoins>::const_iterator it = mapCoins.find(txid);
+        if (it == mapCoins.end())
+            return false;
+        coins = it->second;
+        return true;
+    }
+};
+
+BOOST_AUTO_TEST_CASE(MempoolCoinsViewBatchTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CMutableTransaction tx1 = CMutableTransaction();
+    tx1.vin.resize(1);
+    tx1.vin[0].scriptSig = CScript() << OP_1;
+    tx1.vout.resize(1);
+    tx1.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+    tx1.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 10000LL, 0, 10.0, 1));
+
+    CCoinsViewMapTest base;
+    uint256 txidUnspent = GetRandHash(), txidPruned = GetRandHash(), txidMissing = GetRandHash();
+    CCoins& coins = base.mapCoins[txidUnspent];
+    coins.nVersion = 1;
+    coins.nHeight = 10;
+    coins.vout.resize(2);
+    coins.vout[1].nValue = 5 * COIN;
+    coins.vout[1].scriptPubKey = CScript() << OP_TRUE;
+    base.mapCoins[txidPruned].nVersion = 1;
+
+    // The batch finds what GetCoins finds: the mempool transaction and the unspent coins of the base
+    CCoinsViewMemPool view(&base, pool);
+    std::vector<uint256> vTxid;
+    vTxid.push_back(txidPruned);
+    vTxid.push_back(tx1.GetHash());
+    vTxid.push_back(txidMissing);
+    vTxid.push_back(txidUnspent);
+    std::vector<std::pair<uint256, CCoins> > vCoins;
+    view.GetCoinsBatch(vTxid, vCoins);
+    BOOST_CHECK_EQUAL(vCoins.size(), 2);
+    for (unsigned int i = 0; i < vCoins.size(); i++) {
+        CCoins coinsSingle;
+        BOOST_CHECK(view.GetCoins(vCoins[i].first, coinsSingle));
+        BOOST_CHECK(vCoins[i].second == coinsSingle);
+    }
+    BOOST_CHECK(vCoins[0].first == tx1.GetHash());
+    BOOST_CHECK_EQUAL(vCoins[0].second.nHeight, MEMPOOL_HEIGHT);
+    BOOST_CHECK(vCoins[1].first == txidUnspent);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -4,11 +4,15 @@
 
 #include "init.h"
 #include "main.h"
+#include "masternode-payments.h"
 #include "miner.h"
 #include "pubkey.h"
 #include "uint256.h"
 #include "util.h"
 
+#include <algorithm>
+#include <list>
+
 #include <boost/test/unit_test.hpp>
 
 BOOST_AUTO_TEST_SUITE(miner_tests)
@@ -81,6 +85,7 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
             txFirst.push_back(new CTransaction(pblock->vtx[0]));
         pblock->hashMerkleRoot = pblock->BuildMerkleTree();
         pblock->nNonce = blockinfo[i].nonce;
+        pblock->InvalidateHash();
         CValidationState state;
         BOOST_CHECK(ProcessNewBlock(state, NULL, pblock));
         BOOST_CHECK(state.IsValid());
@@ -264,4 +269,136 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     Checkpoints::fEnabled = true;
 }
 
+static void VoteBlockPayee(int nBlockHeight, const CScript& payee, uint32_t n)
+{
+    CMasternodePaymentWinner winner(CTxIn(COutPoint(uint256(n + 1), n)));
+    winner.nBlockHeight = nBlockHeight;
+    winner.AddPayee(payee);
+    BOOST_CHECK(masternodePayments.AddWinningMasternode(winner));
+}
+
+BOOST_AUTO_TEST_CASE(CreateNewBlock_cache_payee)
+{
+    CScript scriptPubKey = CScript() << OP_TRUE;
+    CScript payeeA = CScript() << OP_1 << OP_DROP << OP_TRUE;
+    CScript payeeB = CScript() << OP_2 << OP_DROP << OP_TRUE;
+    unsigned int nTransactionsUpdated;
+
+    LOCK(cs_main);
+    Checkpoints::fEnabled = false;
+    const int nHeight = chainActive.Height() + 1;
+    BOOST_REQUIRE(nHeight > 100);
+
+    CBlockTemplateCache cache;
+    VoteBlockPayee(nHeight, payeeA, 0);
+    boost::shared_ptr<const CBlockTemplate> ptemplate = cache.Get(scriptPubKey, pwalletMain, 60, nTransactionsUpdated);
+    BOOST_REQUIRE(ptemplate);
+    BOOST_REQUIRE_EQUAL(ptemplate->block.vtx[0].vout.size(), 2U);
+    BOOST_CHECK(ptemplate->block.vtx[0].vout[1].scriptPubKey == payeeA);
+    BOOST_CHECK(cache.Get(scriptPubKey, pwalletMain, 60, nTransactionsUpdated) == ptemplate);
+
+    // Same tip and mempool, but another masternode won the votes for the next block
+    VoteBlockPayee(nHeight, payeeB, 1);
+    VoteBlockPayee(nHeight, payeeB, 2);
+    boost::shared_ptr<const CBlockTemplate> ptemplateNew = cache.Get(scriptPubKey, pwalletMain, 60, nTransactionsUpdated);
+    BOOST_REQUIRE(ptemplateNew);
+    BOOST_CHECK(ptemplateNew != ptemplate);
+    BOOST_CHECK_EQUAL(ptemplateNew->block.hashPrevBlock.ToString(), ptemplate->block.hashPrevBlock.ToString());
+    BOOST_REQUIRE_EQUAL(ptemplateNew->block.vtx[0].vout.size(), 2U);
+    BOOST_CHECK(ptemplateNew->block.vtx[0].vout[1].scriptPubKey == payeeB);
+    BOOST_CHECK(ptemplate->block.vtx[0].vout[1].scriptPubKey == payeeA);
+    BOOST_CHECK(cache.Get(scriptPubKey, pwalletMain, 60, nTransactionsUpdated) == ptemplateNew);
+
+    masternodePayments.Clear();
+    Checkpoints::fEnabled = true;
+}
+
+static CMutableTransaction SpendOutput(const CTransaction& txPrev, CAmount nFee)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(txPrev.GetHash(), 0);
+    tx.vin[0].scriptSig = CScript() << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = txPrev.vout[0].nValue - nFee;
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    return tx;
+}
+
+static bool TemplateHasTx(const CBlockTemplate& blocktemplate, const CTransaction& tx)
+{
+    return std::find(blocktemplate.block.vtx.begin(), blocktemplate.block.vtx.end(), tx) != blocktemplate.block.vtx.end();
+}
+
+BOOST_AUTO_TEST_CASE(CreateNewBlock_cache_update)
+{
+    CScript scriptPubKey = CScript() << OP_TRUE;
+    CScript scriptOther = CScript() << OP_2 << OP_DROP << OP_TRUE;
+    const CAmount nFee = 1000000;
+    unsigned int nTransactionsUpdated;
+
+    LOCK(cs_main);
+    Checkpoints::fEnabled = false;
+    BOOST_REQUIRE(chainActive.Height() > 100);
+    SetMockTime(GetTime());
+
+    // The coinbases of the first blocks are mature and left unspent by the tests before
+    std::vector<CTransaction> vCoinbase;
+    for (int i = 1; i <= 2; i++) {
+        CBlock block;
+        BOOST_REQUIRE(ReadBlockFromDisk(block, chainActive[i]));
+        vCoinbase.push_back(block.vtx[0]);
+    }
+    CTransaction txParent = SpendOutput(vCoinbase[0], nFee);
+    CTransaction txChild = SpendOutput(txParent, nFee);
+    CTransaction txOther = SpendOutput(vCoinbase[1], nFee);
+
+    CBlockTemplateCache cache;
+    mempool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, nFee, GetTime(), 111.0, chainActive.Height()));
+    mempool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, nFee, GetTime(), 111.0, chainActive.Height()));
+    boost::shared_ptr<const CBlockTemplate> ptemplate = cache.Get(scriptPubKey, pwalletMain, 5, nTransactionsUpdated);
+    BOOST_REQUIRE(ptemplate);
+    BOOST_CHECK_EQUAL(ptemplate->block.vtx.size(), 3U);
+
+    // Within the refresh interval a new transaction waits
+    mempool.addUnchecked(txOther.GetHash(), CTxMemPoolEntry(txOther, nFee, GetTime(), 111.0, chainActive.Height()));
+    BOOST_CHECK(cache.Get(scriptPubKey, pwalletMain, 5, nTransactionsUpdated) == ptemplate);
+
+    // Then it is added after the transactions already selected
+    SetMockTime(GetTime() + 10);
+    boost::shared_ptr<const CBlockTemplate> ptemplateAdded = cache.Get(scriptPubKey, pwalletMain, 5, nTransactionsUpdated);
+    BOOST_REQUIRE(ptemplateAdded);
+    BOOST_CHECK(ptemplateAdded != ptemplate);
+    BOOST_REQUIRE_EQUAL(ptemplateAdded->block.vtx.size(), 4U);
+    BOOST_CHECK(ptemplateAdded->block.vtx[0] == ptemplate->block.vtx[0]);
+    BOOST_CHECK(ptemplateAdded->block.vtx[1] == ptemplate->block.vtx[1]);
+    BOOST_CHECK(ptemplateAdded->block.vtx[2] == ptemplate->block.vtx[2]);
+    BOOST_CHECK(ptemplateAdded->block.vtx[3] == txOther);
+    BOOST_CHECK_EQUAL(ptemplateAdded->vTxFees[0], -3 * nFee);
+    BOOST_CHECK_EQUAL(ptemplate->block.vtx.size(), 3U);
+
+    // A transaction leaving the mempool is dropped with its descendants
+    std::list<CTransaction> removed;
+    mempool.remove(txParent, removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 2U);
+    SetMockTime(GetTime() + 10);
+    boost::shared_ptr<const CBlockTemplate> ptemplateDropped = cache.Get(scriptPubKey, pwalletMain, 5, nTransactionsUpdated);
+    BOOST_REQUIRE(ptemplateDropped);
+    BOOST_REQUIRE_EQUAL(ptemplateDropped->block.vtx.size(), 2U);
+    BOOST_CHECK(ptemplateDropped->block.vtx[1] == txOther);
+    BOOST_CHECK_EQUAL(ptemplateDropped->vTxFees[0], -nFee);
+    BOOST_CHECK(TemplateHasTx(*ptemplateAdded, txParent));
+
+    // Another coinbase script gets the same transactions
+    boost::shared_ptr<const CBlockTemplate> ptemplateOther = cache.Get(scriptOther, pwalletMain, 5, nTransactionsUpdated);
+    BOOST_REQUIRE(ptemplateOther);
+    BOOST_CHECK(ptemplateOther->block.vtx[0].vout[0].scriptPubKey == scriptOther);
+    BOOST_CHECK(ptemplateOther->block.vtx[1] == txOther);
+    BOOST_CHECK(ptemplateDropped->block.vtx[0].vout[0].scriptPubKey == scriptPubKey);
+
+    mempool.clear();
+    SetMockTime(0);
+    Checkpoints::fEnabled = true;
+}
+
 BOOST_AUTO_TEST_SUITE_END()
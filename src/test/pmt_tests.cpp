@@ -104,4 +104,41 @@ BOOST_AUTO_TEST_CASE(pmt_test1)
     }
 }
 
+BOOST_AUTO_TEST_CASE(merkle_root_reuse)
+{
+    for (unsigned int nTx = 0; nTx < 20; nTx++) {
+        CBlock block;
+        for (unsigned int j = 0; j < nTx; j++) {
+            CMutableTransaction tx;
+            tx.nLockTime = rand();
+            block.vtx.push_back(CTransaction(tx));
+        }
+        // duplicate the last two transactions, a mutation BuildMerkleTree reports; the root
+        // stays as it is unless there were only two, which gives H(H(ab), H(ab)) instead of H(ab)
+        if (nTx >= 2 && nTx % 2 == 0 && nTx % 4 != 0) {
+            block.vtx.push_back(block.vtx[nTx - 2]);
+            block.vtx.push_back(block.vtx[nTx - 1]);
+        }
+
+        bool fMutated1 = false, fMutated2 = true;
+        uint256 root1 = block.BuildMerkleTree(&fMutated1);
+        std::vector<uint256> vTree = block.vMerkleTree;
+
+        // the tree is reused, with the same result
+        BOOST_CHECK(block.GetMerkleRoot(&fMutated2) == root1);
+        BOOST_CHECK_EQUAL(fMutated1, fMutated2);
+        BOOST_CHECK(block.vMerkleTree == vTree);
+
+        // a tree built from other transactions is not
+        if (nTx > 0) {
+            CMutableTransaction tx;
+            tx.nLockTime = rand();
+            block.vtx.back() = CTransaction(tx);
+            BOOST_CHECK(block.GetMerkleRoot(&fMutated2) == block.BuildMerkleTree(&fMutated1));
+            BOOST_CHECK(block.GetMerkleRoot() != root1);
+            BOOST_CHECK_EQUAL(fMutated1, fMutated2);
+        }
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
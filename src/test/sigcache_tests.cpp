@@ -0,0 +1,89 @@
+// Copyright (c) 2017 The PIVX developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "key.h"
+#include "random.h"
+#include "script/sigcache.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(sigcache_tests)
+
+BOOST_AUTO_TEST_CASE(sigcache_entries)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    CKey keyOther;
+    keyOther.MakeNewKey(true);
+
+    CSignatureCache cache(1 << 20);
+    BOOST_CHECK(cache.GetCapacity() > 25000);
+
+    uint256 sighash = GetRandHash();
+    vector<unsigned char> vchSig;
+    BOOST_CHECK(key.Sign(sighash, vchSig));
+    BOOST_CHECK(!cache.Get(sighash, vchSig, pubkey));
+    cache.Set(sighash, vchSig, pubkey);
+    BOOST_CHECK(cache.Get(sighash, vchSig, pubkey));
+
+    // Any other part of the entry misses
+    BOOST_CHECK(!cache.Get(GetRandHash(), vchSig, pubkey));
+    BOOST_CHECK(!cache.Get(sighash, vchSig, keyOther.GetPubKey()));
+    vector<unsigned char> vchSigOther(vchSig);
+    vchSigOther.back() ^= 1;
+    BOOST_CHECK(!cache.Get(sighash, vchSigOther, pubkey));
+    BOOST_CHECK(!cache.Get(sighash, vector<unsigned char>(), pubkey));
+
+    // Filling the cache several times over evicts old entries, the recent ones stay
+    vector<uint256> vHashes;
+    for (size_t i = 0; i < cache.GetCapacity() * 3; i++) {
+        vHashes.push_back(GetRandHash());
+        cache.Set(vHashes.back(), vchSig, pubkey);
+    }
+    size_t nOldHits = 0, nRecentHits = 0;
+    for (size_t i = 0; i < 1000; i++) {
+        nOldHits += cache.Get(vHashes[i], vchSig, pubkey);
+        nRecentHits += cache.Get(vHashes[vHashes.size() - 1 - i], vchSig, pubkey);
+    }
+    BOOST_CHECK(nOldHits < 100);
+    BOOST_CHECK(nRecentHits > 900);
+
+    // A cache without memory keeps nothing
+    CSignatureCache cacheNone(0);
+    BOOST_CHECK_EQUAL(cacheNone.GetCapacity(), 0);
+    cacheNone.Set(sighash, vchSig, pubkey);
+    BOOST_CHECK(!cacheNone.Get(sighash, vchSig, pubkey));
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_transactions)
+{
+    CSignatureCache cache(1 << 20);
+    uint256 txid = GetRandHash();
+    BOOST_CHECK(!cache.Get(txid, SCRIPT_VERIFY_P2SH));
+    cache.Set(txid, SCRIPT_VERIFY_P2SH);
+    BOOST_CHECK(cache.Get(txid, SCRIPT_VERIFY_P2SH));
+
+    // Only the exact flags it passed under count
+    BOOST_CHECK(!cache.Get(txid, SCRIPT_VERIFY_NONE));
+    BOOST_CHECK(!cache.Get(txid, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC));
+    BOOST_CHECK(!cache.Get(GetRandHash(), SCRIPT_VERIFY_P2SH));
+
+    // A transaction entry never matches a signature entry of the same hash
+    CKey key;
+    key.MakeNewKey(true);
+    BOOST_CHECK(!cache.Get(txid, vector<unsigned char>(), key.GetPubKey()));
+
+    uint256 txidShared = GetRandHash();
+    BOOST_CHECK(!IsTransactionVerified(txidShared, SCRIPT_VERIFY_P2SH));
+    SetTransactionVerified(txidShared, SCRIPT_VERIFY_P2SH);
+    BOOST_CHECK(IsTransactionVerified(txidShared, SCRIPT_VERIFY_P2SH));
+    BOOST_CHECK(!IsTransactionVerified(txidShared, SCRIPT_VERIFY_NONE));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
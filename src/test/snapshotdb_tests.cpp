@@ -0,0 +1,164 @@
+// Copyright (c) 2017 The PIVX developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "snapshotdb.h"
+#include "util.h"
+
+#include <map>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(snapshotdb_tests)
+
+static uint64_t FileSize(const CSnapshotDB& snapshot)
+{
+    return boost::filesystem::file_size(GetDataDir() / snapshot.GetFilename());
+}
+
+static map<int, string> ReadMap(CSnapshotDB& snapshot, uint32_t nId)
+{
+    map<int, string> m;
+    BOOST_CHECK(snapshot.ReadSection(nId, m) == CSnapshotDB::Ok);
+    return m;
+}
+
+BOOST_AUTO_TEST_CASE(snapshotdb_append)
+{
+    map<int, string> mapSmall, mapLarge;
+    mapSmall[1] = "one";
+    for (int i = 0; i < 100; i++)
+        mapLarge[i] = string(100, 'a' + i % 26);
+
+    CSnapshotDB snapshot("snapshotdb_append.dat", "SnapshotTest");
+    snapshot.AddSection(1, mapSmall);
+    snapshot.AddSection(2, mapLarge);
+    BOOST_CHECK(snapshot.WriteSections());
+    uint64_t nSize = FileSize(snapshot);
+
+    // Another reader finds the sections, a file of another kind is refused
+    CSnapshotDB reader("snapshotdb_append.dat", "SnapshotTest");
+    BOOST_CHECK(reader.ReadHeader() == CSnapshotDB::Ok);
+    BOOST_CHECK(ReadMap(reader, 1) == mapSmall);
+    BOOST_CHECK(ReadMap(reader, 2) == mapLarge);
+    BOOST_CHECK(!reader.HasSection(3));
+    CSnapshotDB other("snapshotdb_append.dat", "OtherTest");
+    BOOST_CHECK(other.ReadHeader() == CSnapshotDB::IncorrectMagicMessage);
+
+    // Unchanged sections are not written again
+    snapshot.AddSection(1, mapSmall);
+    snapshot.AddSection(2, mapLarge);
+    BOOST_CHECK(snapshot.WriteSections());
+    BOOST_CHECK_EQUAL(FileSize(snapshot), nSize);
+
+    // A changed section is appended, the large one stays where it is
+    mapSmall[2] = "two";
+    snapshot.AddSection(1, mapSmall);
+    snapshot.AddSection(2, mapLarge);
+    BOOST_CHECK(snapshot.WriteSections());
+    BOOST_CHECK(FileSize(snapshot) > nSize);
+    BOOST_CHECK(FileSize(snapshot) < nSize + 1000);
+    BOOST_CHECK(reader.ReadHeader() == CSnapshotDB::Ok);
+    BOOST_CHECK(ReadMap(reader, 1) == mapSmall);
+    BOOST_CHECK(ReadMap(reader, 2) == mapLarge);
+
+    // A section read later from an older table is still there after appends
+    CSnapshotDB deferred(reader);
+    for (int i = 0; i < 20; i++) {
+        mapSmall[i] = string(200, 'x');
+        snapshot.AddSection(1, mapSmall);
+        snapshot.KeepSection(2);
+        BOOST_CHECK(snapshot.WriteSections());
+        BOOST_CHECK(FileSize(snapshot) > nSize);
+        nSize = FileSize(snapshot);
+    }
+    BOOST_CHECK(ReadMap(deferred, 2) == mapLarge);
+    BOOST_CHECK(reader.ReadHeader() == CSnapshotDB::Ok);
+    BOOST_CHECK(ReadMap(reader, 1) == mapSmall);
+    BOOST_CHECK(ReadMap(reader, 2) == mapLarge);
+
+    // Without kept sections, a file mostly stale is written anew
+    mapSmall[0] = "zero";
+    snapshot.AddSection(1, mapSmall);
+    snapshot.AddSection(2, mapLarge);
+    BOOST_CHECK(snapshot.WriteSections());
+    BOOST_CHECK(FileSize(snapshot) < nSize);
+    BOOST_CHECK(reader.ReadHeader() == CSnapshotDB::Ok);
+    BOOST_CHECK(ReadMap(reader, 1) == mapSmall);
+    BOOST_CHECK(ReadMap(reader, 2) == mapLarge);
+
+    // Merging keeps the entries already there, a dropped section is not read
+    map<int, string> mapMerged;
+    mapMerged[0] = "newer";
+    mapMerged[1000] = "added";
+    BOOST_CHECK(reader.MergeSection(1, mapMerged) == CSnapshotDB::Ok);
+    BOOST_CHECK_EQUAL(mapMerged.size(), mapSmall.size() + 1);
+    BOOST_CHECK_EQUAL(mapMerged[0], "newer");
+    BOOST_CHECK_EQUAL(mapMerged[1], mapSmall[1]);
+    reader.DropSection(2);
+    BOOST_CHECK(!reader.HasSection(2));
+    map<int, string> mapDropped;
+    BOOST_CHECK(reader.MergeSection(2, mapDropped) == CSnapshotDB::Ok);
+    BOOST_CHECK(mapDropped.empty());
+
+    boost::filesystem::remove(GetDataDir() / snapshot.GetFilename());
+}
+
+BOOST_AUTO_TEST_CASE(snapshotdb_damaged)
+{
+    map<int, string> mapSmall, mapLarge;
+    mapSmall[1] = "one";
+    for (int i = 0; i < 100; i++)
+        mapLarge[i] = string(100, 'a' + i % 26);
+
+    CSnapshotDB snapshot("snapshotdb_damaged.dat", "SnapshotTest");
+    snapshot.AddSection(1, mapSmall);
+    snapshot.AddSection(2, mapLarge);
+    BOOST_CHECK(snapshot.WriteSections());
+    boost::filesystem::path path = GetDataDir() / snapshot.GetFilename();
+    uint64_t nSize = FileSize(snapshot);
+
+    // A damaged section only loses its own data
+    FILE* file = fopen(path.string().c_str(), "r+b");
+    BOOST_REQUIRE(file);
+    BOOST_CHECK_EQUAL(fseek(file, nSize / 2, SEEK_SET), 0);
+    BOOST_CHECK_EQUAL(fputc('!', file), '!');
+    fclose(file);
+    CSnapshotDB reader("snapshotdb_damaged.dat", "SnapshotTest");
+    BOOST_CHECK(reader.ReadHeader() == CSnapshotDB::Ok);
+    BOOST_CHECK(ReadMap(reader, 1) == mapSmall);
+    map<int, string> m;
+    BOOST_CHECK(reader.ReadSection(2, m) == CSnapshotDB::IncorrectHash);
+
+    // It is replaced once its content changes
+    mapLarge[0] = "changed";
+    snapshot.AddSection(1, mapSmall);
+    snapshot.AddSection(2, mapLarge);
+    BOOST_CHECK(snapshot.WriteSections());
+    BOOST_CHECK(reader.ReadHeader() == CSnapshotDB::Ok);
+    BOOST_CHECK(ReadMap(reader, 2) == mapLarge);
+
+    // An append cut short leaves no valid table
+    nSize = FileSize(snapshot);
+    boost::filesystem::resize_file(path, nSize - 1);
+    BOOST_CHECK(reader.ReadHeader() != CSnapshotDB::Ok);
+    boost::filesystem::resize_file(path, 3);
+    BOOST_CHECK(reader.ReadHeader() != CSnapshotDB::Ok);
+
+    // and it is written anew
+    snapshot.AddSection(1, mapSmall);
+    BOOST_CHECK(snapshot.WriteSections());
+    BOOST_CHECK(reader.ReadHeader() == CSnapshotDB::Ok);
+    BOOST_CHECK(ReadMap(reader, 1) == mapSmall);
+    BOOST_CHECK(!reader.HasSection(2));
+
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -7,20 +7,92 @@
 
 #include "main.h"
 #include "pow.h"
+#include "random.h"
+#include "ui_interface.h"
 #include "uint256.h"
+#include "util.h"
 
+#include <algorithm>
+#include <deque>
 #include <stdint.h>
 
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
 
-void static BatchWriteCoins(CLevelDBBatch& batch, const uint256& hash, const CCoins& coins)
+static const char DB_COINS_LEGACY = 'c';
+static const char DB_COIN = 'C';
+
+/** Number of transactions converted per batch by CCoinsViewDB::Upgrade */
+static const unsigned int UPGRADE_BATCH_TXS = 10000;
+
+/** Key of an unspent output record: the txid followed by the output index */
+class CCoinKey
 {
-    if (coins.IsPruned())
-        batch.Erase(make_pair('c', hash));
-    else
-        batch.Write(make_pair('c', hash), coins);
+public:
+    uint256 txid;
+    uint32_t n;
+
+    CCoinKey() : txid(0), n(0) {}
+    CCoinKey(const uint256& txidIn, uint32_t nIn) : txid(txidIn), n(nIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(txid);
+        READWRITE(VARINT(n));
+    }
+};
+
+/** Value of an unspent output record: the output and the metadata of its transaction */
+class CCoinRecord
+{
+public:
+    int nVersion;
+    int nHeight;
+    bool fCoinBase;
+    bool fCoinStake;
+    CTxOut out;
+
+    CCoinRecord() : nVersion(0), nHeight(0), fCoinBase(false), fCoinStake(false) {}
+    CCoinRecord(const CCoins& coins, unsigned int nPos) : nVersion(coins.nVersion), nHeight(coins.nHeight),
+                                                          fCoinBase(coins.fCoinBase), fCoinStake(coins.fCoinStake), out(coins.vout[nPos]) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersionIn)
+    {
+        uint32_t nCode = (uint32_t)nHeight * 4 + (fCoinBase ? 1 : 0) + (fCoinStake ? 2 : 0);
+        READWRITE(VARINT(nCode));
+        if (ser_action.ForRead()) {
+            nHeight = nCode / 4;
+            fCoinBase = nCode & 1;
+            fCoinStake = (nCode & 2) != 0;
+        }
+        READWRITE(VARINT(nVersion));
+        READWRITE(REF(CTxOutCompressor(out)));
+    }
+};
+
+void static BatchWriteCoins(CLevelDBBatch& batch, const uint256& hash, const CCoins& coins, const CCoins& coinsOld)
+{
+    // Rewrite everything if the transaction itself was replaced, as in a reorganization
+    bool fSameTx = coins.nHeight == coinsOld.nHeight && coins.nVersion == coinsOld.nVersion &&
+                   coins.fCoinBase == coinsOld.fCoinBase && coins.fCoinStake == coinsOld.fCoinStake;
+    unsigned int nOutputs = std::max(coins.vout.size(), coinsOld.vout.size());
+    for (unsigned int i = 0; i < nOutputs; i++) {
+        bool fAvailable = coins.IsAvailable(i);
+        bool fAvailableOld = coinsOld.IsAvailable(i);
+        if (fAvailable && (!fAvailableOld || !fSameTx || coins.vout[i] != coinsOld.vout[i]))
+            batch.Write(make_pair(DB_COIN, CCoinKey(hash, i)), CCoinRecord(coins, i));
+        else if (!fAvailable && fAvailableOld)
+            batch.Erase(make_pair(DB_COIN, CCoinKey(hash, i)));
+    }
 }
 
 void static BatchWriteHashBestChain(CLevelDBBatch& batch, const uint256& hash)
@@ -32,14 +104,233 @@ CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(Get
 {
 }
 
+/** Whether a key is one of the output records of txid, whose serialization is in ssPrefix */
+static bool IsCoinKeyOf(const leveldb::Slice& slKey, const CDataStream& ssPrefix)
+{
+    return slKey.size() > ssPrefix.size() && memcmp(slKey.data(), &ssPrefix[0], ssPrefix.size()) == 0;
+}
+
+/** Read the output records of txid into coins, seeking pcursor to them; returns false if there are none */
+static bool ReadCoins(leveldb::Iterator* pcursor, const uint256& txid, CCoins& coins)
+{
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << DB_COIN << txid;
+    pcursor->Seek(leveldb::Slice(&ssPrefix[0], ssPrefix.size()));
+
+    CCoins coinsRet;
+    bool fFound = false;
+    try {
+        for (; pcursor->Valid() && IsCoinKeyOf(pcursor->key(), ssPrefix); pcursor->Next()) {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            CCoinKey key;
+            ssKey >> chType >> key;
+
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            CCoinRecord record;
+            ssValue >> record;
+
+            coinsRet.nVersion = record.nVersion;
+            coinsRet.nHeight = record.nHeight;
+            coinsRet.fCoinBase = record.fCoinBase;
+            coinsRet.fCoinStake = record.fCoinStake;
+            if (key.n >= coinsRet.vout.size())
+                coinsRet.vout.resize(key.n + 1);
+            coinsRet.vout[key.n] = record.out;
+            fFound = true;
+        }
+    } catch (std::exception& e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+    HandleError(pcursor->status());
+
+    if (fFound)
+        coinsRet.swap(coins);
+    return fFound;
+}
+
 bool CCoinsViewDB::GetCoins(const uint256& txid, CCoins& coins) const
 {
-    return db.Read(make_pair('c', txid), coins);
+    boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
+    return ReadCoins(pcursor.get(), txid, coins);
+}
+
+/**
+ * Threads reading and decoding database records for CCoinsViewDB::GetCoinsBatch and
+ * CBlockTreeDB::LoadBlockIndexGuts. They are started as -dbreadthreads asks for them and
+ * kept until exit, so a batch does not pay for creating threads. The caller of Run works as one of them.
+ * The jobs of concurrent callers share the queue.
+ */
+class CDBReadPool
+{
+private:
+    //! A job and the count of unfinished jobs of the Run it belongs to
+    typedef std::pair<boost::function<void()>, int*> Job;
+
+    boost::mutex mutex;
+    boost::condition_variable condWorker;
+    boost::condition_variable condDone;
+    std::deque<Job> queue;
+    boost::thread_group threadGroup;
+    int nStarted;
+    bool fQuit;
+
+    //! Take the next job; returns false once the pool quits
+    bool Take(boost::unique_lock<boost::mutex>& lock, Job& job)
+    {
+        while (queue.empty() && !fQuit)
+            condWorker.wait(lock);
+        if (queue.empty())
+            return false;
+        job = queue.front();
+        queue.pop_front();
+        return true;
+    }
+
+    //! Run a job taken from the queue and count it done; jobs do not throw
+    void Execute(boost::unique_lock<boost::mutex>& lock, const Job& job)
+    {
+        lock.unlock();
+        job.first();
+        lock.lock();
+        if (--*job.second == 0)
+            condDone.notify_all();
+    }
+
+    void Thread()
+    {
+        RenameThread("pivx-dbread");
+        boost::unique_lock<boost::mutex> lock(mutex);
+        Job job;
+        while (Take(lock, job))
+            Execute(lock, job);
+    }
+
+public:
+    CDBReadPool() : nStarted(0), fQuit(false) {}
+
+    ~CDBReadPool()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fQuit = true;
+        }
+        condWorker.notify_all();
+        threadGroup.join_all();
+    }
+
+    //! Number of threads to split a batch over, the caller included, from -dbreadthreads; starts the missing ones
+    int Threads()
+    {
+        int nThreads = GetArg("-dbreadthreads", 0);
+        if (nThreads <= 0)
+            nThreads = boost::thread::hardware_concurrency();
+        nThreads = std::max(1, std::min(nThreads, MAX_DB_READ_THREADS));
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        for (; nStarted < nThreads - 1; nStarted++)
+            threadGroup.create_thread(boost::bind(&CDBReadPool::Thread, this));
+        return nThreads;
+    }
+
+    //! Run the jobs and return once all of them are done
+    void Run(const std::vector<boost::function<void()> >& vJobs)
+    {
+        // The jobs reference the stack frame of the caller, so they must be done even if this thread is interrupted
+        boost::this_thread::disable_interruption di;
+        int nTodo = vJobs.size();
+        boost::unique_lock<boost::mutex> lock(mutex);
+        for (unsigned int i = 0; i < vJobs.size(); i++)
+            queue.push_back(std::make_pair(vJobs[i], &nTodo));
+        condWorker.notify_all();
+        while (nTodo > 0) {
+            if (queue.empty()) {
+                condDone.wait(lock);
+                continue;
+            }
+            Job job = queue.front();
+            queue.pop_front();
+            Execute(lock, job);
+        }
+    }
+};
+
+static CDBReadPool dbReadPool;
+
+/** Order of txids in the database, whose keys hold their bytes in memory order */
+static bool CompareTxidKeys(const uint256& a, const uint256& b)
+{
+    return memcmp(a.begin(), b.begin(), a.size()) < 0;
+}
+
+/** Read the coins of the txids in [first, last) with one cursor; a database error is kept in strError as a worker must not throw */
+static void ReadCoinsRange(CLevelDBWrapper* pdb, std::vector<uint256>::const_iterator first, std::vector<uint256>::const_iterator last, std::vector<std::pair<uint256, CCoins> >* pvCoinsRet, std::string* pstrError)
+{
+    try {
+        boost::scoped_ptr<leveldb::Iterator> pcursor(pdb->NewIterator());
+        for (; first != last; ++first) {
+            CCoins coins;
+            if (ReadCoins(pcursor.get(), *first, coins)) {
+                pvCoinsRet->push_back(std::make_pair(*first, CCoins()));
+                pvCoinsRet->back().second.swap(coins);
+            }
+        }
+    } catch (const leveldb_error& e) {
+        *pstrError = e.what();
+    }
+}
+
+void CCoinsViewDB::GetCoinsBatch(const std::vector<uint256>& vTxid, std::vector<std::pair<uint256, CCoins> >& vCoinsRet) const
+{
+    // Sorted, every seek lands close after the previous one, mostly in blocks leveldb already read
+    std::vector<uint256> vSorted(vTxid);
+    std::sort(vSorted.begin(), vSorted.end(), CompareTxidKeys);
+    vSorted.erase(std::unique(vSorted.begin(), vSorted.end()), vSorted.end());
+
+    int nThreads = std::max<size_t>(1, std::min<size_t>(dbReadPool.Threads(), vSorted.size() / DB_READ_THREAD_BATCH));
+
+    CLevelDBWrapper* pdb = const_cast<CLevelDBWrapper*>(&db);
+    if (nThreads == 1) {
+        std::string strError;
+        ReadCoinsRange(pdb, vSorted.begin(), vSorted.end(), &vCoinsRet, &strError);
+        if (!strError.empty())
+            throw leveldb_error(strError);
+        return;
+    }
+
+    // Each worker sweeps a contiguous part of the key range with its own cursor
+    std::vector<std::vector<std::pair<uint256, CCoins> > > vResults(nThreads);
+    std::vector<std::string> vErrors(nThreads);
+    std::vector<boost::function<void()> > vJobs;
+    for (int i = 0; i < nThreads; i++) {
+        std::vector<uint256>::const_iterator first = vSorted.begin() + vSorted.size() * i / nThreads;
+        std::vector<uint256>::const_iterator last = vSorted.begin() + vSorted.size() * (i + 1) / nThreads;
+        vJobs.push_back(boost::bind(&ReadCoinsRange, pdb, first, last, &vResults[i], &vErrors[i]));
+    }
+    dbReadPool.Run(vJobs);
+    for (int i = 0; i < nThreads; i++) {
+        if (!vErrors[i].empty())
+            throw leveldb_error(vErrors[i]);
+    }
+    for (int i = 0; i < nThreads; i++) {
+        for (std::vector<std::pair<uint256, CCoins> >::iterator it = vResults[i].begin(); it != vResults[i].end(); it++) {
+            vCoinsRet.push_back(std::make_pair(it->first, CCoins()));
+            vCoinsRet.back().second.swap(it->second);
+        }
+    }
 }
 
 bool CCoinsViewDB::HaveCoins(const uint256& txid) const
 {
-    return db.Exists(make_pair('c', txid));
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << DB_COIN << txid;
+    boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
+    pcursor->Seek(leveldb::Slice(&ssPrefix[0], ssPrefix.size()));
+    bool fFound = pcursor->Valid() && IsCoinKeyOf(pcursor->key(), ssPrefix);
+    HandleError(pcursor->status());
+    return fFound;
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const
@@ -50,19 +341,27 @@ uint256 CCoinsViewDB::GetBestBlock() const
     return hashBestChain;
 }
 
-bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
+bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, bool fErase)
 {
     CLevelDBBatch batch;
     size_t count = 0;
     size_t changed = 0;
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            BatchWriteCoins(batch, it->first, it->second.coins);
+            // Only outputs that differ from the records on disk are written
+            CCoins coinsOld;
+            if (!(it->second.flags & CCoinsCacheEntry::FRESH))
+                GetCoins(it->first, coinsOld);
+            BatchWriteCoins(batch, it->first, it->second.coins, coinsOld);
             changed++;
         }
         count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
+        if (fErase) {
+            CCoinsMap::iterator itOld = it++;
+            mapCoins.erase(itOld);
+        } else {
+            ++it;
+        }
     }
     if (hashBlock != uint256(0))
         BatchWriteHashBestChain(batch, hashBlock);
@@ -71,6 +370,60 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
     return db.WriteBatch(batch);
 }
 
+bool CCoinsViewDB::Upgrade()
+{
+    boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewIterator());
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << DB_COINS_LEGACY;
+    pcursor->Seek(ssKeySet.str());
+    if (!pcursor->Valid() || pcursor->key()[0] != DB_COINS_LEGACY)
+        return true;
+
+    LogPrintf("Upgrading chainstate database to one record per unspent output...\n");
+    uiInterface.InitMessage(_("Upgrading chainstate database..."));
+    int64_t nStart = GetTimeMillis();
+    unsigned int nTransactions = 0;
+    unsigned int nOutputs = 0;
+    // The iterator reads a snapshot, every batch converts whole transactions
+    // so an interrupted upgrade just continues on the next start
+    while (pcursor->Valid() && pcursor->key()[0] == DB_COINS_LEGACY) {
+        CLevelDBBatch batch;
+        for (unsigned int i = 0; i < UPGRADE_BATCH_TXS && pcursor->Valid(); i++, pcursor->Next()) {
+            boost::this_thread::interruption_point();
+            try {
+                leveldb::Slice slKey = pcursor->key();
+                CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+                char chType;
+                ssKey >> chType;
+                if (chType != DB_COINS_LEGACY)
+                    break;
+                uint256 txid;
+                ssKey >> txid;
+
+                leveldb::Slice slValue = pcursor->value();
+                CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+                CCoins coins;
+                ssValue >> coins;
+
+                BatchWriteCoins(batch, txid, coins, CCoins());
+                batch.Erase(make_pair(DB_COINS_LEGACY, txid));
+                nTransactions++;
+                for (unsigned int j = 0; j < coins.vout.size(); j++)
+                    nOutputs += coins.IsAvailable(j) ? 1 : 0;
+            } catch (std::exception& e) {
+                return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+            }
+        }
+        if (!db.WriteBatch(batch))
+            return error("%s : Failed to write to coin database", __func__);
+        LogPrintf("%s : %u transactions converted\n", __func__, nTransactions);
+    }
+    HandleError(pcursor->status());
+
+    LogPrintf("Upgraded %u transactions into %u unspent outputs in %dms\n", nTransactions, nOutputs, GetTimeMillis() - nStart);
+    return true;
+}
+
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe)
 {
 }
@@ -120,12 +473,18 @@ bool CCoinsViewDB::GetStats(CCoinsStats& stats) const
        only need read operations on it, use a const-cast to get around
        that restriction.  */
     boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
-    pcursor->SeekToFirst();
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << DB_COIN;
+    pcursor->Seek(ssKeySet.str());
 
+    // The hash covers the outputs grouped by transaction, as it did when the
+    // records were kept per transaction
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     stats.hashBlock = GetBestBlock();
     ss << stats.hashBlock;
     CAmount nTotalAmount = 0;
+    uint256 txhashPrev = 0;
+    bool fFirst = true;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
         try {
@@ -133,35 +492,38 @@ bool CCoinsViewDB::GetStats(CCoinsStats& stats) const
             CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
             char chType;
             ssKey >> chType;
-            if (chType == 'c') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
-                CCoins coins;
-                ssValue >> coins;
-                uint256 txhash;
-                ssKey >> txhash;
-                ss << txhash;
-                ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n');
-                ss << VARINT(coins.nHeight);
+            if (chType != DB_COIN)
+                break;
+            CCoinKey key;
+            ssKey >> key;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            CCoinRecord record;
+            ssValue >> record;
+
+            if (fFirst || key.txid != txhashPrev) {
+                if (!fFirst)
+                    ss << VARINT(0);
+                ss << key.txid;
+                ss << VARINT(record.nVersion);
+                ss << (record.fCoinBase ? 'c' : 'n');
+                ss << VARINT(record.nHeight);
                 stats.nTransactions++;
-                for (unsigned int i = 0; i < coins.vout.size(); i++) {
-                    const CTxOut& out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i + 1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
-                }
-                stats.nSerializedSize += 32 + slValue.size();
-                ss << VARINT(0);
+                txhashPrev = key.txid;
+                fFirst = false;
             }
+            stats.nTransactionOutputs++;
+            ss << VARINT(key.n + 1);
+            ss << record.out;
+            nTotalAmount += record.out.nValue;
+            stats.nSerializedSize += slKey.size() + slValue.size();
             pcursor->Next();
         } catch (std::exception& e) {
             return error("%s : Deserialize or I/O error - %s", __func__, e.what());
         }
     }
+    if (!fFirst)
+        ss << VARINT(0);
     stats.nHeight = mapBlockIndex.find(GetBestBlock())->second->nHeight;
     stats.hashSerialized = ss.GetHash();
     stats.nTotalAmount = nTotalAmount;
@@ -195,6 +557,35 @@ bool CBlockTreeDB::ReadFlag(const std::string& name, bool& fValue)
     return true;
 }
 
+/** Number of block index records read from the database before they are decoded together. */
+static const size_t BLOCK_INDEX_LOAD_CHUNK = 16384;
+
+/**
+ * Decode the raw block index records [nBegin, nEnd). The block hash is taken from the
+ * key; the header hash is only computed for the sampled records, whose position counted
+ * from nSampleOffset is a multiple of nSample.
+ */
+static void DecodeBlockIndexRange(const std::vector<std::pair<std::string, std::string> >* pvRecords, size_t nBegin, size_t nEnd, unsigned int nSample, uint64_t nSampleOffset, std::vector<uint256>* pvHashes, std::vector<CDiskBlockIndex>* pvDiskIndex, std::string* pstrError)
+{
+    try {
+        for (size_t i = nBegin; i < nEnd; i++) {
+            const std::pair<std::string, std::string>& record = (*pvRecords)[i];
+            CDataStream ssKey(record.first.data(), record.first.data() + record.first.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            ssKey >> chType >> (*pvHashes)[i];
+            CDataStream ssValue(record.second.data(), record.second.data() + record.second.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> (*pvDiskIndex)[i];
+
+            if (nSample && (nSampleOffset + i) % nSample == 0 && (*pvDiskIndex)[i].GetBlockHash() != (*pvHashes)[i]) {
+                *pstrError = strprintf("header hash of block index entry %s does not match", (*pvHashes)[i].ToString());
+                return;
+            }
+        }
+    } catch (std::exception& e) {
+        *pstrError = strprintf("Deserialize or I/O error - %s", e.what());
+    }
+}
+
 bool CBlockTreeDB::LoadBlockIndexGuts()
 {
     boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
@@ -203,59 +594,92 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
     ssKeySet << make_pair('b', uint256(0));
     pcursor->Seek(ssKeySet.str());
 
-    // Load mapBlockIndex
-    while (pcursor->Valid()) {
+    int nThreads = dbReadPool.Threads();
+
+    // The key of every record already holds the block hash, so only a sample of the
+    // headers is hashed again to catch a damaged index. The sample starts at a random
+    // entry, so restarts end up checking all of them.
+    unsigned int nSample = std::max<int64_t>(0, GetArg("-blockindexsample", DEFAULT_BLOCK_INDEX_SAMPLE));
+    uint64_t nSampleOffset = nSample ? GetRand(nSample) : 0;
+
+    // Load mapBlockIndex. The records are copied out of the database a chunk at a time
+    // and decoded by several threads; only building the index is left to this one.
+    std::vector<std::pair<std::string, std::string> > vRecords;
+    std::vector<uint256> vHashes;
+    std::vector<CDiskBlockIndex> vDiskIndex;
+    bool fDone = false;
+    while (!fDone) {
         boost::this_thread::interruption_point();
-        try {
+        vRecords.clear();
+        while (vRecords.size() < BLOCK_INDEX_LOAD_CHUNK) {
+            if (!pcursor->Valid()) {
+                fDone = true;
+                break;
+            }
             leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == 'b') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
-                CDiskBlockIndex diskindex;
-                ssValue >> diskindex;
-
-                // Construct block index object
-                CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev = InsertBlockIndex(diskindex.hashPrev);
-                pindexNew->pnext = InsertBlockIndex(diskindex.hashNext);
-                pindexNew->nHeight = diskindex.nHeight;
-                pindexNew->nFile = diskindex.nFile;
-                pindexNew->nDataPos = diskindex.nDataPos;
-                pindexNew->nUndoPos = diskindex.nUndoPos;
-                pindexNew->nVersion = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->nTime = diskindex.nTime;
-                pindexNew->nBits = diskindex.nBits;
-                pindexNew->nNonce = diskindex.nNonce;
-                pindexNew->nStatus = diskindex.nStatus;
-                pindexNew->nTx = diskindex.nTx;
-
-                //Proof Of Stake
-                pindexNew->nMint = diskindex.nMint;
-                pindexNew->nMoneySupply = diskindex.nMoneySupply;
-                pindexNew->nFlags = diskindex.nFlags;
-                pindexNew->nStakeModifier = diskindex.nStakeModifier;
-                pindexNew->prevoutStake = diskindex.prevoutStake;
-                pindexNew->nStakeTime = diskindex.nStakeTime;
-                pindexNew->hashProofOfStake = diskindex.hashProofOfStake;
-
-                if (pindexNew->nHeight <= Params().LAST_POW_BLOCK()) {
-                    if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits))
-                        return error("LoadBlockIndex() : CheckProofOfWork failed: %s", pindexNew->ToString());
-                }
-                // ppcoin: build setStakeSeen
-                if (pindexNew->IsProofOfStake())
-                    setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
-
-                pcursor->Next();
-            } else {
-                break; // if shutdown requested or finished loading block index
+            if (slKey.size() == 0 || slKey[0] != 'b') {
+                fDone = true;
+                break; // finished loading block index
             }
-        } catch (std::exception& e) {
-            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+            leveldb::Slice slValue = pcursor->value();
+            vRecords.push_back(std::make_pair(slKey.ToString(), slValue.ToString()));
+            pcursor->Next();
+        }
+        HandleError(pcursor->status());
+
+        vHashes.assign(vRecords.size(), uint256());
+        vDiskIndex.assign(vRecords.size(), CDiskBlockIndex());
+        int nChunkThreads = std::max<size_t>(1, std::min<size_t>(nThreads, vRecords.size() / DB_READ_THREAD_BATCH));
+        std::vector<std::string> vErrors(nChunkThreads);
+        if (nChunkThreads == 1) {
+            DecodeBlockIndexRange(&vRecords, 0, vRecords.size(), nSample, nSampleOffset, &vHashes, &vDiskIndex, &vErrors[0]);
+        } else {
+            std::vector<boost::function<void()> > vJobs;
+            for (int i = 0; i < nChunkThreads; i++)
+                vJobs.push_back(boost::bind(&DecodeBlockIndexRange, &vRecords, vRecords.size() * i / nChunkThreads, vRecords.size() * (i + 1) / nChunkThreads, nSample, nSampleOffset, &vHashes, &vDiskIndex, &vErrors[i]));
+            dbReadPool.Run(vJobs);
+        }
+        for (int i = 0; i < nChunkThreads; i++) {
+            if (!vErrors[i].empty())
+                return error("%s : %s", __func__, vErrors[i]);
+        }
+        nSampleOffset += vRecords.size();
+
+        for (unsigned int i = 0; i < vDiskIndex.size(); i++) {
+            const CDiskBlockIndex& diskindex = vDiskIndex[i];
+
+            // Construct block index object
+            CBlockIndex* pindexNew = InsertBlockIndex(vHashes[i]);
+            pindexNew->pprev = InsertBlockIndex(diskindex.hashPrev);
+            pindexNew->pnext = InsertBlockIndex(diskindex.hashNext);
+            pindexNew->nHeight = diskindex.nHeight;
+            pindexNew->nFile = diskindex.nFile;
+            pindexNew->nDataPos = diskindex.nDataPos;
+            pindexNew->nUndoPos = diskindex.nUndoPos;
+            pindexNew->nVersion = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->nTime = diskindex.nTime;
+            pindexNew->nBits = diskindex.nBits;
+            pindexNew->nNonce = diskindex.nNonce;
+            pindexNew->nStatus = diskindex.nStatus;
+            pindexNew->nTx = diskindex.nTx;
+
+            //Proof Of Stake
+            pindexNew->nMint = diskindex.nMint;
+            pindexNew->nMoneySupply = diskindex.nMoneySupply;
+            pindexNew->nFlags = diskindex.nFlags;
+            pindexNew->nStakeModifier = diskindex.nStakeModifier;
+            pindexNew->prevoutStake = diskindex.prevoutStake;
+            pindexNew->nStakeTime = diskindex.nStakeTime;
+            pindexNew->hashProofOfStake = diskindex.hashProofOfStake;
+
+            if (pindexNew->nHeight <= Params().LAST_POW_BLOCK()) {
+                if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits))
+                    return error("LoadBlockIndex() : CheckProofOfWork failed: %s", pindexNew->ToString());
+            }
+            // ppcoin: build setStakeSeen
+            if (pindexNew->IsProofOfStake())
+                setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
         }
     }
 
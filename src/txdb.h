@@ -23,8 +23,20 @@ static const int64_t nDefaultDbCache = 100;
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 4096 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
+//! max. -dbreadthreads
+static const int MAX_DB_READ_THREADS = 16;
+//! Number of txids a -dbreadthreads worker reads at least, smaller batches use fewer threads
+static const unsigned int DB_READ_THREAD_BATCH = 32;
+//! -blockindexsample default: header hashes of one in this many block index entries are verified at startup
+static const unsigned int DEFAULT_BLOCK_INDEX_SAMPLE = 1000;
 
-/** CCoinsView backed by the LevelDB coin database (chainstate/) */
+/**
+ * CCoinsView backed by the LevelDB coin database (chainstate/)
+ *
+ * Every unspent output is a record of its own, keyed by its outpoint, so
+ * spending one output of a transaction only erases that record. The records
+ * of a transaction are adjacent and read together into a CCoins.
+ */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
@@ -34,10 +46,15 @@ public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
     bool GetCoins(const uint256& txid, CCoins& coins) const;
+    //! Reads the txids in key order, split over the -dbreadthreads pool whose workers each sweep one cursor forward
+    void GetCoinsBatch(const std::vector<uint256>& vTxid, std::vector<std::pair<uint256, CCoins> >& vCoinsRet) const;
     bool HaveCoins(const uint256& txid) const;
     uint256 GetBestBlock() const;
-    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, bool fErase = true);
     bool GetStats(CCoinsStats& stats) const;
+
+    //! Convert records of the old layout, one per transaction, to one record per output
+    bool Upgrade();
 };
 
 /** Access to the block database (blocks/index/) */